@@ -4,7 +4,7 @@
 
 int main(int argc, char **argv)
 {
-   init(argv[1]);
+   init(argv[1], argc > 2 ? argv[2] : NULL);
    produceRecord("1","Arjun");
    produceRecord("2","Danish");
    sleep(5);
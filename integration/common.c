@@ -1,3 +1,5 @@
+#include <pthread.h>
+
 #include "common.h"
 
 const int TIMEOUT_IN_MS = 500;
@@ -5,53 +7,82 @@ const int TIMEOUT_IN_MS = 500;
 struct context {
   struct ibv_context *ctx;
   struct ibv_pd *pd;
-  struct ibv_cq *cq;
-  struct ibv_comp_channel *comp_channel;
 
-  pthread_t cq_poller_thread;
+  // Each CQ has its own channel and poller thread
+  struct ibv_cq *cq[RC_NUM_CQS];
+  struct ibv_comp_channel *comp_channel[RC_NUM_CQS];
+  pthread_t cq_poller_thread[RC_NUM_CQS];
+
+  uint32_t max_inline_data;
 };
 
 static struct context *s_ctx = NULL;
+// Client connections may be set up from several threads at once
+static pthread_mutex_t s_ctx_mutex = PTHREAD_MUTEX_INITIALIZER;
 static pre_conn_cb_fn s_on_pre_conn_cb = NULL;
 static connect_cb_fn s_on_connect_cb = NULL;
 static completion_cb_fn s_on_completion_cb = NULL;
 static disconnect_cb_fn s_on_disconnect_cb = NULL;
-static char *client_role = NULL;
+static admit_cb_fn s_admit_cb = NULL;
+static struct connect_data client_data;
 
 static void build_context(struct ibv_context *verbs);
-static void build_qp_attr(struct ibv_qp_init_attr *qp_attr);
-static void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect);
+static void build_qp_attr(struct ibv_qp_init_attr *qp_attr, struct ibv_cq *cq);
+static int event_loop(struct rdma_event_channel *ec, int exit_on_disconnect, struct connect_data *data);
 static void * poll_cq(void *);
 
-void build_connection(struct rdma_cm_id *id)
+/**
+ * Create the QP for a connection. Connections to the same partition share
+ * a CQ, so their completions are handled in order by one thread while
+ * other partitions proceed on others.
+ */
+void build_connection(struct rdma_cm_id *id, uint32_t partition)
 {
   struct ibv_qp_init_attr qp_attr;
 
   build_context(id->verbs);
-  build_qp_attr(&qp_attr);
+  build_qp_attr(&qp_attr, s_ctx->cq[partition % RC_NUM_CQS]);
+
+  if (rdma_create_qp(id, s_ctx->pd, &qp_attr)) {
+    // The device cannot inline that much; fall back to registered sends only
+    qp_attr.cap.max_inline_data = 0;
+    TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
+  }
 
-  TEST_NZ(rdma_create_qp(id, s_ctx->pd, &qp_attr));
+  s_ctx->max_inline_data = qp_attr.cap.max_inline_data;
 }
 
 void build_context(struct ibv_context *verbs)
 {
+  struct context *ctx;
+  uintptr_t i;
+
+  pthread_mutex_lock(&s_ctx_mutex);
+
   if (s_ctx) {
+    pthread_mutex_unlock(&s_ctx_mutex);
     if (s_ctx->ctx != verbs)
       rc_die("cannot handle events in more than one context.");
 
     return;
   }
 
-  s_ctx = (struct context *)malloc(sizeof(struct context));
+  ctx = (struct context *)malloc(sizeof(struct context));
 
-  s_ctx->ctx = verbs;
+  ctx->ctx = verbs;
+
+  TEST_Z(ctx->pd = ibv_alloc_pd(ctx->ctx));
+  for (i = 0; i < RC_NUM_CQS; ++i) {
+    TEST_Z(ctx->comp_channel[i] = ibv_create_comp_channel(ctx->ctx));
+    TEST_Z(ctx->cq[i] = ibv_create_cq(ctx->ctx, RC_CQ_DEPTH, NULL, ctx->comp_channel[i], 0));
+    TEST_NZ(ibv_req_notify_cq(ctx->cq[i], 0));
+  }
 
-  TEST_Z(s_ctx->pd = ibv_alloc_pd(s_ctx->ctx));
-  TEST_Z(s_ctx->comp_channel = ibv_create_comp_channel(s_ctx->ctx));
-  TEST_Z(s_ctx->cq = ibv_create_cq(s_ctx->ctx, 10, NULL, s_ctx->comp_channel, 0)); /* cqe=10 is arbitrary */
-  TEST_NZ(ibv_req_notify_cq(s_ctx->cq, 0));
+  s_ctx = ctx;
+  pthread_mutex_unlock(&s_ctx_mutex);
 
-  TEST_NZ(pthread_create(&s_ctx->cq_poller_thread, NULL, poll_cq, NULL));
+  for (i = 0; i < RC_NUM_CQS; ++i)
+    TEST_NZ(pthread_create(&ctx->cq_poller_thread[i], NULL, poll_cq, (void *)i));
 }
 
 void build_params(struct rdma_conn_param *params)
@@ -61,21 +92,28 @@ void build_params(struct rdma_conn_param *params)
   params->rnr_retry_count = 7; /* infinite retry */
 }
 
-void build_qp_attr(struct ibv_qp_init_attr *qp_attr)
+void build_qp_attr(struct ibv_qp_init_attr *qp_attr, struct ibv_cq *cq)
 {
   memset(qp_attr, 0, sizeof(*qp_attr));
 
-  qp_attr->send_cq = s_ctx->cq;
-  qp_attr->recv_cq = s_ctx->cq;
+  qp_attr->send_cq = cq;
+  qp_attr->recv_cq = cq;
   qp_attr->qp_type = IBV_QPT_RC;
 
-  qp_attr->cap.max_send_wr = 10;
-  qp_attr->cap.max_recv_wr = 10;
-  qp_attr->cap.max_send_sge = 1;
+  qp_attr->cap.max_send_wr = RC_SEND_QUEUE_DEPTH;
+  qp_attr->cap.max_recv_wr = RC_RECV_QUEUE_DEPTH;
+  qp_attr->cap.max_send_sge = 3; /* key, value and terminator of a zero-copy record */
   qp_attr->cap.max_recv_sge = 1;
+  qp_attr->cap.max_inline_data = RC_MAX_INLINE_DATA;
 }
 
-void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect)
+/**
+ * Handle connection events until the channel closes or, if asked, the
+ * connection goes down. data is what clients send on connect and what the
+ * server received with the latest connect request. Returns -1 if a client's
+ * connection could not be made, once its callbacks have released it.
+ */
+int event_loop(struct rdma_event_channel *ec, int exit_on_disconnect, struct connect_data *data)
 {
   struct rdma_cm_event *event = NULL;
   struct rdma_conn_param cm_params;
@@ -88,12 +126,15 @@ void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect)
     memcpy(&event_copy, event, sizeof(*event));
     rdma_ack_cm_event(event);
     if (event_copy.event == RDMA_CM_EVENT_CONNECT_REQUEST) {
-        char *role = (char*)event_copy.param.conn.private_data;
-        client_role = (char*) malloc(100*sizeof(char));
-        strcpy(client_role, role);
+        size_t len = event_copy.param.conn.private_data_len;
+        memset(data, 0, sizeof(*data));
+        memcpy(data, event_copy.param.conn.private_data, len < sizeof(*data) ? len : sizeof(*data));
+        data->role[sizeof(data->role) - 1] = '\0';
+        data->topic[sizeof(data->topic) - 1] = '\0';
+        data->group[sizeof(data->group) - 1] = '\0';
     }
     if (event_copy.event == RDMA_CM_EVENT_ADDR_RESOLVED) {
-      build_connection(event_copy.id);
+      build_connection(event_copy.id, data->partition & ~CONNECT_SUBSCRIBE);
       
       if (s_on_pre_conn_cb)
         s_on_pre_conn_cb(event_copy.id);
@@ -101,12 +142,16 @@ void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect)
       TEST_NZ(rdma_resolve_route(event_copy.id, TIMEOUT_IN_MS));
 
     } else if (event_copy.event == RDMA_CM_EVENT_ROUTE_RESOLVED) {
-      cm_params.private_data = (void*) client_role;
-      cm_params.private_data_len = strlen(client_role);
+      cm_params.private_data = data;
+      cm_params.private_data_len = sizeof(*data);
       TEST_NZ(rdma_connect(event_copy.id, &cm_params));
 
+    } else if (event_copy.event == RDMA_CM_EVENT_CONNECT_REQUEST && s_admit_cb && !s_admit_cb(data)) {
+      TEST_NZ(rdma_reject(event_copy.id, NULL, 0));
+      rdma_destroy_id(event_copy.id);
+
     } else if (event_copy.event == RDMA_CM_EVENT_CONNECT_REQUEST) {
-      build_connection(event_copy.id);
+      build_connection(event_copy.id, data->partition & ~CONNECT_SUBSCRIBE);
       if (s_on_pre_conn_cb)
         s_on_pre_conn_cb(event_copy.id);
 
@@ -127,30 +172,66 @@ void event_loop(struct rdma_event_channel *ec, int exit_on_disconnect)
       if (exit_on_disconnect)
         break;
 
+    } else if (event_copy.event == RDMA_CM_EVENT_REJECTED) {
+      rc_die("connection rejected by the broker");
+
+    } else if (exit_on_disconnect && (event_copy.event == RDMA_CM_EVENT_ADDR_ERROR ||
+                                      event_copy.event == RDMA_CM_EVENT_ROUTE_ERROR ||
+                                      event_copy.event == RDMA_CM_EVENT_UNREACHABLE ||
+                                      event_copy.event == RDMA_CM_EVENT_CONNECT_ERROR)) {
+      // Undo what came before, as a disconnect would
+      if (event_copy.id->qp) {
+        rdma_destroy_qp(event_copy.id);
+        if (s_on_disconnect_cb)
+          s_on_disconnect_cb(event_copy.id);
+      }
+      rdma_destroy_id(event_copy.id);
+      return -1;
+
     } else {
       rc_die("unknown event\n");
     }
   }
+  return 0;
 }
 
 char* getRole()
 {
-    return client_role;
+    return client_data.role;
 }
 
-void * poll_cq(void *ctx)
+char* getTopic()
 {
+    return client_data.topic;
+}
+
+uint32_t getPartition()
+{
+    return client_data.partition;
+}
+
+char* getGroup()
+{
+    return client_data.group;
+}
+
+void * poll_cq(void *arg)
+{
+  struct ibv_comp_channel *channel = s_ctx->comp_channel[(uintptr_t)arg];
   struct ibv_cq *cq;
   struct ibv_wc wc;
+  void *ctx;
 
   while (1) {
-    TEST_NZ(ibv_get_cq_event(s_ctx->comp_channel, &cq, &ctx));
+    TEST_NZ(ibv_get_cq_event(channel, &cq, &ctx));
     ibv_ack_cq_events(cq, 1);
     TEST_NZ(ibv_req_notify_cq(cq, 0));
 
     while (ibv_poll_cq(cq, 1, &wc)) {
       if (wc.status == IBV_WC_SUCCESS)
         s_on_completion_cb(&wc);
+      else if (wc.status == IBV_WC_WR_FLUSH_ERR)
+        continue; // posted before the connection went down
       else {
         printf("%d\n", wc.status);
         rc_die("poll_cq: status is not IBV_WC_SUCCESS");
@@ -169,15 +250,26 @@ void rc_init(pre_conn_cb_fn pc, connect_cb_fn conn, completion_cb_fn comp, disco
   s_on_disconnect_cb = disc;
 }
 
-void rc_client_loop(const char *host, const char *port, void *context, const char *role)
+void rc_set_admit_cb(admit_cb_fn admit)
+{
+  s_admit_cb = admit;
+}
+
+void rc_client_loop(const char *host, const char *port, void *context, const struct connect_data *data)
+{
+  if (rc_client_try(host, port, context, data))
+    rc_die("cannot connect to the broker");
+}
+
+int rc_client_try(const char *host, const char *port, void *context, const struct connect_data *data)
 {
   struct addrinfo *addr;
   struct rdma_cm_id *conn = NULL;
   struct rdma_event_channel *ec = NULL;
   struct rdma_conn_param cm_params;
-
-  client_role = (char*) malloc(100 * sizeof(char));
-  strcpy(client_role, role);
+  // Per call, since a client may run one loop per partition
+  struct connect_data conn_data = *data;
+  int ret;
 
   TEST_NZ(getaddrinfo(host, port, NULL, &addr));
 
@@ -191,9 +283,10 @@ void rc_client_loop(const char *host, const char *port, void *context, const cha
 
   build_params(&cm_params);
 
-  event_loop(ec, 1); // exit on disconnect
+  ret = event_loop(ec, 1, &conn_data); // exit on disconnect
 
   rdma_destroy_event_channel(ec);
+  return ret;
 }
 
 void rc_server_loop(const char *port)
@@ -211,7 +304,7 @@ void rc_server_loop(const char *port)
   TEST_NZ(rdma_bind_addr(listener, (struct sockaddr *)&addr));
   TEST_NZ(rdma_listen(listener, 10)); /* backlog=10 is arbitrary */
 
-  event_loop(ec, 0); // don't exit on disconnect
+  event_loop(ec, 0, &client_data); // don't exit on disconnect
 
   rdma_destroy_id(listener);
   rdma_destroy_event_channel(ec);
@@ -230,5 +323,168 @@ void rc_die(const char *reason)
 
 struct ibv_pd * rc_get_pd()
 {
-  return s_ctx->pd;
+  return s_ctx ? s_ctx->pd : NULL;
+}
+
+uint32_t rc_get_max_inline()
+{
+  return s_ctx ? s_ctx->max_inline_data : 0;
+}
+
+static uint32_t payload_length(struct ibv_send_wr *wr)
+{
+  uint32_t len = 0;
+  int i;
+
+  for (i = 0; i < wr->num_sge; ++i)
+    len += wr->sg_list[i].length;
+  return len;
+}
+
+static void post_now(struct rdma_cm_id *id, struct rc_send_queue *sq, struct ibv_send_wr *wr)
+{
+  struct ibv_send_wr *bad_wr = NULL;
+  uint32_t len = payload_length(wr);
+
+  // Small payloads are copied into the WQE, so no DMA read of the buffer is needed
+  if (wr->opcode != IBV_WR_RDMA_READ && len > 0 && len <= rc_get_max_inline())
+    wr->send_flags |= IBV_SEND_INLINE;
+
+  ++sq->unsignaled;
+  ++sq->outstanding;
+  ++sq->posted;
+
+  // Signal every Nth WR, or sooner if the caller needs this completion
+  if (sq->unsignaled >= RC_SIGNAL_INTERVAL || (wr->send_flags & IBV_SEND_SIGNALED)) {
+    wr->send_flags |= IBV_SEND_SIGNALED;
+    sq->batch[sq->batch_tail] = sq->unsignaled;
+    sq->batch_tail = (sq->batch_tail + 1) % (RC_SEND_QUEUE_DEPTH + 1);
+    sq->unsignaled = 0;
+  }
+
+  TEST_NZ(ibv_post_send(id->qp, wr, &bad_wr));
+}
+
+/**
+ * Post a WR, or if the send queue is full, queue it behind the ones
+ * already waiting, to be posted in order as completions make room. A
+ * send's payload is copied, since callers reuse their message buffers; a
+ * copy the device will not inline is registered for as long as it is in
+ * flight. RDMA writes are posted from the caller's buffer, which holds
+ * the log and never changes. Returns non-zero if the WR was deferred.
+ */
+int rc_post_send(struct rdma_cm_id *id, struct rc_send_queue *sq, struct ibv_send_wr *wr)
+{
+  struct rc_deferred_wr *d;
+  uint32_t len;
+  int i;
+
+  sq->id = id;
+  if (sq->deferred_head == NULL && sq->outstanding < RC_SEND_QUEUE_DEPTH) {
+    post_now(id, sq, wr);
+    return 0;
+  }
+
+  if (wr->num_sge > 3)
+    rc_die("rc_post_send: too many scatter entries to defer");
+  TEST_Z(d = (struct rc_deferred_wr *)malloc(sizeof(*d)));
+  d->wr = *wr;
+  d->wr.next = NULL;
+  d->wr.sg_list = d->sge;
+  d->mr = NULL;
+  d->next = NULL;
+  len = payload_length(wr);
+  if ((wr->opcode == IBV_WR_SEND || wr->opcode == IBV_WR_SEND_WITH_IMM) && len > 0 && len <= sizeof(d->data)) {
+    for (i = 0, len = 0; i < wr->num_sge; len += wr->sg_list[i++].length)
+      memcpy(d->data + len, (void *)(uintptr_t)wr->sg_list[i].addr, wr->sg_list[i].length);
+    d->sge[0].addr = (uintptr_t)d->data;
+    d->sge[0].length = len;
+    d->sge[0].lkey = wr->sg_list[0].lkey;
+    d->wr.num_sge = 1;
+    if (len > rc_get_max_inline()) {
+      TEST_Z(d->mr = ibv_reg_mr(rc_get_pd(), d->data, len, 0));
+      d->sge[0].lkey = d->mr->lkey;
+    }
+  } else {
+    for (i = 0; i < wr->num_sge; ++i)
+      d->sge[i] = wr->sg_list[i];
+  }
+
+  if (sq->deferred_tail)
+    sq->deferred_tail->next = d;
+  else
+    sq->deferred_head = d;
+  sq->deferred_tail = d;
+  ++sq->deferred;
+  return 1;
+}
+
+static void free_deferred(struct rc_deferred_wr *d)
+{
+  if (d->mr)
+    ibv_dereg_mr(d->mr);
+  free(d);
+}
+
+/**
+ * Retire the WRs a signaled completion covers, and post the deferred ones
+ * there is now room for. Called under the same lock as rc_post_send().
+ */
+void rc_send_completed(struct rc_send_queue *sq)
+{
+  struct rc_deferred_wr *d;
+
+  if (sq->batch_head == sq->batch_tail)
+    return;
+
+  sq->outstanding -= sq->batch[sq->batch_head];
+  sq->retired += sq->batch[sq->batch_head];
+  sq->batch_head = (sq->batch_head + 1) % (RC_SEND_QUEUE_DEPTH + 1);
+
+  while ((d = sq->copied_head) != NULL && d->seq <= sq->retired) {
+    sq->copied_head = d->next;
+    if (sq->copied_head == NULL)
+      sq->copied_tail = NULL;
+    free_deferred(d);
+  }
+
+  while ((d = sq->deferred_head) != NULL && sq->outstanding < RC_SEND_QUEUE_DEPTH) {
+    sq->deferred_head = d->next;
+    if (sq->deferred_head == NULL)
+      sq->deferred_tail = NULL;
+    --sq->deferred;
+    post_now(sq->id, sq, &d->wr);
+    if (d->mr == NULL) {
+      free(d);
+      continue;
+    }
+    // The device reads the copy when it sends it
+    d->seq = sq->posted;
+    d->next = NULL;
+    if (sq->copied_tail)
+      sq->copied_tail->next = d;
+    else
+      sq->copied_head = d;
+    sq->copied_tail = d;
+  }
+}
+
+/**
+ * Free the WRs still waiting once their connection is gone
+ */
+void rc_drop_deferred(struct rc_send_queue *sq)
+{
+  struct rc_deferred_wr *d;
+
+  while ((d = sq->deferred_head) != NULL) {
+    sq->deferred_head = d->next;
+    free_deferred(d);
+  }
+  sq->deferred_tail = NULL;
+  while ((d = sq->copied_head) != NULL) {
+    sq->copied_head = d->next;
+    free_deferred(d);
+  }
+  sq->copied_tail = NULL;
+  sq->deferred = 0;
 }
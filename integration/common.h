@@ -13,25 +13,123 @@
 
 #define PRODUCER_ROLE "producer"
 #define CONSUMER_ROLE "consumer"
+// A consumer group member's control connection; it reads nothing itself
+#define MEMBER_ROLE "member"
+// A follower broker's control connection, over which the leader names the
+// partitions to replicate; each is then read like a push consumer would
+#define REPLICA_ROLE "replica"
+
+#define TOPIC_NAME_MAX 24
+#define GROUP_NAME_MAX 16
+#define DEFAULT_TOPIC "default"
+
+// Payload size we ask the device to accept inline; it may grant less
+#define RC_MAX_INLINE_DATA 256
+// Only every Nth send is signaled; must stay below max_send_wr
+#define RC_SIGNAL_INTERVAL 4
+#define RC_SEND_QUEUE_DEPTH 16
+#define RC_RECV_QUEUE_DEPTH 16
+// Connections are spread over this many CQs by partition, each polled by
+// its own thread
+#define RC_NUM_CQS 4
+#define RC_CQ_DEPTH 1024
 
 typedef void (*pre_conn_cb_fn)(struct rdma_cm_id *id);
 typedef void (*connect_cb_fn)(struct rdma_cm_id *id);
 typedef void (*completion_cb_fn)(struct ibv_wc *wc);
 typedef void (*disconnect_cb_fn)(struct rdma_cm_id *id);
 
+struct connect_data;
+// Returns zero to reject a connect request carrying the data
+typedef int (*admit_cb_fn)(const struct connect_data *data);
+
+// A WR rc_post_send() could not post yet, with its scatter list, and a
+// copy of a send's payload up to RC_MAX_INLINE_DATA bytes. A copy the
+// device cannot inline is registered as mr, and kept until the WR posted
+// as number seq of its queue is retired.
+struct rc_deferred_wr
+{
+  struct ibv_send_wr wr;
+  struct ibv_sge sge[3];
+  char data[RC_MAX_INLINE_DATA];
+  struct ibv_mr *mr;
+  uint64_t seq;
+  struct rc_deferred_wr *next;
+};
+
+// Send-queue accounting for a connection posting through rc_post_send().
+// A signaled completion retires every unsignaled WR posted before it.
+struct rc_send_queue
+{
+  // WRs posted since the last signaled one
+  int unsignaled;
+  // WRs posted but not yet retired by a signaled completion
+  int outstanding;
+  // Number of WRs each pending signaled WR retires, in posting order
+  int batch[RC_SEND_QUEUE_DEPTH + 1];
+  int batch_head;
+  int batch_tail;
+  // WRs waiting for the queue to have room, oldest first, and the
+  // connection they are for
+  struct rc_deferred_wr *deferred_head;
+  struct rc_deferred_wr *deferred_tail;
+  int deferred;
+  struct rdma_cm_id *id;
+  // WRs posted and retired in all, and deferred ones posted from copies
+  // that are not retired yet, oldest first
+  uint64_t posted;
+  uint64_t retired;
+  struct rc_deferred_wr *copied_head;
+  struct rc_deferred_wr *copied_tail;
+};
+
+// Set in connect_data.partition by a consumer whose first send will be a
+// MSG_SUBSCRIBE; the broker holds MSG_READY back until it is in
+#define CONNECT_SUBSCRIBE 0x80000000u
+
+// Sent as connection private data, which RC limits to 56 bytes
+struct connect_data
+{
+  char role[12];
+  uint32_t partition;
+  char topic[TOPIC_NAME_MAX];
+  // Consumer group, empty for consumers reading on their own
+  char group[GROUP_NAME_MAX];
+};
+
 struct ProducerMessage
 {
     char *key;
+    // Null-terminated for convenience, but may hold binary data
     char *value;
+    size_t value_length;
+    // Set when the broker kept the value out of line; value is then NULL
+    // until fetched by the consumer
+    uint64_t value_addr;
+    uint32_t value_rkey;
+    // Topic the record was published to when read through a subscription
+    // pattern, NULL otherwise
+    char *topic;
     struct ProducerMessage *next;
 };
 
 void rc_init(pre_conn_cb_fn, connect_cb_fn, completion_cb_fn, disconnect_cb_fn);
-void rc_client_loop(const char *host, const char *port, void *context, const char *role);
+void rc_set_admit_cb(admit_cb_fn);
+void rc_client_loop(const char *host, const char *port, void *context, const struct connect_data *data);
+// As rc_client_loop(), but returns -1 rather than dying if the broker
+// cannot be reached, and 0 once a connection it made goes down
+int rc_client_try(const char *host, const char *port, void *context, const struct connect_data *data);
 void rc_disconnect(struct rdma_cm_id *id);
 void rc_die(const char *message);
 struct ibv_pd * rc_get_pd();
+uint32_t rc_get_max_inline();
+int rc_post_send(struct rdma_cm_id *id, struct rc_send_queue *sq, struct ibv_send_wr *wr);
+void rc_send_completed(struct rc_send_queue *sq);
+void rc_drop_deferred(struct rc_send_queue *sq);
 void rc_server_loop(const char *port);
 char* getRole();
+char* getTopic();
+uint32_t getPartition();
+char* getGroup();
 
 #endif
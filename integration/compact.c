@@ -0,0 +1,436 @@
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "compact.h"
+#include "filter.h"
+#include "index.h"
+#include "keys.h"
+#include "lookup.h"
+#include "subscription.h"
+
+// How often the compactor goes over the topics
+#define COMPACT_INTERVAL_US (1000 * 1000)
+// Patterns compact_topics() can be given
+#define COMPACT_MAX_PATTERNS 16
+/**
+ * Segments a compaction swapped out of a log. They are dropped once none
+ * of them is pinned, and no sooner than the round after, so a reader that
+ * looked one up just before the swap has had time to pin it.
+ */
+struct retired
+{
+  uint64_t *segments;
+  int n;
+  int rounds;
+  struct retired *next;
+};
+
+/**
+ * The fresh segments a compaction fills, each pinned until the swap, and
+ * for each producer id, FILTER_PASSING and the sequence of the fragmented
+ * record being kept, so later fragments follow the first. moved holds the
+ * offsets each keyed record was copied from and to, for the topic's lookup
+ * table.
+ */
+struct compaction
+{
+  struct topic *topic;
+  uint32_t generation;
+  uint64_t *out;
+  int num_out;
+  uint64_t tail;
+  uint64_t *passing;
+  uint32_t num_passing;
+  uint64_t *moved;
+  uint64_t num_moved;
+  uint64_t max_moved;
+};
+
+static char *patterns[COMPACT_MAX_PATTERNS];
+static int num_patterns = 0;
+static const char *compact_dir = NULL;
+static struct retired *retired = NULL;
+// Where a segment that was evicted is read to from its file
+static char *scratch = NULL;
+
+void compact_topics(const char *pattern)
+{
+  if (num_patterns == COMPACT_MAX_PATTERNS)
+    rc_die("compact_topics: too many patterns");
+  patterns[num_patterns++] = strdup(pattern);
+}
+
+int compact_enabled()
+{
+  return num_patterns > 0;
+}
+
+static int wanted(const char *name)
+{
+  int i;
+
+  for (i = 0; i < num_patterns; ++i)
+    if (pattern_match(patterns[i], name))
+      return 1;
+  return 0;
+}
+
+/**
+ * Close the segment being filled with an end marker pointing at the first
+ * entry of the next one
+ */
+static void close_output(struct compaction *c, uint64_t next)
+{
+  uint64_t segment = c->out[c->num_out - 1];
+  struct record_header *marker = (struct record_header *)log_at(c->tail);
+
+  memset(marker, 0, sizeof(*marker));
+  marker->flags = RECORD_SEGMENT_END;
+  marker->value_offset = next;
+  marker->length = sizeof(*marker);
+  ((struct segment_header *)log_at(segment))->end = c->tail + sizeof(*marker);
+  log_set_next_segment(segment, next / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE);
+}
+
+/**
+ * Start another segment to fill. Returns -1 if the arena has no slot free.
+ */
+static int add_output(struct compaction *c, int max)
+{
+  uint64_t first;
+  struct segment_header *h;
+
+  if (c->num_out == max || (first = log_new_segment(c->topic, SEGMENT_TOPIC)) == NO_SEGMENT)
+    return -1;
+  if (c->num_out > 0)
+    close_output(c, first);
+
+  h = (struct segment_header *)log_at(first - sizeof(*h));
+  h->generation = c->generation;
+  c->out[c->num_out++] = first - sizeof(*h);
+  c->tail = first;
+  return 0;
+}
+
+/**
+ * Decide whether an entry survives: a record's first fragment does if it
+ * has no key or is the newest with its key, and the rest of its fragments
+ * go where that went
+ */
+static int keep_entry(struct compaction *c, struct key_table *keys, const struct record_header *e, uint64_t index)
+{
+  uint64_t *passing;
+  int keep;
+
+  if (e->producer_id >= c->num_passing) {
+    uint32_t n = c->num_passing ? c->num_passing : 16;
+
+    while (n <= e->producer_id)
+      n *= 2;
+    c->passing = (uint64_t *)realloc(c->passing, n * sizeof(*c->passing));
+    memset(c->passing + c->num_passing, 0, (n - c->num_passing) * sizeof(*c->passing));
+    c->num_passing = n;
+  }
+  passing = &c->passing[e->producer_id];
+
+  if (!(e->flags & RECORD_FIRST_FRAGMENT))
+    return *passing == (FILTER_PASSING | e->sequence);
+
+  keep = e->key_length == 0 || key_get(keys, (const char *)(e + 1), e->key_length)->newest == index;
+  *passing = keep && !(e->flags & RECORD_LAST_FRAGMENT) ? FILTER_PASSING | e->sequence : 0;
+  return keep;
+}
+
+static void add_moved(struct compaction *c, uint64_t from, uint64_t to)
+{
+  if (c->num_moved == c->max_moved) {
+    c->max_moved = c->max_moved ? 2 * c->max_moved : 1024;
+    c->moved = (uint64_t *)realloc(c->moved, 2 * c->max_moved * sizeof(*c->moved));
+  }
+  c->moved[2 * c->num_moved] = from;
+  c->moved[2 * c->num_moved + 1] = to;
+  ++c->num_moved;
+}
+
+/**
+ * Point the keys of the topic's lookup table that are read from the log at
+ * the copies of their records. Done after the swap, which a table built by
+ * then already saw, one key at a time so the topic's appends only ever
+ * wait for one; a table built later takes the log from the new head.
+ */
+static void move_lookup(struct compaction *c)
+{
+  struct lookup_table *lookup;
+  uint64_t i;
+
+  // Ordered after the generation store, so a table created meanwhile is
+  // either seen here or has a builder that sees the new generation
+  if ((lookup = __atomic_load_n(&c->topic->lookup, __ATOMIC_SEQ_CST)) == NULL)
+    return;
+  for (i = 0; i < c->num_moved; ++i)
+    lookup_moved(lookup, (const struct record_header *)log_at(c->moved[2 * i + 1]), c->moved[2 * i], c->moved[2 * i + 1]);
+}
+
+static void write_file(int fd, const char *data, uint64_t length, uint64_t offset)
+{
+  ssize_t n;
+
+  while (length > 0) {
+    if ((n = pwrite(fd, data, length, offset)) <= 0)
+      rc_die("write_file: cannot write segment file");
+    data += n;
+    length -= n;
+    offset += n;
+  }
+}
+
+/**
+ * Write a fresh segment to its file and fsync it. The head segment goes
+ * without its magic, which is written last, once every other one is down.
+ */
+static void write_output(uint64_t segment, int head)
+{
+  struct segment_header h = *(struct segment_header *)log_at(segment);
+  char path[512];
+  int fd;
+
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, compact_dir, (uint32_t)(segment / LOG_SEGMENT_SIZE));
+  if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    rc_die("write_output: cannot create segment file");
+  if (head)
+    h.magic = 0;
+  write_file(fd, (char *)&h, sizeof(h), 0);
+  write_file(fd, log_at(segment) + sizeof(h), h.end - segment - sizeof(h), sizeof(h));
+  TEST_NZ(fdatasync(fd));
+  close(fd);
+}
+
+static void commit_head(uint64_t segment)
+{
+  char path[512];
+  int fd;
+
+  // The fresh files' names are down before the head that leads to them
+  if ((fd = open(compact_dir, O_RDONLY)) < 0)
+    rc_die("commit_head: cannot open the segment directory");
+  TEST_NZ(fsync(fd));
+  close(fd);
+
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, compact_dir, (uint32_t)(segment / LOG_SEGMENT_SIZE));
+  if ((fd = open(path, O_WRONLY)) < 0)
+    rc_die("commit_head: cannot open segment file");
+  write_file(fd, log_at(segment), sizeof(struct segment_header), 0);
+  TEST_NZ(fdatasync(fd));
+  close(fd);
+}
+
+/**
+ * The closed segments of a topic from its head on, which the compactor may
+ * rewrite: those its log has moved on from and, if it is persisted, that
+ * are written to their files. Returns how many there are, and the segment
+ * they end in.
+ */
+static int closed_segments(struct topic *t, uint64_t **segments, uint64_t *limit)
+{
+  uint64_t end = compact_dir ? __atomic_load_n(&t->written, __ATOMIC_ACQUIRE) : __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+  uint64_t segment = __atomic_load_n(&t->head, __ATOMIC_ACQUIRE) / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  int n = 0, max = 0;
+
+  *limit = end / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  *segments = NULL;
+  for (; segment != *limit && segment != NO_SEGMENT; segment = log_next_segment(segment)) {
+    if (n == max) {
+      max = max ? 2 * max : 16;
+      *segments = (uint64_t *)realloc(*segments, max * sizeof(**segments));
+    }
+    (*segments)[n++] = segment;
+  }
+  return n;
+}
+
+/**
+ * Compact the topic up to its closed segments if it matches a pattern and
+ * has closed more since it was last looked at. The first walk finds the
+ * newest record of each key, the second copies the survivors; nothing is
+ * rewritten unless some record was superseded.
+ */
+static void compact_topic(struct topic *t)
+{
+  struct compaction c;
+  struct key_table keys;
+  struct retired *r;
+  uint64_t *in, limit, index = 0, kept = 0, superseded = 0;
+  uint32_t last_sequence = 0;
+  int n, i, fresh = 0, pinned;
+
+  if (!wanted(t->name))
+    return;
+  n = closed_segments(t, &in, &limit);
+  if (n == 0 || limit == t->compact_limit) {
+    free(in);
+    return;
+  }
+
+  memset(&keys, 0, sizeof(keys));
+  for (i = 0; i < n; ++i) {
+    const char *data = log_segment_data(in[i], &scratch, &pinned);
+    const struct segment_header *h = (const struct segment_header *)data;
+    const struct record_header *e;
+    uint64_t offset;
+
+    fresh |= h->generation == 0;
+    last_sequence = h->sequence;
+    for (offset = sizeof(*h);; offset += RECORD_ENTRY_SIZE(e), ++index) {
+      e = (const struct record_header *)(data + offset);
+      if (e->flags & RECORD_SEGMENT_END)
+        break;
+      if ((e->flags & RECORD_FIRST_FRAGMENT) && e->key_length) {
+        struct log_key *k = key_get(&keys, (const char *)(e + 1), e->key_length);
+
+        superseded += k->newest != NO_INDEX;
+        k->newest = index;
+      }
+    }
+    if (pinned)
+      log_unpin(in[i]);
+  }
+
+  t->compact_limit = limit;
+  if (!fresh || superseded == 0) {
+    key_table_free(&keys);
+    free(in);
+    return;
+  }
+
+  // Fewer entries never take more segments than they came in
+  memset(&c, 0, sizeof(c));
+  c.topic = t;
+  c.generation = t->generation + 1;
+  c.out = (uint64_t *)malloc(n * sizeof(*c.out));
+  if (add_output(&c, n) < 0)
+    goto out_of_slots;
+
+  for (i = 0, index = 0; i < n; ++i) {
+    const char *data = log_segment_data(in[i], &scratch, &pinned);
+    const struct record_header *e;
+    uint64_t offset;
+
+    for (offset = sizeof(struct segment_header);; offset += RECORD_ENTRY_SIZE(e), ++index) {
+      e = (const struct record_header *)(data + offset);
+      if (e->flags & RECORD_SEGMENT_END)
+        break;
+      if (!keep_entry(&c, &keys, e, index))
+        continue;
+      // Like an append, always leave room for the end marker
+      if (c.tail + RECORD_ENTRY_SIZE(e) + sizeof(*e) > c.out[c.num_out - 1] + LOG_SEGMENT_SIZE &&
+          add_output(&c, n) < 0) {
+        if (pinned)
+          log_unpin(in[i]);
+        goto out_of_slots;
+      }
+      memcpy(log_at(c.tail), e, e->length);
+      if ((e->flags & RECORD_FIRST_FRAGMENT) && e->key_length)
+        add_moved(&c, in[i] + offset, c.tail);
+      c.tail += RECORD_ENTRY_SIZE(e);
+      ++kept;
+    }
+    if (pinned)
+      log_unpin(in[i]);
+  }
+  close_output(&c, limit + sizeof(struct segment_header));
+
+  // The fresh segments take the numbers just before the first one left
+  // alone, so the log still counts up through them
+  for (i = 0; i < c.num_out; ++i) {
+    struct segment_header *h = (struct segment_header *)log_at(c.out[i]);
+
+    h->sequence = last_sequence + 1 - c.num_out + i;
+    if (i == 0)
+      h->flags |= SEGMENT_HEAD;
+  }
+  if (compact_dir) {
+    for (i = 0; i < c.num_out; ++i)
+      write_output(c.out[i], i == 0);
+    commit_head(c.out[0]);
+  }
+
+  __atomic_store_n(&t->head, c.out[0] + sizeof(struct segment_header), __ATOMIC_RELEASE);
+  __atomic_store_n(&t->generation, c.generation, __ATOMIC_SEQ_CST);
+  log_retire(in, n);
+  index_drop_compacted(t);
+  move_lookup(&c);
+  for (i = 0; i < c.num_out; ++i)
+    log_unpin(c.out[i]);
+
+  r = (struct retired *)calloc(1, sizeof(*r));
+  r->segments = in;
+  r->n = n;
+  r->next = retired;
+  retired = r;
+
+  printf("compacted %s/%u: %d segments into %d, %lu of %lu entries kept for %lu keys\n", t->name, t->partition, n,
+         c.num_out, (unsigned long)kept, (unsigned long)index, (unsigned long)keys.used);
+  key_table_free(&keys);
+  free(c.out);
+  free(c.passing);
+  free(c.moved);
+  return;
+
+out_of_slots:
+  // Tried again once the topic closes another segment
+  for (i = 0; i < c.num_out; ++i)
+    log_unpin(c.out[i]);
+  log_drop(c.out, c.num_out);
+  key_table_free(&keys);
+  free(c.out);
+  free(c.passing);
+  free(c.moved);
+  free(in);
+}
+
+/**
+ * Drop the segments compactions swapped out that no reader is in any more
+ */
+static void drop_retired()
+{
+  struct retired **p = &retired;
+  char path[512];
+  int i;
+
+  while (*p) {
+    struct retired *r = *p;
+
+    if (r->rounds++ == 0 || !log_drop(r->segments, r->n)) {
+      p = &r->next;
+      continue;
+    }
+    if (compact_dir) {
+      for (i = 0; i < r->n; ++i) {
+        snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, compact_dir, (uint32_t)(r->segments[i] / LOG_SEGMENT_SIZE));
+        unlink(path);
+      }
+    }
+    *p = r->next;
+    free(r->segments);
+    free(r);
+  }
+}
+
+static void * run_compactor(void *arg)
+{
+  while (1) {
+    usleep(COMPACT_INTERVAL_US);
+    topic_for_each(compact_topic);
+    drop_retired();
+  }
+  return NULL;
+}
+
+void compact_start(const char *dir)
+{
+  pthread_t thread;
+
+  compact_dir = dir;
+  TEST_NZ(pthread_create(&thread, NULL, run_compactor, NULL));
+  printf("compacting %d topic pattern%s\n", num_patterns, num_patterns == 1 ? "" : "s");
+}
@@ -0,0 +1,39 @@
+#ifndef RDMA_COMPACT_H
+#define RDMA_COMPACT_H
+
+#include "topic.h"
+
+/**
+ * Compacts changelog topics, whose readers only care about the newest
+ * value of each key. A thread of its own goes over the topics whose names
+ * match a compaction pattern and, once one has closed segments appended to
+ * since it last looked, rewrites its log up to them: every closed segment,
+ * earlier compactions' included, is copied into fresh ones keeping only
+ * the newest record of each key. A record with an empty value is a
+ * tombstone and is kept like any other, so readers learn the key is gone;
+ * records without a key are all kept.
+ *
+ * The fresh segments end in the first segment left alone, so the topic's
+ * head moving to them is the whole swap: appends to the topic, and readers
+ * of the segments past them, never notice. Readers already in the old
+ * segments read on to where the chains meet; the old segments are dropped
+ * once none of them is pinned or held by a reader. A new reader asking for
+ * one of them, because its group left off there, starts at the head.
+ * Keys the topic's lookup table reads from the log are pointed at the
+ * copies once the head has moved.
+ *
+ * With the log persisted, the fresh segments are written and fsynced before
+ * the swap, the head one last, so a restart finds either compaction whole
+ * or the log as it was. Logs mapped from their files are not compacted.
+ */
+
+// Compacts topics whose names match the pattern, in subscription syntax
+void compact_topics(const char *pattern);
+
+// Non-zero if compact_topics() was given a pattern
+int compact_enabled();
+
+// Starts the compaction thread; dir is where the log is persisted, or NULL
+void compact_start(const char *dir);
+
+#endif
@@ -27,7 +27,11 @@ float get_time_elapsed_sec(struct timeval tv1, struct timeval tv2) {
 
 int main(int argc, char **argv)
 {
-   init(argv[1]);
+   // Optional topic, and consumer group to read it as a member of
+   if (argc > 3)
+       initGroup(argv[1], argv[2], argv[3]);
+   else
+       init(argv[1], argc > 2 ? argv[2] : NULL);
    sleep(5);
    struct timeval tv1, tv2;
    int i;
@@ -0,0 +1,58 @@
+#include <string.h>
+
+#include "filter.h"
+
+uint32_t key_hash(const char *key, size_t length)
+{
+  uint32_t hash = 2166136261u;
+  size_t i;
+
+  for (i = 0; i < length; ++i)
+    hash = (hash ^ (unsigned char)key[i]) * 16777619u;
+  return hash;
+}
+
+void filter_add_key(struct record_filter *filter, const char *key)
+{
+  uint32_t bucket = key_hash(key, strlen(key)) % FILTER_HASH_BUCKETS;
+
+  filter->kind = FILTER_KEY_HASH;
+  filter->u.hash[bucket / 8] |= 1 << (bucket % 8);
+}
+
+/**
+ * Compare a key with a NUL-terminated bound the way memcmp would if the
+ * shorter of them were padded with the lowest byte value
+ */
+static int compare_key(const char *key, size_t key_length, const char *bound)
+{
+  size_t bound_length = strnlen(bound, FILTER_KEY_MAX);
+  size_t n = key_length < bound_length ? key_length : bound_length;
+  int c = memcmp(key, bound, n);
+
+  if (c != 0)
+    return c;
+  return key_length < bound_length ? -1 : key_length > bound_length;
+}
+
+int filter_match(const struct record_filter *filter, const struct record_header *hdr, const char *key, size_t key_length)
+{
+  uint32_t bucket;
+  size_t n;
+
+  switch (filter->kind) {
+    case FILTER_KEY_PREFIX:
+      n = strnlen(filter->u.key.from, FILTER_KEY_MAX);
+      return key_length >= n && memcmp(key, filter->u.key.from, n) == 0;
+    case FILTER_KEY_RANGE:
+      return compare_key(key, key_length, filter->u.key.from) >= 0 &&
+             (filter->u.key.to[0] == '\0' || compare_key(key, key_length, filter->u.key.to) < 0);
+    case FILTER_KEY_HASH:
+      bucket = key_hash(key, key_length) % FILTER_HASH_BUCKETS;
+      return (filter->u.hash[bucket / 8] >> (bucket % 8)) & 1;
+    case FILTER_VALUE_LENGTH:
+      return hdr->value_length >= filter->u.value_length.min && hdr->value_length <= filter->u.value_length.max;
+    default:
+      return 1;
+  }
+}
@@ -0,0 +1,19 @@
+#ifndef RDMA_FILTER_H
+#define RDMA_FILTER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "messages.h"
+
+// FNV-1a, as producers use to route keys to partitions
+uint32_t key_hash(const char *key, size_t length);
+
+// Marks the key's bucket in a FILTER_KEY_HASH filter
+void filter_add_key(struct record_filter *filter, const char *key);
+
+// Non-zero if the record with the given header and key, not counting any
+// topic name in front of it, passes the filter
+int filter_match(const struct record_filter *filter, const struct record_header *hdr, const char *key, size_t key_length);
+
+#endif
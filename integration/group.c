@@ -0,0 +1,120 @@
+#include "group.h"
+
+// Only touched from the connection event thread
+static struct group *groups = NULL;
+static uint64_t *offsets = NULL;
+static struct ibv_mr *offsets_mr = NULL;
+static int offsets_windows = 0;
+static int num_groups = 0;
+
+struct ibv_mr * group_offsets_mr()
+{
+  return offsets_mr;
+}
+
+int group_offsets_windows()
+{
+  return offsets_windows;
+}
+
+struct group * group_get(const char *name, const char *topic)
+{
+  struct group *g;
+  int i;
+
+  if (topic[0] == '\0')
+    topic = DEFAULT_TOPIC;
+
+  for (g = groups; g; g = g->next)
+    if (strcmp(g->name, name) == 0 && strcmp(g->topic, topic) == 0)
+      return g;
+
+  if (offsets == NULL) {
+    posix_memalign((void **)&offsets, sysconf(_SC_PAGESIZE), MAX_GROUPS * MAX_PARTITIONS * sizeof(*offsets));
+    // Not writable remotely as a whole; readers are given their own slots
+    offsets_mr = ibv_reg_mr(rc_get_pd(), offsets, MAX_GROUPS * MAX_PARTITIONS * sizeof(*offsets),
+                            IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_MW_BIND);
+    if (offsets_mr)
+      offsets_windows = 1;
+    else
+      TEST_Z(offsets_mr = ibv_reg_mr(rc_get_pd(), offsets, MAX_GROUPS * MAX_PARTITIONS * sizeof(*offsets),
+                                     IBV_ACCESS_LOCAL_WRITE));
+  }
+  if (num_groups == MAX_GROUPS)
+    rc_die("group_get: offsets table is full");
+
+  g = (struct group *)calloc(1, sizeof(*g));
+  strncpy(g->name, name, sizeof(g->name) - 1);
+  strncpy(g->topic, topic, sizeof(g->topic) - 1);
+  g->committed = offsets + num_groups++ * MAX_PARTITIONS;
+  for (i = 0; i < MAX_PARTITIONS; ++i)
+    g->committed[i] = NO_OFFSET;
+  g->next = groups;
+  groups = g;
+
+  printf("created group %s on topic %s\n", g->name, g->topic);
+  return g;
+}
+
+void group_join(struct group *group, void *conn)
+{
+  struct group_member **m = &group->members;
+
+  // Appended, so members that were there first keep their partitions
+  while (*m)
+    m = &(*m)->next;
+
+  *m = (struct group_member *)calloc(1, sizeof(**m));
+  (*m)->conn = conn;
+
+  ++group->num_members;
+  ++group->generation;
+}
+
+void group_leave(struct group *group, void *conn)
+{
+  struct group_member **m = &group->members;
+  struct group_member *gone;
+
+  while (*m && (*m)->conn != conn)
+    m = &(*m)->next;
+  if (*m == NULL)
+    return;
+
+  gone = *m;
+  *m = gone->next;
+  free(gone);
+
+  --group->num_members;
+  ++group->generation;
+}
+
+uint64_t group_assignment(struct group *group, void *conn, uint32_t num_partitions)
+{
+  struct group_member *m;
+  uint64_t partitions = 0;
+  uint32_t p;
+  int index = 0;
+
+  for (m = group->members; m && m->conn != conn; m = m->next)
+    ++index;
+  if (m == NULL)
+    return 0;
+
+  for (p = index; p < num_partitions; p += group->num_members)
+    partitions |= (uint64_t)1 << p;
+
+  return partitions;
+}
+
+void group_for_each(const char *topic, void (*fn)(struct group *group))
+{
+  struct group *g;
+
+  if (topic[0] == '\0')
+    topic = DEFAULT_TOPIC;
+
+  for (g = groups; g; g = g->next)
+    if (strcmp(g->topic, topic) == 0)
+      fn(g);
+}
@@ -0,0 +1,62 @@
+#ifndef RDMA_GROUP_H
+#define RDMA_GROUP_H
+
+#include "common.h"
+#include "messages.h"
+
+struct group_member
+{
+  // The member's control connection
+  void *conn;
+  struct group_member *next;
+};
+
+/**
+ * Consumers of a topic sharing its partitions between them. Partitions are
+ * dealt to members round-robin in join order, so every partition has exactly
+ * one reader and shares differ by at most one partition.
+ */
+struct group
+{
+  char name[GROUP_NAME_MAX];
+  char topic[TOPIC_NAME_MAX];
+
+  uint32_t generation;
+  int num_members;
+  struct group_member *members;
+
+  // Arena offset to resume each partition from, NO_OFFSET if none committed.
+  // A row of the offsets table, which readers write into directly.
+  uint64_t *committed;
+
+  struct group *next;
+};
+
+#define NO_OFFSET ((uint64_t)-1)
+
+// Groups the offsets table has rows for
+#define MAX_GROUPS 256
+
+// Registered table of every group's committed offsets, MAX_PARTITIONS per
+// group. Readers commit with an RDMA WRITE into their partition's slot, so
+// the broker spends nothing on commits and reads them only on resume. Only
+// the slot is writable by the reader: it is given a memory window bound to
+// it, or where the device has none, a registration of it alone.
+struct ibv_mr * group_offsets_mr();
+
+// Non-zero if memory windows can be bound to the offsets table
+int group_offsets_windows();
+
+// Looks the group up by name and topic, creating it on first use
+struct group * group_get(const char *name, const char *topic);
+
+void group_join(struct group *group, void *conn);
+void group_leave(struct group *group, void *conn);
+
+// Partitions of the member's share, as a bitmask, out of num_partitions
+uint64_t group_assignment(struct group *group, void *conn, uint32_t num_partitions);
+
+// Calls fn on every group reading the named topic
+void group_for_each(const char *topic, void (*fn)(struct group *group));
+
+#endif
@@ -0,0 +1,116 @@
+#include <time.h>
+
+#include "index.h"
+
+static struct seek_index *indexes = NULL;
+static struct ibv_mr *indexes_mr = NULL;
+// Indexes handed out; logs taking their first record on different threads
+// bump it atomically
+static uint32_t num_indexes = 0;
+static pthread_once_t indexes_once = PTHREAD_ONCE_INIT;
+static pthread_once_t indexes_mr_once = PTHREAD_ONCE_INIT;
+
+static void alloc_indexes()
+{
+  posix_memalign((void **)&indexes, sysconf(_SC_PAGESIZE), INDEX_MAX_LOGS * sizeof(*indexes));
+  memset(indexes, 0, INDEX_MAX_LOGS * sizeof(*indexes));
+}
+
+static uint64_t now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Move an index's first entry on to at least the given one. Both the
+ * appending thread and the compactor move it.
+ */
+static void advance_first(struct seek_index *index, uint64_t to)
+{
+  uint64_t first = __atomic_load_n(&index->first, __ATOMIC_ACQUIRE);
+
+  while (first < to && !__atomic_compare_exchange_n(&index->first, &first, to, 0, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE))
+    ;
+}
+
+/**
+ * Count the record at the offset, appended at timestamp, and index it if
+ * the interval since the last entry is up
+ */
+static void add_record(struct topic *log, uint64_t offset, uint64_t timestamp)
+{
+  struct seek_index *index = log->index;
+  uint64_t record = log->records++;
+  struct index_entry *e;
+  uint64_t next;
+
+  if (index == NULL) {
+    uint32_t i;
+
+    if (log->index_full)
+      return;
+    pthread_once(&indexes_once, alloc_indexes);
+    if ((i = __atomic_fetch_add(&num_indexes, 1, __ATOMIC_RELAXED)) >= INDEX_MAX_LOGS) {
+      log->index_full = 1;
+      return;
+    }
+    index = &indexes[i];
+    __atomic_store_n(&log->index, index, __ATOMIC_RELEASE);
+  }
+
+  next = index->next;
+  if (next > index->first) {
+    e = &index->entries[(next - 1) % INDEX_ENTRIES];
+    if (record - e->record < INDEX_INTERVAL_RECORDS && offset - e->offset < INDEX_INTERVAL_BYTES)
+      return;
+  }
+
+  // Readers halfway through a search notice first moved past what they
+  // found, and search again
+  advance_first(index, next + 1 > INDEX_ENTRIES ? next + 1 - INDEX_ENTRIES : 0);
+  e = &index->entries[next % INDEX_ENTRIES];
+  e->record = record;
+  e->timestamp = timestamp;
+  e->offset = offset;
+  __atomic_store_n(&index->next, next + 1, __ATOMIC_RELEASE);
+}
+
+void index_record(struct topic *log, uint64_t offset)
+{
+  add_record(log, offset, now_ms());
+}
+
+void index_recovered_record(struct topic *log, uint64_t offset, uint64_t timestamp)
+{
+  add_record(log, offset, timestamp);
+}
+
+void index_drop_compacted(struct topic *log)
+{
+  struct seek_index *index = log->index;
+  uint64_t first, next;
+
+  if (index == NULL)
+    return;
+  // Entries are in log order, and compaction takes the log from its head
+  first = __atomic_load_n(&index->first, __ATOMIC_ACQUIRE);
+  next = __atomic_load_n(&index->next, __ATOMIC_ACQUIRE);
+  while (first < next && log_compacted(index->entries[first % INDEX_ENTRIES].offset))
+    ++first;
+  advance_first(index, first);
+}
+
+static void register_indexes()
+{
+  pthread_once(&indexes_once, alloc_indexes);
+  TEST_Z(indexes_mr = ibv_reg_mr(rc_get_pd(), indexes, INDEX_MAX_LOGS * sizeof(*indexes), IBV_ACCESS_REMOTE_READ));
+}
+
+struct ibv_mr * index_mr()
+{
+  pthread_once(&indexes_mr_once, register_indexes);
+  return indexes_mr;
+}
@@ -0,0 +1,41 @@
+#ifndef RDMA_INDEX_H
+#define RDMA_INDEX_H
+
+#include "topic.h"
+
+/**
+ * Sparse seek indexes of the logs, so a consumer can start at a record
+ * number or a point in time without reading everything before it. Every
+ * log gets a struct seek_index in one registered region as it takes its
+ * first record, and an entry in it every INDEX_INTERVAL_RECORDS records or
+ * INDEX_INTERVAL_BYTES bytes; consumers binary search it with RDMA READs
+ * and read the log on from the entry they land on.
+ *
+ * Indexes live in memory only: after a restart, they are rebuilt by walking
+ * each recovered log from its head, numbering the records it holds from 0.
+ * When records were appended is not kept in the log, so recovered entries
+ * carry the modification time of their segment's file. That is never before
+ * the records were appended, so a seek by time may start early but never
+ * skips a record.
+ */
+
+// Logs that can have an index; later ones go without
+#define INDEX_MAX_LOGS 128
+
+// Counts a record whose first fragment was just appended to the log at the
+// offset, and indexes it if the interval since the last entry is up. Called
+// on the thread appending to the log.
+void index_record(struct topic *log, uint64_t offset);
+
+// Counts and indexes a record of a log being recovered, as index_record()
+// does, but as appended at the given time, in ms since the epoch
+void index_recovered_record(struct topic *log, uint64_t offset, uint64_t timestamp);
+
+// Drops the entries pointing into segments compacted out of the log
+void index_drop_compacted(struct topic *log);
+
+// The registered region holding every index, registered on first call;
+// needs rc_get_pd(). Safe to call from any thread.
+struct ibv_mr * index_mr();
+
+#endif
@@ -0,0 +1,59 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "filter.h"
+#include "keys.h"
+
+// Keys a table starts with room for
+#define KEYS_MIN 1024
+
+struct log_key * key_get(struct key_table *t, const char *key, uint16_t length)
+{
+  uint32_t hash = key_hash(key, length);
+  struct log_key *k;
+  uint64_t i;
+
+  if (2 * (t->used + 1) > t->capacity) {
+    struct key_table grown;
+
+    grown.capacity = t->capacity ? 2 * t->capacity : KEYS_MIN;
+    grown.slots = (struct log_key *)calloc(grown.capacity, sizeof(*grown.slots));
+    grown.used = t->used;
+    for (i = 0; i < t->capacity; ++i) {
+      uint64_t j = t->slots[i].hash & (grown.capacity - 1);
+
+      if (t->slots[i].key == NULL)
+        continue;
+      while (grown.slots[j].key)
+        j = (j + 1) & (grown.capacity - 1);
+      grown.slots[j] = t->slots[i];
+    }
+    free(t->slots);
+    *t = grown;
+  }
+
+  for (i = hash & (t->capacity - 1);; i = (i + 1) & (t->capacity - 1)) {
+    k = &t->slots[i];
+    if (k->key == NULL)
+      break;
+    if (k->hash == hash && k->length == length && memcmp(k->key, key, length) == 0)
+      return k;
+  }
+
+  k->key = (char *)malloc(length);
+  memcpy(k->key, key, length);
+  k->length = length;
+  k->hash = hash;
+  k->newest = NO_INDEX;
+  ++t->used;
+  return k;
+}
+
+void key_table_free(struct key_table *t)
+{
+  uint64_t i;
+
+  for (i = 0; i < t->capacity; ++i)
+    free(t->slots[i].key);
+  free(t->slots);
+}
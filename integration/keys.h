@@ -0,0 +1,35 @@
+#ifndef RDMA_KEYS_H
+#define RDMA_KEYS_H
+
+#include <stdint.h>
+
+// Newest record of a key that has none yet
+#define NO_INDEX ((uint64_t)-1)
+
+/**
+ * A key seen in a log being walked, with the index of its newest record:
+ * entries are counted in the order the walk takes them
+ */
+struct log_key
+{
+  char *key;
+  uint16_t length;
+  uint32_t hash;
+  uint64_t newest;
+};
+
+// Open-addressed table of the keys of a log, at most half full; zeroed
+// when empty
+struct key_table
+{
+  struct log_key *slots;
+  uint64_t capacity;
+  uint64_t used;
+};
+
+// The key's entry in the table, added with nothing newest if it is new
+struct log_key * key_get(struct key_table *t, const char *key, uint16_t length);
+
+void key_table_free(struct key_table *t);
+
+#endif
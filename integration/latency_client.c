@@ -0,0 +1,134 @@
+#include "rdma_producer.h"
+#include <unistd.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <time.h>
+
+#ifndef NUM_RECORDS
+    #define NUM_RECORDS 10000
+#endif
+
+#ifndef KEY_SIZE
+    #define KEY_SIZE 8 // in bytes, including the terminator
+#endif
+
+// Same record sizes as scripts/plotting/scripts/micro_individual_latency.py
+static const size_t record_sizes[] = {16, 32, 96, 256, 512, 1024, 10240, 51240, 102400, 1024000};
+
+// Power-of-two microsecond buckets of the ack latency histogram; the last
+// one takes everything slower
+#define HISTOGRAM_BUCKETS 20
+
+static volatile int acked = 0;
+// Names the ack setting of the broker under test, so runs against one
+// acking from its own memory and one waiting for followers can be told
+// apart; NULL for none
+static const char *label = NULL;
+
+static void on_release(char *value, void *arg)
+{
+    __atomic_store_n(&acked, 1, __ATOMIC_RELEASE);
+}
+
+static double now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a, y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Print how many of the sorted latencies fall in each power-of-two bucket
+ * of microseconds, leaving out the empty buckets at either end
+ */
+static void print_histogram(const double *latencies)
+{
+    int counts[HISTOGRAM_BUCKETS] = {0};
+    int i, b, first = HISTOGRAM_BUCKETS, last = 0;
+
+    for (i = 0; i < NUM_RECORDS; i++) {
+        for (b = 0; b < HISTOGRAM_BUCKETS - 1 && latencies[i] >= (double)(2 << b); b++)
+            ;
+        counts[b]++;
+        if (b < first)
+            first = b;
+        if (b > last)
+            last = b;
+    }
+
+    for (b = first; b <= last; b++)
+        printf("    < %7d us %8d\n", 2 << b, counts[b]);
+}
+
+/**
+ * Produce records of the given size one at a time and record the time from
+ * produce to broker acknowledgement. Latencies are written one per line to
+ * latency_<size>.csv, the format read_stats() in the plotting scripts expects,
+ * or to latency_<label>_<size>.csv with a label.
+ */
+static void run(size_t record_size, char *value, double *latencies)
+{
+    char key[KEY_SIZE];
+    char path[64];
+    int i;
+
+    memset(key, 'k', KEY_SIZE - 1);
+    key[KEY_SIZE - 1] = '\0';
+
+    for (i = 0; i < NUM_RECORDS; i++) {
+        acked = 0;
+        double start = now_us();
+        produceRecordZeroCopy(key, value, record_size - (KEY_SIZE - 1), on_release, NULL);
+        while (!__atomic_load_n(&acked, __ATOMIC_ACQUIRE))
+            ;
+        latencies[i] = now_us() - start;
+    }
+
+    if (label)
+        snprintf(path, sizeof(path), "latency_%s_%zu.csv", label, record_size);
+    else
+        snprintf(path, sizeof(path), "latency_%zu.csv", record_size);
+    FILE *f = fopen(path, "w");
+    fprintf(f, "latency_us\n");
+    for (i = 0; i < NUM_RECORDS; i++)
+        fprintf(f, "%f\n", latencies[i]);
+    fclose(f);
+
+    qsort(latencies, NUM_RECORDS, sizeof(double), compare_double);
+    printf("%8zu bytes: p50 %8.2f us  p99 %8.2f us%s%s\n", record_size,
+           latencies[NUM_RECORDS / 2], latencies[NUM_RECORDS * 99 / 100],
+           label ? "  " : "", label ? label : "");
+    print_histogram(latencies);
+}
+
+int main(int argc, char *argv[])
+{
+    size_t max_size = record_sizes[sizeof(record_sizes) / sizeof(record_sizes[0]) - 1];
+    double *latencies = malloc(NUM_RECORDS * sizeof(double));
+    unsigned i;
+
+    // One long-lived value buffer, so only the first record pays for registration
+    char *value = malloc(max_size);
+    memset(value, 'v', max_size);
+
+    // The broker's ack setting is not ours to see, so runs are labelled
+    // with it: leader, replicas-1 and so on
+    if (argc > 3)
+        label = argv[3];
+
+    init(argv[1], argc > 2 ? argv[2] : NULL);
+    sleep(5);
+
+    for (i = 0; i < sizeof(record_sizes) / sizeof(record_sizes[0]); i++)
+        run(record_sizes[i], value, latencies);
+
+    terminate();
+    return 0;
+}
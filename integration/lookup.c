@@ -0,0 +1,171 @@
+#include "filter.h"
+#include "lookup.h"
+
+#define LOOKUP_TABLE_SIZE ((LOOKUP_BUCKETS + 1 + LOOKUP_SPILL_MAX) * sizeof(struct lookup_bucket))
+
+struct lookup_table * lookup_new()
+{
+  struct lookup_table *table = (struct lookup_table *)calloc(1, sizeof(*table));
+
+  posix_memalign((void **)&table->buckets, sysconf(_SC_PAGESIZE), LOOKUP_TABLE_SIZE);
+  memset(table->buckets, 0, LOOKUP_TABLE_SIZE);
+  pthread_mutex_init(&table->mutex, NULL);
+  TEST_Z(table->mr = ibv_reg_mr(rc_get_pd(), table->buckets, LOOKUP_TABLE_SIZE, IBV_ACCESS_REMOTE_READ));
+  return table;
+}
+
+/**
+ * The key's slot among the buckets it may be in, NULL if it has none
+ */
+static struct lookup_slot * find_key(struct lookup_bucket *buckets, const char *key, uint16_t key_length)
+{
+  uint32_t spill = buckets->spill;
+  uint32_t b;
+  int i;
+
+  for (b = 0; b < 2 + spill; ++b)
+    for (i = 0; i < LOOKUP_BUCKET_SLOTS; ++i)
+      if (buckets[b].slots[i].key_length == key_length && memcmp(buckets[b].slots[i].key, key, key_length) == 0)
+        return &buckets[b].slots[i];
+  return NULL;
+}
+
+/**
+ * The key's slot, or else the first free one from its bucket on, which
+ * the bucket's spill is extended to cover. NULL if there is neither.
+ */
+static struct lookup_slot * find_slot(struct lookup_bucket *buckets, const char *key, uint16_t key_length)
+{
+  struct lookup_slot *slot = find_key(buckets, key, key_length);
+  uint32_t spill = buckets->spill;
+  uint32_t b;
+  int i;
+
+  if (slot)
+    return slot;
+  for (b = 0; b < 2 + LOOKUP_SPILL_MAX; ++b) {
+    for (i = 0; i < LOOKUP_BUCKET_SLOTS; ++i) {
+      if (buckets[b].slots[i].key_length != 0)
+        continue;
+      // Readers look this far before the key is in, which only means
+      // they miss it until it is
+      if (b > 1 + spill)
+        __atomic_store_n(&buckets->spill, b - 1, __ATOMIC_RELEASE);
+      return &buckets[b].slots[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * The key of a record's first fragment, without the topic name entries of
+ * subscription logs keep in front of it. Returns 0 for other entries and
+ * records without a key.
+ */
+static int entry_key(const struct record_header *entry, const char **key, uint16_t *key_length)
+{
+  *key = (const char *)(entry + 1);
+  *key_length = entry->key_length;
+  if (!(entry->flags & RECORD_FIRST_FRAGMENT) || *key_length == 0)
+    return 0;
+  if (entry->flags & RECORD_TOPIC) {
+    uint16_t prefix_length = strnlen(*key, *key_length) + 1;
+
+    *key += prefix_length;
+    *key_length -= prefix_length;
+  }
+  return 1;
+}
+
+/**
+ * Point the slot at the record whose first fragment is the entry at the
+ * offset, under an odd version while it is rewritten
+ */
+static void write_slot(struct lookup_slot *slot, const struct record_header *entry, uint64_t offset,
+                       const char *key, uint16_t key_length)
+{
+  const char *value = (const char *)(entry + 1) + entry->key_length;
+  uint32_t version = slot->version;
+
+  __atomic_store_n(&slot->version, version + 1, __ATOMIC_RELAXED);
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+
+  slot->value_length = entry->value_length;
+  if (entry->flags & RECORD_VALUE_REF) {
+    const struct value_ref *ref = (const struct value_ref *)value;
+
+    slot->flags = LOOKUP_REF;
+    slot->addr = ref->addr;
+    slot->rkey = ref->rkey;
+  } else if ((entry->flags & RECORD_LAST_FRAGMENT) && entry->value_length <= LOOKUP_VALUE_MAX) {
+    slot->flags = LOOKUP_INLINE;
+    memcpy(slot->value, value, entry->value_length);
+  } else {
+    slot->flags = LOOKUP_LOG;
+    slot->addr = offset;
+  }
+  if (entry->flags & RECORD_COMPRESSED)
+    slot->flags |= LOOKUP_COMPRESSED;
+  if (slot->key_length == 0) {
+    memcpy(slot->key, key, key_length);
+    slot->key_length = key_length;
+  }
+
+  slot->checksum = LOOKUP_CHECKSUM(slot);
+
+  __atomic_thread_fence(__ATOMIC_RELEASE);
+  __atomic_store_n(&slot->version, version + 2, __ATOMIC_RELAXED);
+}
+
+void lookup_update(struct lookup_table *table, const struct record_header *entry, uint64_t offset)
+{
+  struct lookup_bucket *buckets;
+  struct lookup_slot *slot;
+  const char *key;
+  uint16_t key_length;
+
+  if (!entry_key(entry, &key, &key_length))
+    return;
+
+  // Readers never look for keys this long
+  if (key_length > LOOKUP_KEY_MAX) {
+    ++table->dropped;
+    return;
+  }
+  buckets = &table->buckets[LOOKUP_BUCKET(key_hash(key, key_length))];
+  if ((slot = find_slot(buckets, key, key_length)) == NULL) {
+    if (table->dropped++ == 0)
+      printf("lookup table is leaving keys out\n");
+    __atomic_store_n(&buckets->overflow, 1, __ATOMIC_RELEASE);
+    return;
+  }
+  write_slot(slot, entry, offset, key, key_length);
+}
+
+/**
+ * The builder walks the log up to a tail read after the entry went in, so
+ * one it took as well may come through here again, which changes nothing.
+ * The mutex is uncontended but for the odd compaction.
+ */
+void lookup_append(struct lookup_table *table, const struct record_header *entry, uint64_t offset)
+{
+  pthread_mutex_lock(&table->mutex);
+  if (table->built)
+    lookup_update(table, entry, offset);
+  pthread_mutex_unlock(&table->mutex);
+}
+
+void lookup_moved(struct lookup_table *table, const struct record_header *entry, uint64_t from, uint64_t to)
+{
+  struct lookup_slot *slot;
+  const char *key;
+  uint16_t key_length;
+
+  if (!entry_key(entry, &key, &key_length) || key_length > LOOKUP_KEY_MAX)
+    return;
+  pthread_mutex_lock(&table->mutex);
+  if (table->built && (slot = find_key(&table->buckets[LOOKUP_BUCKET(key_hash(key, key_length))], key, key_length)) &&
+      (slot->flags & LOOKUP_LOG) && slot->addr == from)
+    write_slot(slot, entry, to, key, key_length);
+  pthread_mutex_unlock(&table->mutex);
+}
@@ -0,0 +1,54 @@
+#ifndef RDMA_LOOKUP_H
+#define RDMA_LOOKUP_H
+
+#include "common.h"
+#include "messages.h"
+
+/**
+ * A log's lookup table: the newest value of every key appended to it, laid
+ * out for clients to read with one-sided READs, so a GET takes no broker
+ * CPU. A key's slot is in the bucket its hash picks or the one after, both
+ * covered by a single READ, unless those were full when it came; the
+ * bucket then says how many more to read. Values longer than
+ * LOOKUP_VALUE_MAX are read where their record is, in the value heap or
+ * the log, which takes more READs. A key with no slot left for it marks its
+ * bucket, so readers can tell it from one never appended.
+ */
+struct lookup_table
+{
+  // LOOKUP_BUCKETS + 1 + LOOKUP_SPILL_MAX buckets, so the last ones have as
+  // many after them as any
+  struct lookup_bucket *buckets;
+  struct ibv_mr *mr;
+  // Keys left out, because every bucket they could go in was full or they
+  // are longer than LOOKUP_KEY_MAX
+  uint64_t dropped;
+  // Set once the builder has filled the table from the log up to its tail,
+  // with mutex held; until then appenders leave their entries to it
+  int built;
+  // Held around every change of a built table, which its appender and the
+  // compactor make from threads of their own
+  pthread_mutex_t mutex;
+};
+
+// Allocates and registers an empty table; needs rc_get_pd()
+struct lookup_table * lookup_new();
+
+// Makes the record whose first fragment is the log entry at the offset the
+// newest of its key. Called for every entry of the table's log in log
+// order: by the builder, and then through lookup_append().
+void lookup_update(struct lookup_table *table, const struct record_header *entry, uint64_t offset);
+
+// Called on the thread appending to the table's log with every entry it
+// appends, once the entry is in the log; while the table is not built,
+// only once the builder is done.
+void lookup_append(struct lookup_table *table, const struct record_header *entry, uint64_t offset);
+
+// Called by the compactor for every record it copied, with the copy of its
+// first fragment, once the log's head is swapped: a key read from the log
+// offset the record was at is read from the one it is at now. A table not
+// built yet is left to its builder, which takes the log again from its new
+// head.
+void lookup_moved(struct lookup_table *table, const struct record_header *entry, uint64_t from, uint64_t to);
+
+#endif
@@ -0,0 +1,177 @@
+#include <string.h>
+
+#include "lz.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_OFFSET 65535
+#define LZ_HASH_BITS 12
+// Inputs end in at least this many literals, and no match starts within
+// LZ_MATCH_LIMIT bytes of their end, as in LZ4
+#define LZ_LAST_LITERALS 5
+#define LZ_MATCH_LIMIT 12
+// Misses before the search steps over more than a byte at a time, so
+// incompressible input goes by quickly
+#define LZ_SKIP_SHIFT 6
+
+static uint32_t read32(const uint8_t *p)
+{
+  uint32_t v;
+
+  memcpy(&v, p, sizeof(v));
+  return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+  return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * Write the rest of a length whose nibble was 15. Returns NULL if it does
+ * not fit before end.
+ */
+static uint8_t * put_length(uint8_t *op, uint8_t *end, size_t length)
+{
+  for (; length >= 255; length -= 255) {
+    if (op == end)
+      return NULL;
+    *op++ = 255;
+  }
+  if (op == end)
+    return NULL;
+  *op++ = length;
+  return op;
+}
+
+/**
+ * Write a sequence of literals followed, unless match_length is 0, by a
+ * match. Returns NULL if it does not fit before end.
+ */
+static uint8_t * put_sequence(uint8_t *op, uint8_t *end, const uint8_t *literals, size_t num_literals,
+                              size_t offset, size_t match_length)
+{
+  uint8_t *token = op++;
+  size_t m = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+  if (token >= end)
+    return NULL;
+  *token = (num_literals < 15 ? num_literals : 15) << 4 | (m < 15 ? m : 15);
+  if (num_literals >= 15 && (op = put_length(op, end, num_literals - 15)) == NULL)
+    return NULL;
+  if ((size_t)(end - op) < num_literals)
+    return NULL;
+  memcpy(op, literals, num_literals);
+  op += num_literals;
+  if (match_length == 0)
+    return op;
+
+  if (end - op < 2)
+    return NULL;
+  *op++ = offset & 0xff;
+  *op++ = offset >> 8;
+  if (m >= 15)
+    op = put_length(op, end, m - 15);
+  return op;
+}
+
+size_t lz_compress(const void *in, size_t n, void *out, size_t capacity)
+{
+  const uint8_t *src = (const uint8_t *)in, *ip = src, *anchor = src, *end = src + n;
+  uint8_t *op = (uint8_t *)out, *op_end = op + capacity;
+  uint32_t table[1 << LZ_HASH_BITS];
+  size_t misses = 0;
+
+  memset(table, 0, sizeof(table));
+  while (n >= LZ_MATCH_LIMIT && ip < end - LZ_MATCH_LIMIT) {
+    uint32_t h = hash4(read32(ip));
+    const uint8_t *ref = src + table[h];
+    size_t length = LZ_MIN_MATCH;
+
+    table[h] = ip - src;
+    if (ref >= ip || ip - ref > LZ_MAX_OFFSET || read32(ref) != read32(ip)) {
+      ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+      continue;
+    }
+    misses = 0;
+
+    // Take in what matches before and after the four bytes found
+    while (ip > anchor && ref > src && ip[-1] == ref[-1]) {
+      --ip;
+      --ref;
+      ++length;
+    }
+    while (ip + length < end - LZ_LAST_LITERALS && ip[length] == ref[length])
+      ++length;
+
+    if ((op = put_sequence(op, op_end, anchor, ip - anchor, ip - ref, length)) == NULL)
+      return 0;
+    ip += length;
+    anchor = ip;
+  }
+
+  if ((op = put_sequence(op, op_end, anchor, end - anchor, 0, 0)) == NULL)
+    return 0;
+  return op - (uint8_t *)out;
+}
+
+/**
+ * Read the rest of a length whose nibble was 15 onto it. Returns -1 if the
+ * input ends first.
+ */
+static int get_length(const uint8_t **ip, const uint8_t *end, size_t *length)
+{
+  uint8_t b;
+
+  do {
+    if (*ip == end)
+      return -1;
+    b = *(*ip)++;
+    *length += b;
+  } while (b == 255);
+  return 0;
+}
+
+int64_t lz_decompress(const void *in, size_t n, void *out, size_t capacity)
+{
+  const uint8_t *ip = (const uint8_t *)in, *end = ip + n;
+  uint8_t *op = (uint8_t *)out, *op_end = op + capacity;
+
+  while (ip < end) {
+    uint8_t token = *ip++;
+    size_t length = token >> 4, offset;
+    const uint8_t *ref;
+
+    if (length == 15 && get_length(&ip, end, &length) < 0)
+      return -1;
+    if (length > (size_t)(end - ip) || length > (size_t)(op_end - op))
+      return -1;
+    memcpy(op, ip, length);
+    ip += length;
+    op += length;
+    // The last sequence has no match
+    if (ip == end)
+      break;
+
+    if (end - ip < 2)
+      return -1;
+    offset = ip[0] | (size_t)ip[1] << 8;
+    ip += 2;
+    length = token & 15;
+    if (length == 15 && get_length(&ip, end, &length) < 0)
+      return -1;
+    length += LZ_MIN_MATCH;
+    if (offset == 0 || offset > (size_t)(op - (uint8_t *)out) || length > (size_t)(op_end - op))
+      return -1;
+
+    // A match may overlap what it copies, repeating it
+    ref = op - offset;
+    if (offset >= length) {
+      memcpy(op, ref, length);
+      op += length;
+    } else {
+      while (length--)
+        *op++ = *ref++;
+    }
+  }
+  return op - (uint8_t *)out;
+}
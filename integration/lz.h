@@ -0,0 +1,29 @@
+#ifndef RDMA_LZ_H
+#define RDMA_LZ_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * A byte-oriented LZ77 codec in the manner of LZ4, trading ratio for
+ * speed: no entropy coding, matches found through a single-entry hash
+ * table of 4-byte sequences. The output is a run of sequences, each a
+ * token byte whose nibbles give the literal and match lengths (15 meaning
+ * more length bytes follow, 255 each until one is smaller), the literals,
+ * and a 2-byte little-endian offset back to the match; the last sequence
+ * has literals only.
+ */
+
+// Compresses n bytes into out, returning the compressed length, or 0 if it
+// would not fit in capacity
+size_t lz_compress(const void *in, size_t n, void *out, size_t capacity);
+
+// Most that n compressed bytes can decompress to: no input byte stands for
+// more than a length byte of 255
+#define LZ_MAX_DECOMPRESSED(n) ((uint64_t)(n) * 255)
+
+// Decompresses n bytes into out, returning the decompressed length, or -1
+// if the input is corrupt or decompresses to more than capacity
+int64_t lz_decompress(const void *in, size_t n, void *out, size_t capacity);
+
+#endif
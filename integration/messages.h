@@ -1,14 +1,127 @@
 #ifndef RDMA_MESSAGES_H
 #define RDMA_MESSAGES_H
 
-const char *DEFAULT_PORT = "12346";
-const size_t BUFFER_SIZE = 1024 * 1024 * 1024;
+#include <stddef.h>
+
+#include "common.h"
+
+static const char DEFAULT_PORT[] = "12346";
+static const size_t BUFFER_SIZE = 1024 * 1024 * 1024;
+
+// Producers write chunks into a ring of landing slots on the broker, one
+// slot per write in flight. Must stay below RC_RECV_QUEUE_DEPTH.
+#define LANDING_SLOTS 8
+#define LANDING_SLOT_SIZE (1024 * 1024)
+
+// Multicast group addresses as text, long enough for IPv6
+#define MCAST_GROUP_MAX 46
+
+// Partitions of a topic; assignments to group members are bitmasks
+#define MAX_PARTITIONS 64
+
+// Each topic's log is a chain of segments that entries never straddle;
+// consumers are given access one segment at a time
+#define LOG_SEGMENT_SIZE (16 * 1024 * 1024)
+// Windows onto its log the broker keeps open for a reader at once
+#define CONSUMER_WINDOWS 2
 
 enum message_id
 {
   MSG_INVALID = 0,
   MSG_READY,
-  MSG_DONE
+  MSG_DONE,
+  MSG_ACK,
+  MSG_WINDOW,
+  MSG_ASSIGN,
+  MSG_SUBSCRIBE,
+  MSG_MULTICAST,
+  MSG_FETCH,
+  MSG_TOPIC,
+  MSG_PUSHED,
+  // Sent by a follower instead of MSG_READY to a reader of a partition it
+  // does not replicate, or lags too far behind on; read from the leader.
+  // Also sent to readers already reading once it falls out of sync.
+  MSG_LAGGING,
+  // Sent instead of MSG_READY to a reader the broker cannot serve, such as
+  // one with a new filter once every log slot is taken
+  MSG_REFUSED
+};
+
+// Set in the immediate of a consumer's send when it hands back this many RECORD_ALIGN units of its push ring
+#define IMM_CREDIT 0x40000000u
+// The immediate of a reader's send once it is done reading the snapshot
+// MSG_READY pointed it at
+#define IMM_SNAPSHOT_READ 0x20000000u
+
+// Push rings consumers ask for, and the least the broker accepts; either
+// way an entry and a wrap marker always fit
+#define PUSH_RING_SIZE (4 * LANDING_SLOT_SIZE)
+#define PUSH_RING_MIN (2 * LANDING_SLOT_SIZE)
+
+// A log's seek index gets an entry every this many records or bytes,
+// whichever comes first, and keeps the last INDEX_ENTRIES of them
+#define INDEX_INTERVAL_RECORDS 1024
+#define INDEX_INTERVAL_BYTES (128 * 1024)
+#define INDEX_ENTRIES 8192
+
+// A log's lookup table has 1 << LOOKUP_BUCKET_BITS buckets of
+// LOOKUP_BUCKET_SLOTS keys. A key goes in its bucket or the one after, or
+// failing that up to LOOKUP_SPILL_MAX buckets further on.
+#define LOOKUP_BUCKET_BITS 13
+#define LOOKUP_BUCKET_SLOTS 4
+#define LOOKUP_BUCKETS (1 << LOOKUP_BUCKET_BITS)
+#define LOOKUP_SPILL_MAX 16
+// Longest key a lookup table holds, and longest value it holds inline;
+// longer ones are read from the log
+#define LOOKUP_KEY_MAX 32
+#define LOOKUP_VALUE_MAX 184
+// Bucket of a key's hash; takes the high bits, since producers route keys
+// to partitions by the low ones
+#define LOOKUP_BUCKET(hash) ((uint32_t)((hash) * 2654435761u) >> (32 - LOOKUP_BUCKET_BITS))
+
+// Keys in filters are NUL-terminated and at most this long with the NUL
+#define FILTER_KEY_MAX 32
+// Key hashes are folded into this many buckets for FILTER_KEY_HASH
+#define FILTER_HASH_BUCKETS 256
+
+enum filter_kind
+{
+  FILTER_NONE = 0,
+  // Keys starting with key.from
+  FILTER_KEY_PREFIX,
+  // Keys in [key.from, key.to), compared bytewise; an empty to is unbounded
+  FILTER_KEY_RANGE,
+  // Keys whose hash bucket is set in hash; other keys may share a bucket
+  FILTER_KEY_HASH,
+  // Records with value_length in [value_length.min, value_length.max];
+  // compressed values count their length before compression
+  FILTER_VALUE_LENGTH
+};
+
+/**
+ * Records a consumer wants to see. The broker keeps a log per distinct
+ * filter, holding copies of the matching records, for filtered consumers
+ * to read instead of the topic's.
+ */
+struct record_filter
+{
+  uint32_t kind;
+  uint32_t reserved;
+
+  union
+  {
+    struct
+    {
+      char from[FILTER_KEY_MAX];
+      char to[FILTER_KEY_MAX];
+    } key;
+    uint8_t hash[FILTER_HASH_BUCKETS / 8];
+    struct
+    {
+      uint64_t min;
+      uint64_t max;
+    } value_length;
+  } u;
 };
 
 struct message
@@ -19,10 +132,285 @@ struct message
   {
     struct
     {
+      // Where a producer writes its chunks, or a lookup reader's lookup
+      // table; consumers read their log through the windows MSG_WINDOW
+      // announces instead
       uint64_t addr;
       uint32_t rkey;
+      uint32_t reserved0;
+      // Log offset a consumer starts reading from
+      uint64_t start;
+      // Slot a group reader writes the offset its partition resumes from
+      // into; commit_addr is 0 for readers outside a group
+      uint64_t commit_addr;
+      uint32_t commit_rkey;
+      uint32_t index_rkey;
+      // The seek index of the log a consumer reads, 0 if it has none
+      uint64_t index_addr;
+      // Snapshot a reader that asked for one takes first, start being the
+      // offset it was taken at; snapshot_length is 0 if there is none
+      uint64_t snapshot_addr;
+      uint64_t snapshot_length;
+      uint32_t snapshot_rkey;
+      uint32_t reserved1;
     } mr;
+    struct
+    {
+      // The log bytes [offset, offset + length) are at addr under rkey.
+      // The window replaces the reader's earlier one with the same index,
+      // which the broker only reuses once the reader has moved past it.
+      // A lookup reader is sent one of length 0, replacing none, if the
+      // segment it asked for was compacted out of the log and is no longer
+      // in memory; the key's slot points at the copy by then.
+      uint64_t offset;
+      uint64_t addr;
+      uint32_t rkey;
+      uint32_t length;
+      uint32_t index;
+      uint32_t reserved;
+    } window;
+    struct
+    {
+      // Log offset a reader needs a window onto; the broker answers with
+      // MSG_WINDOW once it has one, which for a segment that is no longer
+      // in memory means reading it from its file first
+      uint64_t offset;
+    } fetch;
+    struct
+    {
+      // Bumped on every rebalance of the group
+      uint32_t generation;
+      uint32_t reserved;
+      // Bit n set if partition n is this member's to read
+      uint64_t partitions;
+    } assign;
+    struct
+    {
+      // FILTER_NONE to read every record
+      struct record_filter filter;
+      // Ring the broker writes the log into as it grows, for consumers
+      // that poll their own memory; ring_size is 0 for ones that read
+      uint64_t ring_addr;
+      uint32_t ring_rkey;
+      uint32_t ring_size;
+      // Non-zero to take the log from a multicast group where the broker
+      // has one, repairing losses through this connection
+      uint32_t multicast;
+      // Non-zero to only look keys up in the log's lookup table; the
+      // broker answers with MSG_READY and the table's address
+      uint32_t lookup;
+      // Non-zero if the reader is a follower broker replicating the log
+      // into its own; the ring it hands back is replicated, which producer
+      // acks may wait for
+      uint32_t replica;
+      // Non-zero to start from the newest snapshot of the log, if the
+      // broker takes them, rather than from its head
+      uint32_t snapshot;
+      // Non-zero if a follower that lost its link resumes from offset, as
+      // the last push it took told it, or a reader a lagging follower sent
+      // here from its MSG_LAGGING's leader_offset, rather than from the head
+      uint32_t resume;
+      uint64_t offset;
+    } subscribe;
+    struct
+    {
+      // Group the log is sent to, sent before MSG_READY
+      char group[MCAST_GROUP_MAX];
+    } multicast;
+    struct
+    {
+      // A partition a follower is to replicate, sent for every partition
+      // the leader has when the follower connects and for every one it
+      // creates after
+      char name[TOPIC_NAME_MAX];
+      uint32_t partition;
+    } topic;
+    struct
+    {
+      // Why a reader got MSG_REFUSED
+      char reason[64];
+    } refused;
+    struct
+    {
+      // Zero in place of MSG_READY. Otherwise the reader reads the
+      // follower's log up to offset, which a push reader has been pushed
+      // already, and then the leader's from leader_offset, where it goes on
+      // from the same record.
+      uint32_t resume;
+      uint32_t reserved;
+      uint64_t offset;
+      uint64_t leader_offset;
+    } lagging;
+    struct
+    {
+      // Sent to a follower once entries are written into its push ring,
+      // which it appends on receipt, with how many bytes the log had past
+      // them at the time. The ring holds them up to ring bytes written in
+      // all, wrapping included, and they take the log up to offset.
+      uint64_t lag;
+      uint64_t ring;
+      uint64_t offset;
+    } pushed;
   } data;
 };
 
+#define RECORD_FIRST_FRAGMENT 0x1
+#define RECORD_LAST_FRAGMENT  0x2
+// The payload holds the key and a struct value_ref instead of the value
+#define RECORD_VALUE_REF      0x4
+// Nothing follows in this segment; the topic continues at value_offset. In
+// a push ring, the broker wrapped around and value_offset is 0.
+#define RECORD_SEGMENT_END    0x8
+// The key is preceded by the NUL-terminated name of the topic the record was
+// published to, counted in key_length; set in subscription logs
+#define RECORD_TOPIC          0x10
+// The producer compressed the value: it starts with a struct
+// compressed_value, and value_length counts the bytes stored
+#define RECORD_COMPRESSED     0x20
+#define RECORD_ALIGN 8
+
+/**
+ * Header of every entry in the broker log, and of every chunk a producer
+ * writes into a landing slot. The payload follows the header: the key (first
+ * fragment only) and then value bytes [value_offset, value_offset + n).
+ * Records larger than a landing slot are split into fragments that may be
+ * interleaved with other producers' entries; readers reassemble them by
+ * (producer_id, sequence). length counts the header too and the broker
+ * publishes it last, so a non-zero length means the whole entry is visible.
+ */
+struct record_header
+{
+  uint32_t length;
+  uint16_t key_length;
+  uint16_t flags;
+  uint32_t producer_id;
+  uint32_t sequence;
+  uint64_t value_length;
+  uint64_t value_offset;
+};
+
+/**
+ * Start of every multicast datagram; the log entry at offset follows. The
+ * broker numbers a log's datagrams consecutively, so receivers can tell
+ * when they missed some and read those entries from the log instead.
+ */
+struct mcast_header
+{
+  uint32_t sequence;
+  uint32_t flags;
+  uint64_t offset;
+};
+
+// The entry does not fit in a datagram; read it from the log
+#define MCAST_ENTRY_OMITTED 0x1
+
+enum codec
+{
+  CODEC_NONE = 0,
+  // lz.h
+  CODEC_LZ
+};
+
+/**
+ * Start of a compressed value, ahead of what the codec made of it. The
+ * broker stores and serves it as it is; consumers decompress it.
+ */
+struct compressed_value
+{
+  uint32_t codec;
+  uint32_t reserved;
+  // Length of the value before compression
+  uint64_t length;
+};
+
+// Where an out-of-line value lives in the broker's value heap
+struct value_ref
+{
+  uint64_t addr;
+  uint32_t rkey;
+  uint32_t reserved;
+};
+
+/**
+ * A key of a log's lookup table, with the newest value appended for it.
+ * Readers take a bucket with one RDMA READ, which need not see a slot's
+ * bytes in any order, and trust a slot only if its version is even and its
+ * checksum matches what it covers: the broker makes version odd before
+ * rewriting a slot, then sets the checksum and makes version even again,
+ * so a READ that saw part of a rewrite finds the checksum off. A key keeps
+ * its slot once it has one; a key_length of 0 marks a free slot.
+ */
+struct lookup_slot
+{
+  uint32_t version;
+  uint16_t key_length;
+  // LOOKUP_INLINE, LOOKUP_REF or LOOKUP_LOG, and LOOKUP_COMPRESSED
+  uint16_t flags;
+  uint64_t value_length;
+  // Where the value is in the broker's value heap, for LOOKUP_REF, or the
+  // log offset of the record's first fragment, for LOOKUP_LOG
+  uint64_t addr;
+  uint32_t rkey;
+  uint32_t reserved;
+  char key[LOOKUP_KEY_MAX];
+  char value[LOOKUP_VALUE_MAX];
+  uint32_t reserved1;
+  // key_hash() of LOOKUP_CHECKSUM_LENGTH bytes from key_length
+  uint32_t checksum;
+};
+
+#define LOOKUP_CHECKSUM_LENGTH (offsetof(struct lookup_slot, checksum) - offsetof(struct lookup_slot, key_length))
+#define LOOKUP_CHECKSUM(slot) key_hash((const char *)&(slot)->key_length, LOOKUP_CHECKSUM_LENGTH)
+
+// The value is in the slot
+#define LOOKUP_INLINE 0x1
+// The value is at addr under rkey, where it never changes
+#define LOOKUP_REF    0x2
+// The value is compressed, as its record's was
+#define LOOKUP_COMPRESSED 0x4
+// The value is read from the record at log offset addr, and the fragments
+// after it with the same producer_id and sequence
+#define LOOKUP_LOG    0x8
+
+struct lookup_bucket
+{
+  // Buckets past the next one that hold keys of this bucket; only grows
+  uint32_t spill;
+  // Set once a key of this bucket was left out, every bucket it could go
+  // in being full, so a key missing from it may have a value after all
+  uint32_t overflow;
+  struct lookup_slot slots[LOOKUP_BUCKET_SLOTS];
+};
+
+/**
+ * An entry of a log's seek index: the first fragment of record number
+ * record, counting the records appended to the log from the first, is at
+ * the log offset, and was appended at timestamp, in ms since the epoch
+ */
+struct index_entry
+{
+  uint64_t record;
+  uint64_t timestamp;
+  uint64_t offset;
+};
+
+/**
+ * A log's seek index, which consumers binary search with RDMA READs. Entries
+ * [first, next) are at entries[i % INDEX_ENTRIES], in the order they were
+ * added, so record numbers and timestamps only grow along them. The broker
+ * moves first past an entry before overwriting it, and next past one once
+ * it is written.
+ */
+struct seek_index
+{
+  uint64_t first;
+  uint64_t next;
+  struct index_entry entries[INDEX_ENTRIES];
+};
+
+#define RECORD_PAYLOAD_LENGTH(h) ((h)->length - sizeof(struct record_header))
+// Distance to the next log entry, padded so headers stay aligned
+#define RECORD_ENTRY_SIZE(h) \
+  (((uint64_t)(h)->length + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1))
+
 #endif
@@ -0,0 +1,173 @@
+#include <pthread.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "messages.h"
+#include "metadata.h"
+
+// Lookups answered by the metadata service; placements never change
+struct cached_placement
+{
+  char topic[TOPIC_NAME_MAX];
+  uint32_t partition;
+  struct broker_address broker;
+  struct cached_placement *next;
+};
+
+static struct cached_placement *placements = NULL;
+// Readers and producers of different partitions resolve concurrently
+static pthread_mutex_t placements_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+void parse_address(const char *address, const char *default_port, struct broker_address *out)
+{
+  const char *colon = strchr(address, ':');
+  size_t len = strlen(address);
+
+  // More than one colon is an IPv6 address without a port
+  if (colon && strchr(colon + 1, ':') == NULL)
+    len = colon - address;
+  else
+    colon = NULL;
+
+  if (len >= sizeof(out->host))
+    rc_die("parse_address: host name too long");
+
+  memcpy(out->host, address, len);
+  out->host[len] = '\0';
+  snprintf(out->port, sizeof(out->port), "%s", colon ? colon + 1 : default_port);
+}
+
+/**
+ * Send one request line to the service and read back the one-line reply,
+ * without its newline. Each request gets its own TCP connection.
+ */
+static void metadata_request(const char *service, const char *request, char *reply, size_t reply_len)
+{
+  struct broker_address address;
+  struct addrinfo hints, *addr;
+  size_t n = 0;
+  ssize_t r;
+  int fd;
+
+  parse_address(service, DEFAULT_METADATA_PORT, &address);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_socktype = SOCK_STREAM;
+  TEST_NZ(getaddrinfo(address.host, address.port, &hints, &addr));
+
+  if ((fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol)) < 0)
+    rc_die("metadata_request: socket failed");
+  if (connect(fd, addr->ai_addr, addr->ai_addrlen))
+    rc_die("metadata_request: cannot reach the metadata service");
+  freeaddrinfo(addr);
+
+  if (write(fd, request, strlen(request)) != (ssize_t)strlen(request))
+    rc_die("metadata_request: write failed");
+
+  while (n < reply_len - 1 && (r = read(fd, reply + n, reply_len - 1 - n)) > 0) {
+    n += r;
+    if (memchr(reply, '\n', n))
+      break;
+  }
+  close(fd);
+
+  reply[n] = '\0';
+  reply[strcspn(reply, "\n")] = '\0';
+  if (strncmp(reply, "ERR", 3) == 0) {
+    fprintf(stderr, "metadata service: %s\n", reply);
+    rc_die("metadata_request: request refused");
+  }
+}
+
+int metadata_replicas(const char *server)
+{
+  int n = 1;
+
+  if (strncmp(server, METADATA_SCHEME, strlen(METADATA_SCHEME)) == 0)
+    return 1;
+  for (; *server; ++server)
+    if (*server == REPLICA_SEPARATOR)
+      ++n;
+  return n;
+}
+
+/**
+ * Parse the given broker of a replica list; a single broker is a list of one
+ */
+static void parse_replica(const char *server, int replica, struct broker_address *out)
+{
+  char address[ADDRESS_HOST_MAX + ADDRESS_PORT_MAX + 1];
+  const char *end;
+
+  while (replica-- > 0 && (server = strchr(server, REPLICA_SEPARATOR)) != NULL)
+    ++server;
+  if (server == NULL)
+    rc_die("parse_replica: no such replica");
+
+  end = strchr(server, REPLICA_SEPARATOR);
+  snprintf(address, sizeof(address), "%.*s", end ? (int)(end - server) : (int)strlen(server), server);
+  parse_address(address, DEFAULT_PORT, out);
+}
+
+void metadata_resolve_replica(const char *server, const char *topic, uint32_t partition, int replica,
+                              struct broker_address *out)
+{
+  if (strncmp(server, METADATA_SCHEME, strlen(METADATA_SCHEME)) == 0)
+    metadata_resolve(server, topic, partition, out);
+  else
+    parse_replica(server, replica, out);
+}
+
+void metadata_resolve(const char *server, const char *topic, uint32_t partition, struct broker_address *out)
+{
+  size_t scheme_len = strlen(METADATA_SCHEME);
+  struct cached_placement *p;
+  char request[128], reply[ADDRESS_HOST_MAX + ADDRESS_PORT_MAX + 2];
+
+  // A list of replicas leads with the leader, which serves everything
+  if (strncmp(server, METADATA_SCHEME, scheme_len) != 0) {
+    parse_replica(server, 0, out);
+    return;
+  }
+
+  pthread_mutex_lock(&placements_mutex);
+
+  for (p = placements; p; p = p->next) {
+    if (strcmp(p->topic, topic) == 0 && p->partition == partition) {
+      *out = p->broker;
+      pthread_mutex_unlock(&placements_mutex);
+      return;
+    }
+  }
+
+  snprintf(request, sizeof(request), "LOOKUP %s %u\n", topic, partition);
+  metadata_request(server + scheme_len, request, reply, sizeof(reply));
+  if (sscanf(reply, "%255s %15s", out->host, out->port) != 2)
+    rc_die("metadata_resolve: bad reply");
+
+  p = (struct cached_placement *)calloc(1, sizeof(*p));
+  strncpy(p->topic, topic, sizeof(p->topic) - 1);
+  p->partition = partition;
+  p->broker = *out;
+  p->next = placements;
+  placements = p;
+
+  pthread_mutex_unlock(&placements_mutex);
+}
+
+void metadata_register_broker(const char *service, const char *host, const char *port)
+{
+  char request[ADDRESS_HOST_MAX + ADDRESS_PORT_MAX + 16], reply[16];
+
+  snprintf(request, sizeof(request), "BROKER %s %s\n", host, port);
+  metadata_request(service, request, reply, sizeof(reply));
+}
+
+uint32_t metadata_partitions(const char *service, const char *topic)
+{
+  char request[64], reply[16];
+
+  snprintf(request, sizeof(request), "PARTITIONS %s\n", topic);
+  metadata_request(service, request, reply, sizeof(reply));
+  return strtoul(reply, NULL, 10);
+}
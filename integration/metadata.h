@@ -0,0 +1,44 @@
+#ifndef RDMA_METADATA_H
+#define RDMA_METADATA_H
+
+#include <stdint.h>
+
+#define DEFAULT_METADATA_PORT "12347"
+// A client's server argument starting with this names the metadata service
+// rather than a broker
+#define METADATA_SCHEME "meta://"
+
+#define ADDRESS_HOST_MAX 256
+#define ADDRESS_PORT_MAX 16
+
+struct broker_address
+{
+  char host[ADDRESS_HOST_MAX];
+  char port[ADDRESS_PORT_MAX];
+};
+
+// Splits "host[:port]" into host and port, taking default_port if none is given
+void parse_address(const char *address, const char *default_port, struct broker_address *out);
+
+// Separates the brokers of a replica list, the leader first and then its
+// followers, which consumers may read from
+#define REPLICA_SEPARATOR ','
+
+// Finds the broker serving the topic partition. server is either a broker
+// address, which serves everything, a replica list, whose leader does, or
+// METADATA_SCHEME and the address of the metadata service. Answers from the
+// service are cached for good.
+void metadata_resolve(const char *server, const char *topic, uint32_t partition, struct broker_address *out);
+
+// Number of brokers a reader may read the topic from, 1 unless server is a
+// replica list, and the given one of them; replica 0 is the leader
+int metadata_replicas(const char *server);
+void metadata_resolve_replica(const char *server, const char *topic, uint32_t partition, int replica,
+                              struct broker_address *out);
+
+// Broker side: announce ourselves to the service, and ask how many
+// partitions a topic has across the cluster
+void metadata_register_broker(const char *service, const char *host, const char *port);
+uint32_t metadata_partitions(const char *service, const char *topic);
+
+#endif
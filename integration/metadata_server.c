@@ -0,0 +1,168 @@
+#include <getopt.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#include "common.h"
+#include "metadata.h"
+
+/**
+ * Maps topic partitions to brokers. Brokers announce themselves at startup;
+ * a partition is placed on the broker holding the fewest partitions the
+ * first time anyone looks it up, and stays there. Requests are single lines
+ * over short-lived TCP connections:
+ *
+ *   BROKER <host> <port>      -> OK
+ *   LOOKUP <topic> <partition> -> <host> <port>
+ *   PARTITIONS <topic>         -> <number of partitions placed so far>
+ */
+
+struct broker
+{
+  struct broker_address address;
+  int num_partitions;
+  struct broker *next;
+};
+
+struct placement
+{
+  char topic[TOPIC_NAME_MAX];
+  uint32_t partition;
+  struct broker *broker;
+  struct placement *next;
+};
+
+static struct broker *brokers = NULL;
+static struct placement *placements = NULL;
+
+static void register_broker(const char *host, const char *port, char *reply, size_t len)
+{
+  struct broker *b;
+
+  for (b = brokers; b; b = b->next)
+    if (strcmp(b->address.host, host) == 0 && strcmp(b->address.port, port) == 0)
+      break;
+
+  // A restarted broker keeps its partitions
+  if (b == NULL) {
+    b = (struct broker *)calloc(1, sizeof(*b));
+    snprintf(b->address.host, sizeof(b->address.host), "%s", host);
+    snprintf(b->address.port, sizeof(b->address.port), "%s", port);
+    b->next = brokers;
+    brokers = b;
+    printf("broker %s:%s joined\n", host, port);
+  }
+
+  snprintf(reply, len, "OK\n");
+}
+
+static void lookup(const char *topic, uint32_t partition, char *reply, size_t len)
+{
+  struct placement *p;
+  struct broker *b, *least = NULL;
+
+  for (p = placements; p; p = p->next)
+    if (strcmp(p->topic, topic) == 0 && p->partition == partition)
+      break;
+
+  if (p == NULL) {
+    for (b = brokers; b; b = b->next)
+      if (least == NULL || b->num_partitions < least->num_partitions)
+        least = b;
+    if (least == NULL) {
+      snprintf(reply, len, "ERR no brokers\n");
+      return;
+    }
+
+    p = (struct placement *)calloc(1, sizeof(*p));
+    strncpy(p->topic, topic, sizeof(p->topic) - 1);
+    p->partition = partition;
+    p->broker = least;
+    p->next = placements;
+    placements = p;
+    ++least->num_partitions;
+    printf("placed %s/%u on %s:%s\n", topic, partition, least->address.host, least->address.port);
+  }
+
+  snprintf(reply, len, "%s %s\n", p->broker->address.host, p->broker->address.port);
+}
+
+static void count_partitions(const char *topic, char *reply, size_t len)
+{
+  struct placement *p;
+  uint32_t n = 0;
+
+  for (p = placements; p; p = p->next)
+    if (strcmp(p->topic, topic) == 0 && p->partition >= n)
+      n = p->partition + 1;
+
+  snprintf(reply, len, "%u\n", n);
+}
+
+static void handle_request(int fd)
+{
+  char request[512], reply[512];
+  char a[ADDRESS_HOST_MAX], b[ADDRESS_HOST_MAX];
+  size_t n = 0;
+  ssize_t r;
+
+  while (n < sizeof(request) - 1 && (r = read(fd, request + n, sizeof(request) - 1 - n)) > 0) {
+    n += r;
+    if (memchr(request, '\n', n))
+      break;
+  }
+  request[n] = '\0';
+
+  if (sscanf(request, "BROKER %255s %255s", a, b) == 2)
+    register_broker(a, b, reply, sizeof(reply));
+  else if (sscanf(request, "LOOKUP %255s %255s", a, b) == 2 && strlen(a) < TOPIC_NAME_MAX)
+    lookup(a, strtoul(b, NULL, 10), reply, sizeof(reply));
+  else if (sscanf(request, "PARTITIONS %255s", a) == 1)
+    count_partitions(a, reply, sizeof(reply));
+  else
+    snprintf(reply, sizeof(reply), "ERR bad request\n");
+
+  if (write(fd, reply, strlen(reply)) < 0)
+    perror("write");
+}
+
+int main(int argc, char **argv)
+{
+  struct sockaddr_in6 addr;
+  const char *port = DEFAULT_METADATA_PORT;
+  int listener, opt, on = 1;
+
+  while ((opt = getopt(argc, argv, "p:")) != -1) {
+    switch (opt) {
+      case 'p':
+        port = optarg;
+        break;
+      default:
+        fprintf(stderr, "usage: %s [-p port]\n", argv[0]);
+        return 1;
+    }
+  }
+
+  memset(&addr, 0, sizeof(addr));
+  addr.sin6_family = AF_INET6;
+  addr.sin6_port = htons(atoi(port));
+
+  if ((listener = socket(AF_INET6, SOCK_STREAM, 0)) < 0)
+    rc_die("socket failed");
+  setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  TEST_NZ(bind(listener, (struct sockaddr *)&addr, sizeof(addr)));
+  TEST_NZ(listen(listener, 64));
+
+  printf("metadata service listening on port %s.\n", port);
+
+  // Requests are tiny and the state is small, so one at a time is plenty
+  while (1) {
+    int fd = accept(listener, NULL, NULL);
+
+    if (fd < 0)
+      continue;
+    handle_request(fd);
+    close(fd);
+  }
+
+  return 0;
+}
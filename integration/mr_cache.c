@@ -0,0 +1,142 @@
+#include <pthread.h>
+
+#include "common.h"
+#include "mr_cache.h"
+
+static struct mr_cache_entry *lru_head = NULL;
+static struct mr_cache_entry *lru_tail = NULL;
+static int num_entries = 0;
+static pthread_mutex_t cache_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void lru_unlink(struct mr_cache_entry *e)
+{
+  if (e->prev)
+    e->prev->next = e->next;
+  else
+    lru_head = e->next;
+
+  if (e->next)
+    e->next->prev = e->prev;
+  else
+    lru_tail = e->prev;
+
+  e->prev = e->next = NULL;
+}
+
+static void lru_push_front(struct mr_cache_entry *e)
+{
+  e->prev = NULL;
+  e->next = lru_head;
+
+  if (lru_head)
+    lru_head->prev = e;
+  else
+    lru_tail = e;
+
+  lru_head = e;
+}
+
+static void destroy_entry(struct mr_cache_entry *e)
+{
+  ibv_dereg_mr(e->mr);
+  free(e);
+}
+
+// Deregisters idle entries from the cold end until we are back under the limit
+static void evict_idle(void)
+{
+  struct mr_cache_entry *e = lru_tail;
+
+  while (e && num_entries >= MR_CACHE_MAX_ENTRIES) {
+    struct mr_cache_entry *prev = e->prev;
+
+    if (e->refcnt == 0) {
+      lru_unlink(e);
+      --num_entries;
+      destroy_entry(e);
+    }
+    e = prev;
+  }
+}
+
+struct mr_cache_entry * mr_cache_acquire(void *addr, size_t len)
+{
+  uintptr_t page = sysconf(_SC_PAGESIZE);
+  uintptr_t start = (uintptr_t)addr;
+  uintptr_t end = start + len;
+  struct ibv_pd *pd = rc_get_pd();
+  struct mr_cache_entry *e;
+
+  if (pd == NULL || len == 0)
+    return NULL;
+
+  pthread_mutex_lock(&cache_mutex);
+
+  for (e = lru_head; e; e = e->next) {
+    if (!e->invalid && e->start <= start && end <= e->end) {
+      lru_unlink(e);
+      lru_push_front(e);
+      ++e->refcnt;
+      pthread_mutex_unlock(&cache_mutex);
+      return e;
+    }
+  }
+
+  evict_idle();
+
+  e = (struct mr_cache_entry *)calloc(1, sizeof(*e));
+  e->start = start & ~(page - 1);
+  e->end = (end + page - 1) & ~(page - 1);
+  e->mr = ibv_reg_mr(pd, (void *)e->start, e->end - e->start, 0);
+  if (e->mr == NULL) {
+    pthread_mutex_unlock(&cache_mutex);
+    free(e);
+    return NULL;
+  }
+  e->refcnt = 1;
+
+  lru_push_front(e);
+  ++num_entries;
+
+  pthread_mutex_unlock(&cache_mutex);
+  return e;
+}
+
+void mr_cache_release(struct mr_cache_entry *entry)
+{
+  pthread_mutex_lock(&cache_mutex);
+
+  if (--entry->refcnt == 0 && entry->invalid) {
+    lru_unlink(entry);
+    --num_entries;
+    destroy_entry(entry);
+  }
+
+  pthread_mutex_unlock(&cache_mutex);
+}
+
+void mr_cache_invalidate(void *addr, size_t len)
+{
+  uintptr_t start = (uintptr_t)addr;
+  uintptr_t end = start + len;
+  struct mr_cache_entry *e, *next;
+
+  pthread_mutex_lock(&cache_mutex);
+
+  for (e = lru_head; e; e = next) {
+    next = e->next;
+
+    if (e->start >= end || start >= e->end)
+      continue;
+
+    if (e->refcnt == 0) {
+      lru_unlink(e);
+      --num_entries;
+      destroy_entry(e);
+    } else {
+      e->invalid = 1;
+    }
+  }
+
+  pthread_mutex_unlock(&cache_mutex);
+}
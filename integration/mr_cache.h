@@ -0,0 +1,39 @@
+#ifndef RDMA_MR_CACHE_H
+#define RDMA_MR_CACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <infiniband/verbs.h>
+
+// Upper bound on the number of idle registrations kept pinned. Entries in use
+// are never evicted, so the cache may briefly grow beyond this.
+#define MR_CACHE_MAX_ENTRIES 64
+
+// A registered range of caller memory, rounded out to page boundaries
+struct mr_cache_entry
+{
+  uintptr_t start;
+  uintptr_t end;
+  struct ibv_mr *mr;
+
+  // Number of posted work requests still referring to this registration
+  int refcnt;
+  // Set when the range was invalidated while in use; deregistered on release
+  int invalid;
+
+  // LRU list, most recently used first
+  struct mr_cache_entry *prev;
+  struct mr_cache_entry *next;
+};
+
+// Returns a registration covering [addr, addr + len), registering it with
+// rc_get_pd() on a miss. Returns NULL if there is no protection domain yet or
+// the registration fails. Must be paired with mr_cache_release().
+struct mr_cache_entry * mr_cache_acquire(void *addr, size_t len);
+void mr_cache_release(struct mr_cache_entry *entry);
+
+// Drops every registration overlapping [addr, addr + len). Call before the
+// memory is freed or remapped, otherwise the cache may hand out a stale lkey.
+void mr_cache_invalidate(void *addr, size_t len);
+
+#endif
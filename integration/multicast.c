@@ -0,0 +1,192 @@
+#include "multicast.h"
+
+static const int MCAST_TIMEOUT_MS = 2000;
+
+/**
+ * Wait for the connection manager's answer to a request on the stream
+ */
+static void wait_for_event(struct mcast_stream *stream, enum rdma_cm_event_type expected, struct rdma_cm_event *out)
+{
+  struct rdma_cm_event *event;
+
+  TEST_NZ(rdma_get_cm_event(stream->ec, &event));
+  *out = *event;
+  rdma_ack_cm_event(event);
+  if (out->event != expected) {
+    fprintf(stderr, "multicast %s: %s\n", stream->address, rdma_event_str(out->event));
+    rc_die("mcast_join: unexpected event");
+  }
+}
+
+static void post_recv_slot(struct mcast_stream *stream, int slot)
+{
+  struct ibv_recv_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = slot;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+
+  sge.addr = (uintptr_t)(stream->buffers + (size_t)slot * stream->slot_size);
+  sge.length = stream->slot_size;
+  sge.lkey = stream->buffers_mr->lkey;
+
+  TEST_NZ(ibv_post_recv(stream->id->qp, &wr, &bad_wr));
+}
+
+struct mcast_stream * mcast_join(const char *address, int sender)
+{
+  struct mcast_stream *stream = (struct mcast_stream *)calloc(1, sizeof(*stream));
+  struct ibv_qp_init_attr qp_attr;
+  struct ibv_port_attr port_attr;
+  struct rdma_cm_event event;
+  struct addrinfo hints, *addr;
+  int slots = sender ? MCAST_SEND_SLOTS : MCAST_RECV_SLOTS;
+  int i;
+
+  snprintf(stream->address, sizeof(stream->address), "%s", address);
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_flags = AI_NUMERICHOST;
+  if (getaddrinfo(address, NULL, &hints, &addr)) {
+    free(stream);
+    return NULL;
+  }
+
+  TEST_Z(stream->ec = rdma_create_event_channel());
+  TEST_NZ(rdma_create_id(stream->ec, &stream->id, stream, RDMA_PS_UDP));
+  TEST_NZ(rdma_resolve_addr(stream->id, NULL, addr->ai_addr, MCAST_TIMEOUT_MS));
+  wait_for_event(stream, RDMA_CM_EVENT_ADDR_RESOLVED, &event);
+
+  TEST_NZ(ibv_query_port(stream->id->verbs, stream->id->port_num, &port_attr));
+  stream->mtu = 1u << (port_attr.active_mtu + 7);
+
+  TEST_Z(stream->pd = ibv_alloc_pd(stream->id->verbs));
+  TEST_Z(stream->cq = ibv_create_cq(stream->id->verbs, slots, NULL, NULL, 0));
+
+  memset(&qp_attr, 0, sizeof(qp_attr));
+  qp_attr.qp_type = IBV_QPT_UD;
+  qp_attr.send_cq = stream->cq;
+  qp_attr.recv_cq = stream->cq;
+  qp_attr.cap.max_send_wr = sender ? slots : 1;
+  qp_attr.cap.max_recv_wr = sender ? 1 : slots;
+  qp_attr.cap.max_send_sge = 1;
+  qp_attr.cap.max_recv_sge = 1;
+  TEST_NZ(rdma_create_qp(stream->id, stream->pd, &qp_attr));
+
+  stream->slot_size = stream->mtu + (sender ? 0 : MCAST_GRH_SIZE);
+  posix_memalign((void **)&stream->buffers, sysconf(_SC_PAGESIZE), (size_t)slots * stream->slot_size);
+  TEST_Z(stream->buffers_mr = ibv_reg_mr(stream->pd, stream->buffers, (size_t)slots * stream->slot_size, IBV_ACCESS_LOCAL_WRITE));
+
+  // Receives go up before the join, so nothing sent after it is missed
+  if (!sender)
+    for (i = 0; i < slots; ++i)
+      post_recv_slot(stream, i);
+
+  memcpy(&stream->group, addr->ai_addr, addr->ai_addrlen);
+  TEST_NZ(rdma_join_multicast(stream->id, addr->ai_addr, stream));
+  wait_for_event(stream, RDMA_CM_EVENT_MULTICAST_JOIN, &event);
+  freeaddrinfo(addr);
+
+  TEST_Z(stream->ah = ibv_create_ah(stream->pd, &event.param.ud.ah_attr));
+  stream->remote_qpn = event.param.ud.qp_num;
+  stream->remote_qkey = event.param.ud.qkey;
+
+  printf("joined multicast group %s as a %s, MTU %u\n", address, sender ? "sender" : "receiver", stream->mtu);
+  return stream;
+}
+
+void mcast_leave(struct mcast_stream *stream)
+{
+  rdma_leave_multicast(stream->id, (struct sockaddr *)&stream->group);
+  rdma_destroy_qp(stream->id);
+  ibv_destroy_ah(stream->ah);
+  ibv_dereg_mr(stream->buffers_mr);
+  ibv_destroy_cq(stream->cq);
+  ibv_dealloc_pd(stream->pd);
+  rdma_destroy_id(stream->id);
+  rdma_destroy_event_channel(stream->ec);
+  free(stream->buffers);
+  free(stream);
+}
+
+void mcast_send(struct mcast_stream *stream, const void *header, uint32_t header_length,
+                const void *data, uint32_t length)
+{
+  char *slot = stream->buffers + (size_t)stream->next_slot * stream->slot_size;
+  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+  struct ibv_wc wc;
+
+  // Every send is signaled, so each completion frees one slot; a failed
+  // one is a lost datagram, which receivers repair like any other
+  do {
+    while (ibv_poll_cq(stream->cq, 1, &wc) > 0)
+      --stream->outstanding;
+  } while (stream->outstanding == MCAST_SEND_SLOTS);
+
+  memcpy(slot, header, header_length);
+  if (length)
+    memcpy(slot + header_length, data, length);
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = stream->next_slot;
+  wr.opcode = IBV_WR_SEND;
+  wr.send_flags = IBV_SEND_SIGNALED;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.wr.ud.ah = stream->ah;
+  wr.wr.ud.remote_qpn = stream->remote_qpn;
+  wr.wr.ud.remote_qkey = stream->remote_qkey;
+
+  sge.addr = (uintptr_t)slot;
+  sge.length = header_length + length;
+  sge.lkey = stream->buffers_mr->lkey;
+
+  TEST_NZ(ibv_post_send(stream->id->qp, &wr, &bad_wr));
+  ++stream->outstanding;
+  stream->next_slot = (stream->next_slot + 1) % MCAST_SEND_SLOTS;
+}
+
+void * mcast_poll(struct mcast_stream *stream, uint32_t *length)
+{
+  struct ibv_wc wc;
+
+  // The previous datagram's slot goes back to the device
+  if (stream->outstanding) {
+    post_recv_slot(stream, stream->next_slot);
+    stream->outstanding = 0;
+  }
+
+  while (ibv_poll_cq(stream->cq, 1, &wc) > 0) {
+    if (wc.status != IBV_WC_SUCCESS) {
+      // A lost datagram is as good as a dropped one
+      post_recv_slot(stream, wc.wr_id);
+      continue;
+    }
+    stream->next_slot = wc.wr_id;
+    stream->outstanding = 1;
+    *length = wc.byte_len - MCAST_GRH_SIZE;
+    return stream->buffers + (size_t)wc.wr_id * stream->slot_size + MCAST_GRH_SIZE;
+  }
+
+  return NULL;
+}
+
+void mcast_group_address(const char *base, uint32_t index, char *out)
+{
+  unsigned char addr[sizeof(struct in6_addr)];
+  int family = strchr(base, ':') ? AF_INET6 : AF_INET;
+  int len = family == AF_INET6 ? 16 : 4;
+  uint32_t last;
+
+  if (inet_pton(family, base, addr) != 1)
+    rc_die("mcast_group_address: bad multicast address");
+
+  memcpy(&last, addr + len - 4, 4);
+  last = htonl(ntohl(last) + index);
+  memcpy(addr + len - 4, &last, 4);
+
+  inet_ntop(family, addr, out, INET6_ADDRSTRLEN);
+}
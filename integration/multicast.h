@@ -0,0 +1,65 @@
+#ifndef RDMA_MULTICAST_H
+#define RDMA_MULTICAST_H
+
+#include <arpa/inet.h>
+
+#include "common.h"
+
+// Datagrams kept in flight by a sender, and receives kept posted by a receiver
+#define MCAST_SEND_SLOTS 64
+#define MCAST_RECV_SLOTS 512
+// Every UD receive starts with this, before the datagram
+#define MCAST_GRH_SIZE 40
+
+/**
+ * One side of an unreliable datagram multicast group, joined through the
+ * connection manager. Each stream has its own PD, CQ and UD QP, so it works
+ * whether or not any RC connection exists yet. Sends and receives are
+ * polled by whoever calls in; there are no threads behind a stream.
+ */
+struct mcast_stream
+{
+  char address[INET6_ADDRSTRLEN];
+  struct sockaddr_storage group;
+
+  struct rdma_event_channel *ec;
+  struct rdma_cm_id *id;
+  struct ibv_pd *pd;
+  struct ibv_cq *cq;
+
+  // Where sends go, from the join
+  struct ibv_ah *ah;
+  uint32_t remote_qpn;
+  uint32_t remote_qkey;
+
+  // Largest datagram the path carries
+  uint32_t mtu;
+
+  // Send or receive slots of mtu bytes, receives with room for the GRH
+  char *buffers;
+  struct ibv_mr *buffers_mr;
+  uint32_t slot_size;
+  // A sender's next slot and sends in flight; a receiver's slot of the
+  // datagram last returned, and whether it is still held
+  int next_slot;
+  int outstanding;
+};
+
+// Joins the group at the address, as a sender or a receiver. Blocks until
+// the join completes; returns NULL if it fails.
+struct mcast_stream * mcast_join(const char *address, int sender);
+void mcast_leave(struct mcast_stream *stream);
+
+// Sends a header and data, which together must fit in the MTU, as one
+// datagram
+void mcast_send(struct mcast_stream *stream, const void *header, uint32_t header_length,
+                const void *data, uint32_t length);
+
+// Returns the next datagram received and its length, or NULL if none has
+// arrived. The datagram stays valid until the next call.
+void * mcast_poll(struct mcast_stream *stream, uint32_t *length);
+
+// Address of the index-th group after base, counting in its last 32 bits
+void mcast_group_address(const char *base, uint32_t index, char *out);
+
+#endif
@@ -0,0 +1,383 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+
+#include "persist.h"
+#include "uring.h"
+
+// Writes in flight at once
+#define PERSIST_QUEUE_DEPTH 64
+// Segment files open at once: those of segments in the arena, and of ones
+// evicted since they were last fsynced
+#define PERSIST_MAX_FILES (2 * NUM_SLOTS)
+// fsyncs, at most one per open file, come on top of the writes
+#define PERSIST_RING_SIZE (PERSIST_QUEUE_DEPTH + PERSIST_MAX_FILES)
+// Tags the completion of an fsync
+#define PERSIST_FSYNC ((uint64_t)-1)
+// Sleep when the logs had nothing new and nothing completed
+#define PERSIST_IDLE_US 100
+
+/**
+ * A segment file the thread has open. It is closed once its log has moved
+ * on from the segment and an fsync batch has covered every write to it.
+ */
+struct persist_file
+{
+  uint32_t segment;
+  // -1 if the entry is free
+  int fd;
+  // The log maps the file and keeps the descriptor
+  int mapped;
+  // Writes in flight
+  int writing;
+  // Written since the last batch began, and part of the batch in flight
+  int dirty;
+  int syncing;
+  // The log has moved on from the segment
+  int closed;
+};
+
+/**
+ * A write in flight. Writes of a topic may complete in any order, so they
+ * are queued on the topic in the order issued, and its written offset only
+ * moves past a run of completed ones at the front.
+ */
+struct persist_op
+{
+  struct topic *topic;
+  // Log offset the topic is written up to once this is done
+  uint64_t end;
+  struct persist_file *file;
+  uint32_t length;
+  int done;
+  // The topic's next write, or the next free op
+  struct persist_op *next;
+};
+
+// The persistence thread's state for one topic
+struct topic_persist
+{
+  // Log offset of the next byte to write
+  uint64_t submitted;
+  // Written offset when the fsync batch in flight began
+  uint64_t sync_target;
+  // Writes in flight, oldest first
+  struct persist_op *first;
+  struct persist_op *last;
+};
+
+static const char *persist_dir = NULL;
+static durable_cb_fn s_on_durable_cb = NULL;
+static struct uring ring;
+static struct persist_op ops[PERSIST_QUEUE_DEPTH];
+static struct persist_op *free_ops = NULL;
+static struct persist_file *files = NULL;
+// fsyncs of the current batch still in flight
+static int syncs_pending = 0;
+
+/**
+ * The open file of a segment, opening it on first use. Returns NULL if as
+ * many files are open as there can be; an fsync batch closes some.
+ */
+static struct persist_file * segment_file(uint64_t segment)
+{
+  struct persist_file *file = NULL;
+  char path[512];
+  int i;
+
+  for (i = 0; i < PERSIST_MAX_FILES; ++i) {
+    if (files[i].fd >= 0 && files[i].segment == segment / LOG_SEGMENT_SIZE)
+      return &files[i];
+    if (files[i].fd < 0 && file == NULL)
+      file = &files[i];
+  }
+  if (file == NULL)
+    return NULL;
+
+  memset(file, 0, sizeof(*file));
+  file->segment = segment / LOG_SEGMENT_SIZE;
+  if ((file->fd = log_segment_fd(segment)) >= 0) {
+    file->mapped = 1;
+    return file;
+  }
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, persist_dir, file->segment);
+  file->fd = open(path, O_WRONLY | O_CREAT, 0644);
+  if (file->fd < 0)
+    rc_die("segment_file: cannot create segment file");
+  return file;
+}
+
+/**
+ * Queue a write of part of a segment to its file, after the topic's other
+ * writes; end is the log offset the topic is written up to once it is done
+ */
+static void submit_write(struct topic *topic, struct persist_file *file, uint64_t segment, uint64_t from,
+                         uint32_t length, uint64_t end)
+{
+  struct topic_persist *p = (struct topic_persist *)topic->persist;
+  struct persist_op *op = free_ops;
+  struct io_uring_sqe *sqe;
+
+  free_ops = op->next;
+  op->topic = topic;
+  op->end = end;
+  op->file = file;
+  op->length = length;
+  op->done = 0;
+  op->next = NULL;
+  if (p->last)
+    p->last->next = op;
+  else
+    p->first = op;
+  p->last = op;
+
+  sqe = uring_sqe(&ring);
+  sqe->opcode = IORING_OP_WRITE;
+  sqe->fd = file->fd;
+  sqe->addr = (uintptr_t)log_at(segment + from);
+  sqe->len = length;
+  sqe->off = from;
+  sqe->user_data = op - ops;
+  ++file->writing;
+}
+
+/**
+ * Queue writes of whatever was appended to the topic since the last round.
+ * A segment the topic has moved on from is written up to its end marker,
+ * and writing continues in the next one. Segments mapped from their files
+ * are written as they are appended to and only need fsyncs.
+ */
+static void submit_writes(struct topic *topic)
+{
+  struct topic_persist *p = (struct topic_persist *)topic->persist;
+  uint64_t tail = __atomic_load_n(&topic->tail, __ATOMIC_ACQUIRE);
+
+  if (p == NULL) {
+    p = (struct topic_persist *)calloc(1, sizeof(*p));
+    p->submitted = p->sync_target = topic->written;
+    topic->persist = p;
+  }
+
+  while (p->submitted != tail && free_ops) {
+    uint64_t segment = p->submitted / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+    int closed = tail / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE != segment;
+    uint64_t end = closed ? log_segment_end(segment) : tail;
+    struct persist_file *file = segment_file(segment);
+
+    if (file == NULL)
+      break;
+
+    if (file->mapped) {
+      file->dirty = 1;
+      file->closed = closed;
+      p->submitted = closed ? log_next_segment(segment) : end;
+      __atomic_store_n(&topic->written, end, __ATOMIC_RELEASE);
+      if (s_on_durable_cb)
+        s_on_durable_cb(topic);
+      continue;
+    }
+
+    // Closing a segment also writes its header again, which now says where
+    // the segment ends
+    if (closed && free_ops->next == NULL)
+      break;
+    submit_write(topic, file, segment, p->submitted - segment, end - p->submitted, end);
+    if (closed) {
+      submit_write(topic, file, segment, 0, sizeof(struct segment_header), end);
+      file->closed = 1;
+    }
+
+    p->submitted = closed ? log_next_segment(segment) : end;
+  }
+}
+
+static void mark_sync_target(struct topic *topic)
+{
+  struct topic_persist *p = (struct topic_persist *)topic->persist;
+
+  if (p)
+    p->sync_target = topic->written;
+}
+
+static void finish_sync(struct topic *topic)
+{
+  struct topic_persist *p = (struct topic_persist *)topic->persist;
+
+  if (p == NULL || p->sync_target == topic->synced)
+    return;
+  __atomic_store_n(&topic->synced, p->sync_target, __ATOMIC_RELEASE);
+  if (s_on_durable_cb)
+    s_on_durable_cb(topic);
+}
+
+/**
+ * Start an fsync batch covering every file written since the last one, if
+ * none is in flight. Whatever the topics had written by now is synced when
+ * the whole batch is done.
+ */
+static void start_sync()
+{
+  int i;
+
+  if (syncs_pending > 0)
+    return;
+
+  topic_for_each(mark_sync_target);
+  for (i = 0; i < PERSIST_MAX_FILES; ++i) {
+    struct persist_file *file = &files[i];
+    struct io_uring_sqe *sqe;
+
+    if (file->fd < 0 || !file->dirty)
+      continue;
+    file->dirty = 0;
+    file->syncing = 1;
+
+    sqe = uring_sqe(&ring);
+    sqe->opcode = IORING_OP_FSYNC;
+    sqe->fd = file->fd;
+    sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    sqe->user_data = PERSIST_FSYNC;
+    ++syncs_pending;
+  }
+}
+
+/**
+ * Close the files the batch just done has synced for the last time
+ */
+static void close_synced()
+{
+  int i;
+
+  for (i = 0; i < PERSIST_MAX_FILES; ++i) {
+    struct persist_file *file = &files[i];
+
+    if (file->fd < 0 || !file->syncing)
+      continue;
+    file->syncing = 0;
+    if (!file->closed || file->dirty || file->writing)
+      continue;
+    if (!file->mapped)
+      close(file->fd);
+    file->fd = -1;
+  }
+}
+
+static void on_write_done(struct persist_op *op, int res)
+{
+  struct topic *topic = op->topic;
+  struct topic_persist *p = (struct topic_persist *)topic->persist;
+  uint64_t written = topic->written;
+
+  if (res < 0 || (uint32_t)res != op->length)
+    rc_die("on_write_done: write to segment file failed");
+
+  op->done = 1;
+  op->file->dirty = 1;
+  --op->file->writing;
+
+  while (p->first && p->first->done) {
+    struct persist_op *o = p->first;
+
+    p->first = o->next;
+    if (p->first == NULL)
+      p->last = NULL;
+    written = o->end;
+    o->next = free_ops;
+    free_ops = o;
+  }
+
+  if (written != topic->written) {
+    __atomic_store_n(&topic->written, written, __ATOMIC_RELEASE);
+    if (s_on_durable_cb)
+      s_on_durable_cb(topic);
+  }
+}
+
+/**
+ * Handle every completion in. Returns how many there were.
+ */
+static int reap()
+{
+  unsigned head = *ring.cq_head;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+
+  for (; head != tail; ++head, ++n) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+
+    if (cqe->user_data == PERSIST_FSYNC) {
+      if (cqe->res < 0)
+        rc_die("reap: fsync of segment file failed");
+      if (--syncs_pending == 0) {
+        close_synced();
+        topic_for_each(finish_sync);
+      }
+    } else {
+      on_write_done(&ops[cqe->user_data], cqe->res);
+    }
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+static void * run_persist(void *arg)
+{
+  while (1) {
+    int progress = reap();
+
+    topic_for_each(submit_writes);
+    start_sync();
+    progress += uring_submit(&ring);
+
+    if (progress == 0)
+      usleep(PERSIST_IDLE_US);
+  }
+  return NULL;
+}
+
+void persist_start(const char *dir, durable_cb_fn durable_cb)
+{
+  pthread_t thread;
+  int i;
+
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST)
+    rc_die("persist_start: cannot create the segment directory");
+  persist_dir = dir;
+  s_on_durable_cb = durable_cb;
+
+  files = (struct persist_file *)calloc(PERSIST_MAX_FILES, sizeof(*files));
+  for (i = 0; i < PERSIST_MAX_FILES; ++i)
+    files[i].fd = -1;
+  for (i = 0; i < PERSIST_QUEUE_DEPTH; ++i) {
+    ops[i].next = free_ops;
+    free_ops = &ops[i];
+  }
+  uring_setup(&ring, PERSIST_RING_SIZE);
+
+  TEST_NZ(pthread_create(&thread, NULL, run_persist, NULL));
+  printf("persisting topics to %s\n", dir);
+}
+
+uint64_t persist_durable(struct topic *topic, enum durability level)
+{
+  switch (level) {
+    case DURABILITY_WRITTEN:
+      return __atomic_load_n(&topic->written, __ATOMIC_ACQUIRE);
+    case DURABILITY_FSYNC:
+      return __atomic_load_n(&topic->synced, __ATOMIC_ACQUIRE);
+    default:
+      return __atomic_load_n(&topic->tail, __ATOMIC_ACQUIRE);
+  }
+}
+
+int persist_level(const char *name)
+{
+  if (strcmp(name, "memory") == 0)
+    return DURABILITY_MEMORY;
+  if (strcmp(name, "written") == 0)
+    return DURABILITY_WRITTEN;
+  if (strcmp(name, "fsync") == 0)
+    return DURABILITY_FSYNC;
+  return -1;
+}
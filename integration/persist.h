@@ -0,0 +1,45 @@
+#ifndef RDMA_PERSIST_H
+#define RDMA_PERSIST_H
+
+#include "topic.h"
+
+/**
+ * Mirrors topic logs into segment files, one file per log segment holding
+ * the same bytes the segment has in the arena, named by segment index as in
+ * SEGMENT_FILE_FORMAT. A thread of its own follows each topic's tail and
+ * writes what was appended through io_uring, so appends never wait on the
+ * disk. fsyncs are group commits: one batch at a time
+ * covers every file written since the last, and whatever is written while
+ * it runs goes in the next.
+ *
+ * Where the log is mapped from the files (log_open() with map set), there
+ * is nothing to write and only the fsyncs are left.
+ *
+ * Subscription and filtered logs are copies of topics and are not
+ * persisted, nor are values kept out of line in the value heap.
+ */
+
+enum durability
+{
+  // Appended to the log in memory
+  DURABILITY_MEMORY = 0,
+  // Written to the segment files, so a broker crash loses nothing
+  DURABILITY_WRITTEN,
+  // fsynced, so a machine crash loses nothing either
+  DURABILITY_FSYNC
+};
+
+// Called on the persistence thread whenever a topic's written or synced
+// offset moves on
+typedef void (*durable_cb_fn)(struct topic *topic);
+
+// Starts persisting every topic into the directory, which must exist
+void persist_start(const char *dir, durable_cb_fn durable_cb);
+
+// Log offset up to which the topic's log is durable at the given level
+uint64_t persist_durable(struct topic *topic, enum durability level);
+
+// Level by name: memory, written or fsync; -1 if there is none
+int persist_level(const char *name);
+
+#endif
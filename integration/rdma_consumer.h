@@ -1,10 +1,150 @@
-// For now, assume that a client knows the IP of server.
-// TODO: Replace this with a discovery service that identifies
-// server based on the supplied topic name
-void init(char *server);
+#include <stddef.h>
+#include <stdint.h>
 
-// Add a record with a key and value
+// server is either a broker, as host[:port], serving every partition, or
+// "meta://host[:port]", the metadata service of a cluster, which is asked
+// where each partition lives. It may also list a broker and its followers,
+// as leader,follower,... (brokers started with -f leader): partitions are
+// then read from the replicas in turn, so their READs spread over every
+// replica's NIC. A group reads each partition from the same replica; other
+// readers start at a replica of their own. A follower not replicating a
+// partition, or lagging too far behind, sends its reader to the leader; one
+// that falls behind later has its readers read what it has and go on from
+// the next record at the leader, except group, filtered and multicast
+// readers, which stay.
+// A NULL topic means DEFAULT_TOPIC; names are cut to TOPIC_NAME_MAX - 1.
+// A topic with wildcard levels subscribes to every topic matching it on the
+// broker, from the time of the first such subscription on: '*' matches one
+// level and a final '#' any number, so md.equities.*.trades and md.# work.
+// Records then carry the name of the topic they were published to.
+void init(char *server, char *topic);
+
+// Like init(), but reads the given partition of the topic rather than the
+// first one. Each partition keeps the order of the keys routed to it.
+void initPartition(char *server, char *topic, int partition);
+
+// Like init(), but joins the named consumer group. The broker shares the
+// topic's partitions out between the members and moves them as members come
+// and go; each partition resumes after the last record the group committed.
+// A record is committed once the application asks for the next one, so
+// after a move some records may be delivered twice, never skipped. Commits
+// are written straight into the broker's offsets table and survive the
+// reader, so a consumer that wants to pick up where it stopped after a
+// restart joins a group of its own.
+// Group names are cut to GROUP_NAME_MAX - 1.
+void initGroup(char *server, char *topic, char *group);
+
+// Filters applied by the broker, so records we do not want are never read
+// over the network: only keys starting with prefix, only keys in [from, to)
+// compared bytewise (a NULL to is unbounded), only the given keys, or only
+// values of min to max bytes. Call one of them before init(); it applies to
+// every partition read. Filter keys are at most 31 bytes. A filter sees the
+// records already in the topic too; the first reader with a new filter
+// makes the broker scan the topic once. Values a producer compressed are
+// filtered by their length before compression. Each new filter takes a log
+// of its own on the broker, which has room for 64 logs in all; once full,
+// it refuses readers with a new filter and their partitions are not read.
+void filterKeyPrefix(const char *prefix);
+void filterKeyRange(const char *from, const char *to);
+void filterKeys(char **keys, int n);
+void filterValueLength(uint64_t min, uint64_t max);
+
+// Has the broker RDMA write records into a ring in our memory as they are
+// appended, rather than us reading them from the broker's, saving a round
+// trip per record. Each partition read gets a thread busy polling its ring.
+// Call before init() or initPartition(); groups read in pull mode only.
+void pushDelivery();
+
+// Has the broker send the log to a multicast group, which every reader of it
+// joins, so its NIC sends each record once however many read it. Needs a
+// broker started with -g. Readers number datagrams to spot losses and read
+// what they missed from the broker's log, as well as anything appended
+// before they joined. Each partition read gets a thread busy polling the
+// group. Call before init() or initPartition(), and not with pushDelivery().
+void multicastDelivery();
+
+// Start every partition read at the given record, counting the records
+// appended to it since the broker started from 0, or for a log the broker
+// recovered from its files, the records the log held then, or at the first
+// record appended at or after the given time, in ms since the epoch. The broker
+// indexes every INDEX_INTERVAL_RECORDS records or INDEX_INTERVAL_BYTES bytes,
+// so a seek costs a binary search of that index with RDMA reads and a read
+// of at most one interval of the log; a time seek may deliver up to an
+// interval of records from before the time. Seeking before the oldest
+// indexed record starts at the start of the log. Call before init() or
+// initPartition(), and not with pushDelivery() or initGroup().
+void seekRecord(uint64_t record);
+void seekTime(uint64_t ms);
+
+// Start every partition read from the broker's newest snapshot of it rather
+// than from the start of its log: the newest record of each key as of some
+// offset of the log, which the reader takes with a few large RDMA READs and
+// delivers before reading the log on from that offset. Needs a broker
+// started with -s matching the topic, which takes a snapshot every few
+// seconds; a partition it has none of yet is read from the start. Records
+// without a key, and keys whose newest record is a tombstone, are not in a
+// snapshot. Readers with a filter read their filtered log from its start.
+// Call before init() or initPartition(), and not with pushDelivery(), a
+// seek or initGroup().
+void startFromSnapshot();
+
+// Instead of reading the topic: connects to partitions 0 .. num_partitions
+// - 1 of it, as producers writing with initPartitioned() do, to look keys up
+// with lookupValue(). Not with any of the above.
+void initLookup(char *server, char *topic, int num_partitions);
+
+// Returns the newest value of the key, as a NUL-terminated copy for the
+// caller to free, and its length. The broker keeps a table of every key's
+// newest value, which this reads with one or two RDMA READs of the broker's
+// memory and no work on its side; values longer than LOOKUP_VALUE_MAX take
+// more READs, of the broker's value heap or its log. Returns NULL if the
+// key has no value, its newest record is a tombstone, or the table cannot
+// serve it, which lookupValueStatus() tells apart. The broker fills the
+// table from the whole log, on a thread of its own, when it is first asked
+// for; lookups of the partition wait until it is done.
+char* lookupValue(char *key, size_t *value_length);
+
+enum lookup_status {
+    LOOKUP_FOUND,
+    // The key has no value, or its newest record is a tombstone
+    LOOKUP_MISSING,
+    // The key may have a value the table does not serve: it is longer than
+    // LOOKUP_KEY_MAX, or came once the table had no room for it near its
+    // hash (the table holds 32K keys, fewer if they cluster), or its newest
+    // record is not all in the log yet
+    LOOKUP_NOT_SERVED
+};
+
+// Like lookupValue(), and says which of those it was
+char* lookupValueStatus(char *key, size_t *value_length, enum lookup_status *status);
+
+// Returns the next record from any partition we read, waiting for one if
+// there is none yet
 struct ProducerMessage* consumeRecord();
 
+// Handles one record in a dispatch pool worker
+typedef void (*record_handler_fn)(struct ProducerMessage *record, void *arg);
+
+// Instead of consumeRecord(): hands records to num_workers threads that each
+// call handler on theirs, picking the thread by the hash of the key, so the
+// records of a key are handled one after another in log order while
+// different keys are handled in parallel. Workers poll lock-free queues of
+// their own, and sleep once theirs has stayed empty a while, fed by a
+// dispatcher thread that takes the records of every partition read. A record counts as processed, for group commits, once the
+// handler has returned for it and for every record taken before it. Call
+// once, after init(), and not together with consumeRecord().
+void dispatchRecords(int num_workers, record_handler_fn handler, void *arg);
+
+// Records waiting for, or being handled by, the given worker
+int dispatchQueueDepth(int worker);
+
+// Returns the record's value, reading it from the broker's value heap if it
+// was stored out of line. Returns NULL if the record's partition has since
+// moved to another group member. Values compressed by the producer, with
+// compressValues(), come decompressed from here, consumeRecord() and
+// lookupValue(); until fetchValue() an out-of-line record's value_length is
+// the length stored.
+char* fetchValue(struct ProducerMessage *record);
+
 // Should be called only after init() at the end
 void terminate();
@@ -1,62 +1,485 @@
 #include <assert.h>
 #include <fcntl.h>
+#include <stddef.h>
 #include <libgen.h>
 #include <pthread.h>
+#include <sched.h>
+#include <time.h>
 
 #include "common.h"
+#include "filter.h"
+#include "lz.h"
 #include "messages.h"
+#include "metadata.h"
+#include "multicast.h"
 #include "rdma_consumer.h"
 
-#define PRODUCER_RECORD_BACKLOG 100000
-#define VAL_LENGTH sizeof(int)
+#define VAL_LENGTH sizeof(struct record_header)
+// Receives kept posted for MSG_READY, MSG_WINDOW and MSG_ASSIGN
+#define MSG_RING_SIZE 4
+// Records a reader may have waiting for the application before it pauses
+#define READ_AHEAD 64
+// A group reader commits after this many delivered records, or sooner
+// once it has caught up with the log
+#define COMMIT_INTERVAL 64
+// A multicast reader that hears nothing for this long reads the log to its
+// end, in case the last datagrams sent were lost
+#define MCAST_IDLE_MS 50
+// Records each dispatch worker may have queued; a power of two
+#define DISPATCH_QUEUE_SIZE 256
+// How long the dispatcher waits for records before checking for ones its
+// workers finished, so those get committed while the log is quiet
+#define DISPATCH_IDLE_MS 10
+// Times an idle dispatch worker looks at its queue before it sleeps until
+// the dispatcher wakes it, or DISPATCH_IDLE_MS pass, so idle workers leave
+// their cores alone
+#define DISPATCH_SPINS 1000
+// A snapshot is read in pieces of this size, this many at once
+#define SNAPSHOT_READ_SIZE (16 * 1024 * 1024)
+#define SNAPSHOT_READS 8
 
+/**
+ * Log bytes [offset, offset + length) the broker lets us read at addr
+ */
+struct log_window {
+    uint64_t offset;
+    uint64_t addr;
+    uint32_t rkey;
+    uint32_t length;
+};
+
+/**
+ * One connection to the broker: a reader of one partition, or the control
+ * connection of a group member, which only receives assignments
+ */
 struct client_context {
-    // For receiving consumer records
+    struct rdma_cm_id *id;
+    int member;
+    uint32_t partition;
+    // Broker of the replica list we read from, 0 for the leader, and set
+    // once a follower sent us back to the leader for lagging behind it
+    int replica;
+    int lagging;
+    // Set once a follower fell behind while we read it: we read its log up
+    // to leave_at, which it pushes a push reader first, and then the
+    // leader's from leader_offset. moved is set once we are on our way there.
+    int leaving;
+    uint64_t leave_at;
+    uint64_t leader_offset;
+    int moved;
+    // For receiving consumer records; one log entry at a time
     char *buffer;
     struct ibv_mr *buffer_mr;
-    // For receiving acks
+    // For receiving acks; a ring consumed in the order it was posted,
+    // followed by one slot for sending MSG_SUBSCRIBE
     struct message *msg;
     struct ibv_mr *msg_mr;
-    // Hold remote addr and keys
-    uint64_t peer_addr;
-    uint32_t peer_rkey;
+    int msg_index;
+    struct rc_send_queue sq;
+    // Push readers post from their polling thread as well as the CQ thread
+    pthread_mutex_t sq_mutex;
+    // Ring the broker writes our log into if we read in push mode, and
+    // where the next entry will appear
+    char *ring;
+    struct ibv_mr *ring_mr;
+    uint64_t ring_head;
+    // Multicast group our log arrives on, empty if it does not; the last
+    // datagram taken, whether we took any, and the log offset of the next
+    // entry we need
+    char mcast_group[MCAST_GROUP_MAX];
+    struct mcast_stream *mcast;
+    uint32_t mcast_sequence;
+    int mcast_synced;
+    uint64_t next_offset;
+    // Log offset of the next read
+    uint64_t read_offset;
+    // Windows onto the log, by the index the broker gave each; a zero
+    // length marks one not given yet. Changed on the CQ thread under mutex,
+    // since multicast readers read through them from their own.
+    struct log_window windows[CONSUMER_WINDOWS];
+    // A read is due but no window covers it yet, and the offset a window
+    // was asked for, if one is on its way
+    int waiting_for_window;
+    int window_requested;
+    uint64_t requested_offset;
+    // The broker answered a lookup reader's fetch with no window, the
+    // segment being compacted out of the log
+    int window_gone;
     // Length of buffer to read from server
     int size;
+    // Header of the entry whose payload is being read, and its log offset
+    struct record_header header;
+    uint64_t entry_offset;
+    // Fragmented records seen in part so far
+    struct Reassembly *reassemblies;
+    // Record whose out-of-line value is being read, how far we got, and
+    // the read to go back to afterwards
+    struct ProducerMessage *fetch;
+    uint64_t fetch_offset;
+    uint32_t fetch_size;
+    int resume_status;
     // State of the client
     enum {
 	READ_POLLING,
-	READ_READY
+	READ_READY,
+	READ_FETCHING
     } read_status;
+
+    // Shared with the application threads, under mutex: records handed
+    // over but not yet taken, a pending fetch, and whether the partition
+    // was taken away from us
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_variable;
+    pthread_cond_t fetch_cond_variable;
+    // Reads a thread of ours waits on itself done, and how many since it
+    // last looked
+    pthread_cond_t read_cond_variable;
+    int read_done;
+    int queued;
+    struct ProducerMessage *fetch_request;
+    int fetch_done;
+    // A fetch was requested and is not done yet
+    int fetch_busy;
+    int revoked;
+    // The application had READ_AHEAD records, so no read was posted, and
+    // set once a read of nothing is posted to wake the CQ thread again
+    int paused;
+    int resuming;
+    // Log offset up to which the application is done, and how many records
+    // that covers since the broker was last told
+    uint64_t delivered;
+    int uncommitted;
+    // Group readers: our partition's slot in the broker's offsets table,
+    // and the registered word commits are written from
+    uint64_t commit_addr;
+    uint32_t commit_rkey;
+    uint64_t *commit_value;
+    struct ibv_mr *commit_mr;
+    // Final commit sent; disconnect once the send queue drains
+    int closing;
+    // Our log's seek index, if it has one. While seeking, a thread of ours
+    // searches it with reads it waits on itself; once it lands, records up
+    // to the one asked for are skipped.
+    uint64_t index_addr;
+    uint32_t index_rkey;
+    int seeking;
+    uint64_t skip_records;
+    // Snapshot the broker handed us to start from, which a thread of ours
+    // reads, as it would seek, before the log
+    uint64_t snapshot_addr;
+    uint64_t snapshot_length;
+    uint32_t snapshot_rkey;
+    // Lookup readers: our log's lookup table, set once the broker has told
+    // us where it is, and held by one lookup at a time
+    uint64_t lookup_addr;
+    uint32_t lookup_rkey;
+    int lookup_ready;
+    pthread_mutex_t lookup_mutex;
+};
+
+/**
+ * A record whose fragments are still arriving, keyed by the producer and its
+ * sequence number since other producers' entries can sit in between
+ */
+struct Reassembly {
+    uint32_t producer_id;
+    uint32_t sequence;
+    // Log offset of the first fragment
+    uint64_t offset;
+    struct ProducerMessage *record;
+    struct Reassembly *next;
+};
+
+/**
+ * A record as handed to the application, with the reader it came from and
+ * the log offset its partition can be resumed from once it is processed
+ */
+struct ConsumerRecord {
+    struct ProducerMessage msg;
+    struct client_context *ctx;
+    uint64_t offset;
+    // The value is stored compressed; fetchValue() inflates it
+    int compressed;
+};
+
+/**
+ * Records waiting for one dispatch worker. Single producer, single consumer:
+ * the dispatcher alone moves head, and the worker alone moves tail, past
+ * each record once it is handled. A worker that found its queue empty for
+ * a while sets sleeping and waits on wake; the dispatcher signals it after
+ * moving head if it finds sleeping set. The dispatcher waiting on the
+ * worker does the same with waiting and room.
+ */
+struct DispatchQueue {
+    struct ProducerMessage *records[DISPATCH_QUEUE_SIZE];
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t tail __attribute__((aligned(64)));
+    int sleeping;
+    int waiting;
+    pthread_mutex_t mutex;
+    pthread_cond_t wake;
+    pthread_cond_t room;
+};
+
+/**
+ * A record handed to a worker, remembered by the dispatcher until the
+ * worker is past it; the handler may have freed the record by then
+ */
+struct DispatchTicket {
+    struct client_context *ctx;
+    uint64_t offset;
+    int worker;
+    uint64_t position;
 };
 
-// Record to be returned to the client
-struct ProducerMessage *producer_record = NULL;
 int shouldDisconnect = 0;
 
-// Mutexes and conditional variables to synchronize polling and 
-// consumeRecord client calls
-pthread_cond_t consumer_cond_variable = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t polling_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t polling_cond_variable = PTHREAD_COND_INITIALIZER;
-pthread_mutex_t consumer_mutex = PTHREAD_MUTEX_INITIALIZER;
+static char *server_name = NULL;
+// Brokers we may read from, more than one if server_name is a replica
+// list, and where in the list readers of this process start
+static int num_replicas = 1;
+static int replica_seed = 0;
+static char *topic_name = DEFAULT_TOPIC;
+// Empty unless we read as a member of a consumer group
+static char group_name[GROUP_NAME_MAX] = "";
+// Reader of each partition we were given, NULL if none
+static struct client_context *readers[MAX_PARTITIONS];
+// Records every reader asks the broker for; FILTER_NONE for all of them.
+// A key hash filter passes other keys in the same buckets, so we keep the
+// keys to drop those.
+static struct record_filter filter;
+static char **filter_keys = NULL;
+static int num_filter_keys = 0;
+// Have the broker write records into our memory rather than read them, or
+// send them to a multicast group
+static int push_delivery = 0;
+static int multicast_delivery = 0;
+// Where every reader starts, if not at the start of its log
+static enum {
+    SEEK_NONE,
+    SEEK_RECORD,
+    SEEK_TIME
+} seek_kind = SEEK_NONE;
+static uint64_t seek_target = 0;
+// Have every reader start from the broker's snapshot of its log
+static int snapshot_bootstrap = 0;
+// Partitions we look keys up in rather than read, 0 for readers
+static int lookup_partitions = 0;
+
+// Records ready for the application, oldest first, from every reader
+static struct ProducerMessage *ready_head = NULL;
+static struct ProducerMessage *ready_tail = NULL;
+static pthread_mutex_t ready_mutex = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t ready_cond_variable = PTHREAD_COND_INITIALIZER;
+// Record last returned by consumeRecord(); processed once the next is asked for
+static struct ConsumerRecord *last_record = NULL;
+// Dispatch pool, if the application asked for one
+static struct DispatchQueue *dispatch_queues = NULL;
+static int num_dispatch_workers = 0;
+static record_handler_fn dispatch_handler = NULL;
+static void *dispatch_arg = NULL;
+
+static void *run_client_loop(void *c);
+static void *run_push_loop(void *c);
+static void *run_multicast_loop(void *c);
+static void *run_seek(void *c);
+static void *run_snapshot(void *c);
+
+/**
+ * Create a ProducerMessage node for the record starting with the given entry
+ * Note: The value is allocated in full but left for the fragments to fill,
+ * unless it is out of line, in which case only its location is kept
+ */
+struct ProducerMessage* createNode(struct client_context *ctx, struct record_header *hdr, char *payload) {
+    struct ConsumerRecord *node = calloc(1, sizeof(struct ConsumerRecord));
+    uint16_t topic_length = 0;
+    if (hdr->flags & RECORD_TOPIC) {
+        topic_length = strnlen(payload, hdr->key_length) + 1;
+        node->msg.topic = strndup(payload, hdr->key_length);
+    }
+    char *k = malloc(hdr->key_length - topic_length + 1);
+    memcpy(k, payload + topic_length, hdr->key_length - topic_length);
+    k[hdr->key_length - topic_length] = '\0';
+    node->ctx = ctx;
+    node->compressed = (hdr->flags & RECORD_COMPRESSED) != 0;
+    node->msg.key = k;
+    node->msg.value_length = hdr->value_length;
+    if (hdr->flags & RECORD_VALUE_REF) {
+        struct value_ref *ref = (struct value_ref *)(payload + hdr->key_length);
+        node->msg.value_addr = ref->addr;
+        node->msg.value_rkey = ref->rkey;
+    } else {
+        node->msg.value = malloc(hdr->value_length + 1);
+        node->msg.value[hdr->value_length] = '\0';
+    }
+    return &node->msg;
+}
+
+static void free_record(struct ProducerMessage *record) {
+    free(record->key);
+    free(record->value);
+    free(record->topic);
+    free((struct ConsumerRecord *)record);
+}
+
+/**
+ * Apply one log entry. Returns the record once its last fragment is in,
+ * NULL while more fragments are expected.
+ */
+static struct ProducerMessage* apply_entry(struct client_context *ctx, struct record_header *hdr, char *payload) {
+    struct Reassembly **r = &ctx->reassemblies;
+    struct ProducerMessage *record = NULL;
+    uint64_t n;
+
+    if (hdr->key_length > RECORD_PAYLOAD_LENGTH(hdr))
+        return NULL;
+    n = RECORD_PAYLOAD_LENGTH(hdr) - hdr->key_length;
+
+    if (hdr->flags & RECORD_VALUE_REF)
+        return n >= sizeof(struct value_ref) ? createNode(ctx, hdr, payload) : NULL;
+
+    if (hdr->flags & RECORD_FIRST_FRAGMENT) {
+        record = createNode(ctx, hdr, payload);
+        if (!(hdr->flags & RECORD_LAST_FRAGMENT)) {
+            struct Reassembly *node = malloc(sizeof(struct Reassembly));
+            node->producer_id = hdr->producer_id;
+            node->sequence = hdr->sequence;
+            node->offset = ctx->entry_offset;
+            node->record = record;
+            node->next = ctx->reassemblies;
+            ctx->reassemblies = node;
+        }
+    } else {
+        while (*r && ((*r)->producer_id != hdr->producer_id || (*r)->sequence != hdr->sequence))
+            r = &(*r)->next;
+        // Started reading after the first fragment; skip the record
+        if (*r == NULL)
+            return NULL;
+        record = (*r)->record;
+    }
+
+    // The fragment must fall within the value its first fragment announced;
+    // one that does not is malformed, or not of this record after all
+    if (hdr->value_offset > record->value_length || n > record->value_length - hdr->value_offset) {
+        fprintf(stderr, "Dropping a record whose fragment does not fit its value\n");
+        if (*r && (*r)->record == record) {
+            struct Reassembly *done = *r;
+            *r = done->next;
+            free(done);
+        }
+        free_record(record);
+        return NULL;
+    }
+    memcpy(record->value + hdr->value_offset, payload + hdr->key_length, n);
+
+    if (!(hdr->flags & RECORD_LAST_FRAGMENT))
+        return NULL;
+    if (!(hdr->flags & RECORD_FIRST_FRAGMENT)) {
+        struct Reassembly *done = *r;
+        *r = done->next;
+        free(done);
+    }
+    return record;
+}
 
 /**
- * Create a ProducerMessage node with the given key and value
- * Note: Creates deep copies of both key and value
+ * Whether the application asked for the record; only keys sharing a hash
+ * bucket with the ones it wants get through the broker unasked for
  */
-struct ProducerMessage* createNode(char *key, char *value) {
-    char *k = malloc(sizeof(char)*strlen(key));
-    char *v = malloc(sizeof(char)*strlen(value));
-    strcpy(k, key);
-    strcpy(v, value);
-    struct ProducerMessage *node = malloc(sizeof(struct ProducerMessage));
-    node->key = k;
-    node->value = v;
-    node->next = NULL;
-    return node;
+static int wanted(struct ProducerMessage *record) {
+    int i;
+    if (filter.kind != FILTER_KEY_HASH)
+        return 1;
+    for (i = 0; i < num_filter_keys; ++i)
+        if (strcmp(record->key, filter_keys[i]) == 0)
+            return 1;
+    return 0;
 }
 
-static void post_receive(struct rdma_cm_id *id) {
+static void deliver(struct client_context *ctx, struct ProducerMessage *record);
+
+/**
+ * Replace a value stored compressed with what the producer produced.
+ * A value that does not decompress, or claims to be longer than it could
+ * decompress to, is left as stored.
+ */
+static void inflate(char **value, size_t *length) {
+    struct compressed_value *frame = (struct compressed_value *)*value;
+    char *raw;
+
+    if (*length < sizeof(*frame) || frame->codec != CODEC_LZ) {
+        fprintf(stderr, "Unknown compressed value format, leaving it as stored\n");
+        return;
+    }
+    // The length comes off the wire; the input bounds what it can be
+    if (frame->length > LZ_MAX_DECOMPRESSED(*length - sizeof(*frame))) {
+        fprintf(stderr, "Corrupt compressed value, leaving it as stored\n");
+        return;
+    }
+    raw = malloc(frame->length + 1);
+    if (lz_decompress(frame + 1, *length - sizeof(*frame), raw, frame->length) != (int64_t)frame->length) {
+        fprintf(stderr, "Corrupt compressed value, leaving it as stored\n");
+        free(raw);
+        return;
+    }
+    raw[frame->length] = '\0';
+    *length = frame->length;
+    free(*value);
+    *value = raw;
+}
+
+/**
+ * Apply the entry at entry_offset and deliver the record if it is complete
+ * and wanted
+ */
+static void take_entry(struct client_context *ctx, struct record_header *hdr, char *payload) {
+    struct ProducerMessage *record;
+    // Records before the one we seeked to; their later fragments are
+    // dropped as orphans
+    if (ctx->skip_records > 0 && (hdr->flags & RECORD_FIRST_FRAGMENT)) {
+        --ctx->skip_records;
+        return;
+    }
+    record = apply_entry(ctx, hdr, payload);
+    if (record != NULL && record->value != NULL && ((struct ConsumerRecord *)record)->compressed) {
+        inflate(&record->value, &record->value_length);
+        ((struct ConsumerRecord *)record)->compressed = 0;
+    }
+    if (record != NULL && wanted(record))
+        deliver(ctx, record);
+    else if (record != NULL)
+        free_record(record);
+}
+
+/**
+ * Hand a complete record to the application. Resuming from its offset must
+ * not skip the start of records still being reassembled.
+ */
+static void deliver(struct client_context *ctx, struct ProducerMessage *record) {
+    struct ConsumerRecord *rec = (struct ConsumerRecord *)record;
+    struct Reassembly *r;
+
+    rec->offset = ctx->entry_offset + RECORD_ENTRY_SIZE(&ctx->header);
+    for (r = ctx->reassemblies; r; r = r->next)
+        if (r->offset < rec->offset)
+            rec->offset = r->offset;
+
+    pthread_mutex_lock(&ctx->mutex);
+    ++ctx->queued;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    pthread_mutex_lock(&ready_mutex);
+    record->next = NULL;
+    if (ready_tail)
+        ready_tail->next = record;
+    else
+        ready_head = record;
+    ready_tail = record;
+    pthread_cond_signal(&ready_cond_variable);
+    pthread_mutex_unlock(&ready_mutex);
+}
+
+static void post_receive(struct rdma_cm_id *id, struct message *msg) {
     struct client_context *ctx = (struct client_context *) id->context;
     struct ibv_recv_wr wr, *bad_wr = NULL;
     struct ibv_sge sge;
@@ -68,9 +491,9 @@ static void post_receive(struct rdma_cm_id *id) {
     // Size of s/g array
     wr.num_sge = 1;
     // Start address of local memory buffer
-    sge.addr = (uintptr_t)ctx->msg;
+    sge.addr = (uintptr_t)msg;
     // Length of the buffer
-    sge.length = sizeof(*ctx->msg);
+    sge.length = sizeof(*msg);
     // Key of the local memory region
     sge.lkey = ctx->msg_mr->lkey;
     // Post the linked list of work requests to the receive queue of the queue pair
@@ -82,31 +505,332 @@ static void post_receive(struct rdma_cm_id *id) {
 static void on_pre_conn(struct rdma_cm_id *id) {
     // Get the context from the connection identifier
     struct client_context *ctx = (struct client_context *) id->context;
-    // Allocate local memory
-    posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
-    // Register the local memory region, enable local write access
-    TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE));
+    ctx->id = id;
+    if (!ctx->member) {
+        // Allocate local memory, large enough for any single log entry
+        posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), LANDING_SLOT_SIZE);
+        // Register the local memory region, enable local write access
+        TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, LANDING_SLOT_SIZE, IBV_ACCESS_LOCAL_WRITE));
+    }
+    if (!ctx->member && push_delivery) {
+        posix_memalign((void **)&ctx->ring, sysconf(_SC_PAGESIZE), PUSH_RING_SIZE);
+        memset(ctx->ring, 0, PUSH_RING_SIZE);
+        TEST_Z(ctx->ring_mr = ibv_reg_mr(rc_get_pd(), ctx->ring, PUSH_RING_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    }
+    if (!ctx->member && group_name[0] != '\0') {
+        posix_memalign((void **)&ctx->commit_value, RECORD_ALIGN, sizeof(*ctx->commit_value));
+        TEST_Z(ctx->commit_mr = ibv_reg_mr(rc_get_pd(), ctx->commit_value, sizeof(*ctx->commit_value), 0));
+    }
     // Allocate and register memory for exchanging keys
-    posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), sizeof(*ctx->msg));
-    TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, sizeof(*ctx->msg), IBV_ACCESS_LOCAL_WRITE));
-    // Post work request on the receive queue
-    post_receive(id);
+    posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), (MSG_RING_SIZE + 1) * sizeof(*ctx->msg));
+    TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, (MSG_RING_SIZE + 1) * sizeof(*ctx->msg), IBV_ACCESS_LOCAL_WRITE));
+    // Post work requests on the receive queue
+    int i;
+    for (i = 0; i < MSG_RING_SIZE; ++i)
+        post_receive(id, &ctx->msg[i]);
+}
+
+/**
+ * A reader with a filter or a push ring sends those first; the broker waits
+ * for them before telling us where to read
+ */
+static void on_connection(struct rdma_cm_id *id) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    struct message *msg = &ctx->msg[MSG_RING_SIZE];
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+
+    if (ctx->member || (filter.kind == FILTER_NONE && !push_delivery && !multicast_delivery && !lookup_partitions &&
+                        !snapshot_bootstrap && !ctx->moved))
+        return;
+
+    memset(msg, 0, sizeof(*msg));
+    msg->id = MSG_SUBSCRIBE;
+    msg->data.subscribe.filter = filter;
+    if (ctx->ring) {
+        msg->data.subscribe.ring_addr = (uintptr_t)ctx->ring;
+        msg->data.subscribe.ring_rkey = ctx->ring_mr->rkey;
+        msg->data.subscribe.ring_size = PUSH_RING_SIZE;
+    }
+    msg->data.subscribe.multicast = multicast_delivery;
+    msg->data.subscribe.lookup = lookup_partitions != 0;
+    // Where we left the follower is where the leader's log goes on
+    msg->data.subscribe.snapshot = snapshot_bootstrap && !ctx->moved;
+    msg->data.subscribe.resume = ctx->moved;
+    msg->data.subscribe.offset = ctx->leader_offset;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)id;
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    sge.addr = (uintptr_t)msg;
+    sge.length = sizeof(*msg);
+    sge.lkey = ctx->msg_mr->lkey;
+    pthread_mutex_lock(&ctx->sq_mutex);
+    rc_post_send(id, &ctx->sq, &wr);
+    pthread_mutex_unlock(&ctx->sq_mutex);
+}
+
+/**
+ * Note that the application is done with a record, so its partition may
+ * resume after it
+ */
+static void processed(struct client_context *ctx, uint64_t offset) {
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->delivered = offset;
+    ++ctx->uncommitted;
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * Have a reader that paused for the application read again: post a read of
+ * nothing, whose completion brings its CQ thread back to continue_reading().
+ * Called with the reader's mutex held.
+ */
+static void resume_reading(struct client_context *ctx) {
+    struct ibv_send_wr wr;
+
+    if (!ctx->paused)
+        return;
+    ctx->paused = 0;
+    __atomic_store_n(&ctx->resuming, 1, __ATOMIC_RELEASE);
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)ctx->id;
+    wr.opcode = IBV_WR_RDMA_READ;
+    wr.send_flags = IBV_SEND_SIGNALED;
+    pthread_mutex_lock(&ctx->sq_mutex);
+    rc_post_send(ctx->id, &ctx->sq, &wr);
+    pthread_mutex_unlock(&ctx->sq_mutex);
+}
+
+/**
+ * Take the next record from any partition, waiting up to timeout_ms for one,
+ * or for good if it is negative. Returns NULL if none came in time.
+ */
+static struct ConsumerRecord* take_record(int timeout_ms) {
+    struct ConsumerRecord *rec;
+    struct client_context *ctx;
+    struct timespec deadline;
+
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_nsec -= 1000000000;
+            ++deadline.tv_sec;
+        }
+    }
+
+    pthread_mutex_lock(&ready_mutex);
+    while (ready_head == NULL) {
+        if (timeout_ms < 0)
+            pthread_cond_wait(&ready_cond_variable, &ready_mutex);
+        else if (pthread_cond_timedwait(&ready_cond_variable, &ready_mutex, &deadline) != 0)
+            break;
+    }
+    rec = (struct ConsumerRecord *)ready_head;
+    if (rec != NULL) {
+        ready_head = ready_head->next;
+        if (ready_head == NULL)
+            ready_tail = NULL;
+    }
+    pthread_mutex_unlock(&ready_mutex);
+    if (rec == NULL)
+        return NULL;
+
+    // Let the reader go on if it was waiting for us to catch up
+    ctx = rec->ctx;
+    pthread_mutex_lock(&ctx->mutex);
+    --ctx->queued;
+    pthread_cond_signal(&ctx->cond_variable);
+    if (ctx->queued < READ_AHEAD)
+        resume_reading(ctx);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    rec->msg.next = NULL;
+    return rec;
 }
 
 struct ProducerMessage* consumeRecord() {
-    // Signal RDMA polling to begin
-    pthread_cond_signal(&consumer_cond_variable);
-    // Wait on polling to complete
-    pthread_mutex_lock(&consumer_mutex);
-    pthread_cond_wait(&polling_cond_variable, &consumer_mutex);
-    pthread_mutex_unlock(&consumer_mutex);
-    // Return record obtained after polling
-    return producer_record;
+    // The application is done with the previous record
+    if (last_record != NULL)
+        processed(last_record->ctx, last_record->offset);
+
+    last_record = take_record(-1);
+    return &last_record->msg;
 }
 
-static void create_and_post_work_request(struct rdma_cm_id *id) {
+/**
+ * When a dispatch thread that found nothing to do gives up waiting
+ */
+static void dispatch_deadline(struct timespec *deadline) {
+    clock_gettime(CLOCK_REALTIME, deadline);
+    deadline->tv_nsec += DISPATCH_IDLE_MS * 1000000L;
+    deadline->tv_sec += deadline->tv_nsec / 1000000000L;
+    deadline->tv_nsec %= 1000000000L;
+}
+
+/**
+ * Handle the records of one queue in order, moving its tail past each once
+ * the handler returns
+ */
+static void *run_dispatch_worker(void *q) {
+    struct DispatchQueue *queue = (struct DispatchQueue *)q;
+    uint64_t tail = queue->tail;
+    int spins = 0;
+
+    while (!shouldDisconnect) {
+        if (__atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == tail) {
+            if (++spins < DISPATCH_SPINS) {
+                sched_yield();
+                continue;
+            }
+            // Set before looking at head once more, as the dispatcher moves
+            // head before looking at sleeping, so one of us sees the other
+            pthread_mutex_lock(&queue->mutex);
+            __atomic_store_n(&queue->sleeping, 1, __ATOMIC_SEQ_CST);
+            if (__atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) == tail) {
+                struct timespec deadline;
+                dispatch_deadline(&deadline);
+                pthread_cond_timedwait(&queue->wake, &queue->mutex, &deadline);
+            }
+            __atomic_store_n(&queue->sleeping, 0, __ATOMIC_RELAXED);
+            pthread_mutex_unlock(&queue->mutex);
+            spins = 0;
+            continue;
+        }
+        spins = 0;
+        dispatch_handler(queue->records[tail % DISPATCH_QUEUE_SIZE], dispatch_arg);
+        __atomic_store_n(&queue->tail, ++tail, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue->waiting, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&queue->mutex);
+            pthread_cond_signal(&queue->room);
+            pthread_mutex_unlock(&queue->mutex);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Wait for a worker to move its tail past position, parking as an idle
+ * worker does once a while of looking finds it has not
+ */
+static void wait_for_worker(struct DispatchQueue *queue, uint64_t position) {
+    int spins = 0;
+
+    while (__atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) <= position && !shouldDisconnect) {
+        if (++spins < DISPATCH_SPINS) {
+            sched_yield();
+            continue;
+        }
+        // Set before looking at tail once more, as the worker moves tail
+        // before looking at waiting
+        pthread_mutex_lock(&queue->mutex);
+        __atomic_store_n(&queue->waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) <= position) {
+            struct timespec deadline;
+            dispatch_deadline(&deadline);
+            pthread_cond_timedwait(&queue->room, &queue->mutex, &deadline);
+        }
+        __atomic_store_n(&queue->waiting, 0, __ATOMIC_RELAXED);
+        pthread_mutex_unlock(&queue->mutex);
+        spins = 0;
+    }
+}
+
+/**
+ * Shard records over the workers by key. Records are handed out in the
+ * order they arrive and tickets kept in that order too; a record counts as
+ * processed once its worker and every worker given an earlier one are past
+ * it, so committed offsets never skip a record still being handled.
+ */
+static void *run_dispatcher(void *c) {
+    uint32_t capacity = num_dispatch_workers * DISPATCH_QUEUE_SIZE;
+    struct DispatchTicket *tickets = calloc(capacity, sizeof(*tickets));
+    uint32_t first = 0, pending = 0;
+
+    while (!shouldDisconnect) {
+        struct ConsumerRecord *rec;
+        struct DispatchQueue *queue;
+        struct DispatchTicket *t;
+        int w;
+
+        while (pending > 0) {
+            t = &tickets[first];
+            if (__atomic_load_n(&dispatch_queues[t->worker].tail, __ATOMIC_ACQUIRE) <= t->position)
+                break;
+            processed(t->ctx, t->offset);
+            first = (first + 1) % capacity;
+            --pending;
+        }
+        // Handled records queue up behind one that is not; wait for it
+        if (pending == capacity) {
+            wait_for_worker(&dispatch_queues[tickets[first].worker], tickets[first].position);
+            continue;
+        }
+
+        rec = take_record(pending > 0 ? DISPATCH_IDLE_MS : -1);
+        if (rec == NULL)
+            continue;
+
+        w = key_hash(rec->msg.key, strlen(rec->msg.key)) % num_dispatch_workers;
+        queue = &dispatch_queues[w];
+        // A full queue holds the others up; the readers pause behind us
+        if (queue->head - __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE) == DISPATCH_QUEUE_SIZE)
+            wait_for_worker(queue, queue->head - DISPATCH_QUEUE_SIZE);
+
+        t = &tickets[(first + pending++) % capacity];
+        t->ctx = rec->ctx;
+        t->offset = rec->offset;
+        t->worker = w;
+        t->position = queue->head;
+        queue->records[queue->head % DISPATCH_QUEUE_SIZE] = &rec->msg;
+        __atomic_store_n(&queue->head, queue->head + 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&queue->sleeping, __ATOMIC_SEQ_CST)) {
+            pthread_mutex_lock(&queue->mutex);
+            pthread_cond_signal(&queue->wake);
+            pthread_mutex_unlock(&queue->mutex);
+        }
+    }
+    free(tickets);
+    return NULL;
+}
+
+void dispatchRecords(int num_workers, record_handler_fn handler, void *arg) {
+    pthread_t thread_id;
+    int i;
+
+    assert(num_workers > 0 && dispatch_queues == NULL && last_record == NULL);
+    posix_memalign((void **)&dispatch_queues, 64, num_workers * sizeof(*dispatch_queues));
+    memset(dispatch_queues, 0, num_workers * sizeof(*dispatch_queues));
+    num_dispatch_workers = num_workers;
+    dispatch_handler = handler;
+    dispatch_arg = arg;
+
+    for (i = 0; i < num_workers; ++i) {
+        pthread_mutex_init(&dispatch_queues[i].mutex, NULL);
+        pthread_cond_init(&dispatch_queues[i].wake, NULL);
+        pthread_cond_init(&dispatch_queues[i].room, NULL);
+    }
+    for (i = 0; i < num_workers; ++i)
+        pthread_create(&thread_id, NULL, run_dispatch_worker, &dispatch_queues[i]);
+    pthread_create(&thread_id, NULL, run_dispatcher, NULL);
+}
+
+int dispatchQueueDepth(int worker) {
+    struct DispatchQueue *queue = &dispatch_queues[worker];
+    uint64_t tail = __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE);
+
+    return __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) - tail;
+}
+
+static void post_read_into(struct rdma_cm_id *id, char *local, uint32_t lkey, uint64_t remote_addr, uint32_t rkey,
+                           uint32_t size) {
     struct client_context *ctx = (struct client_context *)id->context;
-    struct ibv_send_wr wr, *bad_wr = NULL;
+    struct ibv_send_wr wr;
     struct ibv_sge sge;
     memset(&wr, 0, sizeof(wr));
     wr.wr_id = (uintptr_t)id;
@@ -114,65 +838,672 @@ static void create_and_post_work_request(struct rdma_cm_id *id) {
     wr.sg_list = &sge;
     wr.num_sge = 1;
     wr.send_flags = IBV_SEND_SIGNALED;
-    wr.wr.rdma.remote_addr = (uintptr_t)ctx->peer_addr;
-    wr.wr.rdma.rkey = ctx->peer_rkey;
-    
-    sge.addr = (uintptr_t)ctx->buffer;
-    sge.length = ctx->size;
-    sge.lkey = ctx->buffer_mr->lkey;
-    // Post a list of work requests to the send queue 
-    TEST_NZ(ibv_post_send(id->qp, &wr, &bad_wr));
+    wr.wr.rdma.remote_addr = remote_addr;
+    wr.wr.rdma.rkey = rkey;
+
+    sge.addr = (uintptr_t)local;
+    sge.length = size;
+    sge.lkey = lkey;
+    // Post a list of work requests to the send queue
+    pthread_mutex_lock(&ctx->sq_mutex);
+    rc_post_send(id, &ctx->sq, &wr);
+    pthread_mutex_unlock(&ctx->sq_mutex);
+}
+
+static void post_read(struct rdma_cm_id *id, uint64_t remote_addr, uint32_t rkey, uint32_t size) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    post_read_into(id, ctx->buffer, ctx->buffer_mr->lkey, remote_addr, rkey, size);
+}
+
+/**
+ * The window we can read size bytes of the log at the offset through, NULL
+ * if there is none
+ */
+static struct log_window *find_window(struct client_context *ctx, uint64_t offset, uint32_t size) {
+    int w;
+    for (w = 0; w < CONSUMER_WINDOWS; ++w) {
+        struct log_window *window = &ctx->windows[w];
+        if (offset >= window->offset && offset + size <= window->offset + window->length)
+            return window;
+    }
+    return NULL;
+}
+
+/**
+ * Ask the broker for a window onto the log at the offset, unless we did
+ * already. A segment still in memory gets one at once; an evicted one once
+ * the broker has read the part we need from its file.
+ */
+static void request_window(struct rdma_cm_id *id, uint64_t offset) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    struct message *msg = &ctx->msg[MSG_RING_SIZE];
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+
+    if (ctx->window_requested && ctx->requested_offset == offset)
+        return;
+    ctx->window_requested = 1;
+    ctx->requested_offset = offset;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)id;
+    wr.opcode = IBV_WR_SEND;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    sge.addr = (uintptr_t)msg;
+    sge.length = sizeof(*msg);
+    sge.lkey = ctx->msg_mr->lkey;
+    pthread_mutex_lock(&ctx->sq_mutex);
+    memset(msg, 0, sizeof(*msg));
+    msg->id = MSG_FETCH;
+    msg->data.fetch.offset = offset;
+    rc_post_send(id, &ctx->sq, &wr);
+    pthread_mutex_unlock(&ctx->sq_mutex);
+}
+
+static void create_and_post_work_request(struct rdma_cm_id *id) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    struct log_window *window = find_window(ctx, ctx->read_offset, ctx->size);
+    if (window == NULL) {
+        // Resumed when the broker's MSG_WINDOW for it comes in
+        ctx->waiting_for_window = 1;
+        request_window(id, ctx->read_offset);
+        return;
+    }
+    post_read(id, window->addr + (ctx->read_offset - window->offset), window->rkey, ctx->size);
+}
+
+/**
+ * Send the broker a 30-bit immediate: the segment we moved on to, so it can
+ * rebind the window on the one before onto the one after, or with IMM_CREDIT
+ * set how much of our push ring we are done with
+ */
+static void notify_broker(struct rdma_cm_id *id, uint32_t imm, int signaled) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    struct ibv_send_wr wr;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)id;
+    wr.opcode = IBV_WR_SEND_WITH_IMM;
+    wr.imm_data = htonl(imm);
+    if (signaled)
+        wr.send_flags = IBV_SEND_SIGNALED;
+    pthread_mutex_lock(&ctx->sq_mutex);
+    rc_post_send(id, &ctx->sq, &wr);
+    pthread_mutex_unlock(&ctx->sq_mutex);
+}
+
+/**
+ * Record the offset our group may resume this partition from, writing it
+ * straight into the broker's offsets table. Offsets only grow, so a write
+ * still in flight that picks up a later value does no harm.
+ */
+static void commit_offset(struct rdma_cm_id *id, uint64_t offset, int signaled) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    struct ibv_send_wr wr;
+    struct ibv_sge sge;
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)id;
+    wr.opcode = IBV_WR_RDMA_WRITE;
+    wr.sg_list = &sge;
+    wr.num_sge = 1;
+    if (signaled)
+        wr.send_flags = IBV_SEND_SIGNALED;
+    wr.wr.rdma.remote_addr = ctx->commit_addr;
+    wr.wr.rdma.rkey = ctx->commit_rkey;
+
+    sge.addr = (uintptr_t)ctx->commit_value;
+    sge.length = sizeof(*ctx->commit_value);
+    sge.lkey = ctx->commit_mr->lkey;
+    pthread_mutex_lock(&ctx->sq_mutex);
+    *ctx->commit_value = offset;
+    rc_post_send(id, &ctx->sq, &wr);
+    pthread_mutex_unlock(&ctx->sq_mutex);
+}
+
+/**
+ * Read the next piece of an out-of-line value through our local buffer
+ */
+static void post_fetch_read(struct rdma_cm_id *id) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    uint64_t n = ctx->fetch->value_length - ctx->fetch_offset;
+    if (n > LANDING_SLOT_SIZE)
+        n = LANDING_SLOT_SIZE;
+    ctx->fetch_size = n;
+    post_read(id, ctx->fetch->value_addr + ctx->fetch_offset, ctx->fetch->value_rkey, n);
+}
+
+/**
+ * Stop reading for good: commit how far the application got, and drop the
+ * connection once that commit has gone out
+ */
+static void close_reader(struct rdma_cm_id *id) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    ctx->closing = 1;
+    if (ctx->commit_addr != 0 && ctx->delivered != 0)
+        commit_offset(id, ctx->delivered, 1);
+    if (ctx->sq.outstanding == 0)
+        rc_disconnect(id);
+}
+
+/**
+ * Issue the read described by read_offset and size, or pause until the
+ * application has room for more records; other readers share our CQ
+ * thread, so it never waits for the application. Value fetches the
+ * application is waiting on go first, and group readers commit progress on
+ * the way. idle is set when the log had nothing new, a good moment to
+ * commit.
+ */
+static void continue_reading(struct rdma_cm_id *id, int idle) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    struct ProducerMessage *fetch;
+    uint64_t delivered;
+    int uncommitted, revoked;
+
+    pthread_mutex_lock(&ctx->mutex);
+    if (ctx->queued >= READ_AHEAD && ctx->fetch_request == NULL && !ctx->revoked) {
+        // resume_reading() brings us back here
+        ctx->paused = 1;
+        pthread_mutex_unlock(&ctx->mutex);
+        return;
+    }
+    fetch = ctx->fetch_request;
+    ctx->fetch_request = NULL;
+    revoked = ctx->revoked;
+    delivered = ctx->delivered;
+    uncommitted = ctx->uncommitted;
+    if (ctx->commit_addr != 0 && (uncommitted >= COMMIT_INTERVAL || (idle && uncommitted > 0)))
+        ctx->uncommitted = 0;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (fetch != NULL) {
+        ctx->fetch = fetch;
+        ctx->fetch_offset = 0;
+        ctx->resume_status = ctx->read_status;
+        ctx->read_status = READ_FETCHING;
+        post_fetch_read(id);
+        return;
+    }
+    if (revoked) {
+        close_reader(id);
+        return;
+    }
+    // Everything the lagging follower has for us is read
+    if (ctx->leaving && ctx->read_status == READ_POLLING && ctx->read_offset == ctx->leave_at) {
+        ctx->lagging = 1;
+        close_reader(id);
+        return;
+    }
+    if (ctx->commit_addr != 0 && (uncommitted >= COMMIT_INTERVAL || (idle && uncommitted > 0)))
+        commit_offset(id, delivered, 0);
+    create_and_post_work_request(id);
+}
+
+/**
+ * Move past the current entry and start polling for the next one
+ */
+static void read_next_entry(struct rdma_cm_id *id) {
+    struct client_context *ctx = (struct client_context *)id->context;
+    // Transition state to READ_POLLING, move to the next aligned entry
+    ctx->read_status = READ_POLLING;
+    ctx->read_offset += RECORD_ENTRY_SIZE(&ctx->header) - sizeof(ctx->header);
+    ctx->size = VAL_LENGTH;
+    // Issue one sided operation to read the next header
+    continue_reading(id, 0);
 }
 
 static void issue_one_sided_read(struct rdma_cm_id *id) {
     struct client_context *ctx = (struct client_context *)id->context;
+    if (ctx->read_status == READ_FETCHING) {
+        memcpy(ctx->fetch->value + ctx->fetch_offset, ctx->buffer, ctx->fetch_size);
+        ctx->fetch_offset += ctx->fetch_size;
+        if (ctx->fetch_offset < ctx->fetch->value_length) {
+            post_fetch_read(id);
+            return;
+        }
+        pthread_mutex_lock(&ctx->mutex);
+        ctx->fetch_done = 1;
+        pthread_cond_broadcast(&ctx->fetch_cond_variable);
+        pthread_mutex_unlock(&ctx->mutex);
+        // Back to the read we put off for the fetch; push readers have
+        // none, their polling thread goes on by itself
+        ctx->fetch = NULL;
+        ctx->read_status = ctx->resume_status;
+        if (ctx->ring == NULL)
+            continue_reading(id, 0);
+        return;
+    }
     // Check if in polling state
-    char *read_buffer = (char *) malloc((ctx->size+1)*sizeof(char));
-    strncpy(read_buffer, ctx->buffer, ctx->size);
-    read_buffer[ctx->size] = '\0';
     if (ctx->read_status == READ_POLLING) {
-        // Check if buffer has valid length
-        //printf("Polling: %s\n", read_buffer);
-        if (atoi(read_buffer) > 0) {
-            // Transition to READ_READY, set the size
-	    ctx->read_status = READ_READY;
-	    ctx->size = atoi(read_buffer);
-	    // Update remote addr to read from
-            ctx->peer_addr += VAL_LENGTH; // TODO: Wrap around
-	    // Issue one sided operation to read the data
-            create_and_post_work_request(id);
-        } else {
+        // Check if the next entry has been published
+        struct record_header *hdr = (struct record_header *)ctx->buffer;
+        if (hdr->length == 0) {
             // Issue one sided operation, polling logic
-            create_and_post_work_request(id);
-	}
-    } else {
-        //printf("Data: %s\n", read_buffer);
-	//printf("Server wrote into the buffer: %s\n", ctx->buffer);
-	// Deserialize the buffer into producer record
-        char* separator;
-        separator = strchr(read_buffer, '/');
-	//printf("Separator is %s\n", separator);
-        char* key = (char*)malloc(sizeof(char) *  (separator - read_buffer + 1));
-        //printf("Key allocated of length: %zu\n", (separator - ctx->buffer + 1));
-        strncpy(key, ctx->buffer, (separator - read_buffer));
-        int key_length = strlen(key);
-        int val_length = (int)(strlen(read_buffer)-key_length-1);
-        char* value = (char*)malloc(sizeof(char) * val_length);
-        strncpy(value, ctx->buffer+key_length+1, val_length);
-        producer_record = createNode(key, value);      
-        //producer_record = NULL;  
-	pthread_cond_signal(&polling_cond_variable);
-        pthread_mutex_lock(&polling_mutex);
-	pthread_cond_wait(&consumer_cond_variable, &polling_mutex);
-	pthread_mutex_unlock(&polling_mutex);
-	// Transition state to READ_POLLING, change peer_addr and size
-	ctx->read_status = READ_POLLING;
-	ctx->peer_addr += ctx->size;
-	ctx->size = VAL_LENGTH;
-	// Issue one sided operation to read the length
-        create_and_post_work_request(id);
-    } 
-    
+            continue_reading(id, 1);
+            return;
+        }
+        if (hdr->flags & RECORD_SEGMENT_END) {
+            // Continue at the start of the topic's next segment. If we
+            // have a window onto it already, tell the broker we got there;
+            // otherwise asking for one does.
+            ctx->read_offset = hdr->value_offset;
+            if (find_window(ctx, ctx->read_offset, VAL_LENGTH))
+                notify_broker(id, hdr->value_offset / LOG_SEGMENT_SIZE, 0);
+            continue_reading(id, 0);
+            return;
+        }
+        ctx->header = *hdr;
+        ctx->entry_offset = ctx->read_offset;
+        // Transition to READ_READY, set the size
+        ctx->read_status = READ_READY;
+        ctx->size = RECORD_PAYLOAD_LENGTH(hdr);
+        ctx->read_offset += sizeof(*hdr);
+        // Issue one sided operation to read the payload
+        if (ctx->size > 0) {
+            continue_reading(id, 0);
+            return;
+        }
+    }
+
+    // Deserialize the payload into producer record
+    take_entry(ctx, &ctx->header, ctx->buffer);
+    read_next_entry(id);
+}
+
+/**
+ * Read size bytes of broker memory into our buffer, and wait for them
+ */
+static void read_sync(struct client_context *ctx, uint64_t remote_addr, uint32_t rkey, uint32_t size) {
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->read_done = 0;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    post_read(ctx->id, remote_addr, rkey, size);
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (!ctx->read_done)
+        pthread_cond_wait(&ctx->read_cond_variable, &ctx->mutex);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * Read size bytes of our log at the offset into our buffer, from a thread
+ * of our own, waiting for a window onto them first if we have none.
+ * Returns -1 if the broker has none to give, which only lookup readers are
+ * told.
+ */
+static int read_log_sync(struct client_context *ctx, uint64_t offset, uint32_t size) {
+    struct log_window *window;
+    uint64_t addr;
+    uint32_t rkey;
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->window_gone = 0;
+    while ((window = find_window(ctx, offset, size)) == NULL && !ctx->window_gone) {
+        request_window(ctx->id, offset);
+        pthread_cond_wait(&ctx->read_cond_variable, &ctx->mutex);
+    }
+    if (window == NULL) {
+        pthread_mutex_unlock(&ctx->mutex);
+        return -1;
+    }
+    addr = window->addr + (offset - window->offset);
+    rkey = window->rkey;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    read_sync(ctx, addr, rkey, size);
+    return 0;
+}
+
+/**
+ * For readers with a thread of their own: wait while the application has
+ * enough records queued, and read any value it is waiting on. Push readers
+ * leave the read to the CQ thread; multicast readers, and readers taking a
+ * snapshot, do it here.
+ */
+static void serve_application(struct client_context *ctx) {
+    struct ProducerMessage *fetch;
+    uint64_t offset, n;
+
+    pthread_mutex_lock(&ctx->mutex);
+    while (ctx->queued >= READ_AHEAD && ctx->fetch_request == NULL)
+        pthread_cond_wait(&ctx->cond_variable, &ctx->mutex);
+    fetch = ctx->fetch_request;
+    ctx->fetch_request = NULL;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    if (fetch == NULL)
+        return;
+
+    if (ctx->mcast == NULL && !__atomic_load_n(&ctx->seeking, __ATOMIC_ACQUIRE)) {
+        ctx->fetch = fetch;
+        ctx->fetch_offset = 0;
+        ctx->resume_status = ctx->read_status;
+        ctx->read_status = READ_FETCHING;
+        post_fetch_read(ctx->id);
+        return;
+    }
+
+    for (offset = 0; offset < fetch->value_length; offset += n) {
+        n = fetch->value_length - offset;
+        if (n > LANDING_SLOT_SIZE)
+            n = LANDING_SLOT_SIZE;
+        read_sync(ctx, fetch->value_addr + offset, fetch->value_rkey, n);
+        memcpy(fetch->value + offset, ctx->buffer, n);
+    }
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->fetch_done = 1;
+    pthread_cond_broadcast(&ctx->fetch_cond_variable);
+    pthread_mutex_unlock(&ctx->mutex);
+}
+
+/**
+ * Take the entries the broker writes into our ring, polling local memory
+ * rather than reading the broker's. Entries are cleared once taken, so a
+ * stale length is never mistaken for a new entry, and handed back to the
+ * broker a quarter of the ring at a time.
+ */
+static void *run_push_loop(void *c) {
+    struct client_context *ctx = (struct client_context *)c;
+    uint64_t freed = 0;
+
+    while (!shouldDisconnect) {
+        struct record_header *hdr = (struct record_header *)(ctx->ring + ctx->ring_head);
+        // Only told once the last entry for us is in the ring
+        int leaving = __atomic_load_n(&ctx->leaving, __ATOMIC_ACQUIRE);
+
+        serve_application(ctx);
+
+        if (__atomic_load_n(&hdr->length, __ATOMIC_ACQUIRE) == 0) {
+            if (leaving) {
+                ctx->lagging = 1;
+                rc_disconnect(ctx->id);
+                return 0;
+            }
+            continue;
+        }
+
+        if (hdr->flags & RECORD_SEGMENT_END) {
+            // The rest of the ring was skipped; go on from its start
+            freed += PUSH_RING_SIZE - ctx->ring_head;
+            memset(hdr, 0, sizeof(*hdr));
+            ctx->ring_head = 0;
+        } else {
+            uint64_t size = RECORD_ENTRY_SIZE(hdr);
+
+            ctx->header = *hdr;
+            take_entry(ctx, hdr, (char *)(hdr + 1));
+
+            memset(hdr, 0, size);
+            freed += size;
+            ctx->ring_head += size;
+        }
+
+        if (freed >= PUSH_RING_SIZE / 4) {
+            notify_broker(ctx->id, IMM_CREDIT | (uint32_t)(freed / RECORD_ALIGN), 0);
+            freed = 0;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Read the entry at next_offset from the broker's log and take it. Returns
+ * 0 if nothing has been appended there yet.
+ */
+static int repair_entry(struct client_context *ctx) {
+    struct record_header *hdr = (struct record_header *)ctx->buffer;
+
+    read_log_sync(ctx, ctx->next_offset, sizeof(*hdr));
+    if (hdr->length == 0)
+        return 0;
+    if (hdr->flags & RECORD_SEGMENT_END) {
+        ctx->next_offset = hdr->value_offset;
+        pthread_mutex_lock(&ctx->mutex);
+        if (find_window(ctx, ctx->next_offset, sizeof(*hdr)))
+            notify_broker(ctx->id, hdr->value_offset / LOG_SEGMENT_SIZE, 0);
+        pthread_mutex_unlock(&ctx->mutex);
+        return 1;
+    }
+
+    ctx->header = *hdr;
+    ctx->entry_offset = ctx->next_offset;
+    if (RECORD_PAYLOAD_LENGTH(&ctx->header) > 0)
+        read_log_sync(ctx, ctx->next_offset + sizeof(*hdr), RECORD_PAYLOAD_LENGTH(&ctx->header));
+    take_entry(ctx, &ctx->header, ctx->buffer);
+    ctx->next_offset += RECORD_ENTRY_SIZE(&ctx->header);
+    return 1;
+}
+
+/**
+ * Take a datagram. In sequence, its entry is the next one we need. After a
+ * gap, or if the entry did not fit, read the log up to it first; a log's
+ * offsets only grow, so anything before next_offset was taken already.
+ */
+static void take_datagram(struct client_context *ctx, struct mcast_header *dg, uint32_t length) {
+    struct record_header *hdr = (struct record_header *)(dg + 1);
+    int in_sequence = ctx->mcast_synced && dg->sequence == ctx->mcast_sequence + 1;
+    int omitted = (dg->flags & MCAST_ENTRY_OMITTED) ||
+                  length < sizeof(*dg) + sizeof(*hdr) || length < sizeof(*dg) + hdr->length;
+
+    ctx->mcast_synced = 1;
+    ctx->mcast_sequence = dg->sequence;
+    if (dg->offset < ctx->next_offset)
+        return;
+
+    if (!in_sequence || omitted) {
+        uint64_t until = dg->offset + (omitted ? 1 : 0);
+        while (ctx->next_offset < until && repair_entry(ctx))
+            ;
+        if (omitted)
+            return;
+    }
+
+    ctx->header = *hdr;
+    ctx->entry_offset = dg->offset;
+    take_entry(ctx, &ctx->header, (char *)(hdr + 1));
+    ctx->next_offset = dg->offset + RECORD_ENTRY_SIZE(&ctx->header);
+}
+
+static uint64_t now_ms() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/**
+ * Take our log from the multicast group, and from the broker's log through
+ * our connection whatever the group did not bring: what was there before
+ * we joined, and datagrams lost on the way
+ */
+static void *run_multicast_loop(void *c) {
+    struct client_context *ctx = (struct client_context *)c;
+    // Catch up with the log right away
+    uint64_t heard = 0;
+
+    TEST_Z(ctx->mcast = mcast_join(ctx->mcast_group, 0));
+    ctx->next_offset = ctx->read_offset;
+
+    while (!shouldDisconnect) {
+        struct mcast_header *dg;
+        uint32_t length;
+
+        serve_application(ctx);
+
+        dg = (struct mcast_header *)mcast_poll(ctx->mcast, &length);
+        if (dg != NULL) {
+            take_datagram(ctx, dg, length);
+            heard = now_ms();
+        } else if (now_ms() - heard >= MCAST_IDLE_MS) {
+            while (repair_entry(ctx))
+                ;
+            heard = now_ms();
+        }
+    }
+
+    mcast_leave(ctx->mcast);
+    return 0;
+}
+
+/**
+ * Read the log from read_offset on, once a thread of ours that waited on
+ * its own reads is done with them: it goes on as the multicast loop, or
+ * leaves the reads to the CQ thread once we have a window there
+ */
+static void *start_reading(struct client_context *ctx) {
+    // Reads of the log complete on the CQ thread again from here on
+    __atomic_store_n(&ctx->seeking, 0, __ATOMIC_RELEASE);
+    if (ctx->mcast_group[0] != '\0')
+        return run_multicast_loop(ctx);
+
+    // The broker only sent a window onto where it told us to start
+    pthread_mutex_lock(&ctx->mutex);
+    while (find_window(ctx, ctx->read_offset, VAL_LENGTH) == NULL) {
+        request_window(ctx->id, ctx->read_offset);
+        pthread_cond_wait(&ctx->read_cond_variable, &ctx->mutex);
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    create_and_post_work_request(ctx->id);
+    return 0;
+}
+
+/**
+ * Read entry i of our log's seek index
+ */
+static struct index_entry read_index_entry(struct client_context *ctx, uint64_t i) {
+    read_sync(ctx, ctx->index_addr + offsetof(struct seek_index, entries) + (i % INDEX_ENTRIES) * sizeof(struct index_entry),
+              ctx->index_rkey, sizeof(struct index_entry));
+    return *(struct index_entry *)ctx->buffer;
+}
+
+/**
+ * Binary search our log's seek index for the last entry at or before the
+ * record or time asked for, and start reading there; before the oldest
+ * entry, we start where the broker told us. The broker may overwrite or
+ * drop entries while we search, so we search again if the index's first
+ * entry moved past ones we read.
+ */
+static void *run_seek(void *c) {
+    struct client_context *ctx = (struct client_context *)c;
+    struct index_entry e, found;
+    uint64_t first, next, lo, hi, mid;
+    int have;
+
+    do {
+        read_sync(ctx, ctx->index_addr, ctx->index_rkey, 2 * sizeof(uint64_t));
+        first = ((uint64_t *)ctx->buffer)[0];
+        next = ((uint64_t *)ctx->buffer)[1];
+        lo = first;
+        hi = next;
+        have = 0;
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            e = read_index_entry(ctx, mid);
+            if ((seek_kind == SEEK_RECORD ? e.record : e.timestamp) <= seek_target) {
+                found = e;
+                have = 1;
+                lo = mid + 1;
+            } else {
+                hi = mid;
+            }
+        }
+        // Every entry we read was at or past first
+        read_sync(ctx, ctx->index_addr, ctx->index_rkey, sizeof(uint64_t));
+    } while (*(uint64_t *)ctx->buffer > first && first < next);
+
+    if (have) {
+        ctx->read_offset = found.offset;
+        if (seek_kind == SEEK_RECORD)
+            ctx->skip_records = seek_target - found.record;
+    }
+    printf("partition %u seeked to log offset %lu\n", ctx->partition, ctx->read_offset);
+    return start_reading(ctx);
+}
+
+/**
+ * Take the snapshot the broker handed us with a few large reads in flight
+ * at once, deliver its records, and tell the broker we are done with it.
+ * Its records come before any of the log, so they count as being at the
+ * offset it was taken at.
+ */
+static void *run_snapshot(void *c) {
+    struct client_context *ctx = (struct client_context *)c;
+    uint64_t length = ctx->snapshot_length;
+    uint64_t pieces = (length + SNAPSHOT_READ_SIZE - 1) / SNAPSHOT_READ_SIZE, posted = 0, done = 0, offset;
+    struct ibv_mr *mr;
+    char *data;
+
+    posix_memalign((void **)&data, sysconf(_SC_PAGESIZE), length);
+    TEST_Z(mr = ibv_reg_mr(rc_get_pd(), data, length, IBV_ACCESS_LOCAL_WRITE));
+
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->read_done = 0;
+    pthread_mutex_unlock(&ctx->mutex);
+    while (done < pieces) {
+        for (; posted < pieces && posted - done < SNAPSHOT_READS; ++posted) {
+            offset = posted * SNAPSHOT_READ_SIZE;
+            post_read_into(ctx->id, data + offset, mr->lkey, ctx->snapshot_addr + offset, ctx->snapshot_rkey,
+                           length - offset < SNAPSHOT_READ_SIZE ? length - offset : SNAPSHOT_READ_SIZE);
+        }
+        pthread_mutex_lock(&ctx->mutex);
+        while (ctx->read_done == 0)
+            pthread_cond_wait(&ctx->read_cond_variable, &ctx->mutex);
+        done += ctx->read_done;
+        ctx->read_done = 0;
+        pthread_mutex_unlock(&ctx->mutex);
+    }
+    notify_broker(ctx->id, IMM_SNAPSHOT_READ, 0);
+    ibv_dereg_mr(mr);
+
+    for (offset = 0; offset < length; offset += RECORD_ENTRY_SIZE(&ctx->header)) {
+        serve_application(ctx);
+        ctx->header = *(struct record_header *)(data + offset);
+        ctx->entry_offset = ctx->read_offset;
+        take_entry(ctx, &ctx->header, data + offset + sizeof(ctx->header));
+    }
+    free(data);
+    printf("partition %u took a snapshot of %lu bytes, reading on from log offset %lu\n", ctx->partition,
+           (unsigned long)length, (unsigned long)ctx->read_offset);
+    return start_reading(ctx);
+}
+
+/**
+ * Open readers for the partitions we were given and close the ones for
+ * partitions that went to other members of the group
+ */
+static void apply_assignment(struct message *msg) {
+    uint32_t p;
+
+    if (group_name[0] != '\0')
+        printf("group %s generation %u\n", group_name, msg->data.assign.generation);
+    for (p = 0; p < MAX_PARTITIONS; ++p) {
+        int assigned = (msg->data.assign.partitions >> p) & 1;
+        struct client_context *ctx = readers[p];
+
+        if (assigned && ctx == NULL) {
+            pthread_t thread_id;
+            ctx = calloc(1, sizeof(struct client_context));
+            ctx->partition = p;
+            ctx->size = VAL_LENGTH;
+            ctx->read_status = READ_POLLING;
+            pthread_mutex_init(&ctx->mutex, NULL);
+            pthread_cond_init(&ctx->cond_variable, NULL);
+            pthread_cond_init(&ctx->fetch_cond_variable, NULL);
+            pthread_cond_init(&ctx->read_cond_variable, NULL);
+            pthread_mutex_init(&ctx->sq_mutex, NULL);
+            pthread_mutex_init(&ctx->lookup_mutex, NULL);
+            readers[p] = ctx;
+            pthread_create(&thread_id, NULL, run_client_loop, ctx);
+        } else if (!assigned && ctx != NULL) {
+            // Its records already handed over are still delivered; the
+            // context stays allocated since they point at it
+            pthread_mutex_lock(&ctx->mutex);
+            ctx->revoked = 1;
+            pthread_cond_signal(&ctx->cond_variable);
+            resume_reading(ctx);
+            pthread_mutex_unlock(&ctx->mutex);
+            readers[p] = NULL;
+        }
+    }
 }
 
 static void on_completion(struct ibv_wc *wc) {
@@ -180,39 +1511,549 @@ static void on_completion(struct ibv_wc *wc) {
     struct rdma_cm_id *id = (struct rdma_cm_id *)(uintptr_t)(wc->wr_id);
     struct client_context *ctx = (struct client_context *)id->context;
     // Status of the work completion is from receive queue
-    // Set the peer address and key thus obtained 
+    // Set the peer address and key thus obtained
     if (wc->opcode & IBV_WC_RECV) {
-        if (ctx->msg->id == MSG_READY) {
-            ctx->peer_addr = ctx->msg->data.mr.addr;
-            ctx->peer_rkey = ctx->msg->data.mr.rkey;
-	    // Start one sided polling
-            issue_one_sided_read(id);
+        struct message *msg = &ctx->msg[ctx->msg_index];
+        ctx->msg_index = (ctx->msg_index + 1) % MSG_RING_SIZE;
+        if (msg->id == MSG_READY && lookup_partitions) {
+            // Lookups read the table, and nothing else, from here on
+            pthread_mutex_lock(&ctx->mutex);
+            ctx->lookup_addr = msg->data.mr.addr;
+            ctx->lookup_rkey = msg->data.mr.rkey;
+            ctx->lookup_ready = 1;
+            pthread_cond_broadcast(&ctx->cond_variable);
+            pthread_mutex_unlock(&ctx->mutex);
+        } else if (msg->id == MSG_READY) {
+            // The broker sends a window onto where we start on its own
+            ctx->read_offset = msg->data.mr.start;
+            pthread_mutex_lock(&ctx->mutex);
+            ctx->window_requested = 1;
+            ctx->requested_offset = ctx->read_offset;
+            if (find_window(ctx, ctx->read_offset, VAL_LENGTH))
+                ctx->window_requested = 0;
+            pthread_mutex_unlock(&ctx->mutex);
+            ctx->commit_addr = msg->data.mr.commit_addr;
+            ctx->commit_rkey = msg->data.mr.commit_rkey;
+            ctx->index_addr = msg->data.mr.index_addr;
+            ctx->index_rkey = msg->data.mr.index_rkey;
+            if (msg->data.mr.snapshot_length != 0) {
+                // Starts reading, or the multicast loop, once it is taken
+                pthread_t thread_id;
+                ctx->snapshot_addr = msg->data.mr.snapshot_addr;
+                ctx->snapshot_length = msg->data.mr.snapshot_length;
+                ctx->snapshot_rkey = msg->data.mr.snapshot_rkey;
+                __atomic_store_n(&ctx->seeking, 1, __ATOMIC_RELEASE);
+                pthread_create(&thread_id, NULL, run_snapshot, ctx);
+            } else if (seek_kind != SEEK_NONE && ctx->index_addr != 0 && !ctx->moved) {
+                // Starts reading, or the multicast loop, once it has landed
+                pthread_t thread_id;
+                __atomic_store_n(&ctx->seeking, 1, __ATOMIC_RELEASE);
+                pthread_create(&thread_id, NULL, run_seek, ctx);
+            } else if (ctx->mcast_group[0] != '\0') {
+                // Our log is on its way to the group; we only repair
+                pthread_t thread_id;
+                pthread_create(&thread_id, NULL, run_multicast_loop, ctx);
+            } else if (ctx->ring) {
+                // The broker has started writing into our ring
+                pthread_t thread_id;
+                pthread_create(&thread_id, NULL, run_push_loop, ctx);
+            } else {
+	        // Start one sided polling
+                create_and_post_work_request(id);
+            }
+        } else if (msg->id == MSG_WINDOW && msg->data.window.index < CONSUMER_WINDOWS) {
+            // Windows may arrive before MSG_READY. The broker only replaces
+            // one we are done reading through.
+            struct log_window *window = &ctx->windows[msg->data.window.index];
+            pthread_mutex_lock(&ctx->mutex);
+            if (msg->data.window.length == 0) {
+                ctx->window_gone = 1;
+                ctx->window_requested = 0;
+            } else {
+                window->offset = msg->data.window.offset;
+                window->addr = msg->data.window.addr;
+                window->rkey = msg->data.window.rkey;
+                window->length = msg->data.window.length;
+            }
+            if (ctx->window_requested && find_window(ctx, ctx->requested_offset, VAL_LENGTH))
+                ctx->window_requested = 0;
+            pthread_cond_signal(&ctx->read_cond_variable);
+            pthread_mutex_unlock(&ctx->mutex);
+            if (ctx->waiting_for_window) {
+                ctx->waiting_for_window = 0;
+                continue_reading(id, 0);
+            }
+        } else if (msg->id == MSG_ASSIGN) {
+            apply_assignment(msg);
+        } else if (msg->id == MSG_MULTICAST) {
+            memcpy(ctx->mcast_group, msg->data.multicast.group, sizeof(ctx->mcast_group));
+            ctx->mcast_group[sizeof(ctx->mcast_group) - 1] = '\0';
+        } else if (msg->id == MSG_LAGGING && msg->data.lagging.resume) {
+            // Read on up to where the follower's copy ends; the push loop,
+            // or continue_reading(), leaves from there
+            printf("replica %d fell behind on partition %u, going on at the leader\n", ctx->replica, ctx->partition);
+            ctx->leave_at = msg->data.lagging.offset;
+            ctx->leader_offset = msg->data.lagging.leader_offset;
+            __atomic_store_n(&ctx->leaving, 1, __ATOMIC_RELEASE);
+        } else if (msg->id == MSG_LAGGING) {
+            // Nothing was read yet; start over on the leader's log
+            printf("replica %d lags on partition %u, reading it from the leader\n", ctx->replica, ctx->partition);
+            ctx->lagging = 1;
+            rc_disconnect(id);
+            return;
+        } else if (msg->id == MSG_REFUSED) {
+            msg->data.refused.reason[sizeof(msg->data.refused.reason) - 1] = '\0';
+            fprintf(stderr, "broker refused partition %u: %s\n", ctx->partition, msg->data.refused.reason);
+            rc_disconnect(id);
+            return;
         } // put error here
+        post_receive(id, msg);
     } else {
+        pthread_mutex_lock(&ctx->sq_mutex);
+        rc_send_completed(&ctx->sq);
+        pthread_mutex_unlock(&ctx->sq_mutex);
+        if (ctx->closing) {
+            if (ctx->sq.outstanding == 0)
+                rc_disconnect(id);
+            return;
+        }
+        // Multicast, seeking and lookup readers wait on their reads
+        // themselves, counting them, since a snapshot is read several at
+        // a time
+        if (wc->opcode == IBV_WC_RDMA_READ && (ctx->mcast_group[0] != '\0' || lookup_partitions ||
+                                               __atomic_load_n(&ctx->seeking, __ATOMIC_ACQUIRE))) {
+            pthread_mutex_lock(&ctx->mutex);
+            ++ctx->read_done;
+            pthread_cond_signal(&ctx->read_cond_variable);
+            pthread_mutex_unlock(&ctx->mutex);
+            return;
+        }
+        // Paused readers read nothing but the read that wakes them
+        if (wc->opcode == IBV_WC_RDMA_READ && __atomic_exchange_n(&ctx->resuming, 0, __ATOMIC_ACQ_REL)) {
+            continue_reading(id, 0);
+            return;
+        }
         // Do one sided polling
-        issue_one_sided_read(id);
+        if (wc->opcode == IBV_WC_RDMA_READ)
+            issue_one_sided_read(id);
     }
 }
 
-void *run_client_loop(void *s) {
-    char *server = (char *)s;
-    struct client_context ctx;
+/**
+ * Let go of what on_pre_conn() set up for a connection that is gone, so
+ * the context can connect again
+ */
+static void release_connection(struct client_context *ctx) {
+    if (ctx->buffer) {
+        ibv_dereg_mr(ctx->buffer_mr);
+        free(ctx->buffer);
+        ctx->buffer = NULL;
+    }
+    if (ctx->ring) {
+        ibv_dereg_mr(ctx->ring_mr);
+        free(ctx->ring);
+        ctx->ring = NULL;
+    }
+    if (ctx->commit_value) {
+        ibv_dereg_mr(ctx->commit_mr);
+        free(ctx->commit_value);
+        ctx->commit_value = NULL;
+    }
+    ibv_dereg_mr(ctx->msg_mr);
+    free(ctx->msg);
+    ctx->msg = NULL;
+    ctx->msg_index = 0;
+    memset(&ctx->sq, 0, sizeof(ctx->sq));
+}
+
+static void *run_client_loop(void *c) {
+    struct client_context *ctx = (struct client_context *)c;
+    struct broker_address broker;
+    struct connect_data data;
+
+    // Members talk to the leader. Readers of a group read a partition from
+    // the same replica, so its commits stay in one broker's offsets table;
+    // others start where this process does, so readers of the same
+    // partitions spread over the replicas.
+    if (!ctx->member && group_name[0] != '\0')
+        ctx->replica = ctx->partition % num_replicas;
+    else if (!ctx->member)
+        ctx->replica = (ctx->partition + replica_seed) % num_replicas;
+
+    // A member talks to the broker of the topic's first partition, which
+    // coordinates the group; readers go to their partition's broker
+    metadata_resolve_replica(server_name, topic_name, ctx->partition, ctx->replica, &broker);
+
+    memset(&data, 0, sizeof(data));
+    strncpy(data.role, ctx->member ? MEMBER_ROLE : CONSUMER_ROLE, sizeof(data.role) - 1);
+    strncpy(data.topic, topic_name, sizeof(data.topic) - 1);
+    strncpy(data.group, group_name, sizeof(data.group) - 1);
+    data.partition = ctx->partition;
+    if (!ctx->member && (filter.kind != FILTER_NONE || push_delivery || multicast_delivery || lookup_partitions ||
+                         snapshot_bootstrap))
+        data.partition |= CONNECT_SUBSCRIBE;
+
+    rc_client_loop(broker.host, broker.port, ctx, &data);
+    // The connection is gone, so the application has no read to wake
+    pthread_mutex_lock(&ctx->mutex);
+    ctx->paused = 0;
+    pthread_mutex_unlock(&ctx->mutex);
+
+    // A follower lagging behind sent us away, before we read anything or
+    // once we read what it had
+    if (ctx->lagging) {
+        release_connection(ctx);
+        ctx->lagging = 0;
+        ctx->replica = 0;
+        if (ctx->leaving) {
+            // Its windows and our place in its log mean nothing at the leader
+            memset(ctx->windows, 0, sizeof(ctx->windows));
+            ctx->window_requested = 0;
+            ctx->waiting_for_window = 0;
+            ctx->read_status = READ_POLLING;
+            ctx->size = VAL_LENGTH;
+            ctx->ring_head = 0;
+            ctx->closing = 0;
+            ctx->leaving = 0;
+            ctx->moved = 1;
+            data.partition |= CONNECT_SUBSCRIBE;
+        }
+        metadata_resolve(server_name, topic_name, ctx->partition, &broker);
+        rc_client_loop(broker.host, broker.port, ctx, &data);
+    }
+    return 0;
+}
+
+/**
+ * Remember where and what to read, and set up the connection callbacks
+ */
+static void init_client(char *server, char *topic, char *group) {
+    server_name = server;
+    num_replicas = metadata_replicas(server);
+    replica_seed = getpid();
+    if (topic != NULL)
+        topic_name = topic;
+    if (group != NULL)
+        strncpy(group_name, group, sizeof(group_name) - 1);
 
-    ctx.size = VAL_LENGTH;
-    ctx.read_status = READ_POLLING;
     rc_init(
         on_pre_conn,
-        NULL, //on connect
+        on_connection,
         on_completion,
         NULL); // on disconnect
+}
 
-    rc_client_loop(server, DEFAULT_PORT, &ctx, CONSUMER_ROLE);
-    return 0;
+/**
+ * Filters are strings in the broker's filter message; keep them in bounds
+ */
+static void set_filter_key(char *to, const char *key) {
+    assert(strlen(key) < FILTER_KEY_MAX);
+    strncpy(to, key, FILTER_KEY_MAX - 1);
+}
+
+void filterKeyPrefix(const char *prefix) {
+    memset(&filter, 0, sizeof(filter));
+    filter.kind = FILTER_KEY_PREFIX;
+    set_filter_key(filter.u.key.from, prefix);
+}
+
+void filterKeyRange(const char *from, const char *to) {
+    memset(&filter, 0, sizeof(filter));
+    filter.kind = FILTER_KEY_RANGE;
+    set_filter_key(filter.u.key.from, from);
+    if (to != NULL)
+        set_filter_key(filter.u.key.to, to);
+}
+
+void filterKeys(char **keys, int n) {
+    int i;
+    memset(&filter, 0, sizeof(filter));
+    filter_keys = malloc(n * sizeof(*filter_keys));
+    num_filter_keys = n;
+    for (i = 0; i < n; ++i) {
+        filter_keys[i] = strdup(keys[i]);
+        filter_add_key(&filter, keys[i]);
+    }
+}
+
+void filterValueLength(uint64_t min, uint64_t max) {
+    memset(&filter, 0, sizeof(filter));
+    filter.kind = FILTER_VALUE_LENGTH;
+    filter.u.value_length.min = min;
+    filter.u.value_length.max = max;
+}
+
+void pushDelivery() {
+    assert(!multicast_delivery && seek_kind == SEEK_NONE);
+    push_delivery = 1;
+}
+
+void multicastDelivery() {
+    assert(!push_delivery);
+    multicast_delivery = 1;
+}
+
+void seekRecord(uint64_t record) {
+    assert(!push_delivery && !snapshot_bootstrap);
+    seek_kind = SEEK_RECORD;
+    seek_target = record;
+}
+
+void seekTime(uint64_t ms) {
+    assert(!push_delivery && !snapshot_bootstrap);
+    seek_kind = SEEK_TIME;
+    seek_target = ms;
+}
+
+void startFromSnapshot() {
+    assert(!push_delivery && seek_kind == SEEK_NONE);
+    snapshot_bootstrap = 1;
+}
+
+void init(char *server, char *topic) {
+    initPartition(server, topic, 0);
 }
 
-void init(char *server) {
+void initPartition(char *server, char *topic, int partition) {
+    struct message msg;
+
+    assert(partition >= 0 && partition < MAX_PARTITIONS);
+    init_client(server, topic, NULL);
+
+    // Reading on our own is being assigned just the one partition
+    memset(&msg, 0, sizeof(msg));
+    msg.data.assign.partitions = (uint64_t)1 << partition;
+    apply_assignment(&msg);
+}
+
+void initGroup(char *server, char *topic, char *group) {
     pthread_t thread_id;
-    pthread_create(&thread_id, NULL, run_client_loop, (void *)server);
+    struct client_context *ctx;
+
+    // Readers with threads of their own do not commit, and a group resumes
+    // where it left off
+    assert(!push_delivery && !multicast_delivery && seek_kind == SEEK_NONE && !snapshot_bootstrap);
+    init_client(server, topic, group);
+
+    // The broker sends our share of the partitions over this connection
+    ctx = calloc(1, sizeof(struct client_context));
+    ctx->member = 1;
+    pthread_create(&thread_id, NULL, run_client_loop, ctx);
+}
+
+void initLookup(char *server, char *topic, int num_partitions) {
+    struct message msg;
+
+    assert(num_partitions > 0 && num_partitions <= MAX_PARTITIONS);
+    assert(!push_delivery && !multicast_delivery && seek_kind == SEEK_NONE && filter.kind == FILTER_NONE &&
+           !snapshot_bootstrap);
+    init_client(server, topic, NULL);
+    lookup_partitions = num_partitions;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.data.assign.partitions = num_partitions == MAX_PARTITIONS ? ~(uint64_t)0 : ((uint64_t)1 << num_partitions) - 1;
+    apply_assignment(&msg);
+}
+
+/**
+ * The key's slot among the buckets, NULL if it is not there. torn is set if
+ * the broker was rewriting a slot we had to look at.
+ */
+static struct lookup_slot *search_buckets(struct lookup_bucket *buckets, uint32_t n, char *key, size_t key_length, int *torn) {
+    uint32_t b;
+    int i;
+    for (b = 0; b < n; ++b) {
+        for (i = 0; i < LOOKUP_BUCKET_SLOTS; ++i) {
+            struct lookup_slot *slot = &buckets[b].slots[i];
+            if (slot->key_length != key_length || memcmp(slot->key, key, key_length) != 0)
+                continue;
+            // Caught mid-rewrite, in whatever order the READ saw its bytes
+            if ((slot->version & 1) || slot->checksum != LOOKUP_CHECKSUM(slot)) {
+                *torn = 1;
+                return NULL;
+            }
+            return slot;
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Read the value of the record whose first fragment is at the log offset,
+ * value_length bytes: that fragment's part, and then those of the fragments
+ * after it with its producer_id and sequence, skipping other producers'
+ * entries in between. Returns 0 once it is in, 1 if the broker has no
+ * window onto the segment, compaction having moved the record, and -1 if
+ * the record is not all in the log yet or does not add up.
+ */
+static int read_log_value(struct client_context *ctx, uint64_t offset, char *value, uint64_t value_length) {
+    struct record_header hdr;
+    uint32_t producer_id = 0, sequence = 0;
+    int first = 1;
+    uint64_t n;
+
+    for (;;) {
+        if (read_log_sync(ctx, offset, sizeof(hdr)) < 0)
+            return 1;
+        hdr = *(struct record_header *)ctx->buffer;
+        if (hdr.length == 0)
+            return -1;
+        if (hdr.flags & RECORD_SEGMENT_END) {
+            offset = hdr.value_offset;
+            continue;
+        }
+        if (first && !(hdr.flags & RECORD_FIRST_FRAGMENT))
+            return -1;
+        if (!first && ((hdr.flags & RECORD_FIRST_FRAGMENT) || hdr.producer_id != producer_id || hdr.sequence != sequence)) {
+            offset += RECORD_ENTRY_SIZE(&hdr);
+            continue;
+        }
+        first = 0;
+        producer_id = hdr.producer_id;
+        sequence = hdr.sequence;
+
+        if (hdr.key_length > RECORD_PAYLOAD_LENGTH(&hdr))
+            return -1;
+        n = RECORD_PAYLOAD_LENGTH(&hdr) - hdr.key_length;
+        if (hdr.value_offset > value_length || n > value_length - hdr.value_offset)
+            return -1;
+        if (n > 0) {
+            if (read_log_sync(ctx, offset + sizeof(hdr) + hdr.key_length, n) < 0)
+                return 1;
+            memcpy(value + hdr.value_offset, ctx->buffer, n);
+        }
+        if (hdr.flags & RECORD_LAST_FRAGMENT)
+            return 0;
+        offset += RECORD_ENTRY_SIZE(&hdr);
+    }
+}
+
+char* lookupValueStatus(char *key, size_t *value_length, enum lookup_status *status) {
+    size_t key_length = strlen(key);
+    uint32_t hash = key_hash(key, key_length);
+    struct client_context *ctx;
+    struct lookup_slot *found, slot;
+    uint64_t home, offset, n;
+    uint32_t spill, overflow;
+    char *value = NULL;
+    int torn, got, moved = 0;
+
+    assert(lookup_partitions > 0);
+    *status = LOOKUP_NOT_SERVED;
+    if (key_length > LOOKUP_KEY_MAX)
+        return NULL;
+    // Where producers route the key
+    ctx = readers[hash % lookup_partitions];
+    pthread_mutex_lock(&ctx->mutex);
+    while (!ctx->lookup_ready)
+        pthread_cond_wait(&ctx->cond_variable, &ctx->mutex);
+    pthread_mutex_unlock(&ctx->mutex);
+
+    pthread_mutex_lock(&ctx->lookup_mutex);
+    home = ctx->lookup_addr + LOOKUP_BUCKET(hash) * sizeof(struct lookup_bucket);
+    for (;;) {
+        do {
+            torn = 0;
+            read_sync(ctx, home, ctx->lookup_rkey, 2 * sizeof(struct lookup_bucket));
+            spill = ((struct lookup_bucket *)ctx->buffer)->spill;
+            overflow = ((struct lookup_bucket *)ctx->buffer)->overflow;
+            found = search_buckets((struct lookup_bucket *)ctx->buffer, 2, key, key_length, &torn);
+            // Keys that came once both buckets were full are further on
+            if (found == NULL && !torn && spill > 0) {
+                read_sync(ctx, home + 2 * sizeof(struct lookup_bucket), ctx->lookup_rkey, spill * sizeof(struct lookup_bucket));
+                found = search_buckets((struct lookup_bucket *)ctx->buffer, spill, key, key_length, &torn);
+            }
+        } while (torn);
+
+        // A key left out of a full bucket looks like one never appended
+        if (found == NULL) {
+            *status = overflow ? LOOKUP_NOT_SERVED : LOOKUP_MISSING;
+            break;
+        }
+        slot = *found;
+        if (slot.value_length == 0) {
+            *status = LOOKUP_MISSING;
+            break;
+        }
+
+        value = malloc(slot.value_length + 1);
+        value[slot.value_length] = '\0';
+        got = -1;
+        if (slot.flags & LOOKUP_INLINE) {
+            memcpy(value, slot.value, slot.value_length);
+            got = 0;
+        } else if (slot.flags & LOOKUP_LOG) {
+            got = read_log_value(ctx, slot.addr, value, slot.value_length);
+        } else if (slot.flags & LOOKUP_REF) {
+            // Out-of-line values never change once written
+            for (offset = 0; offset < slot.value_length; offset += n) {
+                n = slot.value_length - offset < LANDING_SLOT_SIZE ? slot.value_length - offset : LANDING_SLOT_SIZE;
+                read_sync(ctx, slot.addr + offset, slot.rkey, n);
+                memcpy(value + offset, ctx->buffer, n);
+            }
+            got = 0;
+        }
+        if (got == 0) {
+            *status = LOOKUP_FOUND;
+            *value_length = slot.value_length;
+            break;
+        }
+        free(value);
+        value = NULL;
+        // The broker points the slot at the moved record right after the
+        // move, so once is enough
+        if (got < 0 || moved++)
+            break;
+    }
+    pthread_mutex_unlock(&ctx->lookup_mutex);
+    if (value != NULL && (slot.flags & LOOKUP_COMPRESSED))
+        inflate(&value, value_length);
+    return value;
+}
+
+char* lookupValue(char *key, size_t *value_length) {
+    enum lookup_status status;
+
+    return lookupValueStatus(key, value_length, &status);
+}
+
+char* fetchValue(struct ProducerMessage *record) {
+    struct client_context *ctx = ((struct ConsumerRecord *)record)->ctx;
+
+    if (record->value != NULL)
+        return record->value;
+    record->value = malloc(record->value_length + 1);
+    record->value[record->value_length] = '\0';
+    if (record->value_length == 0)
+        return record->value;
+
+    // The record's reader does the read, between reads of the log, for one
+    // dispatch worker at a time
+    pthread_mutex_lock(&ctx->mutex);
+    while (ctx->fetch_busy && !ctx->revoked)
+        pthread_cond_wait(&ctx->fetch_cond_variable, &ctx->mutex);
+    if (ctx->revoked) {
+        pthread_mutex_unlock(&ctx->mutex);
+        free(record->value);
+        record->value = NULL;
+        return NULL;
+    }
+    ctx->fetch_busy = 1;
+    ctx->fetch_done = 0;
+    ctx->fetch_request = record;
+    pthread_cond_signal(&ctx->cond_variable);
+    resume_reading(ctx);
+    // Wait for the value to arrive
+    while (!ctx->fetch_done)
+        pthread_cond_wait(&ctx->fetch_cond_variable, &ctx->mutex);
+    ctx->fetch_busy = 0;
+    pthread_cond_broadcast(&ctx->fetch_cond_variable);
+    pthread_mutex_unlock(&ctx->mutex);
+    if (record->value != NULL && ((struct ConsumerRecord *)record)->compressed) {
+        inflate(&record->value, &record->value_length);
+        ((struct ConsumerRecord *)record)->compressed = 0;
+    }
+    return record->value;
 }
 
 void terminate() {
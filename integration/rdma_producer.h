@@ -1,10 +1,49 @@
-// For now, assume that a client knows the IP of server.
-// TODO: Replace this with a discovery service that identifies
-// server based on the supplied topic name
-void init(char *server);
+#include <stddef.h>
+#include <stdint.h>
 
-// Add a record with a key and value
+// server is either a broker, as host[:port], serving every partition, or
+// "meta://host[:port]", the metadata service of a cluster, which is asked
+// where each partition lives.
+// A NULL topic means DEFAULT_TOPIC; names are cut to TOPIC_NAME_MAX - 1
+void init(char *server, char *topic);
+
+// Like init(), but writes to partitions 0 .. num_partitions - 1 of the topic
+// over one connection each, so they are appended to in parallel
+void initPartitioned(char *server, char *topic, int num_partitions);
+
+// Add a record with a key and value. Records are routed by a hash of the
+// key, so records with the same key keep their order.
 void produceRecord(char *key, char *value);
 
+// Add a record to the given partition, or route it by key if partition is
+// negative
+void produceRecordToPartition(char *key, char *value, int partition);
+
+// Called once the broker has taken a zero-copy record; value may be reused
+typedef void (*zero_copy_release_fn)(char *value, void *arg);
+
+// Add a record whose value is sent directly from caller memory, routed by
+// key like produceRecord(). The value is registered lazily and the
+// registration is cached, so it pays off for long-lived buffers. value must
+// stay untouched until release is called.
+void produceRecordZeroCopy(char *key, char *value, size_t len,
+        zero_copy_release_fn release, void *arg);
+
+// Must be called before freeing or remapping memory that was passed to
+// produceRecordZeroCopy()
+void invalidateZeroCopyBuffer(void *addr, size_t len);
+
+// Compresses the value of every record produced from now on with an
+// LZ4-class codec (lz.h) before it is written to the broker, which stores
+// it as it is; consumers decompress it. Costs CPU on the producing thread
+// to save network and log bytes, which pays off for text such as JSON.
+// Values shorter than 64 bytes, values that do not shrink, and zero-copy
+// values are sent as they are. Call before producing.
+void compressValues();
+
+// Bytes of values produced so far, and bytes sent for them after
+// compression
+void compressionStats(uint64_t *produced, uint64_t *sent);
+
 // Should be called only after init() at the end
 void terminate();
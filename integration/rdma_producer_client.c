@@ -4,94 +4,245 @@
 #include <pthread.h>
 
 #include "common.h"
+#include "lz.h"
 #include "messages.h"
+#include "metadata.h"
+#include "mr_cache.h"
 #include "rdma_producer.h"
 
 struct client_context
 {
-    // For sending producer records
+    // Staging area for chunks, one slot per landing slot on the broker
     char *buffer;
     struct ibv_mr *buffer_mr;
 
-    // For receiving acks
+    // For receiving acks; a ring consumed in the order it was posted
     struct message *msg;
     struct ibv_mr *msg_mr;
+    int msg_index;
 
     // Hold remote addr and keys
     uint64_t peer_addr;
     uint32_t peer_rkey;
 
+    struct rc_send_queue sq;
+
     int index;
+
+    // Record being split into chunks and how much of its value went out
+    struct ProducerRecord *current;
+    uint64_t current_offset;
+    int current_started;
+    uint32_t sequence;
+
+    // Landing slots: the next one to write, how many await an ack, and the
+    // record each one completes (NULL unless it carries a last fragment)
+    int next_slot;
+    int inflight;
+    struct ProducerRecord *slot_record[LANDING_SLOTS];
+
+    int disconnecting;
+
+    // Partition this connection writes to, and its backlog of records in
+    // the order they were produced
+    char *server;
+    uint32_t partition;
+    struct ProducerRecord **records;
+    int head;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond_variable;
+};
+
+// Receives kept posted: the initial MSG_READY, one ack per slot and MSG_DONE
+#define ACK_RING_SIZE (LANDING_SLOTS + 2)
+
+/**
+ * A record waiting to be sent. Zero-copy records keep their value in caller
+ * memory, registered through the MR cache, until the broker acknowledges them.
+ */
+struct ProducerRecord
+{
+    struct ProducerMessage msg;
+    size_t value_length;
+
+    int zero_copy;
+    // The value was swapped for its compressed form
+    int compressed;
+    struct mr_cache_entry *value_mr;
+    zero_copy_release_fn release;
+    void *release_arg;
 };
 
 #define PRODUCER_RECORD_BACKLOG 100000
+// Values shorter than this are sent as they are, since the frame would eat
+// most of what compression saves
+#define COMPRESS_MIN_VALUE 64
 
-struct ProducerMessage *producer_records[PRODUCER_RECORD_BACKLOG] = {NULL};
-int head = -1;
+// One connection, thread and backlog per partition
+struct client_context *partitions = NULL;
+int num_partitions = 0;
 int shouldDisconnect = 0;
-pthread_mutex_t producer_mutex = PTHREAD_MUTEX_INITIALIZER;
-pthread_cond_t producer_cond_variable = PTHREAD_COND_INITIALIZER;
+// Connections the broker has seen off after terminate()
+int partitions_done = 0;
 pthread_mutex_t terminate_mutex = PTHREAD_MUTEX_INITIALIZER;
 pthread_cond_t terminate_cond_variable = PTHREAD_COND_INITIALIZER;
+// Compress values before writing them, and the bytes of values produced
+// and of what was sent for them, bumped by every producing thread
+static int compress_values = 0;
+static uint64_t value_bytes = 0;
+static uint64_t sent_bytes = 0;
 
 /**
- * Create a ProducerMessage node with the given key and value
+ * Swap a record's value for its compressed form, framed by a struct
+ * compressed_value, if that is smaller
+ */
+static void compress_value(struct ProducerRecord *node)
+{
+    struct compressed_value *frame;
+    size_t n;
+
+    if (node->value_length < COMPRESS_MIN_VALUE)
+        return;
+    frame = malloc(node->value_length);
+    n = lz_compress(node->msg.value, node->value_length, frame + 1, node->value_length - sizeof(*frame) - 1);
+    if (n == 0) {
+        free(frame);
+        return;
+    }
+    frame->codec = CODEC_LZ;
+    frame->reserved = 0;
+    frame->length = node->value_length;
+    free(node->msg.value);
+    node->msg.value = (char *)frame;
+    node->value_length = sizeof(*frame) + n;
+    node->compressed = 1;
+}
+
+/**
+ * Create a ProducerRecord node with the given key and value
  * Note: Creates deep copies of both key and value
  */
-struct ProducerMessage* createNode(char *key, char *value)
+struct ProducerRecord* createNode(char *key, char *value)
 {
-    char *k = malloc(sizeof(key) + 1);
-    char *v = malloc(sizeof(value) + 1);
+    // The key has to fit in the first fragment, with room for the topic
+    // name the broker adds in subscription logs
+    assert(strlen(key) <= UINT16_MAX - TOPIC_NAME_MAX);
+    char *k = malloc(strlen(key) + 1);
+    char *v = malloc(strlen(value) + 1);
     strcpy(k, key);
     strcpy(v, value);
-    struct ProducerMessage *node = malloc(sizeof(struct ProducerMessage));
-    node->key = k;
-    node->value = v;
-    node->next = NULL;
+    struct ProducerRecord *node = calloc(1, sizeof(struct ProducerRecord));
+    node->msg.key = k;
+    node->msg.value = v;
+    node->value_length = strlen(v);
+    __atomic_fetch_add(&value_bytes, node->value_length, __ATOMIC_RELAXED);
+    if (compress_values)
+        compress_value(node);
+    __atomic_fetch_add(&sent_bytes, node->value_length, __ATOMIC_RELAXED);
+    return node;
+}
+
+/**
+ * Create a ProducerRecord node that refers to the caller's value in place
+ * Note: Only the key is copied
+ */
+struct ProducerRecord* createZeroCopyNode(char *key, char *value, size_t len,
+        zero_copy_release_fn release, void *arg)
+{
+    assert(strlen(key) <= UINT16_MAX - TOPIC_NAME_MAX);
+    char *k = malloc(strlen(key) + 1);
+    strcpy(k, key);
+    struct ProducerRecord *node = calloc(1, sizeof(struct ProducerRecord));
+    node->msg.key = k;
+    node->msg.value = value;
+    node->value_length = len;
+    node->zero_copy = 1;
+    node->release = release;
+    node->release_arg = arg;
+    __atomic_fetch_add(&value_bytes, len, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&sent_bytes, len, __ATOMIC_RELAXED);
     return node;
 }
 
 /**
- * Add the given node to the list of producer records
+ * Free a record once the broker no longer needs its memory, handing
+ * zero-copy values back to the caller
  */
-void insertAtEnd(struct ProducerMessage *node)
+void releaseNode(struct ProducerRecord *node)
 {
-    pthread_mutex_lock(&producer_mutex);
+    if (node->value_mr)
+        mr_cache_release(node->value_mr);
+    if (node->zero_copy) {
+        if (node->release)
+            node->release(node->msg.value, node->release_arg);
+    } else {
+        free(node->msg.value);
+    }
+    free(node->msg.key);
+    free(node);
+}
+
+/**
+ * Add the given node to the backlog of the given partition
+ */
+void insertAtEnd(struct client_context *ctx, struct ProducerRecord *node)
+{
+    pthread_mutex_lock(&ctx->mutex);
     //printf("Adding producer record\n");
-    head = (head + 1) % PRODUCER_RECORD_BACKLOG;
+    ctx->head = (ctx->head + 1) % PRODUCER_RECORD_BACKLOG;
     // assert that we are not over-flowing
-    assert(producer_records[head] == NULL);
-    producer_records[head] = node;
-    pthread_mutex_unlock(&producer_mutex);
+    assert(ctx->records[ctx->head] == NULL);
+    ctx->records[ctx->head] = node;
+    pthread_mutex_unlock(&ctx->mutex);
+    pthread_cond_signal(&ctx->cond_variable);
+}
+
+/**
+ * Pick the partition for a key: FNV-1a, so a key always lands in the same
+ * partition and its records stay in order
+ */
+static struct client_context* partition_for(char *key, int partition)
+{
+    uint32_t hash = 2166136261u;
+
+    if (partition < 0) {
+        for (; *key; ++key)
+            hash = (hash ^ (unsigned char)*key) * 16777619u;
+        partition = hash % num_partitions;
+    }
+    assert(partition < num_partitions);
+    return &partitions[partition];
 }
 
-static void rdma_send(struct rdma_cm_id *id, uint32_t len)
+/**
+ * Write a chunk from the given staging slot into the matching landing slot,
+ * or tell the broker we are done when slot is negative
+ */
+static void rdma_send(struct rdma_cm_id *id, int slot, struct ibv_sge *sg_list, int num_sge)
 {
     struct client_context *ctx = (struct client_context *) id->context;
-    struct ibv_send_wr wr, *bad_wr = NULL;
-    struct ibv_sge sge;
-    
+    struct ibv_send_wr wr;
+
     memset(&wr, 0, sizeof(wr));
 
+    // The broker's MSG_ACK tells us the write landed, so the write itself
+    // is signaled only as often as send-queue accounting needs
     wr.wr_id = (uintptr_t)id;
     wr.opcode = IBV_WR_RDMA_WRITE_WITH_IMM;
-    wr.send_flags = IBV_SEND_SIGNALED;
-    wr.imm_data = htonl(len);
-    wr.wr.rdma.remote_addr = ctx->peer_addr;
+    // Slots are numbered from one; zero means disconnect
+    wr.imm_data = htonl(slot + 1);
+    wr.wr.rdma.remote_addr = ctx->peer_addr + (slot < 0 ? 0 : slot * LANDING_SLOT_SIZE);
     wr.wr.rdma.rkey = ctx->peer_rkey;
 
-    if (len > 0) {
-        wr.sg_list = &sge;
-        wr.num_sge = 1;
-        sge.addr = (uintptr_t)ctx->buffer;
-        sge.length = len;
-        sge.lkey = ctx->buffer_mr->lkey;
+    if (slot >= 0) {
+        wr.sg_list = sg_list;
+        wr.num_sge = num_sge;
     }
 
-    TEST_NZ(ibv_post_send(id->qp, &wr, &bad_wr));
+    rc_post_send(id, &ctx->sq, &wr);
 }
 
-static void post_receive(struct rdma_cm_id *id)
+static void post_receive(struct rdma_cm_id *id, struct message *msg)
 {
     struct client_context *ctx = (struct client_context *) id->context;
     struct ibv_recv_wr wr, *bad_wr = NULL;
@@ -102,66 +253,153 @@ static void post_receive(struct rdma_cm_id *id)
     wr.sg_list = &sge;
     wr.num_sge = 1;
 
-    sge.addr = (uintptr_t)ctx->msg;
-    sge.length = sizeof(*ctx->msg);
+    sge.addr = (uintptr_t)msg;
+    sge.length = sizeof(*msg);
     sge.lkey = ctx->msg_mr->lkey;
 
     TEST_NZ(ibv_post_recv(id->qp, &wr, &bad_wr));
 }
 
-static void send_producer_record(struct rdma_cm_id *id)
+/**
+ * Take the next record off the backlog. Blocks for one only if wait is set,
+ * which we do only when nothing is in flight so acks are never held up.
+ */
+static struct ProducerRecord* next_record(struct client_context *ctx, int wait)
+{
+    pthread_mutex_lock(&ctx->mutex);
+    struct ProducerRecord *h = ctx->records[ctx->index];
+    while (h == NULL && wait && shouldDisconnect == 0) {
+        // Wait till we have a node added to the list
+        pthread_cond_wait(&ctx->cond_variable, &ctx->mutex);
+        h = ctx->records[ctx->index];
+    }
+    if (h != NULL) {
+        ctx->records[ctx->index] = NULL;
+        ctx->index = (ctx->index + 1) % PRODUCER_RECORD_BACKLOG;
+    }
+    pthread_mutex_unlock(&ctx->mutex);
+    return h;
+}
+
+/**
+ * Write the next fragment of the current record into a free landing slot.
+ * The first fragment carries the key; values that do not fit in one slot
+ * continue in further fragments, which the broker may interleave with
+ * other producers' records.
+ */
+static void send_chunk(struct rdma_cm_id *id)
 {
     struct client_context *ctx = (struct client_context *)id->context;
-    // Now look at head of ProducerMessage linked list
-    pthread_mutex_lock(&producer_mutex);
-    struct ProducerMessage *h = producer_records[ctx->index];
-    // We need to send message associated with the head.
-    if(h == NULL) {
-        printf("Record is null; checking if should disconnect\n");
-        if(shouldDisconnect == 1) {
-            printf("Disconnecting..\n");
-            rdma_send(id, 0);
-            return;
+    struct ProducerRecord *h = ctx->current;
+    int slot = ctx->next_slot;
+    struct record_header *hdr = (struct record_header *)(ctx->buffer + slot * LANDING_SLOT_SIZE);
+    char *payload = (char *)(hdr + 1);
+    size_t key_length = ctx->current_started ? 0 : strlen(h->msg.key);
+    uint64_t n = h->value_length - ctx->current_offset;
+    struct ibv_sge sge[2];
+    int num_sge = 1;
+
+    if (n > LANDING_SLOT_SIZE - sizeof(*hdr) - key_length)
+        n = LANDING_SLOT_SIZE - sizeof(*hdr) - key_length;
+
+    hdr->length = sizeof(*hdr) + key_length + n;
+    hdr->key_length = key_length;
+    hdr->flags = (ctx->current_started ? 0 : RECORD_FIRST_FRAGMENT) |
+                 (ctx->current_offset + n == h->value_length ? RECORD_LAST_FRAGMENT : 0) |
+                 (h->compressed ? RECORD_COMPRESSED : 0);
+    hdr->producer_id = 0; // assigned by the broker
+    hdr->sequence = ctx->sequence;
+    hdr->value_length = h->value_length;
+    hdr->value_offset = ctx->current_offset;
+    memcpy(payload, h->msg.key, key_length);
+
+    // Inlined records are copied at post time, so registering is pointless
+    if (h->zero_copy && h->value_mr == NULL &&
+            sizeof(*hdr) + key_length + h->value_length > rc_get_max_inline())
+        h->value_mr = mr_cache_acquire(h->msg.value, h->value_length);
+
+    sge[0].addr = (uintptr_t)hdr;
+    sge[0].lkey = ctx->buffer_mr->lkey;
+    if (h->value_mr) {
+        // Gather the value straight from caller memory
+        sge[0].length = sizeof(*hdr) + key_length;
+        sge[1].addr = (uintptr_t)(h->msg.value + ctx->current_offset);
+        sge[1].length = n;
+        sge[1].lkey = h->value_mr->mr->lkey;
+        num_sge = n > 0 ? 2 : 1;
+    } else {
+        memcpy(payload + key_length, h->msg.value + ctx->current_offset, n);
+        sge[0].length = hdr->length;
+    }
+    rdma_send(id, slot, sge, num_sge);
+
+    ctx->current_offset += n;
+    ctx->current_started = 1;
+    ctx->next_slot = (slot + 1) % LANDING_SLOTS;
+    ++ctx->inflight;
+
+    if (hdr->flags & RECORD_LAST_FRAGMENT) {
+        ctx->slot_record[slot] = h;
+        ctx->current = NULL;
+        ++ctx->sequence;
+    } else {
+        ctx->slot_record[slot] = NULL;
+    }
+}
+
+/**
+ * Keep every free landing slot busy with chunks of pending records
+ */
+static void send_producer_records(struct rdma_cm_id *id)
+{
+    struct client_context *ctx = (struct client_context *)id->context;
+
+    while (ctx->inflight < LANDING_SLOTS && !ctx->disconnecting) {
+        if (ctx->current == NULL) {
+            ctx->current = next_record(ctx, ctx->inflight == 0);
+            ctx->current_offset = 0;
+            ctx->current_started = 0;
         }
-        // Wait till we have a node added to the linked list
-        printf("Waiting for record to be produced\n");
-        pthread_cond_wait(&producer_cond_variable, &producer_mutex);
-        h = producer_records[ctx->index];
-        if(h == NULL && shouldDisconnect == 1) {
-            printf("Disconnecting..\n");
-            rdma_send(id, 0);
+        if (ctx->current == NULL) {
+            if (shouldDisconnect == 1 && ctx->inflight == 0) {
+                printf("Disconnecting..\n");
+                ctx->disconnecting = 1;
+                rdma_send(id, -1, NULL, 0);
+            }
             return;
         }
-        //printf("Got a producer record now\n");
+        send_chunk(id);
     }
-    // Serialize the msg as key/value
-    // TODO: Use a better serialization logic
-    char *str = (char*) malloc(strlen(h->key) + strlen(h->value) + 2);
-    strcpy(str, h->key);
-    strcat(str, "/");
-    strcat(str, h->value);
-    str[strlen(str)] = '\0';
-    strcpy(ctx->buffer, str);
-    producer_records[ctx->index] = NULL;
-    pthread_mutex_unlock(&producer_mutex);
-    //printf("sending %s via RDMA\n", ctx->buffer);
-    rdma_send(id, strlen(str)+1);
-    
-    // Get ready to send next message
-    ctx->index = ctx->index + 1;
+}
+
+/**
+ * The broker appended the oldest chunk in flight; free its slot and, if it
+ * finished a record, the record itself
+ */
+static void on_ack(struct client_context *ctx)
+{
+    int slot = (ctx->next_slot - ctx->inflight + LANDING_SLOTS) % LANDING_SLOTS;
+
+    if (ctx->slot_record[slot]) {
+        releaseNode(ctx->slot_record[slot]);
+        ctx->slot_record[slot] = NULL;
+    }
+    --ctx->inflight;
 }
 
 static void on_pre_conn(struct rdma_cm_id *id)
 {
     struct client_context *ctx = (struct client_context *) id->context;
+    int i;
 
-    posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
-    TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, 0));
+    posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), LANDING_SLOTS * LANDING_SLOT_SIZE);
+    TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, LANDING_SLOTS * LANDING_SLOT_SIZE, 0));
 
-    posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), sizeof(*ctx->msg));
-    TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, sizeof(*ctx->msg), IBV_ACCESS_LOCAL_WRITE));
+    posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), ACK_RING_SIZE * sizeof(*ctx->msg));
+    TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, ACK_RING_SIZE * sizeof(*ctx->msg), IBV_ACCESS_LOCAL_WRITE));
 
-    post_receive(id);
+    for (i = 0; i < ACK_RING_SIZE; ++i)
+        post_receive(id, &ctx->msg[i]);
 }
 
 static void on_completion(struct ibv_wc *wc)
@@ -170,57 +408,135 @@ static void on_completion(struct ibv_wc *wc)
     struct client_context *ctx = (struct client_context *)id->context;
     
     if (wc->opcode & IBV_WC_RECV) {
-        if (ctx->msg->id == MSG_READY) {
-            ctx->peer_addr = ctx->msg->data.mr.addr;
-            ctx->peer_rkey = ctx->msg->data.mr.rkey;
-            //printf("received ready, sending next producer record\n");
-            send_producer_record(id);
-            post_receive(id);
-        } else if (ctx->msg->id == MSG_DONE) {
+        struct message *msg = &ctx->msg[ctx->msg_index];
+        ctx->msg_index = (ctx->msg_index + 1) % ACK_RING_SIZE;
+
+        if (msg->id == MSG_READY) {
+            ctx->peer_addr = msg->data.mr.addr;
+            ctx->peer_rkey = msg->data.mr.rkey;
+            send_producer_records(id);
+            post_receive(id, msg);
+        } else if (msg->id == MSG_ACK) {
+            on_ack(ctx);
+            send_producer_records(id);
+            post_receive(id, msg);
+        } else if (msg->id == MSG_DONE) {
             printf("received DONE, disconnecting\n");
             rc_disconnect(id);
+            pthread_mutex_lock(&terminate_mutex);
+            ++partitions_done;
             pthread_cond_signal(&terminate_cond_variable);
+            pthread_mutex_unlock(&terminate_mutex);
         }
+    } else {
+        rc_send_completed(&ctx->sq);
     }
 }
 
-void *run_client_loop(void *s)
+// Topic to write to, passed to the broker on connect
+static char *topic_name = DEFAULT_TOPIC;
+
+void *run_client_loop(void *c)
+{
+    struct client_context *ctx = (struct client_context *)c;
+
+    struct broker_address broker;
+    struct connect_data data;
+
+    // Partitions may live on different brokers
+    metadata_resolve(ctx->server, topic_name, ctx->partition, &broker);
+
+    memset(&data, 0, sizeof(data));
+    strncpy(data.role, PRODUCER_ROLE, sizeof(data.role) - 1);
+    strncpy(data.topic, topic_name, sizeof(data.topic) - 1);
+    data.partition = ctx->partition;
+
+    rc_client_loop(broker.host, broker.port, ctx, &data);
+    return 0;
+}
+
+void init(char *server, char *topic)
 {
-    char *server = (char *)s;
-    struct client_context ctx;
+    initPartitioned(server, topic, 1);
+}
+
+void initPartitioned(char *server, char *topic, int partitions_count)
+{
+    pthread_t thread_id;
+    int i;
+
+    assert(partitions_count > 0 && partitions_count <= MAX_PARTITIONS);
+    if (topic != NULL)
+        topic_name = topic;
 
-    ctx.index = 0;
     rc_init(
         on_pre_conn,
         NULL, //on connect
         on_completion,
         NULL); // on disconnect
 
-    rc_client_loop(server, DEFAULT_PORT, &ctx, PRODUCER_ROLE);
-    return 0;
+    num_partitions = partitions_count;
+    partitions = calloc(num_partitions, sizeof(struct client_context));
+    for (i = 0; i < num_partitions; ++i) {
+        struct client_context *ctx = &partitions[i];
+        ctx->server = server;
+        ctx->partition = i;
+        ctx->records = calloc(PRODUCER_RECORD_BACKLOG, sizeof(struct ProducerRecord *));
+        ctx->head = -1;
+        pthread_mutex_init(&ctx->mutex, NULL);
+        pthread_cond_init(&ctx->cond_variable, NULL);
+        pthread_create(&thread_id, NULL, run_client_loop, ctx);
+    }
 }
 
-void init(char *server)
+// TODO: Should give the caller a callback function option
+void produceRecord(char *key, char *value)
 {
-    pthread_t thread_id;
-    pthread_create(&thread_id, NULL, run_client_loop, (void *)server);
+    produceRecordToPartition(key, value, -1);
 }
 
-// TODO: Should give the caller a callback function option
-void produceRecord(char *key, char *value)
+void produceRecordToPartition(char *key, char *value, int partition)
 {
-    insertAtEnd(createNode(key, value));
-    pthread_cond_signal(&producer_cond_variable);
+    insertAtEnd(partition_for(key, partition), createNode(key, value));
+}
+
+void produceRecordZeroCopy(char *key, char *value, size_t len,
+        zero_copy_release_fn release, void *arg)
+{
+    insertAtEnd(partition_for(key, -1), createZeroCopyNode(key, value, len, release, arg));
+}
+
+void invalidateZeroCopyBuffer(void *addr, size_t len)
+{
+    mr_cache_invalidate(addr, len);
+}
+
+void compressValues()
+{
+    compress_values = 1;
+}
+
+void compressionStats(uint64_t *produced, uint64_t *sent)
+{
+    *produced = __atomic_load_n(&value_bytes, __ATOMIC_RELAXED);
+    *sent = __atomic_load_n(&sent_bytes, __ATOMIC_RELAXED);
 }
 
 void terminate()
 {
-    shouldDisconnect = 1;
-    // Signal RDMA thread to remove it from waiting
-    pthread_cond_signal(&producer_cond_variable);
+    int i;
+
+    for (i = 0; i < num_partitions; ++i) {
+        pthread_mutex_lock(&partitions[i].mutex);
+        shouldDisconnect = 1;
+        pthread_mutex_unlock(&partitions[i].mutex);
+        // Signal RDMA thread to remove it from waiting
+        pthread_cond_signal(&partitions[i].cond_variable);
+    }
     // Wait for all producer records to be sent
     pthread_mutex_lock(&terminate_mutex);
-    pthread_cond_wait(&terminate_cond_variable, &terminate_mutex);
+    while (partitions_done < num_partitions)
+        pthread_cond_wait(&terminate_cond_variable, &terminate_mutex);
     printf("Finished termination\n");
     pthread_mutex_unlock(&terminate_mutex); 
 }
@@ -0,0 +1,443 @@
+#include <pthread.h>
+
+#include "messages.h"
+#include "metadata.h"
+#include "replica.h"
+#include "topic.h"
+
+// The control link and one link per partition replicated
+#define REPLICA_MAX_LINKS 256
+// Receives a link keeps posted: the leader's pushes, and on the control
+// link its partitions, may arrive back to back
+#define REPLICA_RECEIVES RC_RECV_QUEUE_DEPTH
+// Waits between attempts to get a lost link back, doubling from the first
+#define REPLICA_RETRY_MIN_MS 100
+#define REPLICA_RETRY_MAX_MS 5000
+
+/**
+ * A connection to the leader: the control link, with no topic, or a
+ * partition's, with the ring the leader pushes the partition's log into
+ */
+struct replica_link
+{
+  int used;
+  struct rdma_cm_id *id;
+  struct connect_data data;
+  struct topic *topic;
+
+  // Ring of outgoing messages, one per send queue slot. Sends are made on
+  // the link's own thread and on its CQ thread, under mutex.
+  struct message *msg;
+  struct ibv_mr *msg_mr;
+  int msg_index;
+  struct rc_send_queue sq;
+  pthread_mutex_t mutex;
+
+  // Ring of receives, completed in the order posted
+  struct message *recv_msg;
+  struct ibv_mr *recv_msg_mr;
+  int recv_index;
+
+  // Where the next entry goes in the push ring, ring bytes taken in all,
+  // ring bytes appended but not yet handed back, and pushes of the leader
+  // not yet answered
+  char *ring;
+  struct ibv_mr *ring_mr;
+  uint64_t ring_head;
+  uint64_t taken;
+  uint64_t freed;
+  int unanswered;
+
+  // Offset of the leader's log our copy has got to, kept across losing
+  // the link, if resumed is set
+  uint64_t resume_offset;
+  int resumed;
+
+  // Set once the leader sent something we cannot take; the link is
+  // disconnected and connected again, and what came after is ignored
+  int dropped;
+};
+
+static struct broker_address leader;
+// Readers of a partition lagging further than this go to the leader
+static uint64_t max_lag = 0;
+static replica_lagging_cb_fn s_on_lagging_cb = NULL;
+// A static table, so telling our links from the broker's connections is a
+// matter of where their contexts are
+static struct replica_link links[REPLICA_MAX_LINKS];
+static pthread_mutex_t links_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Keep the link connected, waiting longer after each attempt in a row that
+ * fails to reach the leader. A partition's link picks up where its last
+ * push left it; the control link is told of every partition again.
+ */
+static void * run_link(void *arg)
+{
+  struct replica_link *link = (struct replica_link *)arg;
+  useconds_t wait_ms = REPLICA_RETRY_MIN_MS;
+
+  while (1) {
+    if (rc_client_try(leader.host, leader.port, link, &link->data) == 0)
+      wait_ms = REPLICA_RETRY_MIN_MS;
+    else if ((wait_ms *= 2) > REPLICA_RETRY_MAX_MS)
+      wait_ms = REPLICA_RETRY_MAX_MS;
+    usleep(wait_ms * 1000);
+  }
+  return NULL;
+}
+
+/**
+ * Connect a link to the leader on a thread of its own, which runs its
+ * connection events. Does nothing if the partition has a link already.
+ */
+static void start_link(const char *role, const char *name, uint32_t partition)
+{
+  struct replica_link *link = NULL;
+  pthread_attr_t attr;
+  pthread_t thread;
+  int i;
+
+  // Our copy needs a log of its own; the link only looks it up later
+  if (strcmp(role, CONSUMER_ROLE) == 0 && topic_get(name, partition) == NULL) {
+    fprintf(stderr, "no room to replicate %s/%u\n", name, partition);
+    return;
+  }
+
+  pthread_mutex_lock(&links_mutex);
+  for (i = 0; i < REPLICA_MAX_LINKS; ++i) {
+    if (!links[i].used) {
+      if (link == NULL)
+        link = &links[i];
+    } else if (strcmp(links[i].data.role, role) == 0 && strcmp(links[i].data.topic, name) == 0 &&
+               (links[i].data.partition & ~CONNECT_SUBSCRIBE) == partition) {
+      pthread_mutex_unlock(&links_mutex);
+      return;
+    }
+  }
+  if (link == NULL)
+    rc_die("start_link: too many partitions to replicate");
+
+  memset(link, 0, sizeof(*link));
+  link->used = 1;
+  strncpy(link->data.role, role, sizeof(link->data.role) - 1);
+  strncpy(link->data.topic, name, sizeof(link->data.topic) - 1);
+  link->data.partition = partition;
+  // A partition is read through a push ring, which the broker waits for
+  if (strcmp(role, CONSUMER_ROLE) == 0)
+    link->data.partition |= CONNECT_SUBSCRIBE;
+  pthread_mutex_init(&link->mutex, NULL);
+  pthread_mutex_unlock(&links_mutex);
+
+  TEST_NZ(pthread_attr_init(&attr));
+  TEST_NZ(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+  TEST_NZ(pthread_create(&thread, &attr, run_link, link));
+  pthread_attr_destroy(&attr);
+}
+
+void replica_follow(const char *address, uint64_t lag)
+{
+  parse_address(address, DEFAULT_PORT, &leader);
+  max_lag = lag;
+  start_link(REPLICA_ROLE, "", 0);
+}
+
+void replica_set_lagging_cb(replica_lagging_cb_fn lagging_cb)
+{
+  s_on_lagging_cb = lagging_cb;
+}
+
+int replica_in_sync(struct topic *topic)
+{
+  return __atomic_load_n(&topic->replicating, __ATOMIC_ACQUIRE) &&
+         __atomic_load_n(&topic->lag, __ATOMIC_ACQUIRE) <= max_lag;
+}
+
+int replica_owns(void *context)
+{
+  return (char *)context >= (char *)links && (char *)context < (char *)(links + REPLICA_MAX_LINKS);
+}
+
+/**
+ * Disconnect a link the leader broke the protocol on; run_link() connects
+ * it again, and a partition's picks up from the last push it took
+ */
+static void drop_link(struct replica_link *link, const char *reason)
+{
+  fprintf(stderr, "dropping link to %s:%s: %s\n", leader.host, leader.port, reason);
+  link->dropped = 1;
+  rc_disconnect(link->id);
+}
+
+static void post_receive(struct replica_link *link, struct message *msg)
+{
+  struct ibv_recv_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)link->id;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+
+  sge.addr = (uintptr_t)msg;
+  sge.length = sizeof(*msg);
+  sge.lkey = link->recv_msg_mr->lkey;
+
+  TEST_NZ(ibv_post_recv(link->id->qp, &wr, &bad_wr));
+}
+
+/**
+ * Answer the leader's pushes, handing back the ring appended from since
+ * the last answer. One answer per push, so the leader knows how many of
+ * its pushes are still to be taken. Called with the link's mutex held.
+ */
+static void answer_pushes(struct replica_link *link)
+{
+  while (link->unanswered > 0 && link->sq.outstanding < RC_SEND_QUEUE_DEPTH) {
+    struct ibv_send_wr wr;
+
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)link->id;
+    wr.opcode = IBV_WR_SEND_WITH_IMM;
+    wr.imm_data = htonl(IMM_CREDIT | (uint32_t)(link->freed / RECORD_ALIGN));
+    rc_post_send(link->id, &link->sq, &wr);
+
+    link->freed = 0;
+    --link->unanswered;
+  }
+}
+
+/**
+ * Non-zero if the ring holds whole entries from where we are up to where
+ * a push says it ends, so none of it is appended unless all of it can be
+ */
+static int push_valid(struct replica_link *link, uint64_t ring)
+{
+  uint64_t taken = link->taken, head = link->ring_head;
+
+  if (ring - taken > PUSH_RING_SIZE)
+    return 0;
+  while (taken != ring) {
+    struct record_header *hdr = (struct record_header *)(link->ring + head);
+    uint64_t size;
+
+    if (__atomic_load_n(&hdr->length, __ATOMIC_ACQUIRE) < sizeof(*hdr) || RECORD_ENTRY_SIZE(hdr) > PUSH_RING_SIZE - head)
+      return 0;
+    size = hdr->flags & RECORD_SEGMENT_END ? PUSH_RING_SIZE - head : RECORD_ENTRY_SIZE(hdr);
+    if (!(hdr->flags & RECORD_SEGMENT_END) && hdr->key_length > RECORD_PAYLOAD_LENGTH(hdr))
+      return 0;
+    if (size > ring - taken)
+      return 0;
+    taken += size;
+    head = (head + size) % PUSH_RING_SIZE;
+  }
+  return 1;
+}
+
+/**
+ * Append what the leader pushed into the ring, up to where the push says
+ * it ends, to our own log, and note how far behind the leader's that
+ * leaves it. Entries of later pushes wait for theirs, so the offset the
+ * push gives is exactly how far our copy goes. Runs on the partition's CQ
+ * thread, as appends of the broker's own producers would. Entries are
+ * cleared once taken, so a stale length is never mistaken for a new entry.
+ * A push that does not add up drops the link.
+ */
+static void take_pushes(struct replica_link *link, const struct message *msg)
+{
+  int in_sync = replica_in_sync(link->topic);
+
+  if (!push_valid(link, msg->data.pushed.ring)) {
+    drop_link(link, "push does not match the ring");
+    return;
+  }
+
+  while (link->taken != msg->data.pushed.ring) {
+    struct record_header *hdr = (struct record_header *)(link->ring + link->ring_head);
+    struct record_header copy;
+    char *payload = (char *)(hdr + 1);
+    uint64_t size;
+
+    if (hdr->flags & RECORD_SEGMENT_END) {
+      // The rest of the ring was skipped; go on from its start
+      link->freed += PUSH_RING_SIZE - link->ring_head;
+      link->taken += PUSH_RING_SIZE - link->ring_head;
+      memset(hdr, 0, sizeof(*hdr));
+      link->ring_head = 0;
+      continue;
+    }
+
+    // Appending rewrites the header it is given
+    copy = *hdr;
+    size = RECORD_ENTRY_SIZE(hdr);
+    topic_append(link->topic, &copy, payload, payload + copy.key_length, RECORD_PAYLOAD_LENGTH(&copy) - copy.key_length);
+
+    memset(hdr, 0, size);
+    link->freed += size;
+    link->taken += size;
+    link->ring_head += size;
+  }
+  // Read along with our tail when the link goes down
+  __atomic_store_n(&link->resume_offset, msg->data.pushed.offset, __ATOMIC_RELEASE);
+  link->resumed = 1;
+  __atomic_store_n(&link->topic->lag, msg->data.pushed.lag, __ATOMIC_RELEASE);
+  if (in_sync && !replica_in_sync(link->topic) && s_on_lagging_cb)
+    s_on_lagging_cb(link->topic, link->topic->tail, msg->data.pushed.offset);
+
+  pthread_mutex_lock(&link->mutex);
+  ++link->unanswered;
+  answer_pushes(link);
+  pthread_mutex_unlock(&link->mutex);
+}
+
+void replica_on_pre_conn(struct rdma_cm_id *id)
+{
+  struct replica_link *link = (struct replica_link *)id->context;
+  int i;
+
+  link->id = id;
+  log_alloc();
+  // Everything but where our copy got to starts over with the connection
+  memset(&link->sq, 0, sizeof(link->sq));
+  link->msg_index = 0;
+  link->recv_index = 0;
+  link->ring_head = 0;
+  link->taken = 0;
+  link->freed = 0;
+  link->unanswered = 0;
+  link->dropped = 0;
+
+  if (strcmp(link->data.role, CONSUMER_ROLE) == 0) {
+    link->topic = topic_get(link->data.topic, link->data.partition & ~CONNECT_SUBSCRIBE);
+
+    posix_memalign((void **)&link->ring, sysconf(_SC_PAGESIZE), PUSH_RING_SIZE);
+    memset(link->ring, 0, PUSH_RING_SIZE);
+    TEST_Z(link->ring_mr = ibv_reg_mr(rc_get_pd(), link->ring, PUSH_RING_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+  }
+
+  posix_memalign((void **)&link->msg, sysconf(_SC_PAGESIZE), RC_SEND_QUEUE_DEPTH * sizeof(*link->msg));
+  TEST_Z(link->msg_mr = ibv_reg_mr(rc_get_pd(), link->msg, RC_SEND_QUEUE_DEPTH * sizeof(*link->msg), 0));
+
+  posix_memalign((void **)&link->recv_msg, sysconf(_SC_PAGESIZE), REPLICA_RECEIVES * sizeof(*link->recv_msg));
+  TEST_Z(link->recv_msg_mr = ibv_reg_mr(rc_get_pd(), link->recv_msg, REPLICA_RECEIVES * sizeof(*link->recv_msg), IBV_ACCESS_LOCAL_WRITE));
+  for (i = 0; i < REPLICA_RECEIVES; ++i)
+    post_receive(link, &link->recv_msg[i]);
+}
+
+/**
+ * A partition's link subscribes with its ring, marked as a replica's so
+ * the leader counts what it hands back towards producer acks
+ */
+void replica_on_connection(struct rdma_cm_id *id)
+{
+  struct replica_link *link = (struct replica_link *)id->context;
+  struct message *msg;
+  struct ibv_send_wr wr;
+  struct ibv_sge sge;
+
+  if (link->topic == NULL) {
+    printf("following %s:%s\n", leader.host, leader.port);
+    return;
+  }
+
+  pthread_mutex_lock(&link->mutex);
+  msg = &link->msg[link->msg_index];
+  link->msg_index = (link->msg_index + 1) % RC_SEND_QUEUE_DEPTH;
+  memset(msg, 0, sizeof(*msg));
+  msg->id = MSG_SUBSCRIBE;
+  msg->data.subscribe.ring_addr = (uintptr_t)link->ring;
+  msg->data.subscribe.ring_rkey = link->ring_mr->rkey;
+  msg->data.subscribe.ring_size = PUSH_RING_SIZE;
+  msg->data.subscribe.replica = 1;
+  msg->data.subscribe.resume = link->resumed;
+  msg->data.subscribe.offset = link->resume_offset;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)id;
+  wr.opcode = IBV_WR_SEND;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+
+  sge.addr = (uintptr_t)msg;
+  sge.length = sizeof(*msg);
+  sge.lkey = link->msg_mr->lkey;
+
+  rc_post_send(id, &link->sq, &wr);
+  pthread_mutex_unlock(&link->mutex);
+}
+
+void replica_on_completion(struct ibv_wc *wc)
+{
+  struct rdma_cm_id *id = (struct rdma_cm_id *)(uintptr_t)wc->wr_id;
+  struct replica_link *link = (struct replica_link *)id->context;
+  struct message *msg;
+
+  if (!(wc->opcode & IBV_WC_RECV)) {
+    pthread_mutex_lock(&link->mutex);
+    rc_send_completed(&link->sq);
+    // Answers may have waited for send queue slots
+    answer_pushes(link);
+    pthread_mutex_unlock(&link->mutex);
+    return;
+  }
+
+  if (link->dropped)
+    return;
+
+  msg = &link->recv_msg[link->recv_index];
+  link->recv_index = (link->recv_index + 1) % REPLICA_RECEIVES;
+
+  // Pushes come on a partition's link, partitions on the control link
+  if ((msg->id == MSG_PUSHED || msg->id == MSG_READY) != (link->topic != NULL)) {
+    drop_link(link, "message on the wrong link");
+    return;
+  }
+
+  if (msg->id == MSG_PUSHED) {
+    take_pushes(link, msg);
+    if (link->dropped)
+      return;
+  } else if (msg->id == MSG_TOPIC) {
+    start_link(CONSUMER_ROLE, msg->data.topic.name, msg->data.topic.partition);
+  } else if (msg->id == MSG_READY) {
+    printf("replicating %s/%u from %s:%s\n", link->topic->name, link->topic->partition, leader.host, leader.port);
+    // Readers are sent to the leader until the first push says how far
+    // behind we are
+    __atomic_store_n(&link->topic->lag, (uint64_t)-1, __ATOMIC_RELEASE);
+    __atomic_store_n(&link->topic->replicating, 1, __ATOMIC_RELEASE);
+  } else {
+    drop_link(link, "unexpected message");
+    return;
+  }
+
+  post_receive(link, msg);
+}
+
+void replica_on_disconnect(struct rdma_cm_id *id)
+{
+  struct replica_link *link = (struct replica_link *)id->context;
+
+  if (link->topic) {
+    int in_sync = replica_in_sync(link->topic);
+    // Read before our tail: should a last push still be being taken, its
+    // records are read twice rather than missed
+    uint64_t leader_offset = __atomic_load_n(&link->resume_offset, __ATOMIC_ACQUIRE);
+
+    __atomic_store_n(&link->topic->replicating, 0, __ATOMIC_RELEASE);
+    printf("stopped replicating %s/%u\n", link->topic->name, link->topic->partition);
+    if (in_sync && link->resumed && s_on_lagging_cb)
+      s_on_lagging_cb(link->topic, __atomic_load_n(&link->topic->tail, __ATOMIC_ACQUIRE), leader_offset);
+  } else
+    printf("lost leader %s:%s\n", leader.host, leader.port);
+
+  if (link->ring) {
+    ibv_dereg_mr(link->ring_mr);
+    free(link->ring);
+    link->ring = NULL;
+  }
+  rc_drop_deferred(&link->sq);
+  ibv_dereg_mr(link->recv_msg_mr);
+  free(link->recv_msg);
+  ibv_dereg_mr(link->msg_mr);
+  free(link->msg);
+}
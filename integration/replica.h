@@ -0,0 +1,58 @@
+#ifndef RDMA_REPLICA_H
+#define RDMA_REPLICA_H
+
+#include "common.h"
+
+/**
+ * Makes this broker a follower of another, the leader, keeping a copy of
+ * every topic partition the leader has. A control connection learns the
+ * partitions, the ones the leader holds when we connect and every one it
+ * creates after. Each partition then gets a link of its own that reads it
+ * like a push consumer would: the leader RDMA writes its log entries into a
+ * ring we registered and tells us with a send, and we append them to our
+ * own log on the partition's CQ thread and hand the ring back. Handing it
+ * back is what tells the leader how far we have the log, and what producer
+ * acks waiting for replicas wait on.
+ *
+ * Our log is our own, with segments and offsets of its own, so the leader
+ * cannot write into it directly. Replicating starts from what the leader
+ * holds in memory. A link that goes down is connected again, waiting longer
+ * after each attempt that fails, and a partition's picks up from the
+ * leader's offset its last push took our copy to.
+ *
+ * Readers may read a partition from us rather than from the leader, which
+ * spreads their READs over the replicas. Our log ends where replication
+ * has got to, so they never read past it. Every push says how far the
+ * leader's log ran past it, and a partition we lag too far behind on, or do
+ * not replicate, is read from the leader instead. Once a partition falls
+ * out of sync, its readers are told where our log ends and where the
+ * leader's goes on from there.
+ */
+
+struct topic;
+
+// Starts following the leader at host[:port]. Readers of partitions that
+// lag more than max_lag bytes behind are sent to the leader.
+void replica_follow(const char *leader, uint64_t max_lag);
+
+// Non-zero if the partition is being replicated and lags no more than
+// max_lag behind the leader's, so readers may read it from us
+int replica_in_sync(struct topic *topic);
+
+// Called once a partition that was in sync no longer is, because a push
+// left it too far behind or its link went down: our copy ends at offset,
+// where the leader's log is at leader_offset. Runs on the partition's CQ
+// thread, or on its link's for a link that went down.
+typedef void (*replica_lagging_cb_fn)(struct topic *topic, uint64_t offset, uint64_t leader_offset);
+void replica_set_lagging_cb(replica_lagging_cb_fn lagging_cb);
+
+// Non-zero if the connection context is one of the follower's links; those
+// are handed to the replica_on_* callbacks rather than the broker's own
+int replica_owns(void *context);
+
+void replica_on_pre_conn(struct rdma_cm_id *id);
+void replica_on_connection(struct rdma_cm_id *id);
+void replica_on_completion(struct ibv_wc *wc);
+void replica_on_disconnect(struct rdma_cm_id *id);
+
+#endif
@@ -1,47 +1,797 @@
 #include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
 #include <sys/stat.h>
 
 #include "common.h"
+#include "compact.h"
+#include "group.h"
+#include "index.h"
+#include "lookup.h"
 #include "messages.h"
+#include "metadata.h"
+#include "multicast.h"
+#include "persist.h"
+#include "replica.h"
+#include "snapshot.h"
+#include "subscription.h"
+#include "tier.h"
+#include "topic.h"
+
+// Receives a consumer keeps posted: its subscription, segment notifications,
+// window fetches and credits may arrive back to back
+#define CONSUMER_RECEIVES 5
+// Pushes a follower is told of before it answers; each answer is a credit,
+// which must find a receive posted
+#define REPLICA_PUSHES 4
+
+/**
+ * How far a follower's ring was written when it was told of a push, and
+ * the log offset of the next entry to push then. Once the follower hands
+ * its ring back past it, it has appended the log up to the offset.
+ */
+struct replica_mark
+{
+  uint64_t ring;
+  uint64_t offset;
+};
+
+/**
+ * A window onto its log a consumer reads through, as the consumer was told
+ * of it: a memory window bound to a segment in memory, which stays pinned
+ * while it is, or a chunk of an evicted segment staged by tier, whose
+ * segment is held so compaction cannot drop its file. Where the device has
+ * no memory windows, or the log was not registered for them, windows onto
+ * memory carry the log's rkey.
+ */
+struct consumer_window
+{
+  struct ibv_mw *mw;
+  uint32_t rkey;
+  // Segment the window is on, NO_SEGMENT if it is on none
+  uint64_t segment;
+  int staged;
+};
 
 struct conn_context
 {
+  struct rdma_cm_id *id;
   char *buffer;
   struct ibv_mr *buffer_mr;
 
+  // Ring of outgoing messages, one per send queue slot
   struct message *msg;
   struct ibv_mr *msg_mr;
+  int msg_index;
+
+  struct rc_send_queue sq;
 
   char *role;
+  struct topic *topic;
+  // Set once the client sent something we cannot take; what it sent after
+  // is ignored until the disconnect comes through
+  int dropped;
+  uint32_t producer_id;
+  // A producer's landing slots waiting to be handed back until the log is
+  // durable up to the given offsets, oldest first. Sends to a producer are
+  // made under ack_mutex, since the persistence thread makes them too.
+  uint64_t ack_offsets[LANDING_SLOTS];
+  int ack_head;
+  int num_acks;
+  pthread_mutex_t ack_mutex;
+  struct conn_context *next_producer;
+  // Group of a member, or of a consumer reading on a group's behalf
+  struct group *group;
+  // A group reader's window onto its partition's slot of the offsets
+  // table, or where there are no memory windows, a registration of the
+  // slot, and the rkey it commits under
+  struct ibv_mw *commit_mw;
+  struct ibv_mr *commit_mr;
+  uint32_t commit_rkey;
+  // Log offset a consumer starts reading from
+  uint64_t start;
+  // Set until the consumer's MSG_SUBSCRIBE has come in
+  int subscribing;
+  // A reader asked to start from the log's snapshot, and the one it was
+  // handed, held until it has read it
+  int bootstrap;
+  struct snapshot *snapshot;
+  // Ring of a consumer's receives, completed in the order posted
+  struct message *recv_msg;
+  struct ibv_mr *recv_msg_mr;
+  int recv_index;
+
+  // Ring of a push consumer, ring_size 0 if it reads the log itself: bytes
+  // written to it so far, bytes it handed back, and the log offset of the
+  // next entry to write, whose segment is pinned
+  uint64_t ring_addr;
+  uint32_t ring_rkey;
+  uint32_t ring_size;
+  uint64_t ring_written;
+  uint64_t ring_freed;
+  uint64_t push_offset;
+  // Segment pushed before the current one, kept pinned until the consumer
+  // has handed back the ring up to where its last entry went
+  uint64_t push_done;
+  uint64_t push_done_at;
+  struct conn_context *next_pusher;
+  // Takes its log from the log's multicast group
+  int multicast;
+  // A follower replicating the log: pushes it was told of but has not
+  // answered, ring written when it was last told, points of its ring not
+  // yet handed back, and the log offset up to which it has the log
+  int replica;
+  int pushes;
+  uint64_t pushed;
+  struct replica_mark marks[REPLICA_PUSHES];
+  int mark_head;
+  int num_marks;
+  uint64_t replicated;
+  // Where the follower, or a reader a lagging follower sent here, resumes
+  // from; NO_OFFSET for the log's head
+  uint64_t resume;
+  // On a follower, set once the partition fell out of sync while the
+  // reader read it, and 2 once it was told to go on at the leader: where
+  // our copy ends, which a push reader is pushed up to first, and where
+  // the leader's log goes on from
+  int leaving;
+  uint64_t leave_at;
+  uint64_t leader_offset;
+  // A follower's control connection, on the list of those told of every
+  // partition
+  struct conn_context *next_follower;
+
+  // Key, length and heap offset of the out-of-line value being received
+  int value_pending;
+  char *value_key;
+  uint16_t value_key_length;
+  uint64_t value_length;
+  uint64_t value_heap_offset;
+  // The value being received did not fit the heap and goes to the log
+  int value_spilled;
+
+  // Windows onto the segment a consumer reads and the one after it
+  struct consumer_window window[CONSUMER_WINDOWS];
+  // Offset of the segment the consumer last said it is reading
+  uint64_t segment;
+  // Reads evicted segments for the consumer; made on first use
+  struct tier_reader *tier;
+  struct conn_context *next_consumer;
+  // Set for a lookup reader, which only fetches windows onto the records
+  // its table points at; next_waiting links those waiting for the table
+  int lookup;
+  struct conn_context *next_waiting;
 };
 
 // Number of client connections to the server
 static int num_clients = 0;
-// The buffer shared remotely by the server
-static char* consumer_buffer = NULL;
-// Memory region of the buffer shared remotely by the server
-static struct ibv_mr *consumer_buffer_mr;
+// Connected consumers, for following their topics onto new segments. Held
+// around every send to a consumer or group member, since those happen on
+// both the connection event thread and the CQ threads.
+static struct conn_context *consumers = NULL;
+static pthread_mutex_t consumers_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Lookup readers whose table is still being built, under consumers_mutex
+static struct conn_context *lookup_waiters = NULL;
+// Tags log entries so consumers can reassemble fragmented records
+static uint32_t next_producer_id = 0;
+// Connected producers, for handing back slots as the log becomes durable
+static struct conn_context *producers = NULL;
+static pthread_mutex_t producers_mutex = PTHREAD_MUTEX_INITIALIZER;
+// How durable a chunk is before its landing slot is handed back. Anything
+// but DURABILITY_MEMORY needs topics persisted to persist_dir.
+static enum durability ack_durability = DURABILITY_MEMORY;
+// Followers that must have a chunk too before its slot is handed back; 0
+// leaves them out of it
+static int ack_replicas = 0;
+// Leader we replicate, NULL if we lead ourselves, and how far behind it a
+// partition may lag for its readers to read it from us; a ring's worth by
+// default
+static const char *leader = NULL;
+static uint64_t max_lag = PUSH_RING_SIZE;
+// Control connections of our followers, under consumers_mutex
+static struct conn_context *followers = NULL;
+static const char *persist_dir = NULL;
+// Map the log from the segment files rather than write them
+static int map_log = 0;
+// Registered heap for values kept out of the log, read by consumers on demand.
+// It only grows, and lives in this process alone: it is neither persisted
+// nor replicated, and once full, large values stay in the log.
+static char *value_heap = NULL;
+static struct ibv_mr *value_heap_mr;
+static uint64_t value_heap_tail = 0;
+static int value_heap_full = 0;
+static pthread_mutex_t value_heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Values at least this large go to the heap; 0 keeps every value in the log
+static uint64_t out_of_line_threshold = 0;
+// Metadata service of the cluster we are part of, NULL if we run alone
+static const char *metadata_service = NULL;
+// Written to a push ring when an entry does not fit before its end
+static struct record_header *wrap_marker = NULL;
+static struct ibv_mr *wrap_marker_mr;
+
+// Send queue slots pushing leaves free for control messages
+#define PUSH_SQ_RESERVE 4
+// Sleep while a follower's send queue is too full to tell it of a partition
+#define ANNOUNCE_WAIT_US 10
+// Follower being told of every partition; only used on the connection event
+// thread
+static struct conn_context *announcing = NULL;
 
-static void send_message(struct rdma_cm_id *id)
+/**
+ * A log sent to a multicast group as it grows
+ */
+struct topic_multicast
+{
+  struct mcast_stream *stream;
+  uint32_t sequence;
+};
+
+// Logs get groups counting up from this address, if it is set
+static const char *multicast_base = NULL;
+static uint32_t num_multicast_groups = 0;
+// Consumers of different partitions may ask for groups at once
+static pthread_mutex_t multicast_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Claim the next slot of the message ring. A slot is reused only after a
+ * send queue's worth of later sends, by which time a send posted from it
+ * is retired; one deferred for want of room was posted from a copy.
+ */
+static struct message * new_message(struct conn_context *ctx, int msg_id)
+{
+  struct message *msg = &ctx->msg[ctx->msg_index];
+
+  ctx->msg_index = (ctx->msg_index + 1) % RC_SEND_QUEUE_DEPTH;
+  memset(msg, 0, sizeof(*msg));
+  msg->id = msg_id;
+  return msg;
+}
+
+static void send_message(struct rdma_cm_id *id, struct message *msg)
 {
   struct conn_context *ctx = (struct conn_context *)id->context;
 
-  struct ibv_send_wr wr, *bad_wr = NULL;
+  struct ibv_send_wr wr;
   struct ibv_sge sge;
 
   memset(&wr, 0, sizeof(wr));
 
+  // Control messages fit inline and nobody waits on their completion
   wr.wr_id = (uintptr_t)id;
   wr.opcode = IBV_WR_SEND;
   wr.sg_list = &sge;
   wr.num_sge = 1;
-  wr.send_flags = IBV_SEND_SIGNALED;
 
-  sge.addr = (uintptr_t)ctx->msg;
-  sge.length = sizeof(*ctx->msg);
+  sge.addr = (uintptr_t)msg;
+  sge.length = sizeof(*msg);
   sge.lkey = ctx->msg_mr->lkey;
 
-  TEST_NZ(ibv_post_send(id->qp, &wr, &bad_wr));
+  rc_post_send(id, &ctx->sq, &wr);
+}
+
+/**
+ * Tell a consumer that the log bytes from the offset on are at addr, through
+ * the window with the given index
+ */
+static void send_window(struct conn_context *ctx, int w, uint64_t offset, uint64_t addr, uint32_t rkey, uint32_t length)
+{
+  struct message *msg = new_message(ctx, MSG_WINDOW);
+
+  msg->data.window.offset = offset;
+  msg->data.window.addr = addr;
+  msg->data.window.rkey = rkey;
+  msg->data.window.length = length;
+  msg->data.window.index = w;
+  send_message(ctx->id, msg);
+}
+
+/**
+ * Take a window off its segment, which the consumer has moved past: the
+ * memory window stops working, and the segment may be evicted again
+ */
+static void release_window(struct conn_context *ctx, int w)
+{
+  struct consumer_window *win = &ctx->window[w];
+  struct ibv_send_wr wr;
+
+  if (win->segment != NO_SEGMENT) {
+    if (win->mw && !win->staged) {
+      memset(&wr, 0, sizeof(wr));
+      wr.wr_id = (uintptr_t)ctx->id;
+      wr.opcode = IBV_WR_LOCAL_INV;
+      wr.invalidate_rkey = win->rkey;
+      rc_post_send(ctx->id, &ctx->sq, &wr);
+    }
+    log_unpin(win->segment);
+  }
+  win->segment = NO_SEGMENT;
+  win->staged = 0;
+}
+
+/**
+ * Point one of a consumer's windows at a segment in memory, which the
+ * caller pinned for it. Type 2 windows are bound through the consumer's
+ * own send queue, so this is cheap and needs no new registration.
+ */
+static void bind_window(struct conn_context *ctx, int w, uint64_t segment)
+{
+  struct consumer_window *win = &ctx->window[w];
+  struct ibv_send_wr wr;
+
+  release_window(ctx, w);
+  win->segment = segment;
+
+  if (win->mw == NULL) {
+    win->rkey = log_mr()->rkey;
+  } else {
+    win->rkey = ibv_inc_rkey(win->rkey);
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)ctx->id;
+    wr.opcode = IBV_WR_BIND_MW;
+    wr.bind_mw.mw = win->mw;
+    wr.bind_mw.rkey = win->rkey;
+    wr.bind_mw.bind_info.mr = log_mr();
+    wr.bind_mw.bind_info.addr = (uintptr_t)log_at(segment);
+    wr.bind_mw.bind_info.length = LOG_SEGMENT_SIZE;
+    wr.bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_READ;
+    rc_post_send(ctx->id, &ctx->sq, &wr);
+  }
+
+  // Sent after the bind on the same queue, so the rkey is live on arrival
+  send_window(ctx, w, segment, (uintptr_t)log_at(segment), win->rkey, LOG_SEGMENT_SIZE);
+}
+
+static int window_rank(const struct consumer_window *win)
+{
+  return win->staged ? 0 : win->segment == NO_SEGMENT ? 1 : 2;
+}
+
+/**
+ * The window to reuse for something other than the segment the consumer
+ * reads, which is never taken from under it: a staged one, an unused one,
+ * or else the one on the older segment. -1 if every window is on it.
+ */
+static int spare_window(struct conn_context *ctx)
+{
+  int w, spare = -1;
+
+  for (w = 0; w < CONSUMER_WINDOWS; ++w) {
+    struct consumer_window *win = &ctx->window[w];
+
+    if (win->segment == ctx->segment)
+      continue;
+    if (spare < 0 || window_rank(win) < window_rank(&ctx->window[spare]) ||
+        (window_rank(win) == window_rank(&ctx->window[spare]) && win->segment < ctx->window[spare].segment))
+      spare = w;
+  }
+  return spare;
+}
+
+/**
+ * Give the consumer the segment after the one it reads, if its topic has
+ * got that far and it is in memory; evicted ones are fetched once the
+ * consumer gets there
+ */
+static void bind_next_window(struct conn_context *ctx)
+{
+  uint64_t next = log_next_segment(ctx->segment);
+  int w;
+
+  if (next == NO_SEGMENT)
+    return;
+  for (w = 0; w < CONSUMER_WINDOWS; ++w)
+    if (ctx->window[w].segment == next && !ctx->window[w].staged)
+      return;
+  if ((w = spare_window(ctx)) >= 0 && log_pin(next))
+    bind_window(ctx, w, next);
+}
+
+/**
+ * Set aside a window for the chunk of an evicted segment tier stages for
+ * the consumer: the one on the last chunk, or a spare. The segment is held
+ * from now on, so the consumer is in it while the chunk is read.
+ */
+static void stage_window(struct conn_context *ctx, uint64_t segment)
+{
+  int w;
+
+  for (w = 0; w < CONSUMER_WINDOWS && !ctx->window[w].staged; ++w)
+    ;
+  if (w == CONSUMER_WINDOWS)
+    w = spare_window(ctx);
+  log_hold(segment);
+  release_window(ctx, w);
+  ctx->window[w].segment = segment;
+  ctx->window[w].staged = 1;
+}
+
+/**
+ * Give the consumer a window onto the log at the offset, and onto the
+ * segment after: the window on the segment already, if it asked before
+ * that one arrived, a new one if the segment is in memory, or else the
+ * chunk tier stages from the segment's file. Called with consumers_mutex
+ * held.
+ */
+static void fetch_window(struct conn_context *ctx, uint64_t offset)
+{
+  uint64_t segment = offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  int w;
+
+  ctx->segment = segment;
+  for (w = 0; w < CONSUMER_WINDOWS; ++w)
+    if (ctx->window[w].segment == segment && !ctx->window[w].staged)
+      break;
+
+  if (w < CONSUMER_WINDOWS) {
+    send_window(ctx, w, segment, (uintptr_t)log_at(segment), ctx->window[w].rkey, LOG_SEGMENT_SIZE);
+  } else if (log_pin(segment)) {
+    bind_window(ctx, spare_window(ctx), segment);
+  } else {
+    if (ctx->tier == NULL)
+      ctx->tier = tier_reader_new(ctx);
+    stage_window(ctx, segment);
+    tier_fetch(ctx->tier, offset);
+  }
+  bind_next_window(ctx);
+}
+
+/**
+ * Runs on the tier thread once a chunk of an evicted segment a consumer
+ * asked for is staged, and sends it through the window set aside for it.
+ * There is none if the consumer has asked for something else since.
+ */
+static void on_staged(struct tier_reader *r, uint64_t offset, uint32_t length, uint64_t addr, uint32_t rkey)
+{
+  struct conn_context *ctx;
+  int w;
+
+  pthread_mutex_lock(&consumers_mutex);
+  if ((ctx = (struct conn_context *)tier_reader_conn(r)) != NULL) {
+    for (w = 0; w < CONSUMER_WINDOWS; ++w)
+      if (ctx->window[w].staged && ctx->window[w].segment == offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE)
+        break;
+    if (w < CONSUMER_WINDOWS)
+      send_window(ctx, w, offset, addr, rkey, length);
+  }
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * RDMA write an entry into a push consumer's ring in two parts, its length
+ * last: the consumer polls on the length, and one write's bytes may land in
+ * any order.
+ */
+static void write_to_ring(struct conn_context *ctx, const char *entry, uint32_t lkey, uint32_t length, uint64_t pos)
+{
+  const uint32_t n = sizeof(((struct record_header *)0)->length);
+  struct ibv_send_wr wr;
+  struct ibv_sge sge;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)ctx->id;
+  wr.opcode = IBV_WR_RDMA_WRITE;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+  wr.wr.rdma.rkey = ctx->ring_rkey;
+
+  wr.wr.rdma.remote_addr = ctx->ring_addr + pos + n;
+  sge.addr = (uintptr_t)entry + n;
+  sge.length = length - n;
+  sge.lkey = lkey;
+  rc_post_send(ctx->id, &ctx->sq, &wr);
+
+  wr.send_flags = 0;
+  wr.wr.rdma.remote_addr = ctx->ring_addr + pos;
+  sge.addr = (uintptr_t)entry;
+  sge.length = n;
+  rc_post_send(ctx->id, &ctx->sq, &wr);
+}
+
+/**
+ * Tell a follower its ring holds what was written into it so far, and how
+ * far behind the log that leaves it, and remember which log offset that
+ * gets it to
+ */
+static void tell_replica(struct conn_context *ctx)
+{
+  struct replica_mark *mark = &ctx->marks[(ctx->mark_head + ctx->num_marks++) % REPLICA_PUSHES];
+  struct message *msg = new_message(ctx, MSG_PUSHED);
+
+  // Placed after the ring writes before it, so the follower finds them
+  msg->data.pushed.lag = log_distance(ctx->push_offset, __atomic_load_n(&ctx->topic->tail, __ATOMIC_ACQUIRE));
+  msg->data.pushed.ring = ctx->ring_written;
+  msg->data.pushed.offset = ctx->push_offset;
+  send_message(ctx->id, msg);
+
+  mark->ring = ctx->ring_written;
+  mark->offset = ctx->push_offset;
+  ctx->pushed = ctx->ring_written;
+  ++ctx->pushes;
+}
+
+/**
+ * Tell a reader of a partition that fell out of sync to go on at the
+ * leader, once it has read our log up to leave_at. Called with
+ * consumers_mutex held.
+ */
+static void send_lagging(struct conn_context *ctx)
+{
+  struct message *msg = new_message(ctx, MSG_LAGGING);
+
+  msg->data.lagging.resume = 1;
+  msg->data.lagging.offset = ctx->leave_at;
+  msg->data.lagging.leader_offset = ctx->leader_offset;
+  send_message(ctx->id, msg);
+  ctx->leaving = 2;
+}
+
+/**
+ * Write a push consumer's log entries into its ring, as far as the log
+ * goes and the ring and send queue have room. Entries are copied straight
+ * out of the log, which never changes once written. Segments evicted
+ * before the consumer got to them are skipped. Called with consumers_mutex
+ * held; picks up again on the consumer's next credit or send completion.
+ * A follower is told of what was written, a few times at most before it
+ * answers, and a reader leaving a lagging follower of where to go on.
+ */
+static void push_entries(struct conn_context *ctx)
+{
+  if (ctx->push_done != NO_SEGMENT && ctx->ring_freed >= ctx->push_done_at) {
+    log_unpin(ctx->push_done);
+    ctx->push_done = NO_SEGMENT;
+  }
+
+  // An entry and maybe a wrap marker, two writes each
+  while (ctx->sq.outstanding + ctx->sq.deferred + 4 <= RC_SEND_QUEUE_DEPTH - PUSH_SQ_RESERVE) {
+    struct record_header *entry = (struct record_header *)log_at(ctx->push_offset);
+    uint32_t length = __atomic_load_n(&entry->length, __ATOMIC_ACQUIRE);
+    uint64_t pos = ctx->ring_written % ctx->ring_size;
+    uint64_t skip = 0;
+
+    if (ctx->leaving && ctx->push_offset == ctx->leave_at) {
+      // After the entries on the same queue, so they are in the ring first
+      if (ctx->leaving == 1)
+        send_lagging(ctx);
+      break;
+    }
+    if (length == 0)
+      break;
+    // Writes out of the segment may still be in flight, so it stays pinned
+    // until they are in the ring; a segment is far larger than the ring,
+    // so the one before is long done with by then
+    if (entry->flags & RECORD_SEGMENT_END) {
+      uint64_t next = log_pin_from(entry->value_offset);
+
+      if (ctx->push_done != NO_SEGMENT)
+        log_unpin(ctx->push_done);
+      ctx->push_done = ctx->push_offset;
+      ctx->push_done_at = ctx->ring_written;
+      ctx->push_offset = next;
+      continue;
+    }
+
+    // Like the log, the ring always has room for a marker after an entry
+    if (pos + RECORD_ENTRY_SIZE(entry) + sizeof(*entry) > ctx->ring_size)
+      skip = ctx->ring_size - pos;
+    if (ctx->ring_written + skip + RECORD_ENTRY_SIZE(entry) - ctx->ring_freed > ctx->ring_size)
+      break;
+
+    if (skip) {
+      write_to_ring(ctx, (char *)wrap_marker, wrap_marker_mr->lkey, sizeof(*wrap_marker), pos);
+      ctx->ring_written += skip;
+      pos = 0;
+    }
+    write_to_ring(ctx, (char *)entry, log_mr()->lkey, length, pos);
+    ctx->ring_written += RECORD_ENTRY_SIZE(entry);
+    ctx->push_offset += RECORD_ENTRY_SIZE(entry);
+  }
+
+  // Takes one of the slots the loop leaves free
+  if (ctx->replica && ctx->ring_written != ctx->pushed && ctx->pushes < REPLICA_PUSHES)
+    tell_replica(ctx);
+}
+
+/**
+ * Move the topic's replicated offset up to the furthest that ack_replicas
+ * of its followers have got. Called with consumers_mutex held; returns
+ * non-zero if it moved.
+ */
+static int update_replicated(struct topic *topic)
+{
+  uint64_t replicated = topic->replicated;
+  struct conn_context *c, *d;
+
+  for (c = (struct conn_context *)topic->pushers; c; c = c->next_pusher) {
+    int n = 0;
+
+    if (!c->replica || c->replicated <= replicated)
+      continue;
+    for (d = (struct conn_context *)topic->pushers; d; d = d->next_pusher)
+      if (d->replica && d->replicated >= c->replicated)
+        ++n;
+    if (n >= ack_replicas)
+      replicated = c->replicated;
+  }
+
+  if (replicated == topic->replicated)
+    return 0;
+  // Read by producers' acks, which do not take consumers_mutex
+  __atomic_store_n(&topic->replicated, replicated, __ATOMIC_RELEASE);
+  return 1;
+}
+
+/**
+ * Take a follower's answer to a push: its ring handed back up to
+ * ring_freed, so it has the log up to every push that covers. Called with
+ * consumers_mutex held; returns non-zero if the topic's replicated offset
+ * moved.
+ */
+static int replica_answered(struct conn_context *ctx)
+{
+  --ctx->pushes;
+  while (ctx->num_marks > 0 && ctx->marks[ctx->mark_head].ring <= ctx->ring_freed) {
+    ctx->replicated = ctx->marks[ctx->mark_head].offset;
+    ctx->mark_head = (ctx->mark_head + 1) % REPLICA_PUSHES;
+    --ctx->num_marks;
+  }
+  return ack_replicas > 0 && update_replicated(ctx->topic);
+}
+
+/**
+ * Send a log entry to the log's multicast group, or only its place in the
+ * log if it does not fit in a datagram
+ */
+static void multicast_entry(struct topic_multicast *m, uint64_t offset)
+{
+  struct record_header *entry = (struct record_header *)log_at(offset);
+  struct mcast_header hdr;
+
+  hdr.sequence = m->sequence++;
+  hdr.offset = offset;
+  hdr.flags = 0;
+
+  if (sizeof(hdr) + entry->length > m->stream->mtu) {
+    hdr.flags = MCAST_ENTRY_OMITTED;
+    mcast_send(m->stream, &hdr, sizeof(hdr), NULL, 0);
+  } else {
+    mcast_send(m->stream, &hdr, sizeof(hdr), entry, entry->length);
+  }
+}
+
+/**
+ * Runs on the thread appending to the topic, so a log's datagrams go out
+ * in log order
+ */
+static void on_append(struct topic *topic, uint64_t offset)
+{
+  struct topic_multicast *m = (struct topic_multicast *)__atomic_load_n(&topic->multicast, __ATOMIC_ACQUIRE);
+  struct conn_context *ctx;
+
+  if (m)
+    multicast_entry(m, offset);
+  if (__atomic_load_n(&topic->pushers, __ATOMIC_ACQUIRE) == NULL)
+    return;
+
+  pthread_mutex_lock(&consumers_mutex);
+  for (ctx = (struct conn_context *)topic->pushers; ctx; ctx = ctx->next_pusher)
+    push_entries(ctx);
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * Hand the producer back the landing slots of chunks that are now as
+ * durable as acks wait for. Called with the producer's ack_mutex held.
+ */
+static void send_durable_acks(struct conn_context *ctx)
+{
+  uint64_t durable = persist_durable(ctx->topic, ack_durability);
+  uint64_t replicated = __atomic_load_n(&ctx->topic->replicated, __ATOMIC_ACQUIRE);
+
+  if (ack_replicas > 0 && replicated < durable)
+    durable = replicated;
+
+  while (ctx->num_acks > 0 && ctx->ack_offsets[ctx->ack_head] <= durable) {
+    send_message(ctx->id, new_message(ctx, MSG_ACK));
+    ctx->ack_head = (ctx->ack_head + 1) % LANDING_SLOTS;
+    --ctx->num_acks;
+  }
+}
+
+/**
+ * Send the acks of the topic's producers that have become due
+ */
+static void send_topic_acks(struct topic *topic)
+{
+  struct conn_context *ctx;
+
+  pthread_mutex_lock(&producers_mutex);
+  for (ctx = producers; ctx; ctx = ctx->next_producer) {
+    if (ctx->topic != topic)
+      continue;
+    pthread_mutex_lock(&ctx->ack_mutex);
+    send_durable_acks(ctx);
+    pthread_mutex_unlock(&ctx->ack_mutex);
+  }
+  pthread_mutex_unlock(&producers_mutex);
+}
+
+/**
+ * Runs on the persistence thread as a topic's files catch up with its log
+ */
+static void on_durable(struct topic *topic)
+{
+  if (ack_durability != DURABILITY_MEMORY)
+    send_topic_acks(topic);
+}
+
+static void on_segment_roll(struct topic *topic, uint64_t from, uint64_t to)
+{
+  struct conn_context *ctx;
+
+  pthread_mutex_lock(&consumers_mutex);
+  for (ctx = consumers; ctx; ctx = ctx->next_consumer)
+    if (ctx->topic == topic && ctx->segment == from && ctx->ring_size == 0)
+      bind_next_window(ctx);
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * Tell every member of the group which partitions are now theirs. Members
+ * close readers of partitions they lost and open readers, resuming from the
+ * committed offsets, for the ones they gained.
+ */
+static void send_assignments(struct group *group)
+{
+  uint32_t num_partitions = topic_partitions(group->topic);
+  struct group_member *m;
+
+  // A subscription is read as a single stream
+  if (is_pattern(group->topic))
+    num_partitions = 1;
+  // Other brokers may hold partitions we have not seen
+  else if (metadata_service) {
+    uint32_t cluster_partitions = metadata_partitions(metadata_service, group->topic);
+    if (cluster_partitions > num_partitions)
+      num_partitions = cluster_partitions;
+  }
+
+  pthread_mutex_lock(&consumers_mutex);
+  for (m = group->members; m; m = m->next) {
+    struct conn_context *ctx = (struct conn_context *)m->conn;
+    struct message *msg = new_message(ctx, MSG_ASSIGN);
+
+    msg->data.assign.generation = group->generation;
+    msg->data.assign.partitions = group_assignment(group, ctx, num_partitions);
+    send_message(ctx->id, msg);
+  }
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * Tell a follower to replicate the partition. A follower that connects is
+ * told of every partition at once, more than its send queue holds, so this
+ * waits for room, letting go of consumers_mutex for the completions that
+ * make it. Called on the connection event thread, which is the only one to
+ * take followers off the list, with consumers_mutex held.
+ */
+static void announce_partition(struct conn_context *ctx, struct topic *topic)
+{
+  struct message *msg;
+
+  while (ctx->sq.outstanding >= RC_SEND_QUEUE_DEPTH) {
+    pthread_mutex_unlock(&consumers_mutex);
+    usleep(ANNOUNCE_WAIT_US);
+    pthread_mutex_lock(&consumers_mutex);
+  }
+  msg = new_message(ctx, MSG_TOPIC);
+  snprintf(msg->data.topic.name, sizeof(msg->data.topic.name), "%s", topic->name);
+  msg->data.topic.partition = topic->partition;
+  send_message(ctx->id, msg);
+}
+
+static void announce_to_follower(struct topic *topic)
+{
+  announce_partition(announcing, topic);
 }
 
 static void post_receive(struct rdma_cm_id *id)
@@ -57,125 +807,988 @@ static void post_receive(struct rdma_cm_id *id)
   TEST_NZ(ibv_post_recv(id->qp, &wr, &bad_wr));
 }
 
+static void post_consumer_receive(struct rdma_cm_id *id, struct message *msg)
+{
+  struct conn_context *ctx = (struct conn_context *)id->context;
+  struct ibv_recv_wr wr, *bad_wr = NULL;
+  struct ibv_sge sge;
+
+  memset(&wr, 0, sizeof(wr));
+  wr.wr_id = (uintptr_t)id;
+  wr.sg_list = &sge;
+  wr.num_sge = 1;
+
+  sge.addr = (uintptr_t)msg;
+  sge.length = sizeof(*msg);
+  sge.lkey = ctx->recv_msg_mr->lkey;
+
+  TEST_NZ(ibv_post_recv(id->qp, &wr, &bad_wr));
+}
+
+/**
+ * Copy a fragment of a large value into the value heap. Once the last one
+ * is in, the log gets a single entry holding the key and a reference to the
+ * value, so consumers scanning keys do not read the value. A fragment that
+ * does not fall within the value its first fragment announced is rejected,
+ * along with the rest of the value. Returns zero if the chunk is for the
+ * log instead, since its value did not fit the heap.
+ */
+static int append_to_heap(struct conn_context *ctx, struct record_header *chunk)
+{
+  char *payload = (char *)(chunk + 1);
+  uint64_t n = RECORD_PAYLOAD_LENGTH(chunk) - chunk->key_length;
+  struct value_ref ref;
+
+  if (chunk->flags & RECORD_FIRST_FRAGMENT) {
+    ctx->value_pending = 0;
+    ctx->value_spilled = 0;
+    // Shared by every partition
+    pthread_mutex_lock(&value_heap_mutex);
+    if (value_heap == NULL) {
+      posix_memalign((void **)&value_heap, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
+      TEST_Z(value_heap_mr = ibv_reg_mr(rc_get_pd(), value_heap, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    }
+    if (value_heap_tail + chunk->value_length > BUFFER_SIZE) {
+      if (!value_heap_full)
+        fprintf(stderr, "value heap is full, keeping large values in the log\n");
+      value_heap_full = 1;
+      pthread_mutex_unlock(&value_heap_mutex);
+      ctx->value_spilled = !(chunk->flags & RECORD_LAST_FRAGMENT);
+      return 0;
+    }
+
+    ctx->value_heap_offset = value_heap_tail;
+    value_heap_tail += (chunk->value_length + RECORD_ALIGN - 1) & ~(uint64_t)(RECORD_ALIGN - 1);
+    pthread_mutex_unlock(&value_heap_mutex);
+
+    ctx->value_pending = 1;
+    ctx->value_length = chunk->value_length;
+    ctx->value_key = realloc(ctx->value_key, chunk->key_length + 1);
+    ctx->value_key_length = chunk->key_length;
+    memcpy(ctx->value_key, payload, chunk->key_length);
+  } else if (ctx->value_spilled) {
+    ctx->value_spilled = !(chunk->flags & RECORD_LAST_FRAGMENT);
+    return 0;
+  } else if (!ctx->value_pending) {
+    fprintf(stderr, "append_to_heap: rejecting a fragment without a first fragment\n");
+    return 1;
+  }
+
+  if (chunk->value_offset > ctx->value_length || n > ctx->value_length - chunk->value_offset) {
+    fprintf(stderr, "append_to_heap: rejecting a fragment past the end of its value\n");
+    ctx->value_pending = 0;
+    return 1;
+  }
+  memcpy(value_heap + ctx->value_heap_offset + chunk->value_offset, payload + chunk->key_length, n);
+
+  if (!(chunk->flags & RECORD_LAST_FRAGMENT))
+    return 1;
+
+  ref.addr = (uintptr_t)(value_heap + ctx->value_heap_offset);
+  ref.rkey = value_heap_mr->rkey;
+  ref.reserved = 0;
+  ctx->value_pending = 0;
+
+  chunk->flags = RECORD_FIRST_FRAGMENT | RECORD_LAST_FRAGMENT | RECORD_VALUE_REF | (chunk->flags & RECORD_COMPRESSED);
+  chunk->key_length = ctx->value_key_length;
+  chunk->value_offset = 0;
+  topic_append(ctx->topic, chunk, ctx->value_key, &ref, sizeof(ref));
+  return 1;
+}
+
+/**
+ * Disconnect a client that broke the protocol, rather than take every
+ * other client down with it
+ */
+static void drop_connection(struct conn_context *ctx, const char *reason)
+{
+  fprintf(stderr, "dropping a %s: %s\n", ctx->role, reason);
+  ctx->dropped = 1;
+  rc_disconnect(ctx->id);
+}
+
+/**
+ * Copy a chunk from a producer's landing slot to the end of the log
+ */
+static void append_to_log(struct conn_context *ctx, struct record_header *chunk)
+{
+  char *payload = (char *)(chunk + 1);
+
+  if (chunk->length < sizeof(*chunk) || chunk->length > LANDING_SLOT_SIZE) {
+    drop_connection(ctx, "bad chunk length");
+    return;
+  }
+  if (chunk->key_length > RECORD_PAYLOAD_LENGTH(chunk)) {
+    fprintf(stderr, "append_to_log: rejecting a chunk whose key runs past it\n");
+    return;
+  }
+
+  chunk->producer_id = ctx->producer_id;
+
+  if (out_of_line_threshold > 0 && chunk->value_length >= out_of_line_threshold && append_to_heap(ctx, chunk))
+    return;
+
+  topic_append(ctx->topic, chunk, payload, payload + chunk->key_length,
+                RECORD_PAYLOAD_LENGTH(chunk) - chunk->key_length);
+}
+
+/**
+ * Whether to take a connection at all. A follower of ours would copy
+ * references into our value heap, which it cannot serve, so we have none
+ * while we keep values out of line. As a follower we take no producers:
+ * their records would interleave with the leader's and diverge from it.
+ * Readers and producers of a partition must name one we can have, and a
+ * pattern may only be read, from partition 0, if it is well formed. Their
+ * log is created here, so one there is no room for is refused.
+ */
+static int admit(const struct connect_data *data)
+{
+  int partitioned = strcmp(data->role, MEMBER_ROLE) != 0 && strcmp(data->role, REPLICA_ROLE) != 0;
+  uint32_t partition = data->partition & ~CONNECT_SUBSCRIBE, num_partitions;
+  struct topic *topic;
+
+  if (out_of_line_threshold > 0 && strcmp(data->role, REPLICA_ROLE) == 0) {
+    fprintf(stderr, "rejecting a follower: values are kept out of line\n");
+    return 0;
+  }
+  if (leader && strcmp(data->role, PRODUCER_ROLE) == 0) {
+    fprintf(stderr, "rejecting a producer: following %s, which takes the writes\n", leader);
+    return 0;
+  }
+  if (partitioned && (data->partition & ~CONNECT_SUBSCRIBE) >= MAX_PARTITIONS) {
+    fprintf(stderr, "rejecting a %s: partition %u out of range\n", data->role, data->partition & ~CONNECT_SUBSCRIBE);
+    return 0;
+  }
+  // Consumers may read patterns; nobody publishes to one
+  if (partitioned && is_pattern(data->topic) &&
+      (strcmp(data->role, CONSUMER_ROLE) != 0 || (data->partition & ~CONNECT_SUBSCRIBE) != 0 || !pattern_valid(data->topic))) {
+    fprintf(stderr, "rejecting a %s: bad subscription pattern %s\n", data->role, data->topic);
+    return 0;
+  }
+  if (!partitioned)
+    return 1;
+
+  num_partitions = topic_partitions(data->topic);
+  topic = is_pattern(data->topic) ? subscription_get(data->topic) : topic_get(data->topic, partition);
+  if (topic == NULL) {
+    fprintf(stderr, "rejecting a %s: no room for the log of %s/%u\n", data->role, data->topic, partition);
+    return 0;
+  }
+
+  // A new partition needs an owner in every group reading the topic, and
+  // a copy on every follower
+  if (topic_partitions(data->topic) != num_partitions) {
+    struct conn_context *f;
+
+    group_for_each(topic->name, send_assignments);
+    pthread_mutex_lock(&consumers_mutex);
+    for (f = followers; f; f = f->next_follower)
+      announce_partition(f, topic);
+    pthread_mutex_unlock(&consumers_mutex);
+  }
+  return 1;
+}
+
 static void on_pre_conn(struct rdma_cm_id *id)
 {
-  struct conn_context *ctx = (struct conn_context *)malloc(sizeof(struct conn_context));
+  struct conn_context *ctx;
+  uint32_t partition = getPartition() & ~CONNECT_SUBSCRIBE;
 
+  // Our own links to the leader we follow come through here too
+  if (replica_owns(id->context)) {
+    replica_on_pre_conn(id);
+    return;
+  }
+
+  ctx = (struct conn_context *)calloc(1, sizeof(struct conn_context));
   id->context = ctx;
+  ctx->id = id;
+
+  // Both point into the connect request, which the next one overwrites
+  ctx->role = strdup(getRole());
+  log_alloc();
+
+  if (strcmp(ctx->role, MEMBER_ROLE) == 0) {
+    // Joins once connected, so its assignment can be sent right away
+    ctx->group = group_get(getGroup(), getTopic());
+    printf("ROLE:%s GROUP:%s TOPIC:%s\n", ctx->role, ctx->group->name, ctx->group->topic);
+  } else if (strcmp(ctx->role, REPLICA_ROLE) == 0) {
+    // Told of every partition once connected
+    printf("ROLE:%s\n", ctx->role);
+  } else {
+    // Checked, and the log created, on admission
+    if (is_pattern(getTopic())) {
+      ctx->topic = subscription_get(getTopic());
+    } else {
+      ctx->topic = topic_get(getTopic(), partition);
+    }
+    printf("ROLE:%s TOPIC:%s/%u\n", ctx->role, ctx->topic->name, ctx->topic->partition);
+  }
 
-  ctx->role = getRole();
-  printf("ROLE:%s\n", ctx->role);
   if (strcmp(ctx->role, PRODUCER_ROLE) == 0) {
-    posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
-    TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    int i;
+
+    ctx->producer_id = next_producer_id++;
+    pthread_mutex_init(&ctx->ack_mutex, NULL);
+    pthread_mutex_lock(&producers_mutex);
+    ctx->next_producer = producers;
+    producers = ctx;
+    pthread_mutex_unlock(&producers_mutex);
+
+    posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), LANDING_SLOTS * LANDING_SLOT_SIZE);
+    TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, LANDING_SLOTS * LANDING_SLOT_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
 
-    posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), sizeof(*ctx->msg));
-    TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, sizeof(*ctx->msg), 0));
+    // One receive per landing slot the producer may have in flight
+    for (i = 0; i < LANDING_SLOTS - 1; ++i)
+      post_receive(id);
+  } else if (strcmp(ctx->role, CONSUMER_ROLE) == 0) {
+    int i;
+
+    ++num_clients;
 
-    if(consumer_buffer == NULL) {
-        posix_memalign((void **)&consumer_buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
-        TEST_Z(consumer_buffer_mr = ibv_reg_mr(rc_get_pd(), consumer_buffer, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+    if (getGroup()[0] != '\0')
+      ctx->group = group_get(getGroup(), getTopic());
+    //printf("Number of clients: %d\n", num_clients);
+
+    // Windows are only bound where the log was registered for them;
+    // otherwise consumers are given the log's own rkey
+    for (i = 0; i < CONSUMER_WINDOWS; ++i) {
+      ctx->window[i].segment = NO_SEGMENT;
+      if (log_windows_ok() && (ctx->window[i].mw = ibv_alloc_mw(rc_get_pd(), IBV_MW_TYPE_2)) != NULL)
+        ctx->window[i].rkey = ctx->window[i].mw->rkey;
+    }
+    ctx->push_done = NO_SEGMENT;
+    ctx->resume = NO_OFFSET;
+
+    if (getPartition() & CONNECT_SUBSCRIBE)
+      ctx->subscribing = 1;
+    if (wrap_marker == NULL) {
+      posix_memalign((void **)&wrap_marker, sysconf(_SC_PAGESIZE), sizeof(*wrap_marker));
+      memset(wrap_marker, 0, sizeof(*wrap_marker));
+      wrap_marker->flags = RECORD_SEGMENT_END;
+      wrap_marker->length = sizeof(*wrap_marker);
+      TEST_Z(wrap_marker_mr = ibv_reg_mr(rc_get_pd(), wrap_marker, sizeof(*wrap_marker), 0));
     }
+
+    posix_memalign((void **)&ctx->recv_msg, sysconf(_SC_PAGESIZE), CONSUMER_RECEIVES * sizeof(*ctx->recv_msg));
+    TEST_Z(ctx->recv_msg_mr = ibv_reg_mr(rc_get_pd(), ctx->recv_msg, CONSUMER_RECEIVES * sizeof(*ctx->recv_msg), IBV_ACCESS_LOCAL_WRITE));
+    for (i = 0; i < CONSUMER_RECEIVES; ++i)
+      post_consumer_receive(id, &ctx->recv_msg[i]);
+  }
+
+  posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), RC_SEND_QUEUE_DEPTH * sizeof(*ctx->msg));
+  TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, RC_SEND_QUEUE_DEPTH * sizeof(*ctx->msg), 0));
+
+  if (ctx->recv_msg == NULL)
+    post_receive(id);
+}
+
+/**
+ * Let a group reader write its partition's committed offset, and no other.
+ * The bind goes through the reader's own send queue ahead of MSG_READY, so
+ * the rkey is live once the reader has it. Called with consumers_mutex held.
+ */
+static void bind_commit_window(struct conn_context *ctx, uint64_t *slot)
+{
+  struct ibv_send_wr wr;
+
+  if (group_offsets_windows() && (ctx->commit_mw = ibv_alloc_mw(rc_get_pd(), IBV_MW_TYPE_2)) != NULL) {
+    ctx->commit_rkey = ibv_inc_rkey(ctx->commit_mw->rkey);
+    memset(&wr, 0, sizeof(wr));
+    wr.wr_id = (uintptr_t)ctx->id;
+    wr.opcode = IBV_WR_BIND_MW;
+    wr.bind_mw.mw = ctx->commit_mw;
+    wr.bind_mw.rkey = ctx->commit_rkey;
+    wr.bind_mw.bind_info.mr = group_offsets_mr();
+    wr.bind_mw.bind_info.addr = (uintptr_t)slot;
+    wr.bind_mw.bind_info.length = sizeof(*slot);
+    wr.bind_mw.bind_info.mw_access_flags = IBV_ACCESS_REMOTE_WRITE;
+    rc_post_send(ctx->id, &ctx->sq, &wr);
   } else {
-    ++num_clients;
-    if (consumer_buffer == NULL) {
-          posix_memalign((void **)&ctx->buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
-          TEST_Z(ctx->buffer_mr = ibv_reg_mr(rc_get_pd(), ctx->buffer, BUFFER_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
-          consumer_buffer = ctx->buffer;
-          consumer_buffer_mr = ctx->buffer_mr;
-          printf("Registering to new memory...\n");
-      } else {
-          printf("Registering to the existing memory...\n");
-          ctx->buffer = consumer_buffer;
-          ctx->buffer_mr = consumer_buffer_mr;
-      }
-      //printf("Assigned buffer....\n");
-      //printf("Number of clients: %d\n", num_clients);
-    
-      posix_memalign((void **)&ctx->msg, sysconf(_SC_PAGESIZE), sizeof(*ctx->msg));
-      TEST_Z(ctx->msg_mr = ibv_reg_mr(rc_get_pd(), ctx->msg, sizeof(*ctx->msg), 0));
+    TEST_Z(ctx->commit_mr = ibv_reg_mr(rc_get_pd(), slot, sizeof(*slot), IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_WRITE));
+    ctx->commit_rkey = ctx->commit_mr->rkey;
+  }
+}
+
+/**
+ * Let go of a reader's snapshot once, whichever of the CQ thread, on its
+ * reader's word that it is done, and the connection event thread, on its
+ * disconnect, gets there first
+ */
+static void release_snapshot(struct conn_context *ctx)
+{
+  struct snapshot *snapshot = __atomic_exchange_n(&ctx->snapshot, NULL, __ATOMIC_ACQ_REL);
+
+  if (snapshot)
+    snapshot_release(snapshot);
+}
+
+/**
+ * Tell a consumer where its log starts. Readers for a group pick up where
+ * the partition's last reader left off, unless compaction has rewritten
+ * that part of the log since, and then start from its head. Readers that
+ * asked for a snapshot are handed the log's newest, under the same
+ * condition, and start where it was taken. Consumers get a window onto where
+ * they start now, and onto the next segment as soon as there is one; push
+ * consumers are sent what the log holds so far and then every entry
+ * appended.
+ */
+static void start_consumer(struct conn_context *ctx)
+{
+  struct message *msg;
+  struct seek_index *index;
+  int i;
+
+  ctx->start = __atomic_load_n(&ctx->topic->head, __ATOMIC_ACQUIRE);
+  if (ctx->group) {
+    // Written by the partition's earlier readers, not by us
+    uint64_t committed = __atomic_load_n(&ctx->group->committed[ctx->topic->partition], __ATOMIC_ACQUIRE);
+
+    if (committed != NO_OFFSET && !log_compacted(committed))
+      ctx->start = committed;
+  } else if (ctx->resume != NO_OFFSET) {
+    // A follower back from losing its link has the log up to there, and a
+    // reader a lagging follower sent here read its copy up to there
+    if (!log_compacted(ctx->resume))
+      ctx->start = ctx->resume;
+  } else if (ctx->bootstrap && ctx->ring_size == 0 && (ctx->snapshot = snapshot_take(ctx->topic)) != NULL) {
+    if (!log_compacted(ctx->snapshot->offset))
+      ctx->start = ctx->snapshot->offset;
+    // With nothing to read, it is done with the snapshot already
+    if (log_compacted(ctx->snapshot->offset) || ctx->snapshot->length == 0)
+      release_snapshot(ctx);
+  }
+  ctx->segment = ctx->start / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+
+  // Consumers that do not poll the log need no windows onto it; multicast
+  // ones read through theirs to repair
+  if (ctx->ring_size) {
+    for (i = 0; i < CONSUMER_WINDOWS; ++i) {
+      if (ctx->window[i].mw)
+        ibv_dealloc_mw(ctx->window[i].mw);
+      ctx->window[i].mw = NULL;
+    }
+  }
+
+  pthread_mutex_lock(&consumers_mutex);
+  if (ctx->ring_size == 0)
+    fetch_window(ctx, ctx->start);
+  ctx->next_consumer = consumers;
+  consumers = ctx;
+
+  if (ctx->group)
+    bind_commit_window(ctx, &ctx->group->committed[ctx->topic->partition]);
+  msg = new_message(ctx, MSG_READY);
+  msg->data.mr.start = ctx->start;
+  if (ctx->group) {
+    msg->data.mr.commit_addr = (uintptr_t)&ctx->group->committed[ctx->topic->partition];
+    msg->data.mr.commit_rkey = ctx->commit_rkey;
+  }
+  // A log gets its index with its first record, so an empty one has none
+  if ((index = __atomic_load_n(&ctx->topic->index, __ATOMIC_ACQUIRE)) != NULL) {
+    msg->data.mr.index_addr = (uintptr_t)index;
+    msg->data.mr.index_rkey = index_mr()->rkey;
+  }
+  if (ctx->snapshot) {
+    msg->data.mr.snapshot_addr = (uintptr_t)ctx->snapshot->data;
+    msg->data.mr.snapshot_length = ctx->snapshot->length;
+    msg->data.mr.snapshot_rkey = ctx->snapshot->mr->rkey;
+  }
+  send_message(ctx->id, msg);
+
+  if (ctx->ring_size) {
+    ctx->push_offset = log_pin_from(ctx->start);
+    ctx->next_pusher = (struct conn_context *)ctx->topic->pushers;
+    __atomic_store_n(&ctx->topic->pushers, ctx, __ATOMIC_RELEASE);
+    push_entries(ctx);
   }
-  post_receive(id);
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * On a follower, send a reader of a partition we do not replicate, or lag
+ * too far behind on, to the leader rather than start it. Subscriptions are
+ * fed by every topic they match, so nothing says how far behind they are;
+ * their readers stay. Returns non-zero if the reader was sent away.
+ */
+static int redirect_reader(struct conn_context *ctx)
+{
+  if (leader == NULL || is_pattern(ctx->topic->name) || replica_in_sync(ctx->topic))
+    return 0;
+
+  pthread_mutex_lock(&consumers_mutex);
+  send_message(ctx->id, new_message(ctx, MSG_LAGGING));
+  pthread_mutex_unlock(&consumers_mutex);
+  return 1;
+}
+
+/**
+ * Runs once a partition we follow falls out of sync: its readers read our
+ * copy up to where it ends and go on from the same record at the leader,
+ * push readers once they are pushed up to there. Filtered logs have
+ * offsets of their own, and group readers commit to our offsets table, so
+ * theirs stay, as do multicast readers.
+ */
+static void on_lagging(struct topic *topic, uint64_t offset, uint64_t leader_offset)
+{
+  struct conn_context *ctx;
+
+  pthread_mutex_lock(&consumers_mutex);
+  for (ctx = consumers; ctx; ctx = ctx->next_consumer) {
+    if (ctx->topic != topic || ctx->replica || ctx->group || ctx->multicast || ctx->leaving)
+      continue;
+    ctx->leaving = 1;
+    ctx->leave_at = offset;
+    ctx->leader_offset = leader_offset;
+    if (ctx->ring_size)
+      push_entries(ctx);
+    else
+      send_lagging(ctx);
+  }
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * Tell a reader we cannot serve it, instead of MSG_READY; it disconnects
+ */
+static void refuse_reader(struct conn_context *ctx, const char *reason)
+{
+  struct message *msg;
+
+  fprintf(stderr, "refusing a reader of %s/%u: %s\n", ctx->topic->name, ctx->topic->partition, reason);
+  pthread_mutex_lock(&consumers_mutex);
+  msg = new_message(ctx, MSG_REFUSED);
+  strncpy(msg->data.refused.reason, reason, sizeof(msg->data.refused.reason) - 1);
+  send_message(ctx->id, msg);
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * Have the consumer take its log from the log's multicast group, which is
+ * joined the first time anyone asks for it
+ */
+static void start_multicast(struct conn_context *ctx)
+{
+  struct topic_multicast *m;
+  struct message *msg;
+
+  pthread_mutex_lock(&multicast_mutex);
+  m = (struct topic_multicast *)ctx->topic->multicast;
+  if (m == NULL) {
+    char group[MCAST_GROUP_MAX];
+
+    mcast_group_address(multicast_base, num_multicast_groups++, group);
+    m = (struct topic_multicast *)calloc(1, sizeof(*m));
+    TEST_Z(m->stream = mcast_join(group, 1));
+    __atomic_store_n(&ctx->topic->multicast, m, __ATOMIC_RELEASE);
+    printf("sending %s/%u to %s\n", ctx->topic->name, ctx->topic->partition, group);
+  }
+  pthread_mutex_unlock(&multicast_mutex);
+
+  ctx->multicast = 1;
+
+  pthread_mutex_lock(&consumers_mutex);
+  msg = new_message(ctx, MSG_MULTICAST);
+  snprintf(msg->data.multicast.group, sizeof(msg->data.multicast.group), "%s", m->stream->address);
+  send_message(ctx->id, msg);
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * Tell a lookup reader where the log's lookup table is. It asks for windows
+ * only to read values the table does not hold, so it is sent none yet.
+ * Called with consumers_mutex held.
+ */
+static void send_lookup(struct conn_context *ctx, struct lookup_table *lookup)
+{
+  struct message *msg = new_message(ctx, MSG_READY);
+
+  msg->data.mr.addr = (uintptr_t)lookup->buckets;
+  msg->data.mr.rkey = lookup->mr->rkey;
+  send_message(ctx->id, msg);
+}
+
+/**
+ * Send a lookup reader its log's table, or have it wait for the table to
+ * be built if it is not yet; the builder sets built before it runs
+ * on_lookup_built(), which takes consumers_mutex too
+ */
+static void start_lookup(struct conn_context *ctx)
+{
+  struct lookup_table *lookup = topic_lookup(ctx->topic);
+
+  pthread_mutex_lock(&consumers_mutex);
+  ctx->lookup = 1;
+  if (__atomic_load_n(&lookup->built, __ATOMIC_ACQUIRE)) {
+    send_lookup(ctx, lookup);
+  } else {
+    ctx->next_waiting = lookup_waiters;
+    lookup_waiters = ctx;
+  }
+  pthread_mutex_unlock(&consumers_mutex);
+}
+
+/**
+ * Runs on the thread that built the log's lookup table: hand the table to
+ * the readers waiting for it
+ */
+static void on_lookup_built(struct topic *topic)
+{
+  struct conn_context **c = &lookup_waiters;
+
+  pthread_mutex_lock(&consumers_mutex);
+  while (*c) {
+    struct conn_context *ctx = *c;
+
+    if (ctx->topic == topic) {
+      *c = ctx->next_waiting;
+      send_lookup(ctx, topic->lookup);
+    } else {
+      c = &ctx->next_waiting;
+    }
+  }
+  pthread_mutex_unlock(&consumers_mutex);
 }
 
 static void on_connection(struct rdma_cm_id *id)
 {
   struct conn_context *ctx = (struct conn_context *)id->context;
+  struct message *msg;
 
-  ctx->msg->id = MSG_READY;
-  ctx->msg->data.mr.addr = (uintptr_t)ctx->buffer_mr->addr;
-  ctx->msg->data.mr.rkey = ctx->buffer_mr->rkey;
+  if (replica_owns(ctx)) {
+    replica_on_connection(id);
+    return;
+  }
+
+  if (strcmp(ctx->role, MEMBER_ROLE) == 0) {
+    group_join(ctx->group, ctx);
+    send_assignments(ctx->group);
+    return;
+  }
 
-  send_message(id);
+  // Partitions created from now on are announced as they are
+  if (strcmp(ctx->role, REPLICA_ROLE) == 0) {
+    pthread_mutex_lock(&consumers_mutex);
+    ctx->next_follower = followers;
+    followers = ctx;
+    announcing = ctx;
+    topic_for_each(announce_to_follower);
+    pthread_mutex_unlock(&consumers_mutex);
+    return;
+  }
+
+  // Others are started once their MSG_SUBSCRIBE is in
+  if (strcmp(ctx->role, CONSUMER_ROLE) == 0) {
+    if (!ctx->subscribing && !redirect_reader(ctx))
+      start_consumer(ctx);
+    return;
+  }
+
+  msg = new_message(ctx, MSG_READY);
+  msg->data.mr.addr = (uintptr_t)ctx->buffer_mr->addr;
+  msg->data.mr.rkey = ctx->buffer_mr->rkey;
+  send_message(id, msg);
 }
 
 static void on_disconnect(struct rdma_cm_id *id)
 {
   struct conn_context *ctx = (struct conn_context *)id->context;
+
+  if (replica_owns(ctx)) {
+    replica_on_disconnect(id);
+    return;
+  }
+
   if (strcmp(ctx->role, PRODUCER_ROLE) == 0) {
+    struct conn_context **c = &producers;
+
+    pthread_mutex_lock(&producers_mutex);
+    while (*c && *c != ctx)
+      c = &(*c)->next_producer;
+    if (*c)
+      *c = ctx->next_producer;
+    pthread_mutex_unlock(&producers_mutex);
+
+    rc_drop_deferred(&ctx->sq);
     ibv_dereg_mr(ctx->buffer_mr);
     ibv_dereg_mr(ctx->msg_mr);
     free(ctx->buffer);
     free(ctx->msg);
+    free(ctx->value_key);
+    free(ctx->role);
+    free(ctx);
+  } else if (strcmp(ctx->role, MEMBER_ROLE) == 0) {
+    group_leave(ctx->group, ctx);
+    send_assignments(ctx->group);
+    rc_drop_deferred(&ctx->sq);
+    ibv_dereg_mr(ctx->msg_mr);
+    free(ctx->msg);
+    free(ctx->role);
+    free(ctx);
+  } else if (strcmp(ctx->role, REPLICA_ROLE) == 0) {
+    struct conn_context **c = &followers;
+
+    pthread_mutex_lock(&consumers_mutex);
+    while (*c && *c != ctx)
+      c = &(*c)->next_follower;
+    if (*c)
+      *c = ctx->next_follower;
+    pthread_mutex_unlock(&consumers_mutex);
+
+    printf("follower left\n");
+    rc_drop_deferred(&ctx->sq);
+    ibv_dereg_mr(ctx->msg_mr);
+    free(ctx->msg);
+    free(ctx->role);
     free(ctx);
   } else {
+    struct conn_context **c = &consumers;
+    int i;
+
+    pthread_mutex_lock(&consumers_mutex);
+    while (*c && *c != ctx)
+      c = &(*c)->next_consumer;
+    if (*c)
+      *c = ctx->next_consumer;
+    c = &lookup_waiters;
+    while (*c && *c != ctx)
+      c = &(*c)->next_waiting;
+    if (*c)
+      *c = ctx->next_waiting;
+    if (ctx->ring_size) {
+      c = (struct conn_context **)&ctx->topic->pushers;
+      while (*c && *c != ctx)
+        c = &(*c)->next_pusher;
+      if (*c) {
+        *c = ctx->next_pusher;
+        log_unpin(ctx->push_offset);
+      }
+      if (ctx->push_done != NO_SEGMENT)
+        log_unpin(ctx->push_done);
+    }
+    // Nothing more is posted on the connection; letting go of the pins is
+    // all there is to releasing its windows
+    for (i = 0; i < CONSUMER_WINDOWS; ++i)
+      if (ctx->window[i].segment != NO_SEGMENT)
+        log_unpin(ctx->window[i].segment);
+    if (ctx->tier)
+      tier_reader_free(ctx->tier);
+    pthread_mutex_unlock(&consumers_mutex);
+
+    release_snapshot(ctx);
+
     --num_clients;
     printf("Number of clients remaining: %d\n", num_clients);
+    for (i = 0; i < CONSUMER_WINDOWS; ++i)
+      if (ctx->window[i].mw)
+        ibv_dealloc_mw(ctx->window[i].mw);
+    // A reader whose partition went to another member commits once more
+    // and disconnects, and its hold on the slot goes with it
+    if (ctx->commit_mw)
+      ibv_dealloc_mw(ctx->commit_mw);
+    if (ctx->commit_mr)
+      ibv_dereg_mr(ctx->commit_mr);
+    ibv_dereg_mr(ctx->recv_msg_mr);
+    free(ctx->recv_msg);
+    rc_drop_deferred(&ctx->sq);
     ibv_dereg_mr(ctx->msg_mr);
     free(ctx->msg);
+    free(ctx->role);
     free(ctx);
   }
 }
 
+/**
+ * Take a consumer's send: a credit, the segment it moved on to or the end
+ * of its snapshot in the immediate, a fetch of a window, or its
+ * subscription
+ */
+static void on_consumer_receive(struct conn_context *ctx, struct ibv_wc *wc, struct message *msg)
+{
+  if (wc->wc_flags & IBV_WC_WITH_IMM) {
+    uint32_t imm = ntohl(wc->imm_data);
+    int replicated = 0;
+
+    if (imm & IMM_SNAPSHOT_READ) {
+      release_snapshot(ctx);
+      return;
+    }
+
+    pthread_mutex_lock(&consumers_mutex);
+    if (imm & IMM_CREDIT) {
+      ctx->ring_freed += (uint64_t)(imm & ~IMM_CREDIT) * RECORD_ALIGN;
+      if (ctx->replica)
+        replicated = replica_answered(ctx);
+      push_entries(ctx);
+    } else {
+      // The window on the segment before is free to cover the one after
+      ctx->segment = (uint64_t)imm * LOG_SEGMENT_SIZE;
+      bind_next_window(ctx);
+    }
+    pthread_mutex_unlock(&consumers_mutex);
+
+    // Producers are walked without consumers_mutex, as on_durable does
+    if (replicated)
+      send_topic_acks(ctx->topic);
+  } else if (msg->id == MSG_FETCH) {
+    uint64_t offset = msg->data.fetch.offset;
+
+    pthread_mutex_lock(&consumers_mutex);
+    if (!ctx->lookup || !log_compacted(offset)) {
+      fetch_window(ctx, offset);
+    } else if (log_pin(offset)) {
+      // Kept in memory by the window's own pin
+      fetch_window(ctx, offset);
+      log_unpin(offset);
+    } else {
+      // A record compaction moved since the reader looked its key up, whose
+      // file may be about to go; the key's slot is pointed at the copy
+      // right after the swap, so the reader looks again
+      send_window(ctx, 0, offset, 0, 0, 0);
+    }
+    pthread_mutex_unlock(&consumers_mutex);
+  } else if (msg->id == MSG_SUBSCRIBE && ctx->subscribing) {
+    ctx->subscribing = 0;
+    // Followers of ours read what we have, however far behind that is
+    if (!msg->data.subscribe.replica && redirect_reader(ctx))
+      return;
+    if (msg->data.subscribe.lookup) {
+      start_lookup(ctx);
+      return;
+    }
+    // We run on the thread appending to the topic, so the filtered log can
+    // be filled from it without racing producers
+    if (msg->data.subscribe.filter.kind != FILTER_NONE) {
+      struct topic *log = topic_filter(ctx->topic, &msg->data.subscribe.filter);
+
+      if (log == NULL) {
+        refuse_reader(ctx, "no room for another filtered log");
+        return;
+      }
+      ctx->topic = log;
+    }
+    // Filtered and subscription logs have no snapshots, so their readers
+    // start from the head
+    ctx->bootstrap = msg->data.subscribe.snapshot;
+    if (msg->data.subscribe.resume)
+      ctx->resume = msg->data.subscribe.offset;
+
+    if (msg->data.subscribe.ring_size) {
+      if (msg->data.subscribe.ring_size < PUSH_RING_MIN || msg->data.subscribe.ring_size % RECORD_ALIGN) {
+        drop_connection(ctx, "bad push ring size");
+        return;
+      }
+      ctx->ring_addr = msg->data.subscribe.ring_addr;
+      ctx->ring_rkey = msg->data.subscribe.ring_rkey;
+      ctx->ring_size = msg->data.subscribe.ring_size;
+    }
+    // Followers copy the partition's whole log through a ring
+    if (msg->data.subscribe.replica) {
+      if (ctx->ring_size == 0 || msg->data.subscribe.filter.kind != FILTER_NONE || is_pattern(ctx->topic->name)) {
+        drop_connection(ctx, "bad replica subscription");
+        return;
+      }
+      ctx->replica = 1;
+      // Told at once, so it knows it is in sync with an empty log
+      ctx->pushed = NO_OFFSET;
+      printf("replicating %s/%u to a follower\n", ctx->topic->name, ctx->topic->partition);
+    }
+    // Without a group to send to, it reads the log like everyone else
+    if (msg->data.subscribe.multicast && multicast_base)
+      start_multicast(ctx);
+
+    start_consumer(ctx);
+  } else {
+    drop_connection(ctx, "unexpected message");
+  }
+}
+
 static void on_completion(struct ibv_wc *wc)
 {
   struct rdma_cm_id *id = (struct rdma_cm_id *)(uintptr_t)wc->wr_id;
   struct conn_context *ctx = (struct conn_context *)id->context;
-  
+
+  if (replica_owns(ctx)) {
+    replica_on_completion(wc);
+    return;
+  }
+
+  if (!(wc->opcode & IBV_WC_RECV)) {
+    if (strcmp(ctx->role, PRODUCER_ROLE) == 0) {
+      pthread_mutex_lock(&ctx->ack_mutex);
+      rc_send_completed(&ctx->sq);
+      pthread_mutex_unlock(&ctx->ack_mutex);
+    } else {
+      pthread_mutex_lock(&consumers_mutex);
+      rc_send_completed(&ctx->sq);
+      // Pushing may have stopped for want of send queue slots
+      if (ctx->ring_size && !ctx->subscribing)
+        push_entries(ctx);
+      pthread_mutex_unlock(&consumers_mutex);
+    }
+    return;
+  }
+
+  if (ctx->dropped)
+    return;
+
   if (strcmp(ctx->role, PRODUCER_ROLE) == 0) {
     if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-      uint32_t size = ntohl(wc->imm_data);
-      if(size == 0) {
-          ctx->msg->id = MSG_DONE;
-          send_message(id);
+      // The immediate names the landing slot written, counting from one
+      uint32_t slot = ntohl(wc->imm_data);
+      if(slot == 0) {
+          pthread_mutex_lock(&ctx->ack_mutex);
+          send_message(id, new_message(ctx, MSG_DONE));
+          pthread_mutex_unlock(&ctx->ack_mutex);
           return;
       }
-      //printf("Received data %s\n", ctx->buffer);
-      int data_size = strlen(ctx->buffer);
-      sprintf(consumer_buffer + strlen(consumer_buffer), "%04d", data_size);
-      sprintf(consumer_buffer + strlen(consumer_buffer), "%s", ctx->buffer);
-      //printf("Consumer buffer: %s\n", consumer_buffer);
+      append_to_log(ctx, (struct record_header *)(ctx->buffer + (slot - 1) * LANDING_SLOT_SIZE));
+      if (ctx->dropped)
+        return;
       post_receive(id);
-      ctx->msg->id = MSG_READY;
-      send_message(id);
-    }
-  } else {
-    if (wc->opcode == IBV_WC_RECV_RDMA_WITH_IMM) {
-      uint32_t size = ntohl(wc->imm_data);
-      if(size == 0) {
-          ctx->msg->id = MSG_DONE;
-          send_message(id);
-          return;
+
+      // Hand the slot back to the producer, at once or once the log is
+      // durable past the chunk and followers have it; neither the disk nor
+      // the followers are waited on here
+      pthread_mutex_lock(&ctx->ack_mutex);
+      if (ack_durability == DURABILITY_MEMORY && ack_replicas == 0) {
+        send_message(id, new_message(ctx, MSG_ACK));
+      } else {
+        ctx->ack_offsets[(ctx->ack_head + ctx->num_acks++) % LANDING_SLOTS] = ctx->topic->tail;
+        send_durable_acks(ctx);
       }
-      //printf("Received data %s\n", ctx->buffer);
-      post_receive(id);
-      ctx->msg->id = MSG_READY;
-      send_message(id);
+      pthread_mutex_unlock(&ctx->ack_mutex);
     }
+  } else if (strcmp(ctx->role, CONSUMER_ROLE) == 0) {
+    struct message *msg = &ctx->recv_msg[ctx->recv_index];
+
+    ctx->recv_index = (ctx->recv_index + 1) % CONSUMER_RECEIVES;
+    on_consumer_receive(ctx, wc, msg);
+    if (!ctx->dropped)
+      post_consumer_receive(id, msg);
   }
 }
 
+static int usage(const char *program)
+{
+  fprintf(stderr, "usage: %s [-v out-of-line value threshold in bytes] [-p port]\n"
+                  "          [-m metadata service host[:port] [-a address to advertise]]\n"
+                  "          [-g first multicast group address]\n"
+                  "          [-d directory to persist topics to [-D memory|written|fsync acks]\n"
+                  "           [-F map the log from its files]]\n"
+                  "          [-c pattern of topics to compact]...\n"
+                  "          [-s pattern of topics to snapshot for new readers]...\n"
+                  "          [-f leader host[:port] to follow [-L lag in bytes readers put up with]]\n"
+                  "          [-A followers acks wait for]\n", program);
+  return 1;
+}
+
 int main(int argc, char **argv)
 {
+  const char *port = DEFAULT_PORT;
+  char host[ADDRESS_HOST_MAX] = "";
+  int opt, level;
+
+  while ((opt = getopt(argc, argv, "v:p:m:a:g:d:D:Fc:s:f:L:A:")) != -1) {
+    switch (opt) {
+      case 'v':
+        out_of_line_threshold = strtoull(optarg, NULL, 10);
+        break;
+      case 'p':
+        port = optarg;
+        break;
+      case 'm':
+        metadata_service = optarg;
+        break;
+      case 'a':
+        snprintf(host, sizeof(host), "%s", optarg);
+        break;
+      case 'g':
+        multicast_base = optarg;
+        break;
+      case 'd':
+        persist_dir = optarg;
+        break;
+      case 'D':
+        if ((level = persist_level(optarg)) < 0)
+          return usage(argv[0]);
+        ack_durability = (enum durability)level;
+        break;
+      case 'F':
+        map_log = 1;
+        break;
+      case 'c':
+        if (!pattern_valid(optarg))
+          return usage(argv[0]);
+        compact_topics(optarg);
+        break;
+      case 's':
+        if (!pattern_valid(optarg))
+          return usage(argv[0]);
+        snapshot_topics(optarg);
+        break;
+      case 'f':
+        leader = optarg;
+        break;
+      case 'L':
+        max_lag = strtoull(optarg, NULL, 10);
+        break;
+      case 'A':
+        ack_replicas = atoi(optarg);
+        break;
+      default:
+        return usage(argv[0]);
+    }
+  }
+  if ((ack_durability != DURABILITY_MEMORY || map_log) && persist_dir == NULL)
+    return usage(argv[0]);
+  // The value heap is neither persisted nor replicated, so references into
+  // it would outlive it in the files, or point into the leader's memory
+  if (out_of_line_threshold > 0 && (persist_dir || leader))
+    return usage(argv[0]);
+  // Compaction writes the segments it fills through their files, under the
+  // mapping of a mapped log
+  if (map_log && compact_enabled())
+    return usage(argv[0]);
+
+  // Whatever an earlier run left in the directory comes back first
+  if (persist_dir) {
+    log_open(persist_dir, map_log);
+    persist_start(persist_dir, on_durable);
+    // Segments are evicted from the log, and read back from their files
+    tier_start(persist_dir, on_staged);
+  }
+  if (compact_enabled())
+    compact_start(persist_dir);
+  if (snapshot_enabled())
+    snapshot_start();
+
+  // Clients find us through the service from now on
+  if (metadata_service) {
+    if (host[0] == '\0')
+      TEST_NZ(gethostname(host, sizeof(host)));
+    metadata_register_broker(metadata_service, host, port);
+  }
+
+  log_set_roll_cb(on_segment_roll);
+  log_set_append_cb(on_append);
+  log_set_lookup_cb(on_lookup_built);
+  replica_set_lagging_cb(on_lagging);
+  rc_set_admit_cb(admit);
+
   rc_init(
     on_pre_conn,
     on_connection,
     on_completion,
     on_disconnect);
 
+  // Our links to the leader go through the callbacks above
+  if (leader)
+    replica_follow(leader, max_lag);
+
   printf("waiting for connections. interrupt (^C) to exit.\n");
 
-  rc_server_loop(DEFAULT_PORT);
+  rc_server_loop(port);
 
   return 0;
 }
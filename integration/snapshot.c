@@ -0,0 +1,236 @@
+#include <pthread.h>
+
+#include "keys.h"
+#include "snapshot.h"
+#include "subscription.h"
+
+// How often the snapshot thread goes over the topics
+#define SNAPSHOT_INTERVAL_US (5 * 1000 * 1000)
+// Patterns snapshot_topics() can be given
+#define SNAPSHOT_MAX_PATTERNS 16
+
+/**
+ * A snapshot being taken: the keys walked so far and the index of the
+ * entry being walked, the entries kept and how many records they hold,
+ * and for each producer id,
+ * FILTER_PASSING and the sequence of the fragmented record being kept, so
+ * later fragments follow the first
+ */
+struct snapshot_build
+{
+  struct key_table keys;
+  uint64_t index;
+  char *data;
+  uint64_t length;
+  uint64_t capacity;
+  uint64_t records;
+  uint64_t *passing;
+  uint32_t num_passing;
+};
+
+typedef void (*snapshot_entry_fn)(struct snapshot_build *b, const struct record_header *e);
+
+static char *patterns[SNAPSHOT_MAX_PATTERNS];
+static int num_patterns = 0;
+// Held while a log's newest snapshot is swapped, and while reference
+// counts change
+static pthread_mutex_t snapshots_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Where a segment that was evicted is read to from its file
+static char *scratch = NULL;
+
+void snapshot_topics(const char *pattern)
+{
+  if (num_patterns == SNAPSHOT_MAX_PATTERNS)
+    rc_die("snapshot_topics: too many patterns");
+  patterns[num_patterns++] = strdup(pattern);
+}
+
+int snapshot_enabled()
+{
+  return num_patterns > 0;
+}
+
+static int wanted(const char *name)
+{
+  int i;
+
+  for (i = 0; i < num_patterns; ++i)
+    if (pattern_match(patterns[i], name))
+      return 1;
+  return 0;
+}
+
+struct snapshot * snapshot_take(struct topic *log)
+{
+  struct snapshot *s;
+
+  pthread_mutex_lock(&snapshots_mutex);
+  if ((s = (struct snapshot *)log->snapshot) != NULL)
+    ++s->refs;
+  pthread_mutex_unlock(&snapshots_mutex);
+  return s;
+}
+
+void snapshot_release(struct snapshot *s)
+{
+  int last;
+
+  pthread_mutex_lock(&snapshots_mutex);
+  last = --s->refs == 0;
+  pthread_mutex_unlock(&snapshots_mutex);
+
+  if (!last)
+    return;
+  if (s->mr)
+    ibv_dereg_mr(s->mr);
+  free(s->data);
+  free(s);
+}
+
+/**
+ * Call fn on the entries of the last snapshot, if there is one, and then
+ * on those of the log from the offset it was taken at up to another,
+ * counting them in b->index
+ */
+static void walk(struct snapshot_build *b, const struct snapshot *last, uint64_t from, uint64_t to, snapshot_entry_fn fn)
+{
+  const struct record_header *e;
+  uint64_t offset;
+  int pinned;
+
+  b->index = 0;
+  for (offset = 0; last && offset < last->length; offset += RECORD_ENTRY_SIZE(e), ++b->index) {
+    e = (const struct record_header *)(last->data + offset);
+    fn(b, e);
+  }
+
+  while (from != to) {
+    uint64_t segment = from / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+    const char *data = log_segment_data(segment, &scratch, &pinned);
+
+    for (; from != to; from += RECORD_ENTRY_SIZE(e), ++b->index) {
+      e = (const struct record_header *)(data + (from - segment));
+      if (e->flags & RECORD_SEGMENT_END) {
+        from = e->value_offset;
+        break;
+      }
+      fn(b, e);
+    }
+    if (pinned)
+      log_unpin(segment);
+  }
+}
+
+static void note_key(struct snapshot_build *b, const struct record_header *e)
+{
+  if ((e->flags & RECORD_FIRST_FRAGMENT) && e->key_length)
+    key_get(&b->keys, (const char *)(e + 1), e->key_length)->newest = b->index;
+}
+
+/**
+ * Keep an entry if it starts the newest record of its key and that is no
+ * tombstone, or if it is a later fragment of one that does
+ */
+static void keep_entry(struct snapshot_build *b, const struct record_header *e)
+{
+  uint64_t *passing;
+  int keep;
+
+  if (e->producer_id >= b->num_passing) {
+    uint32_t n = b->num_passing ? b->num_passing : 16;
+
+    while (n <= e->producer_id)
+      n *= 2;
+    b->passing = (uint64_t *)realloc(b->passing, n * sizeof(*b->passing));
+    memset(b->passing + b->num_passing, 0, (n - b->num_passing) * sizeof(*b->passing));
+    b->num_passing = n;
+  }
+  passing = &b->passing[e->producer_id];
+
+  if (!(e->flags & RECORD_FIRST_FRAGMENT)) {
+    keep = *passing == (FILTER_PASSING | e->sequence);
+  } else {
+    keep = e->key_length && e->value_length &&
+           key_get(&b->keys, (const char *)(e + 1), e->key_length)->newest == b->index;
+    *passing = keep && !(e->flags & RECORD_LAST_FRAGMENT) ? FILTER_PASSING | e->sequence : 0;
+  }
+  if (!keep)
+    return;
+
+  while (b->length + RECORD_ENTRY_SIZE(e) > b->capacity) {
+    b->capacity = b->capacity ? 2 * b->capacity : LOG_SEGMENT_SIZE;
+    b->data = (char *)realloc(b->data, b->capacity);
+  }
+  memcpy(b->data + b->length, e, e->length);
+  memset(b->data + b->length + e->length, 0, RECORD_ENTRY_SIZE(e) - e->length);
+  b->length += RECORD_ENTRY_SIZE(e);
+  b->records += (e->flags & RECORD_FIRST_FRAGMENT) != 0;
+}
+
+/**
+ * Take a new snapshot of the topic if it matches a pattern and was
+ * appended to since its last. The first walk finds the newest record of
+ * each key, the second copies the survivors.
+ */
+static void snapshot_topic(struct topic *t)
+{
+  struct snapshot *last = (struct snapshot *)t->snapshot, *s;
+  struct snapshot_build b;
+  uint64_t from, to;
+
+  if (!wanted(t->name))
+    return;
+  to = __atomic_load_n(&t->tail, __ATOMIC_ACQUIRE);
+  from = last ? last->offset : __atomic_load_n(&t->head, __ATOMIC_ACQUIRE);
+  if (from == to)
+    return;
+  // The last snapshot's segment is held already; the head's is held for
+  // the walk, in case compaction swaps it out meanwhile
+  if (last == NULL)
+    log_hold(from);
+
+  memset(&b, 0, sizeof(b));
+  walk(&b, last, from, to, note_key);
+  walk(&b, last, from, to, keep_entry);
+
+  s = (struct snapshot *)calloc(1, sizeof(*s));
+  s->data = b.data;
+  s->length = b.length;
+  s->offset = to;
+  s->refs = 1;
+  if (s->length)
+    TEST_Z(s->mr = ibv_reg_mr(rc_get_pd(), s->data, s->length, IBV_ACCESS_REMOTE_READ));
+  log_hold(to);
+
+  pthread_mutex_lock(&snapshots_mutex);
+  t->snapshot = s;
+  pthread_mutex_unlock(&snapshots_mutex);
+
+  log_unpin(from);
+  if (last)
+    snapshot_release(last);
+
+  printf("snapshot of %s/%u at %lu: %lu records, %lu bytes\n", t->name, t->partition, (unsigned long)to,
+         (unsigned long)b.records, (unsigned long)s->length);
+  key_table_free(&b.keys);
+  free(b.passing);
+}
+
+static void * run_snapshots(void *arg)
+{
+  while (1) {
+    usleep(SNAPSHOT_INTERVAL_US);
+    // Nothing can read a snapshot before the first connection
+    if (rc_get_pd() != NULL)
+      topic_for_each(snapshot_topic);
+  }
+  return NULL;
+}
+
+void snapshot_start()
+{
+  pthread_t thread;
+
+  TEST_NZ(pthread_create(&thread, NULL, run_snapshots, NULL));
+  printf("taking snapshots of %d topic pattern%s\n", num_patterns, num_patterns == 1 ? "" : "s");
+}
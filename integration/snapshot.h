@@ -0,0 +1,55 @@
+#ifndef RDMA_SNAPSHOT_H
+#define RDMA_SNAPSHOT_H
+
+#include "topic.h"
+
+/**
+ * Snapshots of changelog topics, so a new reader of a long-lived one can
+ * build its state from every key's newest record rather than from the
+ * whole log. A thread of its own goes over the topics whose names match a
+ * snapshot pattern and, once one was appended to since its last snapshot,
+ * takes a new one as of its tail: it walks the last snapshot and the log
+ * appended since, keeps the newest record of each key, and lays them out
+ * as log entries in a registered region. Readers take that with RDMA READs
+ * and then read the log on from the offset the snapshot was taken at.
+ *
+ * Records without a key, and keys whose newest record is a tombstone, are
+ * left out, since a reader starting from a snapshot has nothing to forget.
+ * The fragments of a record follow its first; a record whose last
+ * fragments were not yet appended when the snapshot was taken ends in the
+ * log past it.
+ *
+ * The segment a snapshot was taken in is held until the next one is, so
+ * compaction cannot drop the part of the log it goes on from. A snapshot
+ * is freed once a newer one replaced it and every reader handed it is done
+ * with it. Snapshots live in memory only.
+ */
+struct snapshot
+{
+  // Log entries, as in a segment but with no end marker; NULL if there
+  // are none
+  char *data;
+  struct ibv_mr *mr;
+  uint64_t length;
+  // Log offset the snapshot was taken at, which readers go on from
+  uint64_t offset;
+  // Readers handed it, and one while it is its log's newest
+  int refs;
+};
+
+// Takes snapshots of topics whose names match the pattern, in subscription
+// syntax
+void snapshot_topics(const char *pattern);
+
+// Non-zero if snapshot_topics() was given a pattern
+int snapshot_enabled();
+
+// Starts the snapshot thread
+void snapshot_start();
+
+// The newest snapshot of the log, held until snapshot_release(); NULL if
+// it has none. Safe from any thread.
+struct snapshot * snapshot_take(struct topic *log);
+void snapshot_release(struct snapshot *s);
+
+#endif
@@ -0,0 +1,165 @@
+#include <pthread.h>
+
+#include "subscription.h"
+
+// One level of the patterns added so far
+struct trie_node
+{
+  char level[TOPIC_NAME_MAX];
+  struct trie_node *children;
+  struct trie_node *sibling;
+  // Child for a '*' level
+  struct trie_node *any;
+
+  // Log of the pattern ending here, and of the one ending here with '#'
+  struct topic *exact;
+  struct topic *rest;
+};
+
+static struct trie_node root;
+static uint32_t generation = 0;
+// Patterns are added on the connection event thread and matched on the CQ
+// threads appending to topics
+static pthread_mutex_t trie_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+int is_pattern(const char *name)
+{
+  return strpbrk(name, TOPIC_WILDCARD_ONE TOPIC_WILDCARD_REST) != NULL;
+}
+
+int pattern_valid(const char *pattern)
+{
+  const char *level = pattern;
+
+  while (1) {
+    const char *end = strchr(level, TOPIC_LEVEL_SEPARATOR);
+    size_t len = end ? (size_t)(end - level) : strlen(level);
+
+    if (len == 0)
+      return 0;
+    if (memchr(level, TOPIC_WILDCARD_ONE[0], len) && len != 1)
+      return 0;
+    if (memchr(level, TOPIC_WILDCARD_REST[0], len) && (len != 1 || end != NULL))
+      return 0;
+    if (end == NULL)
+      return 1;
+    level = end + 1;
+  }
+}
+
+int pattern_match(const char *pattern, const char *name)
+{
+  while (1) {
+    const char *pattern_end = strchr(pattern, TOPIC_LEVEL_SEPARATOR);
+    const char *name_end = strchr(name, TOPIC_LEVEL_SEPARATOR);
+    size_t len = pattern_end ? (size_t)(pattern_end - pattern) : strlen(pattern);
+
+    if (strcmp(pattern, TOPIC_WILDCARD_REST) == 0)
+      return 1;
+    if (!(len == 1 && pattern[0] == TOPIC_WILDCARD_ONE[0]) &&
+        (len != (name_end ? (size_t)(name_end - name) : strlen(name)) || strncmp(pattern, name, len) != 0))
+      return 0;
+    if (name_end == NULL)
+      return pattern_end == NULL || strcmp(pattern_end + 1, TOPIC_WILDCARD_REST) == 0;
+    if (pattern_end == NULL)
+      return 0;
+    pattern = pattern_end + 1;
+    name = name_end + 1;
+  }
+}
+
+static struct trie_node * child(struct trie_node *node, const char *level, size_t len)
+{
+  struct trie_node *c;
+
+  if (len == 1 && level[0] == TOPIC_WILDCARD_ONE[0]) {
+    if (node->any == NULL)
+      node->any = (struct trie_node *)calloc(1, sizeof(*c));
+    return node->any;
+  }
+
+  for (c = node->children; c; c = c->sibling)
+    if (strlen(c->level) == len && strncmp(c->level, level, len) == 0)
+      return c;
+
+  c = (struct trie_node *)calloc(1, sizeof(*c));
+  memcpy(c->level, level, len);
+  c->sibling = node->children;
+  node->children = c;
+  return c;
+}
+
+struct topic * subscription_get(const char *pattern)
+{
+  struct trie_node *node = &root;
+  const char *level = pattern;
+  struct topic **log;
+
+  pthread_mutex_lock(&trie_mutex);
+
+  while (1) {
+    const char *end = strchr(level, TOPIC_LEVEL_SEPARATOR);
+    size_t len = end ? (size_t)(end - level) : strlen(level);
+
+    if (end == NULL && len == 1 && level[0] == TOPIC_WILDCARD_REST[0]) {
+      log = &node->rest;
+      break;
+    }
+    node = child(node, level, len);
+    if (end == NULL) {
+      log = &node->exact;
+      break;
+    }
+    level = end + 1;
+  }
+
+  if (*log == NULL && (*log = topic_new(pattern, 0)) != NULL) {
+    __atomic_add_fetch(&generation, 1, __ATOMIC_RELEASE);
+    printf("created subscription %s\n", pattern);
+  }
+
+  pthread_mutex_unlock(&trie_mutex);
+  return *log;
+}
+
+uint32_t subscription_generation()
+{
+  return __atomic_load_n(&generation, __ATOMIC_ACQUIRE);
+}
+
+static int match(struct trie_node *node, const char *level, struct topic **logs, int n, int max)
+{
+  const char *end;
+  size_t len;
+  struct trie_node *c;
+
+  if (node->rest && n < max)
+    logs[n++] = node->rest;
+
+  if (level == NULL) {
+    if (node->exact && n < max)
+      logs[n++] = node->exact;
+    return n;
+  }
+
+  end = strchr(level, TOPIC_LEVEL_SEPARATOR);
+  len = end ? (size_t)(end - level) : strlen(level);
+
+  for (c = node->children; c; c = c->sibling)
+    if (strlen(c->level) == len && strncmp(c->level, level, len) == 0)
+      n = match(c, end ? end + 1 : NULL, logs, n, max);
+  if (node->any)
+    n = match(node->any, end ? end + 1 : NULL, logs, n, max);
+
+  return n;
+}
+
+int subscription_match(const char *name, struct topic **logs, int max)
+{
+  int n;
+
+  pthread_mutex_lock(&trie_mutex);
+  n = match(&root, name, logs, 0, max);
+  pthread_mutex_unlock(&trie_mutex);
+  return n;
+}
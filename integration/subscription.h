@@ -0,0 +1,42 @@
+#ifndef RDMA_SUBSCRIPTION_H
+#define RDMA_SUBSCRIPTION_H
+
+#include "topic.h"
+
+/**
+ * Topic names are hierarchical, with levels separated by '.'. In a
+ * subscription pattern, a '*' level matches any one level and a final '#'
+ * level matches any number of trailing levels, including none:
+ * md.equities.*.trades matches md.equities.ibm.trades, md.# matches md and
+ * everything below it.
+ *
+ * Each pattern has a log of its own that every record published to a
+ * matching topic is copied into, so a subscriber reads the union of the
+ * streams through one connection, the same way it reads a topic. Patterns
+ * are kept in a trie, and each topic remembers the logs it feeds until the
+ * set of patterns changes.
+ */
+
+#define TOPIC_LEVEL_SEPARATOR '.'
+#define TOPIC_WILDCARD_ONE "*"
+#define TOPIC_WILDCARD_REST "#"
+
+// Non-zero if the name has wildcard levels
+int is_pattern(const char *name);
+// Non-zero if wildcards appear only as whole levels, and '#' only last
+int pattern_valid(const char *pattern);
+// Non-zero if the topic name matches the pattern
+int pattern_match(const char *pattern, const char *name);
+
+// The log of the pattern, created on first use, or NULL if the arena has
+// no room for another log. Only called from the connection event thread.
+struct topic * subscription_get(const char *pattern);
+
+// Bumped whenever a pattern is added
+uint32_t subscription_generation();
+
+// Fills logs with the logs of the patterns matching the topic name, up to
+// max of them, and returns how many match
+int subscription_match(const char *name, struct topic **logs, int max);
+
+#endif
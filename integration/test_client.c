@@ -32,6 +32,21 @@ char *rand_string(char *str, size_t size)
     return str;
 }
 
+// A JSON-like value: the same fields over and over with varying numbers,
+// which compresses the way event payloads do
+char *json_string(char *str, size_t size)
+{
+    size_t n = 0;
+    if (size) {
+        while (n + 1 < size) {
+            n += snprintf(str + n, size - n, "{\"id\":%d,\"user\":\"user%d\",\"event\":\"click\",\"price\":%d.%02d},",
+                          rand(), rand() % 1000, rand() % 100, rand() % 100);
+        }
+        str[size - 1] = '\0';
+    }
+    return str;
+}
+
 float get_time_elapsed_sec(struct timeval tv1, struct timeval tv2) {
     struct timeval tvdiff = { tv2.tv_sec - tv1.tv_sec, tv2.tv_usec - tv1.tv_usec };
     if (tvdiff.tv_usec < 0) { tvdiff.tv_usec += 1000000; tvdiff.tv_sec -= 1; }
@@ -41,6 +56,12 @@ float get_time_elapsed_sec(struct timeval tv1, struct timeval tv2) {
 int main(int argc, char *argv[])
 {
     int i; 
+    // Optional "compress" and "json" after the topic and partitions
+    int compress = 0, json = 0;
+    for(i=4;i<argc;i++) {
+        compress |= strcmp(argv[i], "compress") == 0;
+        json |= strcmp(argv[i], "json") == 0;
+    }
     // Generate keys and values
     char **keys;
     keys = (char**) malloc(NUM_RECORDS*sizeof(char*));
@@ -53,11 +74,18 @@ int main(int argc, char *argv[])
     values = (char**) malloc(NUM_RECORDS*sizeof(char*));
     for(i=0;i<NUM_RECORDS;i++) {
 	values[i] = (char*)malloc(VAL_SIZE*sizeof(char));
-        rand_string(values[i], VAL_SIZE);
+        if (json)
+            json_string(values[i], VAL_SIZE);
+        else
+            rand_string(values[i], VAL_SIZE);
     }
 
+    if (compress)
+        compressValues();
+
     // Now, connect to the PubSub server
-    init(argv[1]);
+    // Optional topic and number of partitions to spread the keys over
+    initPartitioned(argv[1], argc > 2 ? argv[2] : NULL, argc > 3 ? atoi(argv[3]) : 1);
     sleep(5);
 
     // Produce the records
@@ -74,7 +102,16 @@ int main(int argc, char *argv[])
 
     printf("Write throughput: %f\n MBps", throughputMBps); 
 
-    // Terminate
+    // Terminate, which waits for every record to be written
     terminate();
+
+    // Raw bytes delivered per second, against what crossed the wire
+    uint64_t produced, sent;
+    gettimeofday(&tv2, NULL);
+    compressionStats(&produced, &sent);
+    timeElapsedSec = get_time_elapsed_sec(tv1,tv2);
+    printf("Effective throughput: %f MBps, %lu value bytes sent for %lu (ratio %.2f)\n",
+           dataSentBytes/(timeElapsedSec*1000000), (unsigned long)sent, (unsigned long)produced,
+           sent ? (float)produced/sent : 0);
     return 0;
 }
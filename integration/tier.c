@@ -0,0 +1,281 @@
+#include <fcntl.h>
+#include <pthread.h>
+
+#include "tier.h"
+#include "uring.h"
+
+// Each half of a reader's staging buffer
+#define TIER_STAGE_SIZE (4 * LANDING_SLOT_SIZE)
+// Largest log entry: a chunk, with a subscription log's topic prefix
+#define TIER_ENTRY_MAX (LANDING_SLOT_SIZE + TOPIC_NAME_MAX + RECORD_ALIGN)
+// Reads in flight at once, one per reader at most
+#define TIER_QUEUE_DEPTH 64
+// Sleep when nothing was asked for and nothing completed
+#define TIER_IDLE_US 100
+
+/**
+ * A chunk of a segment staged in one half of a reader's buffer
+ */
+struct tier_half
+{
+  // Log offsets of the chunk; valid once ready
+  uint64_t start;
+  uint64_t end;
+  int ready;
+  // The chunk runs to the end of its segment
+  int last;
+};
+
+struct tier_reader
+{
+  void *conn;
+  char *stage;
+  struct ibv_mr *stage_mr;
+  struct tier_half half[2];
+  // Half last handed out, and half being read into; -1 for none
+  int published;
+  int reading;
+  // Segment file being read, the segment's offset and where it ends
+  int fd;
+  uint64_t segment;
+  uint64_t segment_end;
+
+  // Set by tier_fetch() under tier_mutex: offset asked for, whether the
+  // reader is queued, and whether it was freed
+  uint64_t wanted;
+  int queued;
+  int freed;
+  // The tier thread's copy of wanted, NO_SEGMENT once served
+  uint64_t want;
+  struct tier_reader *next_pending;
+  struct tier_reader *next_dead;
+};
+
+static const char *tier_dir = NULL;
+static staged_cb_fn s_on_staged_cb = NULL;
+static struct uring ring;
+// Readers with a fetch to serve, and ones freed; taken by the tier thread
+static struct tier_reader *pending = NULL;
+static struct tier_reader *dead = NULL;
+static pthread_mutex_t tier_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static int covers(struct tier_half *h, uint64_t offset)
+{
+  return h->ready && offset >= h->start && offset < h->end &&
+         (h->end - offset >= TIER_ENTRY_MAX || h->last);
+}
+
+/**
+ * Open the file of the segment holding the offset, if it is not the one
+ * open already, and learn where the segment ends from its header
+ */
+static void open_segment(struct tier_reader *r, uint64_t offset)
+{
+  uint64_t segment = offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  struct segment_header h;
+  char path[512];
+
+  if (r->fd >= 0 && r->segment == segment)
+    return;
+  if (r->fd >= 0)
+    close(r->fd);
+
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, tier_dir, (unsigned)(segment / LOG_SEGMENT_SIZE));
+  if ((r->fd = open(path, O_RDONLY)) < 0)
+    rc_die("open_segment: cannot open segment file");
+  // Evicted segments are closed, so their headers say where they end
+  if (pread(r->fd, &h, sizeof(h), 0) != sizeof(h) || h.end <= segment)
+    rc_die("open_segment: segment file has no end");
+  r->segment = segment;
+  r->segment_end = h.end;
+}
+
+/**
+ * Queue a read of the chunk starting at the offset into a half
+ */
+static void read_chunk(struct tier_reader *r, int half, uint64_t start)
+{
+  struct tier_half *h = &r->half[half];
+  struct io_uring_sqe *sqe;
+
+  open_segment(r, start);
+  h->start = start;
+  h->end = start + TIER_STAGE_SIZE < r->segment_end ? start + TIER_STAGE_SIZE : r->segment_end;
+  h->last = h->end == r->segment_end;
+  h->ready = 0;
+  r->reading = half;
+
+  sqe = uring_sqe(&ring);
+  sqe->opcode = IORING_OP_READ;
+  sqe->fd = r->fd;
+  sqe->addr = (uintptr_t)(r->stage + half * TIER_STAGE_SIZE);
+  sqe->len = h->end - h->start;
+  sqe->off = h->start - r->segment;
+  sqe->user_data = (uintptr_t)r;
+}
+
+/**
+ * Hand the reader the half covering what it wants, and read ahead into
+ * the other. Otherwise read what it wants into the half it was not handed,
+ * once any read in flight is done.
+ */
+static void serve(struct tier_reader *r)
+{
+  int h, other;
+
+  if (__atomic_load_n(&r->freed, __ATOMIC_ACQUIRE) || r->want == NO_SEGMENT)
+    return;
+
+  for (h = 0; h < 2; ++h)
+    if (covers(&r->half[h], r->want))
+      break;
+
+  if (h == 2) {
+    if (r->reading < 0)
+      read_chunk(r, r->published == 0 ? 1 : 0, r->want);
+    return;
+  }
+
+  r->want = NO_SEGMENT;
+  r->published = h;
+  s_on_staged_cb(r, r->half[h].start, r->half[h].end - r->half[h].start,
+                 (uintptr_t)(r->stage + h * TIER_STAGE_SIZE), r->stage_mr->rkey);
+
+  // The next chunk overlaps this one by an entry, so every offset this
+  // one leaves out is covered by it
+  other = 1 - h;
+  if (!r->half[h].last && r->reading < 0 &&
+      !(r->half[other].ready && r->half[other].start == r->half[h].end - TIER_ENTRY_MAX))
+    read_chunk(r, other, r->half[h].end - TIER_ENTRY_MAX);
+}
+
+/**
+ * Handle every completion in. Returns how many there were.
+ */
+static int reap()
+{
+  unsigned head = *ring.cq_head;
+  unsigned tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+  int n = 0;
+
+  for (; head != tail; ++head, ++n) {
+    struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+    struct tier_reader *r = (struct tier_reader *)(uintptr_t)cqe->user_data;
+    struct tier_half *h = &r->half[r->reading];
+
+    if (cqe->res < 0 || (uint64_t)cqe->res != h->end - h->start)
+      rc_die("reap: read of segment file failed");
+    h->ready = 1;
+    r->reading = -1;
+    serve(r);
+  }
+  __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+  return n;
+}
+
+static void destroy_reader(struct tier_reader *r)
+{
+  if (r->fd >= 0)
+    close(r->fd);
+  ibv_dereg_mr(r->stage_mr);
+  free(r->stage);
+  free(r);
+}
+
+static void * run_tier(void *arg)
+{
+  // Freed readers with a read still in flight
+  struct tier_reader *dying = NULL;
+
+  while (1) {
+    struct tier_reader *r, *next, *todo, *freed;
+    int progress = reap();
+
+    pthread_mutex_lock(&tier_mutex);
+    todo = pending;
+    freed = dead;
+    pending = dead = NULL;
+    for (r = todo; r; r = r->next_pending) {
+      r->queued = 0;
+      r->want = r->wanted;
+    }
+    pthread_mutex_unlock(&tier_mutex);
+
+    for (r = todo; r; r = r->next_pending) {
+      serve(r);
+      ++progress;
+    }
+
+    // Taken along with the pending list, so none of them is left on it
+    while (freed) {
+      r = freed;
+      freed = r->next_dead;
+      r->next_dead = dying;
+      dying = r;
+    }
+    for (r = dying, dying = NULL; r; r = next) {
+      next = r->next_dead;
+      if (r->reading >= 0) {
+        r->next_dead = dying;
+        dying = r;
+      } else {
+        destroy_reader(r);
+      }
+    }
+
+    progress += uring_submit(&ring);
+    if (progress == 0)
+      usleep(TIER_IDLE_US);
+  }
+  return NULL;
+}
+
+void tier_start(const char *dir, staged_cb_fn staged_cb)
+{
+  pthread_t thread;
+
+  tier_dir = dir;
+  s_on_staged_cb = staged_cb;
+  uring_setup(&ring, TIER_QUEUE_DEPTH);
+  TEST_NZ(pthread_create(&thread, NULL, run_tier, NULL));
+}
+
+struct tier_reader * tier_reader_new(void *conn)
+{
+  struct tier_reader *r = (struct tier_reader *)calloc(1, sizeof(*r));
+
+  r->conn = conn;
+  r->published = r->reading = -1;
+  r->fd = -1;
+  r->want = NO_SEGMENT;
+  posix_memalign((void **)&r->stage, sysconf(_SC_PAGESIZE), 2 * TIER_STAGE_SIZE);
+  TEST_Z(r->stage_mr = ibv_reg_mr(rc_get_pd(), r->stage, 2 * TIER_STAGE_SIZE, IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ));
+  return r;
+}
+
+void tier_fetch(struct tier_reader *r, uint64_t offset)
+{
+  pthread_mutex_lock(&tier_mutex);
+  r->wanted = offset;
+  if (!r->queued && !r->freed) {
+    r->queued = 1;
+    r->next_pending = pending;
+    pending = r;
+  }
+  pthread_mutex_unlock(&tier_mutex);
+}
+
+void * tier_reader_conn(struct tier_reader *r)
+{
+  return __atomic_load_n(&r->conn, __ATOMIC_ACQUIRE);
+}
+
+void tier_reader_free(struct tier_reader *r)
+{
+  pthread_mutex_lock(&tier_mutex);
+  __atomic_store_n(&r->conn, NULL, __ATOMIC_RELEASE);
+  __atomic_store_n(&r->freed, 1, __ATOMIC_RELEASE);
+  r->next_dead = dead;
+  dead = r;
+  pthread_mutex_unlock(&tier_mutex);
+}
@@ -0,0 +1,42 @@
+#ifndef RDMA_TIER_H
+#define RDMA_TIER_H
+
+#include "topic.h"
+
+/**
+ * Serves reads of segments evicted from the arena out of their files. Each
+ * reader that asks for one gets a registered staging buffer of two halves,
+ * and a thread of its own reads chunks of the segment file into them
+ * through io_uring. The half a reader was handed stays as it is until it
+ * asks for something past it; meanwhile the other half is read ahead, so
+ * a reader going through a cold segment mostly finds its next chunk staged.
+ *
+ * Chunks never cross segments. Each one holds whole entries for every
+ * offset it is handed out for: it runs at least an entry past it, or to
+ * the end of the segment.
+ */
+
+struct tier_reader;
+
+// Called on the tier thread once the log bytes [offset, offset + length)
+// a reader asked for are at addr under rkey, until its next fetch
+typedef void (*staged_cb_fn)(struct tier_reader *r, uint64_t offset, uint32_t length, uint64_t addr, uint32_t rkey);
+
+// Starts the thread serving reads from the segment files in dir
+void tier_start(const char *dir, staged_cb_fn staged_cb);
+
+// A reader for the connection, whose staging buffer is registered now
+struct tier_reader * tier_reader_new(void *conn);
+
+// Stages the chunk holding the log offset, which must be in a segment that
+// was evicted. Returns at once; staged_cb follows. A fetch not yet served
+// is replaced by a later one.
+void tier_fetch(struct tier_reader *r, uint64_t offset);
+
+// The connection the reader was made for, NULL once it was freed
+void * tier_reader_conn(struct tier_reader *r);
+
+// Lets the reader go; its buffer is freed once no read into it is in flight
+void tier_reader_free(struct tier_reader *r);
+
+#endif
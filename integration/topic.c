@@ -0,0 +1,1240 @@
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+
+#include "filter.h"
+#include "index.h"
+#include "lookup.h"
+#include "subscription.h"
+#include "topic.h"
+
+// Tells a segment that holds a log from one that never did
+#define SEGMENT_MAGIC 0x4d474553u
+// How long a log that needs a slot sleeps while one is being written out
+#define EVICT_WAIT_US 100
+
+// The arena every topic's segments are held in, registered once
+static char *log_buffer = NULL;
+static struct ibv_mr *log_buffer_mr = NULL;
+// The arena was registered for memory windows to be bound to it
+static int log_windows = 0;
+// Segments are handed out in order and their offsets never reused;
+// partitions roll from different threads, so this is bumped atomically
+static uint64_t segments_used = 0;
+// For each segment, the offset of the segment its topic continues in, the
+// slot of the arena holding it, -1 if it is not in memory, how many readers
+// pinned or hold it, and whether its log was compacted out of it
+static uint64_t *next_segment = NULL;
+static int32_t *segment_slot = NULL;
+static uint32_t *segment_pins = NULL;
+static uint8_t *segment_retired = NULL;
+// For each slot, the offset of the segment in it or NO_SEGMENT, the log
+// that segment belongs to, and the file it is mapped from, -1 if it is
+// plain memory
+static uint64_t *slot_segment = NULL;
+static struct topic **slot_log = NULL;
+static int *slot_fd = NULL;
+// Held while slots are handed out, evicted, pinned, unpinned or dropped
+static pthread_mutex_t slot_mutex = PTHREAD_MUTEX_INITIALIZER;
+// Slots are mapped from the files of the segments in them
+static int mapped = 0;
+// Segments written to their files may be evicted to make room; a mapped
+// log only once the device faults its pages in on demand
+static int evicting = 0;
+// Non-zero once the log was put back together from segment files, and
+// the directory they are in
+static int recovered = 0;
+static const char *log_dir = NULL;
+static struct topic *topics = NULL;
+// Partitions are looked up from the connection event thread and from the
+// threads of a follower's replication links
+static pthread_mutex_t topics_mutex = PTHREAD_MUTEX_INITIALIZER;
+static segment_roll_cb_fn s_on_roll_cb = NULL;
+static append_cb_fn s_on_append_cb = NULL;
+static lookup_built_cb_fn s_on_lookup_cb = NULL;
+
+void log_set_roll_cb(segment_roll_cb_fn roll_cb)
+{
+  s_on_roll_cb = roll_cb;
+}
+
+void log_set_append_cb(append_cb_fn append_cb)
+{
+  s_on_append_cb = append_cb;
+}
+
+void log_set_lookup_cb(lookup_built_cb_fn lookup_cb)
+{
+  s_on_lookup_cb = lookup_cb;
+}
+
+static double now_ms()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+static void alloc_segment_table()
+{
+  uint64_t i;
+
+  next_segment = (uint64_t *)malloc(LOG_SEGMENTS * sizeof(*next_segment));
+  segment_slot = (int32_t *)malloc(LOG_SEGMENTS * sizeof(*segment_slot));
+  segment_pins = (uint32_t *)calloc(LOG_SEGMENTS, sizeof(*segment_pins));
+  segment_retired = (uint8_t *)calloc(LOG_SEGMENTS, sizeof(*segment_retired));
+  for (i = 0; i < LOG_SEGMENTS; ++i) {
+    next_segment[i] = NO_SEGMENT;
+    segment_slot[i] = -1;
+  }
+
+  slot_segment = (uint64_t *)malloc(NUM_SLOTS * sizeof(*slot_segment));
+  slot_log = (struct topic **)calloc(NUM_SLOTS, sizeof(*slot_log));
+  slot_fd = (int *)malloc(NUM_SLOTS * sizeof(*slot_fd));
+  for (i = 0; i < NUM_SLOTS; ++i) {
+    slot_segment[i] = NO_SEGMENT;
+    slot_fd[i] = -1;
+  }
+}
+
+char * log_at(uint64_t offset)
+{
+  int32_t slot = __atomic_load_n(&segment_slot[offset / LOG_SEGMENT_SIZE], __ATOMIC_ACQUIRE);
+
+  return log_buffer + (uint64_t)slot * LOG_SEGMENT_SIZE + offset % LOG_SEGMENT_SIZE;
+}
+
+static struct segment_header * segment_header(uint64_t segment)
+{
+  return (struct segment_header *)log_at(segment / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE);
+}
+
+/**
+ * Evict the oldest segment that no reader has pinned, that its log has
+ * moved on from and that is written to its file up to its end marker; the
+ * compactor writes the segments it fills before anyone reads them.
+ * Readers find it in the file from then on. Returns its slot, or -1 if no
+ * segment qualifies, setting unwritten if one would once it is written.
+ * Called with slot_mutex held.
+ */
+static int32_t evict_slot(int *unwritten)
+{
+  int32_t slot, victim = -1;
+
+  for (slot = 0; slot < NUM_SLOTS; ++slot) {
+    struct segment_header *h = (struct segment_header *)(log_buffer + (uint64_t)slot * LOG_SEGMENT_SIZE);
+    struct topic *log = slot_log[slot];
+
+    // Logs that are not persisted never get this far
+    if (log == NULL || h->end == 0 || segment_pins[slot_segment[slot] / LOG_SEGMENT_SIZE])
+      continue;
+    // A mapped segment is in its file already, but is kept until fsynced so
+    // the persistence thread is done with its descriptor
+    if (h->generation == 0 &&
+        __atomic_load_n(mapped ? &log->synced : &log->written, __ATOMIC_ACQUIRE) < h->end) {
+      *unwritten = 1;
+      continue;
+    }
+    if (victim < 0 || slot_segment[slot] < slot_segment[victim])
+      victim = slot;
+  }
+
+  if (victim >= 0)
+    __atomic_store_n(&segment_slot[slot_segment[victim] / LOG_SEGMENT_SIZE], -1, __ATOMIC_RELEASE);
+  return victim;
+}
+
+/**
+ * Map the segment's file over a slot, creating the file if the segment is
+ * new, in place of the one the slot was mapped from. Called with slot_mutex
+ * held.
+ */
+static void map_slot(int32_t slot, uint64_t segment)
+{
+  char path[512];
+  struct stat st;
+  int fd;
+
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, log_dir, (uint32_t)(segment / LOG_SEGMENT_SIZE));
+  if ((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0)
+    rc_die("map_slot: cannot open segment file");
+  TEST_NZ(fstat(fd, &st));
+  if (st.st_size != LOG_SEGMENT_SIZE)
+    TEST_NZ(ftruncate(fd, LOG_SEGMENT_SIZE));
+  if (mmap(log_buffer + (uint64_t)slot * LOG_SEGMENT_SIZE, LOG_SEGMENT_SIZE, PROT_READ | PROT_WRITE,
+           MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED)
+    rc_die("map_slot: cannot map segment file");
+  if (slot_fd[slot] >= 0)
+    close(slot_fd[slot]);
+  slot_fd[slot] = fd;
+}
+
+/**
+ * Give a segment of the log a slot of the arena, a free one or one evicted
+ * for it, mapping its file there if the log is mapped. Returns -1 if there
+ * is none, setting unwritten if there will be once the persistence thread
+ * catches up.
+ */
+static int32_t take_slot(uint64_t segment, struct topic *log, int *unwritten)
+{
+  int32_t slot = -1, i;
+
+  *unwritten = 0;
+  pthread_mutex_lock(&slot_mutex);
+  for (i = 0; i < NUM_SLOTS && slot < 0; ++i)
+    if (slot_segment[i] == NO_SEGMENT)
+      slot = i;
+  if (slot < 0 && evicting)
+    slot = evict_slot(unwritten);
+  if (slot >= 0 && mapped)
+    map_slot(slot, segment);
+
+  if (slot >= 0) {
+    // Until the new header is written, the slot must not look evictable
+    ((struct segment_header *)(log_buffer + (uint64_t)slot * LOG_SEGMENT_SIZE))->end = 0;
+    slot_segment[slot] = segment;
+    slot_log[slot] = log;
+    __atomic_store_n(&segment_slot[segment / LOG_SEGMENT_SIZE], slot, __ATOMIC_RELEASE);
+  }
+  pthread_mutex_unlock(&slot_mutex);
+  return slot;
+}
+
+int log_pin(uint64_t offset)
+{
+  uint64_t segment = offset / LOG_SEGMENT_SIZE;
+  int32_t slot = -1;
+
+  if (segment >= LOG_SEGMENTS)
+    return 0;
+
+  pthread_mutex_lock(&slot_mutex);
+  if ((slot = segment_slot[segment]) >= 0)
+    ++segment_pins[segment];
+  pthread_mutex_unlock(&slot_mutex);
+  return slot >= 0;
+}
+
+void log_hold(uint64_t offset)
+{
+  pthread_mutex_lock(&slot_mutex);
+  ++segment_pins[offset / LOG_SEGMENT_SIZE];
+  pthread_mutex_unlock(&slot_mutex);
+}
+
+void log_unpin(uint64_t offset)
+{
+  uint64_t segment = offset / LOG_SEGMENT_SIZE;
+
+  pthread_mutex_lock(&slot_mutex);
+  if (segment < LOG_SEGMENTS && segment_pins[segment] > 0)
+    --segment_pins[segment];
+  pthread_mutex_unlock(&slot_mutex);
+}
+
+uint64_t log_pin_from(uint64_t offset)
+{
+  // The segment a log appends to is never evicted, so this ends
+  while (!log_pin(offset))
+    offset = log_next_segment(offset) + sizeof(struct segment_header);
+  return offset;
+}
+
+void log_alloc()
+{
+  int access = IBV_ACCESS_LOCAL_WRITE | IBV_ACCESS_REMOTE_READ;
+  double start = now_ms();
+
+  pthread_mutex_lock(&topics_mutex);
+  if (log_buffer_mr != NULL) {
+    pthread_mutex_unlock(&topics_mutex);
+    return;
+  }
+
+  if (log_buffer == NULL) {
+    alloc_segment_table();
+    posix_memalign((void **)&log_buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
+  }
+
+  // Pinning writable file pages for good is refused on most file systems:
+  // a mapped log is faulted in on demand where the device can do that, and
+  // is otherwise pinned read-only, which is all consumers need
+  if (mapped) {
+    log_buffer_mr = ibv_reg_mr(rc_get_pd(), log_buffer, BUFFER_SIZE, access | IBV_ACCESS_ON_DEMAND);
+    access = IBV_ACCESS_REMOTE_READ;
+    // Pages the device pinned would outlive the file mapped over them, so
+    // only a log faulted in on demand can hand its slots on
+    pthread_mutex_lock(&slot_mutex);
+    evicting = log_buffer_mr != NULL;
+    pthread_mutex_unlock(&slot_mutex);
+  }
+  // Consumers get at it through memory windows where the device has them
+  if (log_buffer_mr == NULL && (log_buffer_mr = ibv_reg_mr(rc_get_pd(), log_buffer, BUFFER_SIZE, access | IBV_ACCESS_MW_BIND)))
+    log_windows = 1;
+  if (log_buffer_mr == NULL)
+    TEST_Z(log_buffer_mr = ibv_reg_mr(rc_get_pd(), log_buffer, BUFFER_SIZE, access));
+
+  if (recovered)
+    printf("registered log in %.1f ms\n", now_ms() - start);
+  pthread_mutex_unlock(&topics_mutex);
+}
+
+/**
+ * Read up to length bytes of a file from the offset. Returns how many there
+ * were.
+ */
+static uint64_t read_file(int fd, char *into, uint64_t length, uint64_t offset)
+{
+  uint64_t n = 0;
+  ssize_t got;
+
+  while (n < length && (got = pread(fd, into + n, length - n, offset + n)) > 0)
+    n += got;
+  return n;
+}
+
+/**
+ * Find the segments in dir, and read the header of each into found. A
+ * mapped arena is reserved in memory the device can pin, for segment files
+ * to be mapped over slots as they are taken.
+ */
+static void load_segments(const char *dir, int map, struct segment_header **found)
+{
+  char path[512];
+  struct dirent *e;
+  DIR *d;
+  uint64_t i;
+
+  if (map) {
+    log_buffer = (char *)mmap(NULL, BUFFER_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                              -1, 0);
+    if (log_buffer == MAP_FAILED)
+      rc_die("load_segments: cannot reserve the log");
+    mapped = 1;
+  } else {
+    posix_memalign((void **)&log_buffer, sysconf(_SC_PAGESIZE), BUFFER_SIZE);
+  }
+  if ((d = opendir(dir)) == NULL)
+    return;
+
+  while ((e = readdir(d)) != NULL) {
+    struct segment_header *h;
+    char *end;
+    int fd;
+
+    i = strtoul(e->d_name, &end, 10);
+    if (end == e->d_name || strcmp(end, ".log") != 0 || i >= LOG_SEGMENTS)
+      continue;
+    snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+    if ((fd = open(path, O_RDONLY)) < 0)
+      continue;
+    h = (struct segment_header *)calloc(1, sizeof(*h));
+    if (read_file(fd, (char *)h, sizeof(*h), 0) == sizeof(*h) && h->magic == SEGMENT_MAGIC)
+      found[i] = h;
+    else
+      free(h);
+    close(fd);
+  }
+  closedir(d);
+}
+
+static int same_log(const struct segment_header *a, const struct segment_header *b)
+{
+  return (a->flags & SEGMENT_TOPIC) && (b->flags & SEGMENT_TOPIC) && a->partition == b->partition &&
+         strncmp(a->topic, b->topic, TOPIC_NAME_MAX) == 0;
+}
+
+/**
+ * Non-zero if the segment at index i starts its log: it says it does, and
+ * no compaction the log went through later did as well
+ */
+static int is_head(struct segment_header **found, uint64_t i)
+{
+  uint64_t j;
+
+  if (found[i] == NULL || !(found[i]->flags & SEGMENT_TOPIC) || !(found[i]->flags & SEGMENT_HEAD))
+    return 0;
+  for (j = 0; j < LOG_SEGMENTS; ++j)
+    if (found[j] && (found[j]->flags & SEGMENT_HEAD) && same_log(found[j], found[i]) &&
+        found[j]->generation > found[i]->generation)
+      return 0;
+  return 1;
+}
+
+/**
+ * The segment with the given sequence number of the log that starts with
+ * first, or NO_SEGMENT. Segments compacted out of the log and left behind
+ * share their numbers with the ones written in their place, which win by
+ * generation; those of a later compaction that never got its head to disk
+ * are passed over.
+ */
+static uint64_t find_segment(struct segment_header **found, const struct segment_header *first, uint32_t sequence)
+{
+  uint64_t i, segment = NO_SEGMENT;
+
+  for (i = 0; i < LOG_SEGMENTS; ++i) {
+    struct segment_header *h = found[i];
+
+    if (h && h->sequence == sequence && same_log(h, first) && h->generation <= first->generation &&
+        (segment == NO_SEGMENT || h->generation > found[segment / LOG_SEGMENT_SIZE]->generation))
+      segment = i * LOG_SEGMENT_SIZE;
+  }
+  return segment;
+}
+
+/**
+ * Walk a segment's entries from its first. Returns the offset in the
+ * segment of the first thing that is not a whole entry: the end marker, if
+ * the segment has one, or where the log stopped.
+ */
+static uint64_t walk_segment(const char *data)
+{
+  uint64_t offset = sizeof(struct segment_header);
+
+  while (offset + sizeof(struct record_header) <= LOG_SEGMENT_SIZE) {
+    const struct record_header *entry = (const struct record_header *)(data + offset);
+
+    if (entry->length < sizeof(*entry) || offset + RECORD_ENTRY_SIZE(entry) > LOG_SEGMENT_SIZE ||
+        (entry->flags & RECORD_SEGMENT_END))
+      break;
+    offset += RECORD_ENTRY_SIZE(entry);
+  }
+  return offset;
+}
+
+/**
+ * Make sure a segment that its log continues from ends in a marker
+ * pointing at the next one. The header says where the marker is, unless
+ * the broker went down before that made it to disk; then the segment is
+ * walked, and the marker rewritten if it was lost too. A segment that is
+ * not in memory is checked, and mended, in its file.
+ */
+static void close_segment(const char *dir, struct segment_header *h, uint64_t segment, uint64_t next)
+{
+  static char *scratch = NULL;
+  struct record_header *marker, m;
+  char path[512];
+  char *data = NULL;
+  int fd = -1;
+
+  if (segment_slot[segment / LOG_SEGMENT_SIZE] >= 0) {
+    data = log_at(segment);
+  } else {
+    snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, dir, (uint32_t)(segment / LOG_SEGMENT_SIZE));
+    if ((fd = open(path, O_RDWR)) < 0)
+      rc_die("close_segment: cannot open segment file");
+  }
+
+  if (h->end != 0) {
+    if (data)
+      m = *(struct record_header *)(data + h->end - segment - sizeof(m));
+    else if (read_file(fd, (char *)&m, sizeof(m), h->end - segment - sizeof(m)) != sizeof(m))
+      m.length = 0;
+    if ((m.flags & RECORD_SEGMENT_END) && m.length == sizeof(m)) {
+      if (fd >= 0)
+        close(fd);
+      return;
+    }
+  }
+
+  if (data == NULL) {
+    if (scratch == NULL)
+      scratch = (char *)malloc(LOG_SEGMENT_SIZE);
+    memset(scratch, 0, LOG_SEGMENT_SIZE);
+    read_file(fd, scratch, LOG_SEGMENT_SIZE, 0);
+    data = scratch;
+  }
+
+  marker = (struct record_header *)(data + walk_segment(data));
+  marker->flags = RECORD_SEGMENT_END;
+  marker->value_offset = next + sizeof(*h);
+  marker->length = sizeof(*marker);
+  h->end = segment + ((char *)marker - data) + sizeof(*marker);
+  ((struct segment_header *)data)->end = h->end;
+
+  if (fd >= 0) {
+    if (pwrite(fd, data, h->end - segment, 0) != (ssize_t)(h->end - segment))
+      rc_die("close_segment: cannot mend segment file");
+    close(fd);
+  }
+}
+
+/**
+ * Bring the segment a log appends to back into a slot of the arena, mapped
+ * from its file or read from it
+ */
+static void load_segment(const char *dir, uint64_t segment, struct topic *log)
+{
+  char path[512];
+  int fd, unwritten;
+
+  if (take_slot(segment, log, &unwritten) < 0)
+    rc_die("load_segment: more logs than the arena has slots");
+  if (mapped)
+    return;
+
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, dir, (uint32_t)(segment / LOG_SEGMENT_SIZE));
+  if ((fd = open(path, O_RDONLY)) < 0)
+    rc_die("load_segment: cannot open segment file");
+  read_file(fd, log_at(segment), LOG_SEGMENT_SIZE, 0);
+  close(fd);
+}
+
+/**
+ * Find where a log's last segment ends, dropping an end marker whose next
+ * segment never made it to disk so the log goes on here instead
+ */
+static uint64_t find_tail(uint64_t segment)
+{
+  uint64_t tail = segment + walk_segment(log_at(segment));
+  struct record_header *entry = (struct record_header *)log_at(tail);
+
+  if (tail + sizeof(*entry) <= segment + LOG_SEGMENT_SIZE && (entry->flags & RECORD_SEGMENT_END))
+    entry->length = 0;
+  segment_header(segment)->end = 0;
+  return tail;
+}
+
+/**
+ * Call fn on every entry of a log from one of its offsets up to a later one,
+ * with its offset, in log order. Segments evicted to their files are read
+ * back into scratch, one at a time; those in memory are pinned while they
+ * are read. Each is held until the next one is, so compaction cannot drop
+ * what is yet to be read.
+ */
+static void walk_log(uint64_t offset, uint64_t end, void (*fn)(struct record_header *entry, uint64_t offset, void *arg),
+                     void *arg)
+{
+  uint64_t segment = offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  char *scratch = NULL;
+  int pinned;
+
+  log_hold(segment);
+  while (offset != end) {
+    const char *data = log_segment_data(segment, &scratch, &pinned);
+
+    while (offset != end) {
+      struct record_header *entry = (struct record_header *)(data + (offset - segment));
+
+      if (entry->flags & RECORD_SEGMENT_END) {
+        offset = entry->value_offset;
+        break;
+      }
+      fn(entry, offset, arg);
+      offset += RECORD_ENTRY_SIZE(entry);
+    }
+    if (pinned)
+      log_unpin(segment);
+    if (offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE != segment) {
+      log_hold(offset);
+      log_unpin(segment);
+      segment = offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+    }
+  }
+  log_unpin(segment);
+  free(scratch);
+}
+
+/**
+ * When the segment's file was last written, in ms since the epoch, which is
+ * no earlier than any of its records were appended
+ */
+static uint64_t segment_time(uint64_t segment)
+{
+  char path[512];
+  struct stat st;
+  int fd = log_segment_fd(segment);
+
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, log_dir, (uint32_t)(segment / LOG_SEGMENT_SIZE));
+  if ((fd >= 0 ? fstat(fd, &st) : stat(path, &st)) != 0)
+    return 0;
+  return (uint64_t)st.st_mtim.tv_sec * 1000 + st.st_mtim.tv_nsec / 1000000;
+}
+
+/**
+ * The log being indexed, the segment of the entry last indexed and its time
+ */
+struct recovered_index
+{
+  struct topic *topic;
+  uint64_t segment;
+  uint64_t timestamp;
+};
+
+static void index_entry(struct record_header *entry, uint64_t offset, void *arg)
+{
+  struct recovered_index *r = (struct recovered_index *)arg;
+
+  if (!(entry->flags & RECORD_FIRST_FRAGMENT))
+    return;
+  if (offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE != r->segment) {
+    r->segment = offset / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+    r->timestamp = segment_time(r->segment);
+  }
+  index_recovered_record(r->topic, offset, r->timestamp);
+}
+
+/**
+ * Rebuild every topic partition from the segment headers: follow each log
+ * from its first segment through the ones it says it continues in, and
+ * find its tail. Segments of no partition, those of subscription and
+ * filtered logs, which are refilled from topics, those compacted out of a
+ * log, and leftovers of a crash, are wiped so they can be handed out again. Returns how many partitions
+ * came back.
+ */
+static int rebuild_topics(const char *dir, struct segment_header **found)
+{
+  char *keep = (char *)calloc(LOG_SEGMENTS, 1);
+  char path[512];
+  uint64_t i, used = 0;
+  int n = 0;
+
+  for (i = 0; i < LOG_SEGMENTS; ++i) {
+    struct segment_header *first = found[i];
+    uint64_t segment = i * LOG_SEGMENT_SIZE, next;
+    uint32_t length = 1;
+    struct topic *t;
+
+    if (!is_head(found, i))
+      continue;
+
+    t = (struct topic *)calloc(1, sizeof(*t));
+    strncpy(t->name, first->topic, sizeof(t->name) - 1);
+    t->partition = first->partition;
+    t->head = segment + sizeof(*first);
+    t->generation = first->generation;
+    pthread_mutex_init(&t->mutex, NULL);
+    t->match_generation = subscription_generation() - 1;
+
+    while ((next = find_segment(found, first, found[segment / LOG_SEGMENT_SIZE]->sequence + 1)) != NO_SEGMENT) {
+      close_segment(dir, found[segment / LOG_SEGMENT_SIZE], segment, next);
+      keep[segment / LOG_SEGMENT_SIZE] = 1;
+      next_segment[segment / LOG_SEGMENT_SIZE] = next;
+      segment = next;
+      ++length;
+    }
+    keep[segment / LOG_SEGMENT_SIZE] = 1;
+    load_segment(dir, segment, t);
+    t->tail = t->written = t->synced = find_tail(segment);
+    printf("  %s/%u: %u segments\n", t->name, t->partition, length);
+
+    t->next = topics;
+    topics = t;
+    ++n;
+  }
+
+  for (i = 0; i < LOG_SEGMENTS; ++i) {
+    if (keep[i]) {
+      used = i + 1;
+      continue;
+    }
+    if (found[i] == NULL)
+      continue;
+    snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, dir, (uint32_t)i);
+    unlink(path);
+  }
+
+  // Segments below the last one kept stay unused
+  segments_used = used;
+  free(keep);
+  return n;
+}
+
+void log_open(const char *dir, int map)
+{
+  struct segment_header **found = (struct segment_header **)calloc(LOG_SEGMENTS, sizeof(*found));
+  double start = now_ms(), loaded, rebuilt;
+  uint64_t i;
+  struct topic *t;
+  int n;
+
+  alloc_segment_table();
+  // Mapped slots are mapped from files in it
+  log_dir = dir;
+  load_segments(dir, map, found);
+  loaded = now_ms();
+  n = rebuild_topics(dir, found);
+  recovered = 1;
+  rebuilt = now_ms();
+
+  // Record numbers and times for seeks, counted from each log's head
+  for (t = topics; t; t = t->next) {
+    struct recovered_index r = { t, NO_SEGMENT, 0 };
+
+    walk_log(t->head, t->tail, index_entry, &r);
+  }
+  // Segments written to their files can make room from now on; those of a
+  // mapped log once it is registered
+  evicting = !map;
+
+  printf("recovered %d topic partitions from %s: %s %.1f ms, topics %.1f ms, seek index %.1f ms\n",
+         n, dir, map ? "map" : "read", loaded - start, rebuilt - loaded, now_ms() - rebuilt);
+
+  for (i = 0; i < LOG_SEGMENTS; ++i)
+    free(found[i]);
+  free(found);
+}
+
+char * log_base()
+{
+  return log_buffer;
+}
+
+struct ibv_mr * log_mr()
+{
+  return log_buffer_mr;
+}
+
+int log_windows_ok()
+{
+  return log_windows;
+}
+
+uint64_t log_next_segment(uint64_t segment)
+{
+  return next_segment[segment / LOG_SEGMENT_SIZE];
+}
+
+uint64_t log_distance(uint64_t from, uint64_t to)
+{
+  uint64_t distance = 0;
+
+  while (from / LOG_SEGMENT_SIZE != to / LOG_SEGMENT_SIZE) {
+    uint64_t segment = from / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+    uint64_t next = log_next_segment(segment);
+
+    if (next == NO_SEGMENT)
+      return distance;
+    distance += segment + LOG_SEGMENT_SIZE - from;
+    from = next;
+  }
+  return distance + to - from;
+}
+
+uint64_t log_segment_end(uint64_t segment)
+{
+  return segment_header(segment)->end;
+}
+
+const char * log_segment_data(uint64_t segment, char **scratch, int *pinned)
+{
+  struct segment_header h;
+  char path[512];
+  int fd;
+
+  if ((*pinned = log_pin(segment)))
+    return log_at(segment);
+
+  snprintf(path, sizeof(path), SEGMENT_FILE_FORMAT, log_dir, (uint32_t)(segment / LOG_SEGMENT_SIZE));
+  if (log_dir == NULL || (fd = open(path, O_RDONLY)) < 0)
+    rc_die("log_segment_data: cannot open segment file");
+  // Evicted segments are closed, so their headers say where they end
+  if (pread(fd, &h, sizeof(h), 0) != sizeof(h) || h.end <= segment)
+    rc_die("log_segment_data: segment file has no end");
+  if (*scratch == NULL)
+    *scratch = (char *)malloc(LOG_SEGMENT_SIZE);
+  if (read_file(fd, *scratch, h.end - segment, 0) != h.end - segment)
+    rc_die("log_segment_data: segment file is short");
+  close(fd);
+  return *scratch;
+}
+
+int log_segment_fd(uint64_t segment)
+{
+  int32_t slot = segment_slot[segment / LOG_SEGMENT_SIZE];
+
+  return slot >= 0 ? slot_fd[slot] : -1;
+}
+
+/**
+ * Hand out the next segment to a log, as its segment with the given
+ * sequence number. Returns the offset of its first entry, or NO_SEGMENT if
+ * no slot is free; if told to wait, only once none is being written out.
+ */
+static uint64_t alloc_segment(struct topic *log, uint32_t sequence, uint32_t flags, int wait)
+{
+  uint64_t segment = __atomic_fetch_add(&segments_used, 1, __ATOMIC_RELAXED) * LOG_SEGMENT_SIZE;
+  struct segment_header *h;
+  int32_t slot = -1;
+  int unwritten = 1;
+
+  if (segment / LOG_SEGMENT_SIZE >= LOG_SEGMENTS)
+    rc_die("alloc_segment: log is full");
+  // Appends that outrun the disk wait for a segment to be written out
+  do {
+    if ((slot = take_slot(segment, log, &unwritten)) < 0 && unwritten && wait)
+      usleep(EVICT_WAIT_US);
+  } while (slot < 0 && unwritten && wait);
+  if (slot < 0)
+    return NO_SEGMENT;
+
+  h = segment_header(segment);
+  strncpy(h->topic, log->name, sizeof(h->topic));
+  h->partition = log->partition;
+  h->sequence = sequence;
+  h->generation = 0;
+  h->flags = flags;
+  h->end = 0;
+  // The slot may still hold an evicted segment's entries
+  ((struct record_header *)(h + 1))->length = 0;
+  __atomic_store_n(&h->magic, SEGMENT_MAGIC, __ATOMIC_RELEASE);
+
+  return segment + sizeof(*h);
+}
+
+uint64_t log_new_segment(struct topic *log, uint32_t flags)
+{
+  uint64_t first = alloc_segment(log, 0, flags, 0);
+
+  // Not yet closed, so it could not have been evicted since
+  if (first != NO_SEGMENT)
+    log_pin(first);
+  return first;
+}
+
+void log_set_next_segment(uint64_t segment, uint64_t next)
+{
+  next_segment[segment / LOG_SEGMENT_SIZE] = next;
+}
+
+void log_retire(const uint64_t *segments, int n)
+{
+  int i;
+
+  for (i = 0; i < n; ++i)
+    __atomic_store_n(&segment_retired[segments[i] / LOG_SEGMENT_SIZE], 1, __ATOMIC_RELEASE);
+}
+
+int log_compacted(uint64_t offset)
+{
+  return offset / LOG_SEGMENT_SIZE < LOG_SEGMENTS &&
+         __atomic_load_n(&segment_retired[offset / LOG_SEGMENT_SIZE], __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Links between the segments stay, so a reader that pins its way along
+ * the log skips them like evicted ones
+ */
+int log_drop(const uint64_t *segments, int n)
+{
+  int i;
+
+  pthread_mutex_lock(&slot_mutex);
+  for (i = 0; i < n; ++i)
+    if (segment_pins[segments[i] / LOG_SEGMENT_SIZE])
+      break;
+  if (i == n) {
+    for (i = 0; i < n; ++i) {
+      int32_t slot = segment_slot[segments[i] / LOG_SEGMENT_SIZE];
+
+      if (slot < 0)
+        continue;
+      __atomic_store_n(&segment_slot[segments[i] / LOG_SEGMENT_SIZE], -1, __ATOMIC_RELEASE);
+      slot_segment[slot] = NO_SEGMENT;
+      slot_log[slot] = NULL;
+    }
+  }
+  pthread_mutex_unlock(&slot_mutex);
+  return i == n;
+}
+
+static struct topic * topic_create(const char *name, uint32_t partition, uint32_t flags)
+{
+  struct topic *t = (struct topic *)calloc(1, sizeof(*t));
+
+  strncpy(t->name, name, sizeof(t->name) - 1);
+  t->partition = partition;
+  // Every log holds a slot of the arena for the segment it appends to
+  if ((t->head = t->tail = alloc_segment(t, 0, flags | SEGMENT_HEAD, 1)) == NO_SEGMENT) {
+    fprintf(stderr, "no room in the arena for a log of %s/%u\n", name, partition);
+    free(t);
+    return NULL;
+  }
+  // The segment header is yet to be persisted too
+  t->written = t->synced = t->head - sizeof(struct segment_header);
+  pthread_mutex_init(&t->mutex, NULL);
+  // Looked up on the first append
+  t->match_generation = subscription_generation() - 1;
+  return t;
+}
+
+struct topic * topic_new(const char *name, uint32_t partition)
+{
+  return topic_create(name, partition, 0);
+}
+
+struct topic * topic_get(const char *name, uint32_t partition)
+{
+  struct topic *t;
+
+  // Clients that predate topics send no name
+  if (name[0] == '\0')
+    name = DEFAULT_TOPIC;
+
+  pthread_mutex_lock(&topics_mutex);
+  for (t = topics; t; t = t->next)
+    if (strcmp(t->name, name) == 0 && t->partition == partition)
+      break;
+
+  if (t == NULL && (t = topic_create(name, partition, SEGMENT_TOPIC)) != NULL) {
+    t->next = topics;
+    __atomic_store_n(&topics, t, __ATOMIC_RELEASE);
+    printf("created topic %s partition %u\n", t->name, t->partition);
+  }
+  pthread_mutex_unlock(&topics_mutex);
+  return t;
+}
+
+uint32_t topic_partitions(const char *name)
+{
+  struct topic *t;
+  uint32_t n = 0;
+
+  if (name[0] == '\0')
+    name = DEFAULT_TOPIC;
+
+  for (t = topics; t; t = t->next)
+    if (strcmp(t->name, name) == 0 && t->partition >= n)
+      n = t->partition + 1;
+
+  return n;
+}
+
+void topic_for_each(void (*fn)(struct topic *topic))
+{
+  struct topic *t;
+
+  for (t = __atomic_load_n(&topics, __ATOMIC_ACQUIRE); t; t = t->next)
+    fn(t);
+}
+
+/**
+ * Close the topic's current segment with an end marker pointing at a fresh
+ * one. The link is in place before the marker is published, so a consumer
+ * that sees the marker can always be given the next segment.
+ */
+static void roll_segment(struct topic *topic)
+{
+  uint64_t from = topic->tail / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  struct segment_header *h = segment_header(from);
+  uint64_t to = alloc_segment(topic, h->sequence + 1, h->flags & ~SEGMENT_HEAD, 1);
+  struct record_header *marker = (struct record_header *)log_at(topic->tail);
+
+  if (to == NO_SEGMENT)
+    rc_die("roll_segment: arena is full");
+
+  next_segment[from / LOG_SEGMENT_SIZE] = to / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE;
+  h->end = topic->tail + sizeof(*marker);
+
+  marker->flags = RECORD_SEGMENT_END;
+  marker->value_offset = to;
+  __atomic_store_n(&marker->length, sizeof(*marker), __ATOMIC_RELEASE);
+  // Read by the persistence thread, which relies on the links above
+  __atomic_store_n(&topic->tail, to, __ATOMIC_RELEASE);
+
+  if (s_on_roll_cb)
+    s_on_roll_cb(topic, from, to / LOG_SEGMENT_SIZE * LOG_SEGMENT_SIZE);
+}
+
+/**
+ * Append an entry whose key is preceded by prefix_length bytes of prefix
+ */
+static void append_entry(struct topic *topic, struct record_header *hdr, const char *prefix, uint16_t prefix_length,
+                         const char *key, const void *data, uint32_t data_length)
+{
+  struct record_header *entry;
+  uint64_t offset, segment_end;
+
+  hdr->key_length += prefix_length;
+  hdr->length = sizeof(*hdr) + hdr->key_length + data_length;
+
+  // Leave room for the end marker; if the entry does not fit, continue in
+  // a new segment
+  segment_end = (topic->tail / LOG_SEGMENT_SIZE + 1) * LOG_SEGMENT_SIZE;
+  if (topic->tail + RECORD_ENTRY_SIZE(hdr) + sizeof(*hdr) > segment_end)
+    roll_segment(topic);
+
+  offset = topic->tail;
+  entry = (struct record_header *)log_at(offset);
+
+  // Everything but the length first, so consumers polling on it never see
+  // a partially written entry
+  if (prefix_length)
+    memcpy(entry + 1, prefix, prefix_length);
+  memcpy((char *)(entry + 1) + prefix_length, key, hdr->key_length - prefix_length);
+  memcpy((char *)(entry + 1) + hdr->key_length, data, data_length);
+  entry->key_length = hdr->key_length;
+  entry->flags = hdr->flags;
+  entry->producer_id = hdr->producer_id;
+  entry->sequence = hdr->sequence;
+  entry->value_length = hdr->value_length;
+  entry->value_offset = hdr->value_offset;
+  // A slot that held an evicted segment has stale entries past ours
+  ((struct record_header *)((char *)entry + RECORD_ENTRY_SIZE(hdr)))->length = 0;
+  __atomic_store_n(&entry->length, hdr->length, __ATOMIC_RELEASE);
+
+  __atomic_store_n(&topic->tail, offset + RECORD_ENTRY_SIZE(hdr), __ATOMIC_RELEASE);
+
+  if (hdr->flags & RECORD_FIRST_FRAGMENT) {
+    struct lookup_table *lookup = __atomic_load_n(&topic->lookup, __ATOMIC_ACQUIRE);
+
+    index_record(topic, offset);
+    if (lookup)
+      lookup_append(lookup, entry, offset);
+  }
+
+  if (s_on_append_cb && (__atomic_load_n(&topic->pushers, __ATOMIC_ACQUIRE) ||
+                         __atomic_load_n(&topic->multicast, __ATOMIC_ACQUIRE)))
+    s_on_append_cb(topic, offset);
+}
+
+/**
+ * The length a record's value had before its producer compressed it, from
+ * the frame its value starts with, here or in the value heap. Records that
+ * are not compressed, or whose first fragment is too short to hold the
+ * frame, have the length they are stored with.
+ */
+static uint64_t raw_value_length(const struct record_header *hdr, const void *value, uint32_t value_length)
+{
+  struct compressed_value frame;
+
+  if (!(hdr->flags & RECORD_COMPRESSED))
+    return hdr->value_length;
+  if (hdr->flags & RECORD_VALUE_REF) {
+    if (value_length < sizeof(struct value_ref) || hdr->value_length < sizeof(frame))
+      return hdr->value_length;
+    // Out-of-line values are whole in the heap before their record is
+    value = (const void *)(uintptr_t)((const struct value_ref *)value)->addr;
+  } else if (value_length < sizeof(frame)) {
+    return hdr->value_length;
+  }
+  memcpy(&frame, value, sizeof(frame));
+  return frame.length;
+}
+
+/**
+ * Decide whether an entry goes to a filtered log. The key is tested on a
+ * record's first fragment, with its value length as it was before any
+ * compression; the rest of its fragments go where that went.
+ */
+static int filter_passes(struct topic_filter *f, const struct record_header *hdr, const char *key,
+                         const void *value, uint32_t value_length)
+{
+  struct record_header h;
+  uint64_t *passing;
+  int pass;
+
+  if (hdr->producer_id >= f->num_passing) {
+    uint32_t n = f->num_passing ? f->num_passing : 16;
+
+    while (n <= hdr->producer_id)
+      n *= 2;
+    f->passing = (uint64_t *)realloc(f->passing, n * sizeof(*f->passing));
+    memset(f->passing + f->num_passing, 0, (n - f->num_passing) * sizeof(*f->passing));
+    f->num_passing = n;
+  }
+  passing = &f->passing[hdr->producer_id];
+
+  if (!(hdr->flags & RECORD_FIRST_FRAGMENT))
+    return *passing == (FILTER_PASSING | hdr->sequence);
+
+  h = *hdr;
+  h.value_length = raw_value_length(hdr, value, value_length);
+  pass = filter_match(&f->filter, &h, key, hdr->key_length);
+  *passing = pass && !(hdr->flags & RECORD_LAST_FRAGMENT) ? FILTER_PASSING | hdr->sequence : 0;
+  return pass;
+}
+
+/**
+ * Append an entry to a log, and a copy to each filtered log it passes into
+ */
+static void publish(struct topic *topic, struct record_header *hdr, const char *prefix, uint16_t prefix_length,
+                    const char *key, const void *data, uint32_t data_length)
+{
+  struct record_header copy = *hdr;
+  struct topic_filter *f;
+
+  append_entry(topic, hdr, prefix, prefix_length, key, data, data_length);
+
+  for (f = __atomic_load_n(&topic->filters, __ATOMIC_ACQUIRE); f; f = f->next) {
+    struct record_header h = copy;
+
+    if (filter_passes(f, &h, key, data, data_length))
+      append_entry(f->log, &h, prefix, prefix_length, key, data, data_length);
+  }
+}
+
+/**
+ * Call fn on every entry the topic's log holds in memory, in log order.
+ * Each segment is pinned while it is read, since others may roll and evict.
+ */
+static void for_each_in_memory(struct topic *topic, void (*fn)(struct record_header *entry, void *arg), void *arg)
+{
+  uint64_t offset = log_pin_from(__atomic_load_n(&topic->head, __ATOMIC_ACQUIRE));
+
+  while (offset != topic->tail) {
+    struct record_header *entry = (struct record_header *)log_at(offset);
+
+    if (entry->flags & RECORD_SEGMENT_END) {
+      log_unpin(offset);
+      offset = log_pin_from(entry->value_offset);
+      continue;
+    }
+    fn(entry, arg);
+    offset += RECORD_ENTRY_SIZE(entry);
+  }
+  log_unpin(offset);
+}
+
+/**
+ * Copy an entry of a topic's log to a new filtered log if it passes
+ */
+static void backfill_filter(struct record_header *entry, void *arg)
+{
+  struct topic_filter *f = (struct topic_filter *)arg;
+  char *payload = (char *)(entry + 1);
+  struct record_header h = *entry;
+  uint16_t prefix_length = 0;
+
+  // Entries of subscription logs keep their topic name
+  if (entry->flags & RECORD_TOPIC)
+    prefix_length = strnlen(payload, entry->key_length) + 1;
+  h.key_length -= prefix_length;
+  if (filter_passes(f, &h, payload + prefix_length, payload + entry->key_length,
+                    RECORD_PAYLOAD_LENGTH(entry) - entry->key_length))
+    append_entry(f->log, &h, payload, prefix_length, payload + prefix_length,
+                 payload + entry->key_length, RECORD_PAYLOAD_LENGTH(entry) - entry->key_length);
+}
+
+static void backfill_lookup(struct record_header *entry, uint64_t offset, void *arg)
+{
+  lookup_update((struct lookup_table *)arg, entry, offset);
+}
+
+struct topic * topic_filter(struct topic *topic, const struct record_filter *filter)
+{
+  struct topic_filter *f;
+
+  pthread_mutex_lock(&topic->mutex);
+
+  for (f = topic->filters; f; f = f->next)
+    if (memcmp(&f->filter, filter, sizeof(*filter)) == 0)
+      break;
+
+  if (f == NULL) {
+    struct topic *log = topic_new(topic->name, topic->partition);
+
+    if (log == NULL) {
+      pthread_mutex_unlock(&topic->mutex);
+      return NULL;
+    }
+    f = (struct topic_filter *)calloc(1, sizeof(*f));
+    f->filter = *filter;
+    f->log = log;
+    for_each_in_memory(topic, backfill_filter, f);
+
+    f->next = topic->filters;
+    __atomic_store_n(&topic->filters, f, __ATOMIC_RELEASE);
+    printf("created filtered log of %s/%u\n", topic->name, topic->partition);
+  }
+
+  pthread_mutex_unlock(&topic->mutex);
+  return f->log;
+}
+
+/**
+ * Fill a new lookup table from its log, off the thread appending to it. The
+ * log is walked to its tail for as long as that moves on meanwhile, and the
+ * last stretch with the table's mutex held, which its appender takes until
+ * the table is built. A compaction in between may have moved records the
+ * table points at, which the compactor leaves to us until then, so the log
+ * is taken again from its new head.
+ */
+static void * build_lookup(void *arg)
+{
+  struct topic *topic = (struct topic *)arg;
+  struct lookup_table *lookup = topic->lookup;
+  uint64_t offset, tail;
+  uint32_t generation;
+  double start = now_ms();
+
+  while (!lookup->built) {
+    // The head a compaction swapped in is stored before its generation
+    generation = __atomic_load_n(&topic->generation, __ATOMIC_ACQUIRE);
+    offset = __atomic_load_n(&topic->head, __ATOMIC_ACQUIRE);
+    while ((tail = __atomic_load_n(&topic->tail, __ATOMIC_ACQUIRE)) != offset) {
+      walk_log(offset, tail, backfill_lookup, lookup);
+      offset = tail;
+    }
+
+    pthread_mutex_lock(&lookup->mutex);
+    if (__atomic_load_n(&topic->generation, __ATOMIC_ACQUIRE) == generation) {
+      tail = __atomic_load_n(&topic->tail, __ATOMIC_ACQUIRE);
+      walk_log(offset, tail, backfill_lookup, lookup);
+      __atomic_store_n(&lookup->built, 1, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&lookup->mutex);
+  }
+  printf("built lookup table of %s/%u in %.1f ms\n", topic->name, topic->partition, now_ms() - start);
+
+  if (s_on_lookup_cb)
+    s_on_lookup_cb(topic);
+  return NULL;
+}
+
+struct lookup_table * topic_lookup(struct topic *topic)
+{
+  struct lookup_table *lookup;
+  pthread_attr_t attr;
+  pthread_t thread;
+
+  pthread_mutex_lock(&topic->mutex);
+
+  if ((lookup = topic->lookup) == NULL) {
+    lookup = lookup_new();
+    // Appends from now on wait for the builder, which takes the log up to
+    // wherever it is by then
+    __atomic_store_n(&topic->lookup, lookup, __ATOMIC_RELEASE);
+    TEST_NZ(pthread_attr_init(&attr));
+    TEST_NZ(pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED));
+    TEST_NZ(pthread_create(&thread, &attr, build_lookup, topic));
+    pthread_attr_destroy(&attr);
+    printf("created lookup table of %s/%u\n", topic->name, topic->partition);
+  }
+
+  pthread_mutex_unlock(&topic->mutex);
+  return lookup;
+}
+
+void topic_append(struct topic *topic, struct record_header *hdr, const char *key, const void *data, uint32_t data_length)
+{
+  struct record_header copy = *hdr;
+  uint32_t generation = subscription_generation();
+  int i;
+
+  publish(topic, hdr, NULL, 0, key, data, data_length);
+
+  // Only redo the match when patterns were added since
+  if (topic->match_generation != generation) {
+    topic->num_matches = subscription_match(topic->name, topic->matches, MAX_MATCHING_SUBSCRIPTIONS);
+    topic->match_generation = generation;
+  }
+
+  for (i = 0; i < topic->num_matches; ++i) {
+    struct topic *log = topic->matches[i];
+    struct record_header h = copy;
+
+    // Entries carrying the key say which topic the record came from
+    pthread_mutex_lock(&log->mutex);
+    if (h.flags & RECORD_FIRST_FRAGMENT) {
+      h.flags |= RECORD_TOPIC;
+      publish(log, &h, topic->name, strlen(topic->name) + 1, key, data, data_length);
+    } else {
+      publish(log, &h, NULL, 0, key, data, data_length);
+    }
+    pthread_mutex_unlock(&log->mutex);
+  }
+}
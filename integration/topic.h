@@ -0,0 +1,263 @@
+#ifndef RDMA_TOPIC_H
+#define RDMA_TOPIC_H
+
+#include <pthread.h>
+
+#include "common.h"
+#include "messages.h"
+
+// Log offset meaning "no segment"
+#define NO_SEGMENT ((uint64_t)-1)
+// Segments the arena holds at a time
+#define NUM_SLOTS (BUFFER_SIZE / LOG_SEGMENT_SIZE)
+// Segments handed out over the broker's life. Log offsets count through all
+// of them, so they run past the arena, which holds the ones in memory.
+#define LOG_SEGMENTS 65536
+// File of each segment in a persistence directory, by segment index
+#define SEGMENT_FILE_FORMAT "%s/%06u.log"
+
+/**
+ * Start of every segment, so a restarted broker can tell which log a
+ * segment file belongs to and put the logs back together. The segment's
+ * entries follow it.
+ */
+struct segment_header
+{
+  uint32_t magic;
+  uint32_t flags;
+  char topic[TOPIC_NAME_MAX];
+  uint32_t partition;
+  // Position of the segment in its log, counting from 0
+  uint32_t sequence;
+  // How many times the log had been compacted when the compactor wrote the
+  // segment; 0 for segments appended to
+  uint32_t generation;
+  uint32_t reserved;
+  // Log offset just past the segment's end marker, 0 while the log
+  // still grows in it
+  uint64_t end;
+};
+
+// The segment belongs to a topic partition, not to a subscription or
+// filtered log
+#define SEGMENT_TOPIC 0x1
+// The log starts with the segment. A compacted log has one for every
+// generation; the newest whose segments all made it to disk wins.
+#define SEGMENT_HEAD 0x2
+// Subscriptions a single topic can feed
+#define MAX_MATCHING_SUBSCRIPTIONS 64
+
+struct topic_filter;
+struct lookup_table;
+
+/**
+ * One partition of a named stream. Its log is a chain of LOG_SEGMENT_SIZE
+ * segments held in slots of one registered arena, so partitions do not each
+ * need an MR. A partition is only ever appended to from the CQ thread its
+ * connections share, so appends to different partitions run in parallel.
+ *
+ * Where the log is persisted, the arena is only the hot end of it: once
+ * every slot is taken, the oldest segment a topic has moved on from, written
+ * to its file and pinned by no reader, is evicted to make room, and is read
+ * from the file from then on. A mapped log waits for the segment to be
+ * fsynced, and evicts only where the device faults the arena in on demand.
+ */
+struct topic
+{
+  char name[TOPIC_NAME_MAX];
+  uint32_t partition;
+
+  // Log offsets of the first entry and of the next append. A topic's
+  // segments are allocated in order, so its offsets only ever grow as it is
+  // appended to; compaction moves the head to a chain of fresh segments that
+  // ends in the first one it left alone.
+  uint64_t head;
+  uint64_t tail;
+  // Times the log was compacted, and the segment its closed segments ran up
+  // to when the compactor last looked; kept by the compactor
+  uint32_t generation;
+  uint64_t compact_limit;
+
+  // Log offsets up to which the log is in its segment files, and up to
+  // which those are fsynced; moved by the persistence thread, which keeps
+  // its own state in persist
+  uint64_t written;
+  uint64_t synced;
+  void *persist;
+
+  // Records appended since the broker started, or the log was recovered
+  // with, and the log's seek index, NULL until its first record or if none
+  // was left; kept by the appender
+  uint64_t records;
+  struct seek_index *index;
+  int index_full;
+
+  // Held by the topics appending to this log if it belongs to a
+  // subscription pattern, since they may run on different threads
+  pthread_mutex_t mutex;
+
+  // Subscription logs this topic feeds, as of a subscription generation
+  struct topic *matches[MAX_MATCHING_SUBSCRIPTIONS];
+  int num_matches;
+  uint32_t match_generation;
+
+  // Filtered logs this one feeds. Only ever prepended to, atomically, so
+  // appends can walk the list while a consumer's filter is being added.
+  struct topic_filter *filters;
+
+  // Newest value of every key, for one-sided lookups; NULL until a reader
+  // first asks for it, set atomically like filters
+  struct lookup_table *lookup;
+  // Newest snapshot of the log for new readers to start from, a struct
+  // snapshot; NULL until the snapshot thread takes one
+  void *snapshot;
+
+  // Push consumers of this log and the multicast stream it is sent on,
+  // kept by the broker; the append callback only runs while there are any
+  void *pushers;
+  void *multicast;
+  // Log offset up to which as many followers as producer acks wait for have
+  // appended the log to their own; kept by the broker
+  uint64_t replicated;
+  // On a follower, whether a link to the leader is replicating the log,
+  // and how many bytes it lagged behind the leader's when last pushed to;
+  // kept by the replication links
+  int replicating;
+  uint64_t lag;
+
+  struct topic *next;
+};
+
+/**
+ * A log holding copies of the records of another log that pass a filter
+ */
+struct topic_filter
+{
+  struct record_filter filter;
+  struct topic *log;
+
+  // For each producer id, FILTER_PASSING and the sequence of the
+  // fragmented record being passed, so later fragments follow the first
+  uint64_t *passing;
+  uint32_t num_passing;
+
+  struct topic_filter *next;
+};
+
+#define FILTER_PASSING ((uint64_t)1 << 32)
+
+// Called when a topic's log continues in a freshly allocated segment
+typedef void (*segment_roll_cb_fn)(struct topic *topic, uint64_t from, uint64_t to);
+
+// Called with the offset of every entry appended to a log with pushers or
+// a multicast stream
+typedef void (*append_cb_fn)(struct topic *topic, uint64_t offset);
+
+// Called on the thread that filled a log's lookup table once it is built
+typedef void (*lookup_built_cb_fn)(struct topic *topic);
+
+void log_set_roll_cb(segment_roll_cb_fn roll_cb);
+void log_set_append_cb(append_cb_fn append_cb);
+void log_set_lookup_cb(lookup_built_cb_fn lookup_cb);
+// Allocates and registers the arena on first call; needs rc_get_pd(). Safe
+// from any thread.
+void log_alloc();
+// Puts the log back together from the segment files in dir, before
+// log_alloc(). Only the segment each topic appends to is brought into
+// memory, the rest staying on disk, and segments are evicted from then on.
+// With map set, segments are mapped from their files, which new ones are
+// created as, so the log lives in the files; their slots are handed on only
+// if log_alloc() gets the device to fault the arena in on demand. Topic
+// partitions are rebuilt from the segment headers, and then their seek
+// indexes by walking each log; the time each phase took is reported.
+void log_open(const char *dir, int map);
+char * log_base();
+struct ibv_mr * log_mr();
+// Non-zero if memory windows can be bound to log_mr(); a mapped log faulted
+// in on demand, or a device without windows, gives readers its rkey instead
+int log_windows_ok();
+
+// Where the log byte at the offset is in the arena; its segment must be in
+// memory, because it is pinned or its log still appends to it
+char * log_at(uint64_t offset);
+// Keeps the segment at the offset in memory until log_unpin(). Returns 0,
+// pinning nothing, if it was evicted.
+int log_pin(uint64_t offset);
+// Keeps the segment at the offset, in memory or in its file, from being
+// dropped after compaction until log_unpin(); for readers of evicted ones
+void log_hold(uint64_t offset);
+void log_unpin(uint64_t offset);
+// Pins the first segment of a log in memory from the one at the offset on.
+// Returns the offset, or the first entry of that segment if it is a later one.
+uint64_t log_pin_from(uint64_t offset);
+
+// Offset of the segment following the one at the given offset, or NO_SEGMENT
+uint64_t log_next_segment(uint64_t segment);
+// Bytes of a log from one of its offsets to a later one, counting the
+// segments in between in full; needs none of them in memory
+uint64_t log_distance(uint64_t from, uint64_t to);
+// Offset just past the end marker of a segment its topic has moved on from
+uint64_t log_segment_end(uint64_t segment);
+// The bytes of a segment its log has moved on from: in the arena, pinned,
+// if it is in memory, or else read from its file into *scratch, which is
+// allocated LOG_SEGMENT_SIZE bytes on first use. pinned says which; a
+// pinned segment is the caller's to unpin.
+const char * log_segment_data(uint64_t segment, char **scratch, int *pinned);
+// File the segment is mapped from, -1 if it is plain memory
+int log_segment_fd(uint64_t segment);
+
+// Hands the log a fresh segment for the compactor to fill, pinned, without
+// waiting for a slot. Returns the offset of its first entry, or NO_SEGMENT
+// if no slot is free.
+uint64_t log_new_segment(struct topic *log, uint32_t flags);
+// Records that the log continues from the segment in the next one
+void log_set_next_segment(uint64_t segment, uint64_t next);
+// Marks segments the log was compacted out of. Readers already in them may
+// go on to the end of the chain; nobody new is sent there.
+void log_retire(const uint64_t *segments, int n);
+// Non-zero if the segment at the offset was compacted out of its log
+int log_compacted(uint64_t offset);
+// Frees the slots of the segments if none of them is pinned or held, and
+// returns non-zero; otherwise leaves them be and returns 0
+int log_drop(const uint64_t *segments, int n);
+
+// Every log, whether a topic partition, a filtered log or a subscription's,
+// holds a slot of the arena for the segment it appends to, so the broker
+// has at most NUM_SLOTS of them, 64 with a 1 GiB arena. The calls creating
+// one return NULL once there is no slot left for it.
+
+// Looks the partition up by topic name, creating it and its first segment on
+// first use. Called from the connection event thread, and from a follower's
+// replication links.
+struct topic * topic_get(const char *name, uint32_t partition);
+
+// Allocates a log that is not registered as a topic, for subscriptions
+struct topic * topic_new(const char *name, uint32_t partition);
+
+// Returns the log of the topic's records that pass the filter, shared by
+// every consumer with the same filter. On first use it is created and filled
+// with the matching records the topic holds in memory. Must be called on the
+// thread appending to the topic: a partition's CQ thread, or any thread for
+// a subscription log, whose appenders hold its mutex.
+struct topic * topic_filter(struct topic *topic, const struct record_filter *filter);
+
+// Returns the log's lookup table, creating it on first use. A thread of its
+// own fills it from the whole log, reading segments evicted to their files
+// back in, and sets built and calls the lookup callback once it is done;
+// the table is not to be read before. Safe from any thread.
+struct lookup_table * topic_lookup(struct topic *topic);
+
+// Number of partitions of the named topic created so far
+uint32_t topic_partitions(const char *name);
+
+// Calls fn on every topic partition, but not on subscription or filtered
+// logs; safe from any thread, though it may miss a partition being created
+void topic_for_each(void (*fn)(struct topic *topic));
+
+// Appends an entry with the given header fields, key and data to the topic,
+// and a copy tagged with the topic name to every subscription it matches.
+// Filtered logs of the topic and of the subscriptions get copies if the
+// record passes their filters.
+void topic_append(struct topic *topic, struct record_header *hdr, const char *key, const void *data, uint32_t data_length);
+
+#endif
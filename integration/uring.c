@@ -0,0 +1,83 @@
+#include <errno.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include "uring.h"
+
+void uring_setup(struct uring *r, unsigned entries)
+{
+  struct io_uring_params params;
+  size_t sq_size, cq_size;
+  char *sq, *cq;
+
+  memset(&params, 0, sizeof(params));
+  r->fd = syscall(__NR_io_uring_setup, entries, &params);
+  if (r->fd < 0)
+    rc_die("uring_setup: io_uring_setup failed");
+
+  sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP)
+    sq_size = cq_size = sq_size > cq_size ? sq_size : cq_size;
+
+  sq = mmap(NULL, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  if (sq == MAP_FAILED)
+    rc_die("uring_setup: mapping the submission queue failed");
+  cq = sq;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP)) {
+    cq = mmap(NULL, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+    if (cq == MAP_FAILED)
+      rc_die("uring_setup: mapping the completion queue failed");
+  }
+  r->sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if (r->sqes == MAP_FAILED)
+    rc_die("uring_setup: mapping the submission entries failed");
+
+  r->entries = params.sq_entries;
+  r->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  r->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  r->sq_array = (unsigned *)(sq + params.sq_off.array);
+  r->cq_head = (unsigned *)(cq + params.cq_off.head);
+  r->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  r->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  r->queued = *r->sq_tail;
+  r->unsubmitted = 0;
+}
+
+struct io_uring_sqe * uring_sqe(struct uring *r)
+{
+  unsigned index;
+  struct io_uring_sqe *sqe;
+
+  while (r->unsubmitted == r->entries)
+    uring_submit(r);
+
+  index = r->queued & *r->sq_mask;
+  sqe = &r->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  r->sq_array[index] = index;
+  ++r->queued;
+  ++r->unsubmitted;
+  return sqe;
+}
+
+int uring_submit(struct uring *r)
+{
+  int n;
+
+  if (r->unsubmitted == 0)
+    return 0;
+
+  __atomic_store_n(r->sq_tail, r->queued, __ATOMIC_RELEASE);
+  n = syscall(__NR_io_uring_enter, r->fd, r->unsubmitted, 0, 0, NULL, 0);
+  if (n < 0) {
+    // The kernel is short of room; try again on the next round
+    if (errno == EAGAIN || errno == EBUSY || errno == EINTR)
+      return 0;
+    rc_die("uring_submit: io_uring_enter failed");
+  }
+  r->unsubmitted -= n;
+  return n;
+}
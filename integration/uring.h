@@ -0,0 +1,38 @@
+#ifndef RDMA_URING_H
+#define RDMA_URING_H
+
+#include <linux/io_uring.h>
+
+#include "common.h"
+
+/**
+ * An io_uring driven through the raw system calls, for the threads moving
+ * the log to and from its segment files. Each ring belongs to one thread.
+ */
+struct uring
+{
+  int fd;
+  unsigned entries;
+  unsigned *sq_tail;
+  unsigned *sq_mask;
+  unsigned *sq_array;
+  struct io_uring_sqe *sqes;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned *cq_mask;
+  struct io_uring_cqe *cqes;
+  // Entries queued, and how many of them the kernel has yet to take
+  unsigned queued;
+  unsigned unsubmitted;
+};
+
+void uring_setup(struct uring *r, unsigned entries);
+
+// Claims the next submission entry, cleared; it goes to the kernel on the
+// next uring_submit(), or at once if the submission queue is full
+struct io_uring_sqe * uring_sqe(struct uring *r);
+
+// Hands the queued entries to the kernel. Returns how many it took.
+int uring_submit(struct uring *r);
+
+#endif
@@ -0,0 +1,27 @@
+#! /bin/bash
+# Producer throughput and produce-to-ack latency at each durability level.
+# For each level, starts a broker here persisting to a scratch directory
+# (or not at all, for the baseline) and runs the producer benchmarks against
+# it. Latency CSVs are left in bench_<level>/.
+# Usage: durability_bench.sh <address of this broker> [directory to persist to]
+ADDRESS=$1
+DIR=${2:-/tmp/rdma_pubsub_segments}
+BIN=$(cd "$(dirname "$0")/../integration" && pwd)
+
+for LEVEL in none memory written fsync; do
+    rm -rf "$DIR"
+    if [ "$LEVEL" = none ]; then
+        "$BIN/server" & SERVER=$!
+    else
+        "$BIN/server" -d "$DIR" -D "$LEVEL" & SERVER=$!
+    fi
+    sleep 2
+
+    mkdir -p "bench_$LEVEL"
+    echo "== $LEVEL"
+    (cd "bench_$LEVEL" && "$BIN/test_producer_client" "$ADDRESS" bench_tp | grep throughput)
+    (cd "bench_$LEVEL" && "$BIN/latency_producer_client" "$ADDRESS" bench_lat | grep p50)
+
+    kill $SERVER
+    wait $SERVER 2>/dev/null
+done